@@ -0,0 +1,252 @@
+/*
+ * Headless tool which bakes the precomputed shadow of a scene on the CPU and writes it to a file.
+ * It only uses the core library, i.e. neither OpenGL nor a window are needed.
+ */
+
+#include <iostream>
+#include <fstream>
+using namespace std;
+#include <chrono>
+using namespace std::chrono;
+
+#include "cpvs.h"
+#include "AssimpScene.h"
+#include "Light.h"
+#include "DepthFile.h"
+#include "DepthRasterizer.h"
+#include "SceneGenerator.h"
+#include "ShadowBaker.h"
+#include "BuildStats.h"
+#include "CompressedShadowContainer.h"
+
+
+/* Settings */
+
+const string defaultSceneFile = "../scenes/plane.obj";
+const string defaultOutputFile = "shadow.cpvc";
+
+uint cpvs_size = 4096;
+vec3 lightDirection = {0.25, 1, 0};
+string outputFile = defaultOutputFile;
+string archiveFile;
+string extractFile;
+string generatedShape;
+string statsFile;
+uint generatorSeed = 0;
+
+BakeSettings bakeSettings;
+
+
+inline void printDurationToNow(high_resolution_clock::time_point start) {
+	auto t1 = high_resolution_clock::now();
+	cout << duration_cast<milliseconds>(t1 - start).count() << "msec\n";
+}
+
+inline void printHelpAndExit() {
+	cout << "CPVS Bake Usage:\n"
+		 << "\t--help Prints this help test and exits\n"
+		 << "\t--size=[size of precomputed shadow, e.g. 8196. Must be a power of two]\n"
+		 << "\t--light=[direction to the light, e.g. 0.25,1,0]\n"
+		 << "\t--output=[file the precomputed shadow is written to, default " << defaultOutputFile << "]\n"
+		 << "\t--budget=[memory budget for the precomputed shadow in MB, the rest is written to disk]\n"
+		 << "\t--spill-dir=[directory for the parts of the shadow exceeding the budget]\n"
+		 << "\t--depth-file=[raw/PFM depth map which is used instead of rasterizing the scene]\n"
+		 << "\t--no-shared-dag (store the DAG of every tile separately instead of sharing common subtrees)\n"
+		 << "\t--leafmask-dict (store every unique 64-bit leafmask only once in a table)\n"
+		 << "\t--packed-pointers (store the DAG with 16-bit childmasks and relative 8/16/32-bit pointers)\n"
+		 << "\t--contiguous-children (store the children of every node contiguously and only one pointer per node)\n"
+		 << "\t--tiled-minmax (store the min-max hierarchies in tiles of 8x8 values instead of rows)\n"
+		 << "\t--archive=[file an entropy-coded archive of the precomputed shadow is written to in addition]\n"
+		 << "\t--extract=[archive which is extracted to the output file instead of baking a shadow]\n"
+		 << "\t--generate=[terrain, city, foliage or sparse: bakes the mesh of a generated heightfield instead of a scene file]\n"
+		 << "\t--seed=[seed of the generated heightfield, default 0]\n"
+		 << "\t--stats=[file the timings, node counts and sizes of baking are written to as JSON]\n"
+		 << "\tpath to scene file or default file which will be loaded"
+		 << endl;
+	std::exit(EXIT_SUCCESS);
+}
+
+inline uint parseSize(const string& sizeStr, bool testPowerOfTwo) {
+	uint res;
+	try {
+		res = std::stoul(sizeStr);
+		if (testPowerOfTwo && (!isPowerOfTwo(res) || res < 8))
+			throw std::invalid_argument("Must be power of two and at least 8");
+	} catch (std::exception& exc) {
+		cerr << "Invalid size specified (" << exc.what() << ")\n";
+		std::exit(EXIT_FAILURE);
+	}
+	return res;
+}
+
+inline vec3 parseDirection(const string& directionStr) {
+	vec3 res;
+	try {
+		size_t begin = 0;
+		for (int i = 0; i < 3; ++i) {
+			size_t length;
+			res[i] = std::stof(directionStr.substr(begin), &length);
+			begin += length + 1;
+
+			if (i < 2 && (begin > directionStr.size() || directionStr[begin - 1] != ','))
+				throw std::invalid_argument("Expected three comma separated values");
+		}
+		if (glm::length(res) == 0.0f)
+			throw std::invalid_argument("Must not be zero");
+	} catch (std::exception& exc) {
+		cerr << "Invalid light direction specified (" << exc.what() << ")\n";
+		std::exit(EXIT_FAILURE);
+	}
+	return res;
+}
+
+string parseArguments(int argc, char **argv) {
+	string sceneFile = defaultSceneFile;
+
+	for (int paramNr = 1; paramNr < argc; ++paramNr) {
+		string param(argv[paramNr]);
+
+		if (param == "--help") {
+			printHelpAndExit();
+		} else if (param.substr(0, 6) == "--size") {
+			cpvs_size = parseSize(&argv[paramNr][7], true);
+		} else if (param.substr(0, 7) == "--light") {
+			lightDirection = parseDirection(param.substr(8));
+		} else if (param.substr(0, 8) == "--output") {
+			outputFile = param.substr(9);
+		} else if (param.substr(0, 8) == "--budget") {
+			bakeSettings.memoryBudget = static_cast<size_t>(parseSize(&argv[paramNr][9], false)) * 1024 * 1024;
+		} else if (param.substr(0, 11) == "--spill-dir") {
+			bakeSettings.spillDirectory = param.substr(12);
+		} else if (param.substr(0, 12) == "--depth-file") {
+			bakeSettings.depthFile = param.substr(13);
+		} else if (param == "--no-shared-dag") {
+			bakeSettings.shareSubtrees = false;
+		} else if (param == "--leafmask-dict") {
+			bakeSettings.leafmaskDictionary = true;
+		} else if (param == "--packed-pointers") {
+			bakeSettings.packedPointers = true;
+		} else if (param == "--contiguous-children") {
+			bakeSettings.contiguousChildren = true;
+		} else if (param == "--tiled-minmax") {
+			bakeSettings.tiledMinMax = true;
+		} else if (param.substr(0, 9) == "--archive") {
+			archiveFile = param.substr(10);
+		} else if (param.substr(0, 9) == "--extract") {
+			extractFile = param.substr(10);
+		} else if (param.substr(0, 10) == "--generate") {
+			generatedShape = param.substr(11);
+		} else if (param.substr(0, 6) == "--seed") {
+			generatorSeed = parseSize(param.substr(7), false);
+		} else if (param.substr(0, 7) == "--stats") {
+			statsFile = param.substr(8);
+		} else {
+			sceneFile = param;
+		}
+	}
+
+	if (bakeSettings.packedPointers && bakeSettings.contiguousChildren) {
+		cerr << "--packed-pointers can't be combined with --contiguous-children\n";
+		std::exit(EXIT_FAILURE);
+	}
+	return sceneFile;
+}
+
+inline size_t getFileSize(const string& file) {
+	ifstream is(file, ios::binary | ios::ate);
+	return is.tellg();
+}
+
+int main(int argc, char **argv) {
+	const string sceneFile = parseArguments(argc, argv);
+
+	try {
+		if (!extractFile.empty()) {
+			cout << "Extracting " << extractFile << " to " << outputFile << "... "; cout.flush();
+			const auto t0 = high_resolution_clock::now();
+			const size_t size = CompressedShadowContainer::extractArchive(extractFile, outputFile);
+			const double seconds = duration<double>(high_resolution_clock::now() - t0).count();
+
+			cout << static_cast<uint>(seconds * 1000) << "msec (" << static_cast<float>(size / (1024.0 * 1024.0) / seconds)
+				 << "MB/s)\n";
+			return EXIT_SUCCESS;
+		}
+
+		cout << "Loading scene... "; cout.flush();
+		auto t0 = high_resolution_clock::now();
+		unique_ptr<Scene> scene;
+		if (generatedShape.empty()) {
+			scene = AssimpScene::loadScene(sceneFile);
+		} else {
+			// The mesh is rasterized like a loaded scene, so the shadow fits the light direction
+			const SceneGenerator generator(SceneGenerator::getShape(generatedShape), generatorSeed);
+			scene = generator.createScene(std::min(cpvs_size, 2048u));
+		}
+		printDurationToNow(t0);
+
+		unique_ptr<DepthFile> depthFile;
+		if (!bakeSettings.depthFile.empty()) {
+			depthFile = make_unique<DepthFile>(bakeSettings.depthFile);
+			cpvs_size = depthFile->getWidth();
+		}
+
+		const DirectionalLight light(glm::normalize(lightDirection), scene->boundingBox);
+		const ShadowBaker baker(cpvs_size, bakeSettings);
+		const uint numTiles = baker.getNumTiles();
+		const uint tileSize = baker.getTileSize();
+
+		DepthSource depths("rasterize", [&](uint x, uint y) {
+			const auto P = light.getSubProjection(scene->boundingBox, x, y, numTiles);
+			return DepthRasterizer().render(scene.get(), P, light.getViewTransform(), tileSize);
+		}, false);
+
+		if (depthFile) {
+			const DepthFile* file = depthFile.get();
+			depths = DepthSource("read", [file, tileSize](uint x, uint y) {
+				return file->createImageF(x, y, tileSize);
+			}, false);
+		}
+
+		cout << "Precomputing shadows... "; cout.flush();
+		t0 = high_resolution_clock::now();
+
+		BuildStats stats;
+		BuildStats* statsPtr = statsFile.empty() ? nullptr : &stats;
+
+		CompressedShadowContainer shadows(numTiles);
+		baker.configure(shadows);
+		baker.bake(shadows, depths, statsPtr);
+		stats.addPhase("bake", duration<double>(high_resolution_clock::now() - t0).count());
+
+		cout << "\n... done after ";
+		printDurationToNow(t0);
+
+		cout << "Writing " << outputFile << "... "; cout.flush();
+		t0 = high_resolution_clock::now();
+		shadows.writeToFile(outputFile);
+		stats.addPhase("writeToFile", duration<double>(high_resolution_clock::now() - t0).count());
+		printDurationToNow(t0);
+
+		if (statsPtr)
+			stats.writeJSON(statsFile);
+
+		if (!archiveFile.empty()) {
+			cout << "Writing " << archiveFile << "... "; cout.flush();
+			t0 = high_resolution_clock::now();
+			const size_t archiveSize = shadows.writeArchive(archiveFile);
+			cout << archiveSize / 1024 << "kb, " << static_cast<float>(getFileSize(outputFile)) / archiveSize
+				 << "x smaller than " << outputFile << ", ";
+			printDurationToNow(t0);
+		}
+	} catch (FileNotFound& exc) {
+		cerr << exc.what() << endl;
+		return EXIT_FAILURE;
+	} catch (LoadFileException& exc) {
+		cerr << exc.what() << endl;
+		return EXIT_FAILURE;
+	} catch (std::invalid_argument& exc) {
+		cerr << exc.what() << endl;
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,327 @@
+/*
+ * Benchmark which times the stages of creating and evaluating precomputed shadows separately, for several sizes
+ * and depth maps of SceneGenerator, and writes the results as JSON, so regressions of single stages can be found.
+ * It only uses the core library, i.e. neither OpenGL nor a window are needed.
+ */
+
+#include <algorithm>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <random>
+#include <limits>
+using namespace std;
+#include <chrono>
+using namespace std::chrono;
+
+#include "cpvs.h"
+#include "BuildStats.h"
+#include "CompressedShadow.h"
+#include "CPUShadowContainer.h"
+#include "MinMaxHierarchy.h"
+#include "SceneGenerator.h"
+#include "ShadowBaker.h"
+#include "ThreadPool.h"
+
+
+/* Settings */
+
+const string defaultOutputFile = "benchmark.json";
+
+vector<uint> sizes = {512, 1024, 2048, 4096, 8192, 16384, 32768};
+vector<string> shapeNames = {"terrain", "city", "foliage", "sparse"};
+uint seed = 0;
+uint svoSizeLimit = 4096;
+uint repetitions = 1;
+uint numQueries = 1024 * 1024;
+MinMaxHierarchy::Layout minMaxLayout = MinMaxHierarchy::ROW_MAJOR;
+string outputFile = defaultOutputFile;
+
+
+inline void printHelpAndExit() {
+	cout << "CPVS Benchmark Usage:\n"
+		 << "\t--help Prints this help test and exits\n"
+		 << "\t--sizes=[comma separated sizes of the precomputed shadows, default 512 to 32768]\n"
+		 << "\t--shapes=[comma separated shapes of SceneGenerator, default terrain,city,foliage,sparse]\n"
+		 << "\t--seed=[seed of the generated depth maps, default 0]\n"
+		 << "\t--svo-size-limit=[largest size for which the SVO stages are timed, default " << svoSizeLimit << "]\n"
+		 << "\t--repetitions=[number of runs, the fastest duration of every stage is written, default 1]\n"
+		 << "\t--queries=[number of positions which are evaluated, default " << numQueries << "]\n"
+		 << "\t--tiled-minmax (use the tiled layout for the min-max hierarchies, to compare it with the row-major one)\n"
+		 << "\t--output=[file the results are written to as JSON, default " << defaultOutputFile << "]\n"
+		 << endl;
+	std::exit(EXIT_SUCCESS);
+}
+
+inline uint parseSize(const string& sizeStr, bool testPowerOfTwo) {
+	uint res;
+	try {
+		res = std::stoul(sizeStr);
+		if (testPowerOfTwo && (!isPowerOfTwo(res) || res < 8))
+			throw std::invalid_argument("Must be power of two and at least 8");
+		if (res == 0)
+			throw std::invalid_argument("Must not be zero");
+	} catch (std::exception& exc) {
+		cerr << "Invalid size specified (" << exc.what() << ")\n";
+		std::exit(EXIT_FAILURE);
+	}
+	return res;
+}
+
+inline vector<string> splitList(const string& list) {
+	vector<string> res;
+	stringstream ss(list);
+	string item;
+	while (std::getline(ss, item, ','))
+		res.push_back(item);
+	return res;
+}
+
+void parseArguments(int argc, char **argv) {
+	for (int paramNr = 1; paramNr < argc; ++paramNr) {
+		string param(argv[paramNr]);
+
+		if (param == "--help") {
+			printHelpAndExit();
+		} else if (param.substr(0, 7) == "--sizes") {
+			sizes.clear();
+			for (const string& size : splitList(param.substr(8)))
+				sizes.push_back(parseSize(size, true));
+		} else if (param.substr(0, 8) == "--shapes") {
+			shapeNames = splitList(param.substr(9));
+			for (const string& name : shapeNames) {
+				try {
+					SceneGenerator::getShape(name);
+				} catch (std::invalid_argument& exc) {
+					cerr << exc.what() << "\n";
+					std::exit(EXIT_FAILURE);
+				}
+			}
+		} else if (param.substr(0, 6) == "--seed") {
+			try {
+				seed = std::stoul(param.substr(7));
+			} catch (std::exception& exc) {
+				cerr << "Invalid seed specified (" << exc.what() << ")\n";
+				std::exit(EXIT_FAILURE);
+			}
+		} else if (param.substr(0, 16) == "--svo-size-limit") {
+			svoSizeLimit = parseSize(param.substr(17), false);
+		} else if (param.substr(0, 13) == "--repetitions") {
+			repetitions = parseSize(param.substr(14), false);
+		} else if (param.substr(0, 9) == "--queries") {
+			numQueries = parseSize(param.substr(10), false);
+		} else if (param == "--tiled-minmax") {
+			minMaxLayout = MinMaxHierarchy::TILED;
+		} else if (param.substr(0, 8) == "--output") {
+			outputFile = param.substr(9);
+		} else {
+			cerr << "Unknown argument " << param << " (see --help)\n";
+			std::exit(EXIT_FAILURE);
+		}
+	}
+}
+
+
+/* Stages */
+
+/** Durations in seconds of all stages of one run, in the order the stages were run */
+using Timings = vector<pair<string, double>>;
+
+inline double secondsSince(steady_clock::time_point start) {
+	return duration<double>(steady_clock::now() - start).count();
+}
+
+/** Adds the duration to the stage in timings, or adds the stage if it hasn't been timed yet */
+inline void addDuration(Timings& timings, const string& stage, double seconds) {
+	for (auto& timing : timings) {
+		if (timing.first == stage) {
+			timing.second += seconds;
+			return;
+		}
+	}
+	timings.emplace_back(stage, seconds);
+}
+
+/**
+ * Times creating the min-max hierarchies and the DAGs of all tiles one after another, i.e. every stage on its own
+ * instead of overlapping them like ShadowBaker. Returns the total size of the DAGs in bytes.
+ */
+size_t timeConstruction(const SceneGenerator& generator, uint size, Timings& timings) {
+	const uint tileSize = ShadowBaker::getTileSize(size);
+	const uint numTiles = size / tileSize;
+	size_t dagSize = 0;
+
+	for (uint y = 0; y < numTiles; ++y) {
+		for (uint x = 0; x < numTiles; ++x) {
+			ImageF depths = generator.createTile(size, tileSize, x, y);
+
+			auto t0 = steady_clock::now();
+			const MinMaxHierarchy minMax(std::move(depths), minMaxLayout);
+			addDuration(timings, "minMaxHierarchy", secondsSince(t0));
+
+			for (uint z = 0; z < numTiles; ++z) {
+				t0 = steady_clock::now();
+				auto shadow = CompressedShadow::create(minMax, z, numTiles);
+				addDuration(timings, "create", secondsSince(t0));
+				dagSize += shadow->getDAG().size() * sizeof(uint);
+				shadow.reset();
+
+				// The uncompressed SVO needs a lot more memory than the DAG
+				if (size <= svoSizeLimit) {
+					TileStats stats;
+					CompressedShadow::createFromSvo(minMax, z, numTiles, &stats);
+					for (const auto& phase : stats.phases)
+						addDuration(timings, phase.first, phase.second);
+				}
+			}
+		}
+	}
+	return dagSize;
+}
+
+/** Fills the image with numQueries positions in the volume of the shadow, in random or in scanline order */
+void createQueries(ImageF& positions, bool coherent) {
+	std::mt19937 rng(1);
+	std::uniform_real_distribution<float> ndc(-1.0f, 1.0f);
+
+	const size_t width = positions.getWidth();
+	const size_t height = positions.getHeight();
+	float* data = positions.data();
+
+	for (size_t y = 0; y < height; ++y) {
+		for (size_t x = 0; x < width; ++x) {
+			float* position = data + (y * width + x) * 4;
+			if (coherent) {
+				// A plane through the shadow volume, like the positions of a G-buffer
+				position[0] = (x + 0.5f) / width * 2.0f - 1.0f;
+				position[1] = (y + 0.5f) / height * 2.0f - 1.0f;
+				position[2] = 0.1f * position[0] + 0.2f * position[1];
+			} else {
+				position[0] = ndc(rng);
+				position[1] = ndc(rng);
+				position[2] = ndc(rng);
+			}
+			position[3] = 1.0f;
+		}
+	}
+}
+
+/** Times baking the whole shadow, combining the DAGs and evaluating positions on the CPU */
+void timeEvaluation(const SceneGenerator& generator, uint size, Timings& timings) {
+	BakeSettings settings;
+	settings.tiledMinMax = (minMaxLayout == MinMaxHierarchy::TILED);
+
+	const ShadowBaker baker(size, settings);
+	const uint tileSize = baker.getTileSize();
+
+	const DepthSource depths("generate", [&generator, size, tileSize](uint x, uint y) {
+		return generator.createTile(size, tileSize, x, y);
+	}, false);
+
+	CPUShadowContainer shadows(baker.getNumTiles());
+	baker.configure(shadows);
+
+	auto t0 = steady_clock::now();
+	baker.bake(shadows, depths);
+	addDuration(timings, "bake", secondsSince(t0));
+
+	t0 = steady_clock::now();
+	shadows.combineDAGs();
+	addDuration(timings, "combineDAGs", secondsSince(t0));
+
+	// The positions are in the normalized device coordinates of the light
+	const uint width = 1024;
+	const uint height = (numQueries + width - 1) / width;
+	ImageF positions(width, height, 4), visibilities(width, height, 1);
+
+	for (bool coherent : {false, true}) {
+		createQueries(positions, coherent);
+
+		t0 = steady_clock::now();
+		shadows.evaluate(positions, mat4(1.0f), visibilities);
+		addDuration(timings, coherent ? "evaluateCoherent" : "evaluateRandom", secondsSince(t0));
+	}
+}
+
+
+/* Results */
+
+struct Result {
+	uint size;
+	string shape;
+	size_t dagSize;
+	Timings timings;
+};
+
+void writeJSON(ostream& os, const vector<Result>& results) {
+	os << std::setprecision(6);
+	os << "{\n"
+	   << "  \"threads\": " << ThreadPool::getDefault().getNumThreads() << ",\n"
+	   << "  \"repetitions\": " << repetitions << ",\n"
+	   << "  \"seed\": " << seed << ",\n"
+	   << "  \"queries\": " << (numQueries + 1023) / 1024 * 1024 << ",\n"
+	   << "  \"minMaxLayout\": \"" << (minMaxLayout == MinMaxHierarchy::TILED ? "tiled" : "row-major") << "\",\n"
+	   << "  \"results\": [";
+
+	for (size_t i = 0; i < results.size(); ++i) {
+		const Result& result = results[i];
+		os << (i > 0 ? "," : "") << "\n    {\n"
+		   << "      \"size\": " << result.size << ",\n"
+		   << "      \"shape\": \"" << result.shape << "\",\n"
+		   << "      \"dagBytes\": " << result.dagSize << ",\n"
+		   << "      \"seconds\": {";
+
+		for (size_t j = 0; j < result.timings.size(); ++j) {
+			os << (j > 0 ? "," : "") << "\n        \"" << result.timings[j].first << "\": "
+			   << result.timings[j].second;
+		}
+		os << "\n      }\n    }";
+	}
+	os << "\n  ]\n}\n";
+}
+
+int main(int argc, char **argv) {
+	parseArguments(argc, argv);
+
+	vector<Result> results;
+
+	for (uint size : sizes) {
+		for (const string& name : shapeNames) {
+			cout << "Size " << size << ", " << name << "... "; cout.flush();
+			const SceneGenerator generator(SceneGenerator::getShape(name), seed);
+
+			Result result = {size, name, 0, {}};
+			for (uint run = 0; run < repetitions; ++run) {
+				Timings timings;
+				result.dagSize = timeConstruction(generator, size, timings);
+				timeEvaluation(generator, size, timings);
+
+				// Keep the fastest run of every stage
+				for (const auto& timing : timings) {
+					auto fastest = std::find_if(result.timings.begin(), result.timings.end(),
+							[&timing](const pair<string, double>& t) { return t.first == timing.first; });
+					if (fastest == result.timings.end())
+						result.timings.push_back(timing);
+					else
+						fastest->second = std::min(fastest->second, timing.second);
+				}
+			}
+
+			for (const auto& timing : result.timings)
+				cout << "\n\t" << timing.first << ": " << static_cast<uint>(timing.second * 1000) << "msec";
+			cout << endl;
+			results.push_back(std::move(result));
+		}
+	}
+
+	ofstream os(outputFile);
+	if (!os.is_open()) {
+		cerr << "Could not write " << outputFile << endl;
+		return EXIT_FAILURE;
+	}
+	writeJSON(os, results);
+	cout << "Written to " << outputFile << endl;
+
+	return EXIT_SUCCESS;
+}
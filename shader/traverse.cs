@@ -13,12 +13,24 @@ layout (local_size_x = LOCAL_SIZE, local_size_y = LOCAL_SIZE) in;
 uniform uint width;
 uniform uint height;
 
-/* PCF filtering is not yet implemented! The size of the kernel is therefore still unused */
+/* Width and height of the PCF kernel in voxels, see traverseFiltered */
 uniform uint filterSize;
 
 uniform int dag_levels;
 uniform int grid_levels;
 
+/* If true, level 2 stores pointers to a table of unique leafmasks instead of the leafmasks */
+uniform bool leafmask_dictionary;
+
+/* If true, the DAG is packed (see cs::packDAG): nodes are addressed in 16-bit units and store a 16-bit childmask
+ * followed by pointers relative to the node, whose width in bytes is stored for every level in pointer_widths */
+uniform bool packed_pointers;
+uniform uint pointer_widths;
+
+/* If true, the children of every node are stored contiguously (see cs::layoutContiguousChildren): every node is
+ * one word with the childmask in the lower 16 bits and a pointer to its children relative to the node above */
+uniform bool contiguous_children;
+
 uniform mat4 lightViewProj;
 
 layout (rgba32f, binding = 0) uniform image2D positionsWS;
@@ -71,6 +83,132 @@ uint getChildOffset(uint childmask, uint childIndex) {
 	return bitCount(maskedChildmask);
 }
 
+/* Reads a value with a width of 1, 2 or 4 bytes from a packed DAG. Values wider than 1 byte are 16-bit aligned */
+uint readPacked(uint byteOffset, uint width) {
+	if (width == 1)
+		return (dag[byteOffset >> 2] >> ((byteOffset & 3) * 8)) & 0xFF;
+
+	uint lower = (dag[byteOffset >> 2] >> ((byteOffset & 2) * 8)) & 0xFFFF;
+	if (width == 2)
+		return lower;
+
+	uint upper = (dag[(byteOffset + 2) >> 2] >> (((byteOffset + 2) & 2) * 8)) & 0xFFFF;
+	return lower | (upper << 16);
+}
+
+uint getPointerWidth(int level) {
+	return 1 << ((pointer_widths >> (2 * level)) & 0x3);
+}
+
+/* Same as below for a packed DAG, the root of which is at the given offset in 16-bit units */
+float traversePacked(const ivec3 path, uint offset) {
+	int level = dag_levels - 2;
+	while(level >= MIN_LEVEL) {
+		uint lvlBit = 1 << level;
+		uint childIndex = (bool(path.x & lvlBit) ? 2 : 0) +
+						  (bool(path.y & lvlBit) ? 4 : 0) +
+						  (bool(path.z & lvlBit) ? 8 : 0);
+
+		uint childmask = readPacked(offset * 2, 2);
+
+		uint visibility = 0x3 & (childmask >> childIndex);
+		if (visibility == 0)
+			return 0.0;
+		else if (visibility == 1)
+			return 1.0;
+
+		uint width = getPointerWidth(level);
+		offset += readPacked(offset * 2 + 2 + getChildOffset(childmask, childIndex) * width, width);
+
+		level -= 1;
+	}
+
+#ifdef LEAFMASKS
+	{
+		uint childIndex = (path.z & 0x7) * 2;
+		uint childmask  = readPacked(offset * 2, 2);
+
+		uint visibility = 0x3 & (childmask >> childIndex);
+		if (visibility == 0)
+			return 0.0;
+		else if (visibility == 1)
+			return 1.0;
+
+		uint childOffset = getChildOffset(childmask, childIndex);
+
+		// The leafmask is stored inline as 8 bytes or in the table
+		uint index = offset * 2 + 2 + childOffset * 8;
+		if (leafmask_dictionary) {
+			uint width = getPointerWidth(2);
+			index = (offset + readPacked(offset * 2 + 2 + childOffset * width, width)) * 2;
+		}
+
+		return testLeafmask(path, readPacked(index, 4), readPacked(index + 4, 4));
+	}
+#endif
+
+	return 1.0;
+}
+
+/* Returns the offset of the children of the node at the given offset in a DAG with contiguous children.
+ * Children which are too far away are referenced by a signed offset stored after the children of the node */
+uint getContiguousChildren(uint offset) {
+	uint node = dag[offset];
+	uint pointer = offset + (node >> 17);
+	if ((node & 0x10000) != 0)
+		return uint(int(pointer) + int(dag[pointer]));
+	return pointer;
+}
+
+/* Same as below for a DAG with contiguous children, the root of which is at the given offset */
+float traverseContiguous(const ivec3 path, uint offset) {
+	int level = dag_levels - 2;
+	while(level >= MIN_LEVEL) {
+		uint lvlBit = 1 << level;
+		uint childIndex = (bool(path.x & lvlBit) ? 2 : 0) +
+						  (bool(path.y & lvlBit) ? 4 : 0) +
+						  (bool(path.z & lvlBit) ? 8 : 0);
+
+		uint childmask = dag[offset] & 0xFFFF;
+
+		uint visibility = 0x3 & (childmask >> childIndex);
+		if (visibility == 0)
+			return 0.0;
+		else if (visibility == 1)
+			return 1.0;
+
+		offset = getContiguousChildren(offset) + getChildOffset(childmask, childIndex);
+
+		level -= 1;
+	}
+
+#ifdef LEAFMASKS
+	{
+		uint childIndex = (path.z & 0x7) * 2;
+		uint childmask  = dag[offset] & 0xFFFF;
+
+		uint visibility = 0x3 & (childmask >> childIndex);
+		if (visibility == 0)
+			return 0.0;
+		else if (visibility == 1)
+			return 1.0;
+
+		uint childOffset = getChildOffset(childmask, childIndex);
+
+		// The leafmask is stored inline as 2 words, or the pointer into the table is relative to itself
+		uint index = getContiguousChildren(offset) + childOffset * 2;
+		if (leafmask_dictionary) {
+			index = getContiguousChildren(offset) + childOffset;
+			index += dag[index];
+		}
+
+		return testLeafmask(path, dag[index], dag[index + 1]);
+	}
+#endif
+
+	return 1.0;
+}
+
 /* Traverses the precomputed shadow for the given vector in NDC, i.e. in the range [-1,1]^3 */
 float traverse(const ivec3 path) {
 	uint offset = 0;
@@ -81,12 +219,17 @@ float traverse(const ivec3 path) {
 	offset = dagOffset;
 
 	// The grid stores two special values which indicate if the entire grid cell is
-	// visible or in shadow.
-	if (offset == 0xFFFFFFFF)
+	// visible or in shadow (GRID_CELL_SHADOWED and GRID_CELL_VISIBLE of CompressedShadowContainer).
+	if (offset == 0x0FFFFFFF)
 		return 0.0; // shadow
-	if (offset == 0xFFFFFFFE)
+	if (offset == 0x0FFFFFFE)
 		return 1.0; // visible
 
+	if (packed_pointers)
+		return traversePacked(path, offset);
+	if (contiguous_children)
+		return traverseContiguous(path, offset);
+
 	int level = dag_levels - 2;
 	while(level >= MIN_LEVEL) {
 		uint lvlBit = 1 << level;
@@ -104,7 +247,8 @@ float traverse(const ivec3 path) {
 
 		uint childOffset = getChildOffset(childmask, childIndex);
 
-		offset = dagOffset + dag[offset + 1 + childOffset];
+		// Pointers are absolute, i.e. DAGs of different grid cells may share nodes
+		offset = dag[offset + 1 + childOffset];
 
 		level -= 1;
 	}
@@ -125,6 +269,9 @@ float traverse(const ivec3 path) {
 
 		// Test visibility using the 64-bit leafmask, encoded as two 32-bit values
 		uint index = offset + childOffset * 2 + 1;
+		if (leafmask_dictionary)
+			index = dag[offset + 1 + childOffset];
+
 		return testLeafmask(path, dag[index], dag[index + 1]);
 	}
 #endif
@@ -132,6 +279,175 @@ float traverse(const ivec3 path) {
 	return 1.0;
 }
 
+/* Reads the childmask of the node at the given offset in any layout of the DAG */
+uint readChildmask(uint offset) {
+	if (packed_pointers)
+		return readPacked(offset * 2, 2);
+	if (contiguous_children)
+		return dag[offset] & 0xFFFF;
+	return dag[offset];
+}
+
+/* Returns the offset of the given partially visible child of the node at the given offset in any layout */
+uint readChild(uint offset, uint childmask, uint childIndex, int level) {
+	uint childOffset = getChildOffset(childmask, childIndex);
+	if (packed_pointers) {
+		uint width = getPointerWidth(level);
+		return offset + readPacked(offset * 2 + 2 + childOffset * width, width);
+	}
+	if (contiguous_children)
+		return getContiguousChildren(offset) + childOffset;
+	return dag[offset + 1 + childOffset];
+}
+
+/* Returns the leafmask of the given partially visible child of the node at the given offset in level 2 */
+uvec2 readLeafmask(uint offset, uint childmask, uint childIndex) {
+	uint childOffset = getChildOffset(childmask, childIndex);
+	if (packed_pointers) {
+		uint index = offset * 2 + 2 + childOffset * 8;
+		if (leafmask_dictionary) {
+			uint width = getPointerWidth(2);
+			index = (offset + readPacked(offset * 2 + 2 + childOffset * width, width)) * 2;
+		}
+		return uvec2(readPacked(index, 4), readPacked(index + 4, 4));
+	}
+
+	uint index = offset + 1 + childOffset * 2;
+	if (contiguous_children) {
+		index = getContiguousChildren(offset) + childOffset * 2;
+		if (leafmask_dictionary) {
+			index = getContiguousChildren(offset) + childOffset;
+			index += dag[index];
+		}
+	} else if (leafmask_dictionary) {
+		index = dag[offset + 1 + childOffset];
+	}
+	return uvec2(dag[index], dag[index + 1]);
+}
+
+/* Returns the bits of a leafmask which are in the given rectangle of the xy-plane, like cs::getLeafmaskRect */
+uvec2 getLeafmaskRect(ivec2 minCorner, ivec2 maxCorner) {
+	uint row = ((1u << ((maxCorner.x & 0x7) + 1)) - 1u) & ~((1u << (minCorner.x & 0x7)) - 1u);
+
+	uvec2 rect = uvec2(0);
+	for (int y = minCorner.y & 0x7; y <= (maxCorner.y & 0x7); ++y) {
+		if (y < 4)
+			rect.x |= row << (8 * y);
+		else
+			rect.y |= row << (8 * (y - 4));
+	}
+	return rect;
+}
+
+/* Part of the PCF kernel which is counted in the subtree of a node, see countVisible */
+struct KernelPart {
+	uint offset;
+	int level;
+	ivec2 minCorner;
+	ivec2 maxCorner;
+};
+
+/* The stack holds at most 3 unprocessed siblings of every level */
+const int KERNEL_STACK_SIZE = 64;
+
+/* Counts the visible voxels of the rectangle [minCorner, maxCorner] at z in the DAG at the given offset.
+ * Like cs::countVisibleDAG, the rectangle is split among the children of every node, so all samples share the
+ * upper path, and parts of the rectangle inside one leafmask are counted with bitCount. */
+uint countVisible(uint root, ivec2 minCorner, ivec2 maxCorner, int z) {
+	KernelPart stack[KERNEL_STACK_SIZE];
+	stack[0] = KernelPart(root, dag_levels - 2, minCorner, maxCorner);
+	int stackSize = 1;
+
+	uint visible = 0;
+	while (stackSize > 0) {
+		KernelPart part = stack[--stackSize];
+		uint childmask = readChildmask(part.offset);
+
+		if (part.level < MIN_LEVEL) {
+			// Level 2, so the part is inside one 8x8x1 leafmask
+			uint childIndex = (z & 0x7) * 2;
+			uint visibility = 0x3 & (childmask >> childIndex);
+
+			if (visibility == 1) {
+				ivec2 extent = part.maxCorner - part.minCorner + 1;
+				visible += uint(extent.x * extent.y);
+			} else if (visibility == 2) {
+				uvec2 leafmask = readLeafmask(part.offset, childmask, childIndex)
+						& getLeafmaskRect(part.minCorner, part.maxCorner);
+				visible += uint(bitCount(leafmask.x) + bitCount(leafmask.y));
+			}
+			continue;
+		}
+
+		// The node is aligned to its size, which is twice the size of its children
+		int childSize = 1 << part.level;
+		ivec2 origin = part.minCorner & ~(2 * childSize - 1);
+		uint zIndex = bool(z & childSize) ? 8 : 0;
+
+		for (int y = 0; y < 2; ++y) {
+			for (int x = 0; x < 2; ++x) {
+				ivec2 childMin = max(part.minCorner, origin + ivec2(x, y) * childSize);
+				ivec2 childMax = min(part.maxCorner, origin + ivec2(x + 1, y + 1) * childSize - 1);
+				if (any(greaterThan(childMin, childMax)))
+					continue;
+
+				uint childIndex = uint(x * 2 + y * 4) + zIndex;
+				uint visibility = 0x3 & (childmask >> childIndex);
+
+				// Voxels which are still partially visible without leafmasks are visible
+				if (visibility == 1 || (visibility == 2 && part.level == 0)) {
+					ivec2 extent = childMax - childMin + 1;
+					visible += uint(extent.x * extent.y);
+				} else if (visibility == 2) {
+					uint child = readChild(part.offset, childmask, childIndex, part.level);
+					stack[stackSize++] = KernelPart(child, part.level - 1, childMin, childMax);
+				}
+			}
+		}
+	}
+	return visible;
+}
+
+/* Returns the fraction of visible voxels of the PCF kernel around the given voxel in its xy-plane, like
+ * CPUShadowContainer::traverseFiltered. Samples outside the shadow are visible */
+float traverseFiltered(const ivec3 path) {
+	int size = int(filterSize);
+	int dagRes = 1 << (dag_levels - 1);
+	int gridRes = 1 << grid_levels;
+
+	ivec2 kernelMin = path.xy - size / 2;
+	ivec2 minCorner = max(kernelMin, ivec2(0));
+	ivec2 maxCorner = min(kernelMin + size - 1, ivec2(RESOLUTION - 1));
+	if (any(greaterThan(minCorner, maxCorner)))
+		return 1.0;
+
+	ivec2 extent = maxCorner - minCorner + 1;
+	uint visible = uint(size * size - extent.x * extent.y);
+
+	// Count the samples in every grid cell covered by the kernel
+	int cellZ = path.z / dagRes;
+	int z = path.z % dagRes;
+	for (int cellY = minCorner.y / dagRes; cellY <= maxCorner.y / dagRes; ++cellY) {
+		for (int cellX = minCorner.x / dagRes; cellX <= maxCorner.x / dagRes; ++cellX) {
+			ivec2 origin = ivec2(cellX, cellY) * dagRes;
+			ivec2 cellMin = max(minCorner, origin) - origin;
+			ivec2 cellMax = min(maxCorner, origin + dagRes - 1) - origin;
+
+			uint offset = grid[(cellZ * gridRes + cellY) * gridRes + cellX];
+			if (offset == 0x0FFFFFFF)
+				continue; // shadow
+
+			if (offset == 0x0FFFFFFE) {
+				ivec2 cellExtent = cellMax - cellMin + 1;
+				visible += uint(cellExtent.x * cellExtent.y);
+			} else {
+				visible += countVisible(offset, cellMin, cellMax, z);
+			}
+		}
+	}
+	return float(visible) / float(size * size);
+}
+
 void main() {
 	ivec2 index = ivec2(gl_GlobalInvocationID.xy);
 
@@ -143,7 +459,8 @@ void main() {
 	vec4 projPos = lightViewProj * vec4(posWS, 1.0);
 	projPos = projPos / projPos.w;
 
-	float vis = traverse(getPathFromNDC(projPos.xyz));
+	ivec3 path = getPathFromNDC(projPos.xyz);
+	float vis = (filterSize > 1) ? traverseFiltered(path) : traverse(path);
 
 	imageStore(visibilities, index, vec4(vis));
 }
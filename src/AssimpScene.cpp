@@ -1,8 +1,6 @@
 #include "AssimpScene.h"
 #include <assimp/scene.h>
 #include <assimp/postprocess.h>
-#include <glm/gtc/type_ptr.hpp>
-#include <glm/ext.hpp>
 
 #include <iostream>
 #include <fstream>
@@ -23,7 +21,7 @@ unique_ptr<Scene> AssimpScene::loadScene(const string file) {
 	}
 
 	auto scene = make_unique<Scene>();
-	genVAOsAndUniformBuffer(assimpScene, scene.get());
+	copyMeshes(assimpScene, scene.get());
 
 	return std::move(scene);
 }
@@ -66,65 +64,40 @@ void findBoundingBox(const vector<Mesh>& meshes, AABB& boundingBox) {
 	}
 }
 
-void AssimpScene::genVAOsAndUniformBuffer(const aiScene* aiscene, Scene* resScene) {
-	GLuint buffer;
-	Mesh mesh;
+void AssimpScene::copyMeshes(const aiScene* aiscene, Scene* resScene) {
 	resScene->meshes.reserve(aiscene->mNumMeshes);
 
 	for (unsigned n = 0; n < aiscene->mNumMeshes; ++n) {
 		aiMesh *aimesh = aiscene->mMeshes[n];
+		Mesh mesh;
 
 		auto mat = aiscene->mMaterials[aimesh->mMaterialIndex];
 		setMaterial(mesh, mat);
 
-		glGenVertexArrays(1, &(mesh.vao));
-		glBindVertexArray(mesh.vao);
-
 		// Copy assimp faces to linear array
-		uint *faces = new uint[aimesh->mNumFaces * 3];
-
-		unsigned faceIndex = 0;
+		mesh.numFaces = aimesh->mNumFaces;
+		mesh.indices.reserve(aimesh->mNumFaces * 3);
 		for (unsigned i = 0; i < aimesh->mNumFaces; ++i) {
-			auto face = &aimesh->mFaces[i];
-			memcpy(&faces[faceIndex], face->mIndices, 3 * sizeof(unsigned));
-			faceIndex += 3;
+			const auto face = &aimesh->mFaces[i];
+			mesh.indices.insert(mesh.indices.end(), face->mIndices, face->mIndices + 3);
 		}
-		mesh.numFaces = aimesh->mNumFaces;
-
-		glGenBuffers(1, &buffer);
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, buffer);
-		glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(unsigned) * aimesh->mNumFaces * 3,
-				faces, GL_STATIC_DRAW);
-
-		// Don't forget to delete dynamically allocated memory
-		delete[] faces;
 
 		if (aimesh->HasPositions()) {
-			glGenBuffers(1, &buffer);
-			glBindBuffer(GL_ARRAY_BUFFER, buffer);
-			glBufferData(GL_ARRAY_BUFFER, sizeof(float) * 3 * aimesh->mNumVertices,
-					aimesh->mVertices, GL_STATIC_DRAW);
-
-			glEnableVertexAttribArray(vPosLoc);
-			glVertexAttribPointer(vPosLoc, 3, GL_FLOAT, 0, 0, 0);
+			mesh.positions.reserve(aimesh->mNumVertices);
+			for (uint v = 0; v < aimesh->mNumVertices; ++v)
+				mesh.positions.emplace_back(aimesh->mVertices[v].x, aimesh->mVertices[v].y, aimesh->mVertices[v].z);
 		}
 
 		if (aimesh->HasNormals()) {
-			glGenBuffers(1, &buffer);
-			glBindBuffer(GL_ARRAY_BUFFER, buffer);
-			glBufferData(GL_ARRAY_BUFFER, sizeof(float) * 3 * aimesh->mNumVertices,
-					aimesh->mNormals, GL_STATIC_DRAW);
-
-			glEnableVertexAttribArray(vNormalLoc);
-			glVertexAttribPointer(vNormalLoc, 3, GL_FLOAT, 0, 0, 0);
+			mesh.normals.reserve(aimesh->mNumVertices);
+			for (uint v = 0; v < aimesh->mNumVertices; ++v)
+				mesh.normals.emplace_back(aimesh->mNormals[v].x, aimesh->mNormals[v].y, aimesh->mNormals[v].z);
 		}
 
 		//TODO texcoords
-		glBindVertexArray(0);
-
 		findBoundingBox(aimesh, mesh.boundingBox);
 
-		resScene->meshes.push_back(mesh);
+		resScene->meshes.push_back(std::move(mesh));
 	}
 
 	findBoundingBox(resScene->meshes, resScene->boundingBox);
@@ -6,21 +6,18 @@
 #include <assimp/Importer.hpp>
 
 class AssimpScene {
-protected:
-	enum AttributeLog {
-		vPosLoc = 0,
-		vNormalLoc,
-		vTexCoordLoc,
-	};
-
 public:
 	AssimpScene() = delete;	
 	~AssimpScene() = delete;
 
+	/**
+	 * Loads the meshes of the scene into memory on the CPU.
+	 * Use GLScene::upload to render them with OpenGL.
+	 */
 	static unique_ptr<Scene> loadScene(const string file);
 
 protected:
-	static void genVAOsAndUniformBuffer(const aiScene* aiscene, Scene* resScene);
+	static void copyMeshes(const aiScene* aiscene, Scene* resScene);
 };
 
 #endif
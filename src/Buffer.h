@@ -1,7 +1,7 @@
 #ifndef BUFFER_H
 #define BUFFER_H
 
-#include "cpvs.h"
+#include "cpvsGL.h"
 
 /**
  * A shader storage buffer represents memory on the GPU which can be accessed from a shader.
@@ -16,6 +16,26 @@ public:
 		glBufferData(GL_SHADER_STORAGE_BUFFER, size, data.data(), usage);
 		glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
 	}
+	/**
+	 * Copies count elements starting at data to the buffer, e.g. from memory-mapped file.
+	 */
+	template<typename T>
+	SSBO(const T* data, size_t count, GLenum usage) {
+		glGenBuffers(1, &m_bo);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_bo);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, count * sizeof(T), data, usage);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+	}
+	/**
+	 * Allocates an uninitialized buffer of the given size in bytes, which can be filled with setSubData.
+	 */
+	SSBO(size_t size, GLenum usage) {
+		glGenBuffers(1, &m_bo);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_bo);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, size, nullptr, usage);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+	}
+
 	~SSBO() {
 		glDeleteBuffers(1, &m_bo);
 	}
@@ -26,6 +46,16 @@ public:
 	SSBO(SSBO&&) = default;
 	SSBO& operator=(SSBO&&) = default;
 
+	/**
+	 * Copies data to the buffer, starting at the given offset in bytes.
+	 */
+	template<typename T>
+	inline void setSubData(size_t offset, const vector<T>& data) {
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_bo);
+		glBufferSubData(GL_SHADER_STORAGE_BUFFER, offset, data.size() * sizeof(data[0]), data.data());
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+	}
+
 	/**
 	 * Bind the ssbo at the specified index.
 	 */
@@ -0,0 +1,132 @@
+#include "BuildStats.h"
+
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <tuple>
+using namespace std;
+
+void TileStats::addPhase(const string& name, double seconds) {
+	auto phase = std::find_if(phases.begin(), phases.end(),
+			[&name](const pair<string, double>& p) { return p.first == name; });
+	if (phase == phases.end())
+		phases.emplace_back(name, seconds);
+	else
+		phase->second += seconds;
+}
+
+void BuildStats::addTile(uint x, uint y, uint z, TileStats tile) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_tiles.push_back({x, y, z, std::move(tile)});
+}
+
+void BuildStats::addPhase(const string& name, double seconds) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_total.addPhase(name, seconds);
+}
+
+void BuildStats::setNumMergedNodes(vector<size_t> numMergedNodes) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_total.numMergedNodes = std::move(numMergedNodes);
+}
+
+void BuildStats::setSharedDagSize(size_t dagSize, size_t storeSize) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_total.dagSize = dagSize;
+	m_total.peakDagSize = storeSize;
+}
+
+size_t BuildStats::getNumTiles() const {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_tiles.size();
+}
+
+/* Adds the values to the sums, which are resized if needed */
+inline void addValues(vector<size_t>& sums, const vector<size_t>& values) {
+	if (sums.size() < values.size())
+		sums.resize(values.size(), 0);
+	for (size_t i = 0; i < values.size(); ++i)
+		sums[i] += values[i];
+}
+
+inline void writeArray(ostream& os, const vector<size_t>& values) {
+	os << "[";
+	for (size_t i = 0; i < values.size(); ++i)
+		os << (i > 0 ? ", " : "") << values[i];
+	os << "]";
+}
+
+/* Writes the members of the statistics of a tile or of the whole build, without the enclosing braces */
+void writeMembers(ostream& os, const TileStats& stats, const string& indent) {
+	os << indent << "\"seconds\": {";
+	for (size_t i = 0; i < stats.phases.size(); ++i)
+		os << (i > 0 ? ", " : "") << "\"" << stats.phases[i].first << "\": " << stats.phases[i].second;
+	os << "}";
+
+	if (stats.dagSize > 0)
+		os << ",\n" << indent << "\"dagBytes\": " << stats.dagSize * sizeof(uint);
+	if (stats.peakDagSize > 0)
+		os << ",\n" << indent << "\"peakDagBytes\": " << stats.peakDagSize * sizeof(uint);
+
+	if (!stats.numNodes.empty()) {
+		os << ",\n" << indent << "\"nodes\": ";
+		writeArray(os, stats.numNodes);
+	}
+
+	if (!stats.numMergedNodes.empty()) {
+		os << ",\n" << indent << "\"mergedNodes\": ";
+		writeArray(os, stats.numMergedNodes);
+
+		// Number of nodes of the SVO which are represented by one node of the DAG
+		os << ",\n" << indent << "\"mergeRatios\": [";
+		for (size_t level = 0; level < stats.numMergedNodes.size(); ++level) {
+			const size_t numNodes = level < stats.numNodes.size() ? stats.numNodes[level] : 0;
+			const size_t numMerged = stats.numMergedNodes[level];
+			os << (level > 0 ? ", " : "") << (numMerged > 0 ? numNodes / static_cast<double>(numMerged) : 1.0);
+		}
+		os << "]";
+	}
+}
+
+void BuildStats::writeJSON(ostream& os) const {
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	// Tiles are added in the order they are finished
+	vector<const Tile*> tiles;
+	for (const Tile& tile : m_tiles)
+		tiles.push_back(&tile);
+	std::sort(tiles.begin(), tiles.end(), [](const Tile* a, const Tile* b) {
+		return std::make_tuple(a->z, a->y, a->x) < std::make_tuple(b->z, b->y, b->x);
+	});
+
+	// The unique nodes of the tiles can only be summed up if they don't share nodes
+	TileStats total = m_total;
+	const bool sumMergedNodes = total.numMergedNodes.empty();
+	for (const Tile& tile : m_tiles) {
+		addValues(total.numNodes, tile.stats.numNodes);
+		if (sumMergedNodes)
+			addValues(total.numMergedNodes, tile.stats.numMergedNodes);
+		total.dagSize += tile.stats.dagSize;
+		total.peakDagSize = std::max(total.peakDagSize, tile.stats.peakDagSize);
+	}
+
+	os << std::setprecision(6) << "{\n";
+	writeMembers(os, total, "  ");
+	os << ",\n  \"tiles\": [";
+
+	for (size_t i = 0; i < tiles.size(); ++i) {
+		const Tile& tile = *tiles[i];
+		os << (i > 0 ? "," : "") << "\n    {\n"
+		   << "      \"x\": " << tile.x << ", \"y\": " << tile.y << ", \"z\": " << tile.z << ",\n";
+		writeMembers(os, tile.stats, "      ");
+		os << "\n    }";
+	}
+	os << "\n  ]\n}\n";
+}
+
+void BuildStats::writeJSON(const string& file) const {
+	ofstream os(file);
+	if (!os.is_open())
+		throw FileNotFound("Could not open the file for the build statistics");
+	writeJSON(os);
+}
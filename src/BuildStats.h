@@ -0,0 +1,92 @@
+#ifndef BUILD_STATS_H
+#define BUILD_STATS_H
+
+#include "cpvs.h"
+
+#include <mutex>
+#include <ostream>
+
+/**
+ * Statistics of building the DAG of one tile, see CompressedShadow::create.
+ * All sizes are in words, and the node counts are indexed by level (0 is the lowest level).
+ */
+struct TileStats {
+	/** Durations in seconds of the phases of building the tile, in the order they were run */
+	vector<std::pair<string, double>> phases;
+
+	/** Number of nodes in every level before common subtrees are merged, i.e. the nodes of the SVO */
+	vector<size_t> numNodes;
+
+	/** Number of unique nodes in every level after merging, empty if the tile shares its nodes with other tiles */
+	vector<size_t> numMergedNodes;
+
+	/** Largest size of the DAG or of the intermediate data while building the tile, e.g. the uncompressed SVO */
+	size_t peakDagSize = 0;
+
+	/** Size of the final DAG, 0 if the tile shares its nodes with other tiles */
+	size_t dagSize = 0;
+
+	/** Adds the duration to the phase with the given name */
+	void addPhase(const string& name, double seconds);
+};
+
+/**
+ * Optional sink for statistics of precomputing shadows: the phases of every tile, the nodes per level before and
+ * after merging common subtrees, the peak size of the DAG and the durations of the phases of the whole build.
+ * Is passed to e.g. ShadowBaker::bake and written as JSON.
+ *
+ * Tiles and phases may be added concurrently, e.g. by the tasks building the tiles.
+ */
+class BuildStats {
+public:
+	BuildStats() = default;
+
+	BuildStats(const BuildStats&) = delete;
+	BuildStats& operator=(const BuildStats&) = delete;
+
+	/** Adds the statistics of the tile (x, y, z) of the container */
+	void addTile(uint x, uint y, uint z, TileStats tile);
+
+	/** Adds the duration to the phase of the whole build with the given name, e.g. "bake" */
+	void addPhase(const string& name, double seconds);
+
+	/**
+	 * Sets the number of unique nodes in every level of the whole build, i.e. of a NodeStore shared by all tiles.
+	 * Otherwise the unique nodes of all tiles are summed up.
+	 */
+	void setNumMergedNodes(vector<size_t> numMergedNodes);
+
+	/**
+	 * Sets the size of the DAG laid out from a NodeStore shared by all tiles and the size of the store, which is
+	 * the peak size, since the tiles don't have DAGs of their own.
+	 */
+	void setSharedDagSize(size_t dagSize, size_t storeSize);
+
+	size_t getNumTiles() const;
+
+	/**
+	 * Writes the statistics as JSON, with the sizes in bytes and the merge ratio of every level. The nodes and the DAG
+	 * size of the whole build are the sums of those of the tiles (plus a shared DAG), the peak size is the largest
+	 * of the tiles and the shared store.
+	 */
+	void writeJSON(std::ostream& os) const;
+
+	/**
+	 * Writes the statistics as JSON to the given file.
+	 * @throws FileNotFound if the file can't be opened.
+	 */
+	void writeJSON(const string& file) const;
+
+private:
+	struct Tile {
+		uint x, y, z;
+		TileStats stats;
+	};
+
+	mutable std::mutex m_mutex;
+
+	TileStats m_total;
+	vector<Tile> m_tiles;
+};
+
+#endif
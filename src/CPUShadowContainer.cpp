@@ -0,0 +1,240 @@
+#include "CPUShadowContainer.h"
+#include "CompressedShadowUtil.h"
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+
+// Number of chunks of positions per thread, so that threads which finish early take over the remaining chunks
+constexpr uint CHUNKS_PER_THREAD = 4;
+
+// Minimum number of positions in one chunk
+constexpr size_t MIN_CHUNK_SIZE = 4096;
+
+// Number of pairs of neighboring positions per chunk whose buckets are compared to detect coherent positions
+constexpr size_t COHERENCE_SAMPLES = 64;
+
+void CPUShadowContainer::combineDAGs() {
+	assert(m_info.size() > 0);
+	m_numLevels = getNumLevels();
+
+	m_gridLevels = 0;
+	while ((1u << m_gridLevels) < m_length)
+		++m_gridLevels;
+
+	if (m_file) {
+		// The file already contains the grid and the DAG in their final layout
+		m_gridData = m_file->getGrid();
+		m_dagData = m_file->getDAG();
+	} else {
+		m_usesLeafmaskDictionary = false;
+
+		if (m_packedPointers) {
+			layoutPackedDAG(m_dag, m_grid);
+		} else if (m_contiguousChildren) {
+			layoutContiguousDAG(m_dag, m_grid);
+		} else if (m_store) {
+			layoutSharedDAG(m_dag, m_grid);
+		} else {
+			if (m_leafmaskDictionary && m_memoryBudget == 0)
+				internLeafmasks();
+
+			// Pointers are absolute, so every DAG is relocated to its offset in the combined DAG
+			size_t index = 0;
+			m_dag.clear();
+			m_grid.clear();
+			forEachShadow([&](const CompressedShadow& shadow) {
+				m_grid.push_back(getGridCell(index++, m_dag.size()));
+				shadow.appendDAG(m_dag, m_dag.size());
+			});
+		}
+		m_gridData = m_grid.data();
+		m_dagData = m_dag.data();
+	}
+	m_encoding = CompressedShadow::getLeafmaskEncoding(m_numLevels, m_usesLeafmaskDictionary);
+}
+
+uint CPUShadowContainer::lookupGrid(const ivec3& path) const {
+	assert(m_gridData != nullptr);
+	const ivec3 cell = path >> static_cast<int>(m_numLevels - 1);
+	return m_gridData[getIndex(cell.x, cell.y, cell.z)];
+}
+
+CompressedShadow::NodeVisibility CPUShadowContainer::traverse(const ivec3& path) const {
+	const uint root = lookupGrid(path);
+
+	// The grid stores two special values which indicate if the entire grid cell is visible or in shadow
+	if (root == GRID_CELL_SHADOWED)
+		return CompressedShadow::SHADOW;
+	if (root == GRID_CELL_VISIBLE)
+		return CompressedShadow::VISIBLE;
+
+	// The upper bits of the path select the grid cell and are ignored by the traversal
+	if (m_packedPointers)
+		return cs::traversePacked(m_dagData, root, m_numLevels, m_pointerWidths, m_encoding, path);
+	if (m_contiguousChildren)
+		return cs::traverseContiguous(m_dagData, root, m_numLevels, m_encoding, path);
+	return cs::traverseDAG(m_dagData, root, m_numLevels, m_encoding, path);
+}
+
+float CPUShadowContainer::traverseFiltered(const ivec3& path) const {
+	if (m_filterSize == 1)
+		return (traverse(path) == CompressedShadow::SHADOW) ? 0.0f : 1.0f;
+
+	const int resolution = cs::getResolution(getTotalNumLevels());
+	const int dagResolution = cs::getResolution(m_numLevels);
+	const int numSamples = m_filterSize * m_filterSize;
+
+	// The kernel is centered at the voxel, and samples outside the container are visible
+	const ivec2 kernelMin = ivec2(path) - static_cast<int>(m_filterSize / 2);
+	const ivec2 min = glm::max(kernelMin, ivec2(0));
+	const ivec2 max = glm::min(kernelMin + static_cast<int>(m_filterSize - 1), ivec2(resolution - 1));
+	if (min.x > max.x || min.y > max.y)
+		return 1.0f;
+	uint visible = numSamples - (max.x - min.x + 1) * (max.y - min.y + 1);
+
+	// Count the samples in every grid cell covered by the kernel
+	const int cellZ = path.z / dagResolution;
+	const int z = path.z % dagResolution;
+	for (int cellY = min.y / dagResolution; cellY <= max.y / dagResolution; ++cellY) {
+		for (int cellX = min.x / dagResolution; cellX <= max.x / dagResolution; ++cellX) {
+			const ivec2 origin = ivec2(cellX, cellY) * dagResolution;
+			const ivec2 cellMin = glm::max(min, origin) - origin;
+			const ivec2 cellMax = glm::min(max, origin + dagResolution - 1) - origin;
+
+			const uint root = m_gridData[getIndex(cellX, cellY, cellZ)];
+			if (root == GRID_CELL_SHADOWED)
+				continue;
+
+			if (root == GRID_CELL_VISIBLE) {
+				visible += (cellMax.x - cellMin.x + 1) * (cellMax.y - cellMin.y + 1);
+			} else if (m_packedPointers) {
+				visible += cs::countVisiblePacked(m_dagData, root, m_numLevels, m_pointerWidths, m_encoding,
+						cellMin, cellMax, z);
+			} else if (m_contiguousChildren) {
+				visible += cs::countVisibleContiguous(m_dagData, root, m_numLevels, m_encoding, cellMin, cellMax, z);
+			} else {
+				visible += cs::countVisibleDAG(m_dagData, root, m_numLevels, m_encoding, cellMin, cellMax, z);
+			}
+		}
+	}
+	return static_cast<float>(visible) / numSamples;
+}
+
+void CPUShadowContainer::evaluate(const ImageF& positionsWS, const mat4& lightViewProj, ImageF& visibilities) const {
+	assert(positionsWS.getNumChannels() >= 3 && visibilities.getNumChannels() == 1);
+	assert(positionsWS.getWidth() == visibilities.getWidth() && positionsWS.getHeight() == visibilities.getHeight());
+
+	const size_t numPixels = positionsWS.getWidth() * positionsWS.getHeight();
+	const size_t numChannels = positionsWS.getNumChannels();
+	const float* positions = positionsWS.data();
+	float* result = visibilities.data();
+
+	ThreadPool& pool = ThreadPool::getDefault();
+	const uint numChunks = std::max<size_t>(1, std::min<size_t>(pool.getNumThreads() * CHUNKS_PER_THREAD,
+			numPixels / MIN_CHUNK_SIZE));
+
+	const uint bucketShift = getBucketShift(getTotalNumLevels());
+
+	pool.parallelFor(numPixels, numChunks, [&](uint, size_t begin, size_t end) {
+		vector<Query> queries;
+		vector<uint> buckets;
+		queries.reserve(end - begin);
+
+		for (size_t pixel = begin; pixel < end; ++pixel) {
+			const float* position = positions + pixel * numChannels;
+			vec4 projPos = lightViewProj * vec4(position[0], position[1], position[2], 1.0f);
+			projPos /= projPos.w;
+
+			// Also catches NaN, e.g. of positions in the plane of the light
+			if (!(std::abs(projPos.x) <= 1.0f && std::abs(projPos.y) <= 1.0f && std::abs(projPos.z) <= 1.0f)) {
+				result[pixel] = 1.0f;
+				continue;
+			}
+
+			const ivec3 path = cs::getPathFromNDC(vec3(projPos), getTotalNumLevels());
+			queries.push_back({ path, static_cast<uint>(pixel) });
+		}
+
+		/* Counting sort of the queries by their buckets, so that queries of the same grid cell and subtrees are
+		 * traversed one after another and their nodes stay cached. Positions of a rendered image are mostly
+		 * coherent already, for them sorting costs more than it gains */
+		const bool coherent = isCoherent(queries, bucketShift);
+		if (!coherent) {
+			buckets.reserve(queries.size());
+			for (const Query& query : queries)
+				buckets.push_back(static_cast<uint>(cs::getMortonCode(query.path) >> bucketShift));
+
+			vector<uint> bucketOffsets((1 << BUCKET_BITS) + 1, 0);
+			for (uint bucket : buckets)
+				++bucketOffsets[bucket + 1];
+			std::partial_sum(bucketOffsets.begin(), bucketOffsets.end(), bucketOffsets.begin());
+
+			vector<Query> sorted(queries.size());
+			for (size_t i = 0; i < queries.size(); ++i)
+				sorted[bucketOffsets[buckets[i]]++] = queries[i];
+			queries.swap(sorted);
+		}
+
+		// Interleaving hides the cache misses of incoherent queries, coherent ones would only pay for its bookkeeping
+		if (!coherent && m_filterSize == 1 && !m_packedPointers && !m_contiguousChildren) {
+			traverseInterleaved(queries, result);
+			return;
+		}
+
+		// Like in the shader, voxels which are still partially visible (without leafmasks) are visible
+		for (const Query& query : queries)
+			result[query.pixel] = traverseFiltered(query.path);
+	});
+}
+
+uint CPUShadowContainer::getBucketShift(uint totalNumLevels) {
+	// The coordinates of the voxels have totalNumLevels - 1 bits
+	const uint numBits = 3 * (totalNumLevels - 1);
+	return numBits > BUCKET_BITS ? numBits - BUCKET_BITS : 0;
+}
+
+bool CPUShadowContainer::isCoherent(const vector<Query>& queries, uint bucketShift) {
+	if (queries.size() < 2)
+		return true;
+
+	const size_t numSamples = std::min(COHERENCE_SAMPLES, queries.size() - 1);
+	const size_t stride = (queries.size() - 1) / numSamples;
+
+	size_t numCoherent = 0;
+	for (size_t i = 0; i < numSamples; ++i) {
+		const size_t index = i * stride;
+		if ((cs::getMortonCode(queries[index].path) >> bucketShift)
+				== (cs::getMortonCode(queries[index + 1].path) >> bucketShift))
+			++numCoherent;
+	}
+	return 4 * numCoherent >= numSamples;
+}
+
+void CPUShadowContainer::traverseInterleaved(const vector<Query>& queries, float* result) const {
+	vector<ivec3> paths;
+	vector<uint> roots, pixels;
+	paths.reserve(queries.size());
+	roots.reserve(queries.size());
+	pixels.reserve(queries.size());
+
+	// Only the queries in partially visible grid cells are traversed
+	for (const Query& query : queries) {
+		const uint root = lookupGrid(query.path);
+		if (root == GRID_CELL_SHADOWED || root == GRID_CELL_VISIBLE) {
+			result[query.pixel] = (root == GRID_CELL_SHADOWED) ? 0.0f : 1.0f;
+		} else {
+			paths.push_back(query.path);
+			roots.push_back(root);
+			pixels.push_back(query.pixel);
+		}
+	}
+
+	vector<uint8_t> visibilities(paths.size());
+	cs::traverseInterleaved(m_dagData, m_numLevels, m_encoding, paths.data(), roots.data(), paths.size(),
+			visibilities.data());
+
+	for (size_t i = 0; i < pixels.size(); ++i)
+		result[pixels[i]] = (visibilities[i] == CompressedShadow::SHADOW) ? 0.0f : 1.0f;
+}
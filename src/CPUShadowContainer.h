@@ -0,0 +1,121 @@
+#ifndef CPU_SHADOW_CONTAINER_H
+#define CPU_SHADOW_CONTAINER_H
+
+#include "cpvs.h"
+#include "CompressedShadowContainer.h"
+#include "Image.h"
+
+/**
+ * A CompressedShadowContainer which evaluates the precomputed shadows on the CPU, e.g. on machines without a GPU.
+ *
+ * After the DAGs have been combined (see combineDAGs), the visibility of world-space positions is evaluated like
+ * in shader/traverse.cs, i.e. with the lookup in the top-level grid and in the combined DAG of all shadows,
+ * using all threads of the default ThreadPool. All layouts of the DAG are supported (shared, packed,
+ * contiguous children and the layout of a memory-mapped file).
+ */
+class CPUShadowContainer : public CompressedShadowContainer {
+public:
+	/**
+	 * The positions are bucketed by this number of upper bits of their Morton codes, i.e. by the grid cell and the
+	 * upper levels of the DAG. A full sort costs more than the traversal of the positions gains.
+	 */
+	static constexpr uint BUCKET_BITS = 15;
+
+	/** Creates a container with a fixed length in one dimension of the 3D container. */
+	CPUShadowContainer(uint length)
+		: CompressedShadowContainer(length), m_gridData(nullptr), m_dagData(nullptr), m_numLevels(0), m_gridLevels(0),
+		  m_encoding(CompressedShadow::NO_LEAFMASKS)
+	{ }
+
+	/** Creates a container with a length of 1 and initializes it with the given precomputed shadow. */
+	CPUShadowContainer(unique_ptr<CompressedShadow> shadow)
+		: CompressedShadowContainer(std::move(shadow)), m_gridData(nullptr), m_dagData(nullptr), m_numLevels(0),
+		  m_gridLevels(0), m_encoding(CompressedShadow::NO_LEAFMASKS)
+	{ }
+
+	/** Creates a container from a memory-mapped file, whose grid and DAG are evaluated as they are. */
+	CPUShadowContainer(unique_ptr<ContainerFile> file)
+		: CompressedShadowContainer(std::move(file)), m_gridData(nullptr), m_dagData(nullptr), m_numLevels(0),
+		  m_gridLevels(0), m_encoding(CompressedShadow::NO_LEAFMASKS)
+	{ }
+
+	~CPUShadowContainer() = default;
+
+	/**
+	 * Combines the DAGs of all shadows into one DAG and creates the grid, like they are copied to the GPU.
+	 * Has to be called after all shadows have been set and before they are evaluated.
+	 *
+	 * @note The shadows may be freed with freeOnCPU afterwards, except if the container has been loaded from a
+	 * file, whose mapping is used directly.
+	 */
+	void combineDAGs();
+
+	/**
+	 * Calculates the visibility of every world-space position in the given image (with at least 3 channels)
+	 * and writes 0 (shadow) or 1 (visible) to the image of visibilities, which must have 1 channel and the same size.
+	 * Positions outside the volume of the shadow are visible. If a filter size is set, the visibility is the
+	 * fraction of visible voxels of the PCF kernel (see traverseFiltered).
+	 *
+	 * The positions are split into one chunk per task. If the positions of a chunk are incoherent (e.g. not the
+	 * positions of a rendered image), they are traversed in the order of their Morton codes, i.e. grouped by grid
+	 * cell and then by the nodes of the DAG, and the traversals of several positions are interleaved (see
+	 * traverseInterleaved). Otherwise the positions are traversed one after another in their order in the image.
+	 */
+	void evaluate(const ImageF& positionsWS, const mat4& lightViewProj, ImageF& visibilities) const;
+
+	/** Returns the visibility of the voxel with the given coordinates in the whole container. */
+	CompressedShadow::NodeVisibility traverse(const ivec3& path) const;
+
+	/**
+	 * Returns the fraction of visible voxels of the PCF kernel (see setFilterSize) around the voxel with the given
+	 * coordinates, in the xy-plane of the voxel. Samples outside the container are visible.
+	 */
+	float traverseFiltered(const ivec3& path) const;
+
+	/** Returns the number of levels of the whole container, i.e. including the levels of the grid */
+	inline uint getTotalNumLevels() const {
+		return m_numLevels + m_gridLevels;
+	}
+
+	/**
+	 * Returns the shift of the Morton codes (see cs::getMortonCode) of the voxels of a container with the given
+	 * total number of levels, which leaves the BUCKET_BITS upper bits, i.e. the bucket of a position in evaluate.
+	 */
+	static uint getBucketShift(uint totalNumLevels);
+
+private:
+	/* A position which is evaluated, see evaluate */
+	struct Query {
+		ivec3 path;
+		uint pixel;
+	};
+
+	/** Returns the value of the grid cell which contains the voxel with the given coordinates */
+	uint lookupGrid(const ivec3& path) const;
+
+	/**
+	 * Returns true if at least a quarter of a sample of neighboring queries are in the same bucket of Morton codes,
+	 * i.e. if the nodes of the queries are likely still cached when they are traversed in their order.
+	 */
+	static bool isCoherent(const vector<Query>& queries, uint bucketShift);
+
+	/**
+	 * Writes the visibility of every query to result, with the traversals interleaved by cs::traverseInterleaved.
+	 * @note Only for a DAG with absolute pointers and without PCF.
+	 */
+	void traverseInterleaved(const vector<Query>& queries, float* result) const;
+
+private:
+	vector<uint> m_grid;
+	vector<uint> m_dag;
+
+	// The grid and the DAG which are evaluated, either the ones above or the ones of the mapped file
+	const uint* m_gridData;
+	const uint* m_dagData;
+
+	uint m_numLevels;  // number of levels of the DAG of every grid cell
+	uint m_gridLevels; // log2 of the length of the grid
+	CompressedShadow::LeafmaskEncoding m_encoding;
+};
+
+#endif
@@ -1,21 +1,33 @@
 #include "CompressedShadow.h"
+#include "BuildStats.h"
 #include "CompressedShadowUtil.h"
+#include "DagBuilder.h"
 #include "MinMaxHierarchy.h"
-#include "ShadowMap.h"
+#include "NodeStore.h"
 
 #include <algorithm>
+#include <chrono>
 #include <numeric>
-#include <unordered_set>
 #include <limits>
 using namespace cs;
 using namespace std;
 
 #include <glm/ext.hpp>
 #include <iostream>
+#include <fstream>
+
+// The batch traversal uses AVX2 gathers if the CPU supports them, which is checked at runtime
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define TRAVERSE_AVX2
+#include <immintrin.h>
+#endif
 
 // Enable/disable leafmasks. Also has to be modified in traversal.cs
 #define LEAFMASKS
 
+// Under this number of parent nodes the child pointers are updated by a single thread
+#define PARALLEL_UPDATE_THRESHOLD 16384
+
 /* Decides whether to use 64-bit leafmaks */
 inline bool useLeafmasks(uint numLevels) {
 #ifdef LEAFMASKS
@@ -41,26 +53,121 @@ inline uint getNodeSize(uint m_numLevels, uint level) {
 }
 
 CompressedShadow::CompressedShadow(uint numLevels)
-	: m_numLevels(numLevels)
+	: m_numLevels(numLevels), m_leafmaskDictionary(false)
 {
 	assert(m_numLevels > 3);
 }
 
+/* Adds the duration since t0 to the phase of the stats (if any) and restarts t0 */
+inline void addPhaseToNow(TileStats* stats, const char* phase, chrono::steady_clock::time_point& t0) {
+	const auto t1 = chrono::steady_clock::now();
+	if (stats)
+		stats->addPhase(phase, chrono::duration<double>(t1 - t0).count());
+	t0 = t1;
+}
+
 unique_ptr<CompressedShadow> CompressedShadow::create(const MinMaxHierarchy& minMax,
-		uint zTileIndex, uint zTileNum) {
+		uint zTileIndex, uint zTileNum, TileStats* stats) {
 	auto cs = unique_ptr<CompressedShadow>(new CompressedShadow(minMax.getNumLevels()));
 
+	cs::setDepthOffset(zTileNum);
+	cs->constructDag(minMax, ivec3(0, 0, zTileIndex * 2), stats);
+
+	return cs;
+}
+
+uint CompressedShadow::createInStore(const MinMaxHierarchy& minMax, NodeStore& store,
+		uint zTileIndex, uint zTileNum, TileStats* stats) {
+	assert(store.getNumLevels() == static_cast<uint>(minMax.getNumLevels()));
+
+	auto t0 = chrono::steady_clock::now();
+	cs::setDepthOffset(zTileNum);
+	DagBuilder builder(minMax, store);
+	const uint root = builder.build(ivec3(0, 0, zTileIndex * 2));
+
+	addPhaseToNow(stats, "build", t0);
+	if (stats)
+		stats->numNodes = builder.getNumBuiltNodes();
+	return root;
+}
+
+unique_ptr<NodeStore> CompressedShadow::createNodeStore(uint numLevels) {
+	return make_unique<NodeStore>(numLevels, useLeafmasks(numLevels));
+}
+
+unique_ptr<CompressedShadow> CompressedShadow::createFromSvo(const MinMaxHierarchy& minMax,
+		uint zTileIndex, uint zTileNum, TileStats* stats) {
+	auto cs = unique_ptr<CompressedShadow>(new CompressedShadow(minMax.getNumLevels()));
+
+	auto t0 = chrono::steady_clock::now();
 	cs::setDepthOffset(zTileNum);
 	auto levels = cs->constructSvo(minMax, ivec3(0, 0, zTileIndex * 2));
-	cs->mergeCommonSubtrees(levels);
-	cs->compress();
+	addPhaseToNow(stats, "constructSvo", t0);
+
+	// The uncompressed SVO is the largest the DAG gets
+	if (stats) {
+		stats->numNodes = cs->getNumNodesPerLevel(levels);
+		stats->peakDagSize = std::max(stats->peakDagSize, cs->m_dag.size());
+		t0 = chrono::steady_clock::now();
+	}
+
+	auto nodesPerLevel = cs->mergeCommonSubtrees(levels);
+	addPhaseToNow(stats, "mergeCommonSubtrees", t0);
+
+	if (stats) {
+		stats->numMergedNodes.assign(nodesPerLevel.begin(), nodesPerLevel.end());
+		stats->numMergedNodes.push_back(1); // the root isn't merged
+		t0 = chrono::steady_clock::now();
+	}
+
+	cs->compress(levels, nodesPerLevel);
+	addPhaseToNow(stats, "compress", t0);
+
+	if (stats)
+		stats->dagSize = cs->m_dag.size();
+	return cs;
+}
+
+static const uint FILE_MAGIC = 0x53565043; // "CPVS"
+static const uint FILE_FLAG_LEAFMASK_DICTIONARY = 0x1;
+
+unique_ptr<CompressedShadow> CompressedShadow::readFromFile(const string& file) {
+	ifstream is(file, ios::binary);
+	if (!is.is_open())
+		throw FileNotFound("Compressed shadow file not found");
+
+	uint magic, numLevels, flags;
+	uint64 dagSize;
+	is.read(reinterpret_cast<char*>(&magic), sizeof(magic));
+	is.read(reinterpret_cast<char*>(&numLevels), sizeof(numLevels));
+	is.read(reinterpret_cast<char*>(&flags), sizeof(flags));
+	is.read(reinterpret_cast<char*>(&dagSize), sizeof(dagSize));
+
+	if (!is || magic != FILE_MAGIC || numLevels <= 3)
+		throw LoadFileException("Invalid compressed shadow file");
+
+	auto cs = unique_ptr<CompressedShadow>(new CompressedShadow(numLevels));
+	cs->m_leafmaskDictionary = flags & FILE_FLAG_LEAFMASK_DICTIONARY;
+	cs->m_dag.resize(dagSize);
+	is.read(reinterpret_cast<char*>(cs->m_dag.data()), dagSize * sizeof(uint));
 
+	if (!is)
+		throw LoadFileException("Compressed shadow file is truncated");
 	return cs;
 }
 
-unique_ptr<CompressedShadow> CompressedShadow::create(const ShadowMap* shadowMap, uint zTileIndex, uint zTileNum) {
-	MinMaxHierarchy minMax(shadowMap->createImageF());
-	return create(minMax, zTileIndex, zTileNum);
+void CompressedShadow::writeToFile(const string& file) const {
+	ofstream os(file, ios::binary);
+	if (!os.is_open())
+		throw FileNotFound("Could not open file for writing");
+
+	const uint64 dagSize = m_dag.size();
+	const uint flags = m_leafmaskDictionary ? FILE_FLAG_LEAFMASK_DICTIONARY : 0;
+	os.write(reinterpret_cast<const char*>(&FILE_MAGIC), sizeof(FILE_MAGIC));
+	os.write(reinterpret_cast<const char*>(&m_numLevels), sizeof(m_numLevels));
+	os.write(reinterpret_cast<const char*>(&flags), sizeof(flags));
+	os.write(reinterpret_cast<const char*>(&dagSize), sizeof(dagSize));
+	os.write(reinterpret_cast<const char*>(m_dag.data()), dagSize * sizeof(uint));
 }
 
 CompressedShadow::NodeVisibility CompressedShadow::getTotalVisibility() const {
@@ -71,6 +178,70 @@ CompressedShadow::NodeVisibility CompressedShadow::getTotalVisibility() const {
 	return PARTIAL;
 }
 
+void CompressedShadow::appendDAG(vector<uint>& dag, size_t base) const {
+	assert(base + m_dag.size() < std::numeric_limits<uint>::max());
+
+	const size_t begin = dag.size();
+	dag.insert(dag.end(), m_dag.begin(), m_dag.end());
+
+	if (base == 0)
+		return;
+
+	/* Relocate all pointers, i.e. everything except inline leafmasks and the leafmask table */
+	const LeafmaskEncoding encoding = getLeafmaskEncoding();
+	const auto offsets = getLevelOffsets(m_dag, m_numLevels, encoding);
+
+	for (int level = m_numLevels - 2; level >= static_cast<int>(getMinLevel(m_numLevels)); --level) {
+		if (level == 2 && encoding == INLINE_LEAFMASKS)
+			break;
+
+		for (size_t offset = offsets[level + 1]; offset < offsets[level]; ) {
+			const uint numChildren = getNumChildren(m_dag[offset]);
+			for (uint i = 1; i <= numChildren; ++i)
+				dag[begin + offset + i] += base;
+			offset += 1 + numChildren;
+		}
+	}
+}
+
+CompressedShadow::LeafmaskEncoding CompressedShadow::getLeafmaskEncoding() const {
+	return getLeafmaskEncoding(m_numLevels, m_leafmaskDictionary);
+}
+
+CompressedShadow::LeafmaskEncoding CompressedShadow::getLeafmaskEncoding(uint numLevels, bool leafmaskDictionary) {
+	if (!useLeafmasks(numLevels))
+		return NO_LEAFMASKS;
+	return leafmaskDictionary ? LEAFMASK_POINTERS : INLINE_LEAFMASKS;
+}
+
+size_t CompressedShadow::internLeafmasks() {
+	if (getLeafmaskEncoding() != INLINE_LEAFMASKS)
+		return 0;
+
+	m_leafmaskDictionary = true;
+	return cs::internLeafmasks(m_dag, m_numLevels);
+}
+
+void CompressedShadow::constructDag(const MinMaxHierarchy& minMax, const ivec3 rootOffset, TileStats* stats) {
+	NodeStore store(m_numLevels, useLeafmasks(m_numLevels));
+	DagBuilder builder(minMax, store);
+
+	auto t0 = chrono::steady_clock::now();
+	const uint root = builder.build(rootOffset);
+	addPhaseToNow(stats, "build", t0);
+
+	m_dag = store.layout({ root });
+	addPhaseToNow(stats, "layout", t0);
+
+	// The store and the DAG are both in memory after the layout
+	if (stats) {
+		stats->numNodes = builder.getNumBuiltNodes();
+		stats->numMergedNodes = store.getNumNodesPerLevel();
+		stats->peakDagSize = std::max(stats->peakDagSize, store.getSize() + m_dag.size());
+		stats->dagSize = m_dag.size();
+	}
+}
+
 /**
  * Given a node through it's offset and a pointer to the beginning of it's children, this helper
  * function sets the nodes pointers to it's children in the dag.
@@ -92,7 +263,11 @@ vector<uint> CompressedShadow::constructSvo(const MinMaxHierarchy& minMax, const
 	m_dag.resize(NODE_SIZE + numChildren * getNodeSize(m_numLevels, m_numLevels - 3));
 	m_dag[0] = rootmask;
 
-	vector<ivec3> childCoords = cs::getChildCoordinates(rootmask, rootOffset);
+	/* Coordinates of the nodes in the current and the next level. Both buffers are swapped after each
+	 * level, so their capacity is reused instead of allocating per node or per level. */
+	vector<ivec3> childCoords;
+	vector<ivec3> newChildrenCoords;
+	cs::appendChildCoordinates(rootmask, rootOffset, childCoords);
 	setChildrenOffsets(m_dag, 0, NODE_SIZE, numChildren, getNodeSize(m_numLevels, m_numLevels - 3));
 
 	size_t levelOffset   = NODE_SIZE;   // Offset to the beginning of the current level
@@ -118,7 +293,6 @@ vector<uint> CompressedShadow::constructSvo(const MinMaxHierarchy& minMax, const
 
 		size_t newChildrenNodes  = 0; // counts the number of new children in the next level
 		size_t nextLevelProgress = 0; // current index in the next level
-		vector<ivec3> newChildrenCoords;
 
 		/* First calculate the number of new children nodes so we can resize the dag.
 		 * Thereby set and save all masks so we don't have to calculate them twice */
@@ -134,17 +308,19 @@ vector<uint> CompressedShadow::constructSvo(const MinMaxHierarchy& minMax, const
 		if (level != 0)
 			m_dag.resize(m_dag.size() + newChildrenNodes * childNodeSize, 0);
 
+		newChildrenCoords.clear();
+		newChildrenCoords.reserve(newChildrenNodes);
+
 		for (size_t nodeNr = 0; nodeNr < numLevelNodes; ++nodeNr) {
 			size_t nodeOffset = levelOffset + nodeNr * NODE_SIZE;
 			uint nodemask     = m_dag[nodeOffset];
 			numChildren       = cs::getNumChildren(nodemask);
 
 			if (numChildren > 0) {
-				auto coords = cs::getChildCoordinates(nodemask, childCoords[nodeNr]);
 				size_t childOffset = nextLevelOffset + nextLevelProgress;
 
 				setChildrenOffsets(m_dag, nodeOffset, childOffset, numChildren, childNodeSize);
-				newChildrenCoords.insert(newChildrenCoords.end(), coords.begin(), coords.end());
+				cs::appendChildCoordinates(nodemask, childCoords[nodeNr], newChildrenCoords);
 
 				nextLevelProgress += numChildren * childNodeSize;
 			}
@@ -212,7 +388,18 @@ inline bool levelExists(const vector<uint>& dag, const vector<uint>& levelOffset
 		return levelOffsets[level - 1] > levelOffsets[level];
 }
 
-void CompressedShadow::mergeCommonSubtrees(const vector<uint>& levelOffsets) {
+vector<size_t> CompressedShadow::getNumNodesPerLevel(const vector<uint>& levelOffsets) const {
+	vector<size_t> numNodes(m_numLevels - 1, 0);
+	numNodes[m_numLevels - 2] = 1;
+
+	for (uint level = getMinLevel(m_numLevels); level < m_numLevels - 2; ++level) {
+		if (levelExists(m_dag, levelOffsets, level))
+			numNodes[level] = getLevelSize(m_dag, levelOffsets, level) / getNodeSize(m_numLevels, level);
+	}
+	return numNodes;
+}
+
+vector<uint> CompressedShadow::mergeCommonSubtrees(const vector<uint>& levelOffsets) {
 	vector<uint> nodesPerLevel(m_numLevels - 2, 0);
 
 	uint startLevel = getMinLevel(m_numLevels);
@@ -226,169 +413,160 @@ void CompressedShadow::mergeCommonSubtrees(const vector<uint>& levelOffsets) {
 		vector<uint> tempLevel(levelSize, 0);
 
 		const size_t levelOffset = levelOffsets[level];
-		const size_t nextLevelOffset = levelOffset + levelSize;
 
 		const uint nodeSize = getNodeSize(m_numLevels, level);
-		auto mapping = mergeLevel(m_dag.begin() + levelOffset, m_dag.begin() + nextLevelOffset,
-				tempLevel.begin(), nodeSize, &nodesPerLevel[level]);
+		auto mapping = mergeLevelParallel(m_dag.data() + levelOffset, levelSize / nodeSize,
+				tempLevel.data(), nodeSize, &nodesPerLevel[level]);
 
 		std::copy(tempLevel.begin(), tempLevel.end(), m_dag.begin() + levelOffset);
 
 		updateParentPointers(levelOffsets, mapping, level + 1);
 	}
 
-	removeUnusedNodes(levelOffsets, nodesPerLevel);
+	return nodesPerLevel;
 }
 
-void CompressedShadow::updateParentPointers(const vector<uint>& levelOffsets, unordered_map<uint, uint>& mapping,
+void CompressedShadow::updateParentPointers(const vector<uint>& levelOffsets, const vector<uint>& mapping,
 		uint parentLevel) {
 	const size_t childLevelOffset  = levelOffsets[parentLevel - 1];
+	const uint childNodeSize       = getNodeSize(m_numLevels, parentLevel - 1);
 
 	const size_t parentLevelOffset = levelOffsets[parentLevel];
 	const size_t parentLevelSize   = getLevelSize(m_dag, levelOffsets, parentLevel);
 
-	for (size_t nodeOffset = parentLevelOffset; nodeOffset < parentLevelOffset + parentLevelSize; nodeOffset += NODE_SIZE) {
-		/* Update child pointers which are not null */
-		for (uint child = 1; child < NODE_SIZE; ++child) {
-			const uint oldOffset = m_dag[nodeOffset + child];
+	const size_t numParents        = parentLevelSize / NODE_SIZE;
 
-			if (oldOffset != 0)
-				m_dag[nodeOffset + child] = childLevelOffset + mapping[oldOffset - childLevelOffset];
-		}
-	}
-}
+	// Parents are independent of each other, so split them across threads for large levels
+	const uint numThreads = numParents < PARALLEL_UPDATE_THRESHOLD ? 1 : cs::getNumThreads();
 
-/* Insert val at the end of the vector and maybe applies the offset */
-void insertWithCorrectOffset(vector<uint>& newDag, uint val, uint offset, size_t i) {
-	/* Correct offset if val is not the childmask and not 0 */
-	if ((i % NODE_SIZE != 0) && val != 0) {
-		assert((long)val - (long)offset > 0);
-		val -= offset;
-	}
-	newDag.push_back(val);
-}
+	cs::parallelFor(numParents, numThreads, [&](uint, size_t begin, size_t end) {
+		for (size_t parentNr = begin; parentNr < end; ++parentNr) {
+			const size_t nodeOffset = parentLevelOffset + parentNr * NODE_SIZE;
 
-void CompressedShadow::removeUnusedNodes(const vector<uint>& levelOffsets, const vector<uint>& numNodesPerLevel) {
-	vector<uint> newDag;
+			/* Update child pointers which are not null */
+			for (uint child = 1; child < NODE_SIZE; ++child) {
+				const uint oldOffset = m_dag[nodeOffset + child];
 
-	// Insert root node in new dag unconditionally
-	newDag.insert(newDag.end(), m_dag.begin(), m_dag.begin() + NODE_SIZE);
-
-	size_t levelOffset = NODE_SIZE;
-	int level = m_numLevels - 3;
-	int startLevel = getMinLevel(m_numLevels);
-
-	uint offsetCorrection = 0;
-
-	while(level >= startLevel) {
-		const uint nodeSize = getNodeSize(m_numLevels, level);
-		const size_t levelSize = getLevelSize(m_dag, levelOffsets, level);
-		const size_t mergedLevelSize = numNodesPerLevel[level] * nodeSize;
-
-		offsetCorrection += levelSize - mergedLevelSize;
-
-		if (level == startLevel || offsetCorrection == 0) {
-			newDag.insert(newDag.end(), m_dag.begin() + levelOffset, m_dag.begin() + levelOffset + mergedLevelSize);
-		} else {
-			/* Copy nodes from m_dag to newDag and correct offsets */
-			for (auto i = levelOffset; i < levelOffset + mergedLevelSize; ++i) {
-				insertWithCorrectOffset(newDag, m_dag[i], offsetCorrection, i);
+				if (oldOffset != 0) {
+					const uint oldNodeNr = (oldOffset - childLevelOffset) / childNodeSize;
+					m_dag[nodeOffset + child] = childLevelOffset + mapping[oldNodeNr] * childNodeSize;
+				}
 			}
 		}
-
-		levelOffset += levelSize;
-		--level;
-	}
-
-	m_dag.swap(newDag);
-}
-
-/**
- * Copies a node from the old dag to the specified new dag. Takes different nodes sizes into account.
- *
- * @param newCurrent An offset into the new dag
- * @param oldItNode An iterator from the old dag at the beginning of the node to copy.
- * @param numLevels Number of levels from the dag, i.e. m_numLevels. Needed for useLeafmasks(...)
- * @return The updated offset into the new dag
- */
-template<typename ItOld>
-size_t copyNodeInNewDag(vector<uint>& newDag, uint newCurrent, ItOld oldItNode, uint numChildren, uint numLevels, int level) {
-	uint elems = 1 + numChildren;
-
-	// If leafmaks are used the node size is different
-	if (useLeafmasks(numLevels) && level == getMinLevel(numLevels)) {
-		elems = 1 + 2 * numChildren;
-	}
-	newDag.insert(newDag.begin() + newCurrent, oldItNode, oldItNode + elems);
-	return elems;
+	});
 }
 
-void CompressedShadow::compress() {
-	vector<uint> newDag;
+// Under this number of nodes the DAG is compressed by a single thread
+#define PARALLEL_COMPRESS_THRESHOLD 16384
 
-	int level = m_numLevels - 2;
+void CompressedShadow::compress(const vector<uint>& levelOffsets, const vector<uint>& numNodesPerLevel) {
+	const int rootLevel = m_numLevels - 2;
+	const int minLevel  = getMinLevel(m_numLevels);
 
-	size_t numLevelNodes     = 1; // Number of nodes in the current level
-	size_t oldDagLevelOffset = 0; // m_dag: An offset to the current level
-	size_t oldDagLastLevel   = 0; // m_dag: An offset to the last level (i.e. an offset to the parent nodes)
-	size_t newDagOffset      = 0; // newDag: Current offset in the dag for construction
-	size_t newDagLastLevel   = 0; // newDag: Save an offset to the last level
+	/* Number all nodes globally, starting with the root and continuing level by level.
+	 * This is also the order of the nodes in the compressed DAG. */
+	vector<int> levels;        // all existing levels, starting with the root level
+	vector<size_t> levelBegin; // first global node number of every level in 'levels'
+	size_t numNodes = 0;
 
-	const int minLevel = getMinLevel(m_numLevels);
+	for (int level = rootLevel; level >= minLevel; --level) {
+		const size_t levelNodes = (level == rootLevel) ? 1 : numNodesPerLevel[level];
+		if (levelNodes == 0)
+			break;
 
-	while(level >= minLevel && numLevelNodes > 0) {
-		const size_t newDagLevel = newDagOffset; // the beginning of the current level in the new DAG
-
-		// Maps old offsets from m_dag to new offsets in newDag
-		unordered_map<size_t, size_t> oldToNewOffset;
-
-		// Set of children indices, used to get the number of (unique) new nodes
-		unordered_set<uint> childrenNodesIndices;
-
-		for (size_t nodeNr = 0; nodeNr < numLevelNodes; ++nodeNr) {
-			const uint nodeSize     = getNodeSize(m_numLevels, level);
-			const size_t nodeOffset = oldDagLevelOffset + nodeNr * nodeSize;
-			const uint mask         = m_dag[nodeOffset];
-			const uint numChildren  = cs::getNumChildren(mask);
+		levels.push_back(level);
+		levelBegin.push_back(numNodes);
+		numNodes += levelNodes;
+	}
+	levelBegin.push_back(numNodes);
 
-			oldToNewOffset[nodeOffset] = newDagOffset;
+	const uint numThreads = numNodes < PARALLEL_COMPRESS_THRESHOLD ? 1 : cs::getNumThreads();
 
-			auto nodeIt = m_dag.begin() + nodeOffset;
-			newDagOffset += copyNodeInNewDag(newDag, newDagOffset, nodeIt, numChildren, m_numLevels, level);
+	/* Calls func(levelIndex, nodeNr, globalNr) for every node in [begin, end) */
+	auto forNodes = [&](size_t begin, size_t end, auto func) {
+		uint levelIndex = 0;
+		while (levelBegin[levelIndex + 1] <= begin)
+			++levelIndex;
 
-			childrenNodesIndices.insert(nodeIt + 1, nodeIt + numChildren + 1);
+		for (size_t globalNr = begin; globalNr < end; ++globalNr) {
+			while (levelBegin[levelIndex + 1] <= globalNr)
+				++levelIndex;
+			func(levelIndex, globalNr - levelBegin[levelIndex], globalNr);
 		}
+	};
+
+	auto getOldOffset = [&](uint levelIndex, size_t nodeNr) -> size_t {
+		const int level = levels[levelIndex];
+		const uint nodeSize = (level == rootLevel) ? NODE_SIZE : getNodeSize(m_numLevels, level);
+		return levelOffsets[level] + nodeNr * nodeSize;
+	};
+
+	/* 1. Calculate the size of every compressed node from its childmask and sum them per chunk */
+	vector<uint> newOffsets(numNodes);
+	vector<size_t> chunkSizes(numThreads + 1, 0);
+
+	cs::parallelFor(numNodes, numThreads, [&](uint chunk, size_t begin, size_t end) {
+		size_t chunkSize = 0;
+		forNodes(begin, end, [&](uint levelIndex, size_t nodeNr, size_t globalNr) {
+			const int level = levels[levelIndex];
+			const uint numChildren = getNumChildren(m_dag[getOldOffset(levelIndex, nodeNr)]);
+			const bool leafs = useLeafmasks(m_numLevels) && level == minLevel;
+
+			newOffsets[globalNr] = 1 + (leafs ? 2 : 1) * numChildren;
+			chunkSize += newOffsets[globalNr];
+		});
+		chunkSizes[chunk + 1] = chunkSize;
+	});
+
+	/* 2. Prefix sum over the chunks, then over the nodes within every chunk */
+	std::partial_sum(chunkSizes.begin(), chunkSizes.end(), chunkSizes.begin());
+	assert(chunkSizes[numThreads] < std::numeric_limits<uint>::max());
+
+	cs::parallelFor(numNodes, numThreads, [&](uint chunk, size_t begin, size_t end) {
+		uint offset = chunkSizes[chunk];
+		for (size_t globalNr = begin; globalNr < end; ++globalNr) {
+			const uint nodeSize = newOffsets[globalNr];
+			newOffsets[globalNr] = offset;
+			offset += nodeSize;
+		}
+	});
+
+	/* 3. Copy all nodes to the new DAG and rewrite the pointers to the children */
+	vector<uint> newDag(chunkSizes[numThreads]);
+
+	cs::parallelFor(numNodes, numThreads, [&](uint, size_t begin, size_t end) {
+		forNodes(begin, end, [&](uint levelIndex, size_t nodeNr, size_t globalNr) {
+			const int level = levels[levelIndex];
+			const size_t oldOffset = getOldOffset(levelIndex, nodeNr);
+			const size_t newOffset = newOffsets[globalNr];
+
+			const uint childmask = m_dag[oldOffset];
+			const uint numChildren = getNumChildren(childmask);
+			newDag[newOffset] = childmask;
+
+			if (useLeafmasks(m_numLevels) && level == minLevel) {
+				// Copy the leafmasks
+				std::copy(m_dag.begin() + oldOffset + 1, m_dag.begin() + oldOffset + 1 + 2 * numChildren,
+						newDag.begin() + newOffset + 1);
+				return;
+			}
+			if (numChildren == 0)
+				return;
 
-		if (oldDagLastLevel != oldDagLevelOffset) {
-			// Parent(s) exist, so update the parent(s) offsets
-			size_t currentNewDagPos = newDagLastLevel;
-
-			for (size_t currentOldPos = oldDagLastLevel; currentOldPos < oldDagLevelOffset; currentOldPos += NODE_SIZE) {
-				const uint mask = m_dag[currentOldPos];
-				const uint numChildren = cs::getNumChildren(mask);
+			assert(levelIndex + 1 < levels.size());
+			const size_t childLevelOffset = levelOffsets[level - 1];
+			const uint childNodeSize = getNodeSize(m_numLevels, level - 1);
 
-				for (size_t childNr = 0; childNr < numChildren; ++childNr) {
-					/* Update offsets of all children */
-					size_t oldOffset = m_dag[currentOldPos + childNr + 1];
-					if (oldOffset != 0) {
-						newDag[currentNewDagPos + childNr + 1] = oldToNewOffset[oldOffset];
-					}
-				}
+			for (uint childNr = 0; childNr < numChildren; ++childNr) {
+				const size_t childOffset = m_dag[oldOffset + 1 + childNr];
+				const size_t childNodeNr = (childOffset - childLevelOffset) / childNodeSize;
 
-				currentNewDagPos += numChildren + 1;
+				newDag[newOffset + 1 + childNr] = newOffsets[levelBegin[levelIndex + 1] + childNodeNr];
 			}
-		}
-
-		oldDagLastLevel    = oldDagLevelOffset;
-		oldDagLevelOffset += numLevelNodes * NODE_SIZE;
-		newDagLastLevel    = newDagLevel;
-		numLevelNodes      = childrenNodesIndices.size();
-
-		level--;
-	}
+		});
+	});
 
 	m_dag.swap(newDag);
-	m_dag.shrink_to_fit();
 }
 
 uint getChildOffset(uint childmask, uint childIndex) {
@@ -401,7 +579,7 @@ uint getChildOffset(uint childmask, uint childIndex) {
 	return POPCOUNT(maskedChildMask);
 }
 
-CompressedShadow::NodeVisibility CompressedShadow::traverse(const vec3 position, bool tryLeafmasks) {
+CompressedShadow::NodeVisibility CompressedShadow::traverse(const vec3 position, bool tryLeafmasks) const {
 	const ivec3 path = cs::getPathFromNDC(std::move(position), m_numLevels);
 
 	size_t offset = 0;
@@ -446,6 +624,8 @@ CompressedShadow::NodeVisibility CompressedShadow::traverse(const vec3 position,
 		uint childOffset = getChildOffset(childmask, childIndex);
 
 		uint index = offset + childOffset * 2 + 1;
+		if (m_leafmaskDictionary)
+			index = m_dag[offset + 1 + childOffset];
 
 		int maskIndex = (path.x & 0x7) + 8 * (path.y & 0x7);
 		uint vis = 0;
@@ -461,3 +641,130 @@ CompressedShadow::NodeVisibility CompressedShadow::traverse(const vec3 position,
 
 	return PARTIAL;
 }
+
+#ifdef TRAVERSE_AVX2
+static_assert(sizeof(vec3) == 3 * sizeof(float), "The batch traversal expects tightly packed positions");
+
+/* Returns the number of set bits in the lower 16 bits of every lane */
+__attribute__((target("avx2")))
+inline __m256i popcount16(__m256i v) {
+	const __m256i lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+	                                        0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+	const __m256i nibbles = _mm256_set1_epi8(0x0F);
+	const __m256i counts = _mm256_add_epi8(_mm256_shuffle_epi8(lookup, _mm256_and_si256(v, nibbles)),
+			_mm256_shuffle_epi8(lookup, _mm256_and_si256(_mm256_srli_epi16(v, 4), nibbles)));
+
+	// Add the counts of the two lower bytes
+	return _mm256_and_si256(_mm256_add_epi32(counts, _mm256_srli_epi32(counts, 8)), _mm256_set1_epi32(0xFF));
+}
+
+/**
+ * Gathers the childmasks of all active lanes and tests the children given by their bit offsets (2 * childIndex).
+ * Lanes whose child is visible or in shadow get their result and are deactivated.
+ * @return The number of partially visible children before the child of every lane, i.e. the offset of its pointer.
+ */
+__attribute__((target("avx2")))
+inline __m256i testChildren(const uint* dag, __m256i offsets, __m256i childShifts, __m256i& active, __m256i& result) {
+	const __m256i one = _mm256_set1_epi32(1);
+	const __m256i childmask = _mm256_mask_i32gather_epi32(_mm256_setzero_si256(),
+			reinterpret_cast<const int*>(dag), offsets, active, 4);
+
+	const __m256i visibility = _mm256_and_si256(_mm256_srlv_epi32(childmask, childShifts), _mm256_set1_epi32(0x3));
+	const __m256i finished = _mm256_andnot_si256(_mm256_cmpeq_epi32(visibility, _mm256_set1_epi32(2)), active);
+	result = _mm256_blendv_epi8(result, visibility, finished);
+	active = _mm256_andnot_si256(finished, active);
+
+	const __m256i lowerChildren = _mm256_sub_epi32(_mm256_sllv_epi32(one, childShifts), one);
+	return popcount16(_mm256_and_si256(childmask, _mm256_and_si256(_mm256_set1_epi32(0xAAAA), lowerChildren)));
+}
+
+/**
+ * Traverses the DAG for 8 positions in lockstep: every level gathers the childmasks and pointers of the lanes
+ * which are still partially visible, and lanes retire as soon as they are visible or in shadow.
+ * Same as CompressedShadow::traverse for every position.
+ */
+__attribute__((target("avx2")))
+void traverse8AVX2(const uint* dag, int numLevels, bool tryLeafmasks, bool leafmaskDictionary,
+		const vec3* positions, uint8_t* visibilities) {
+	const __m256i one = _mm256_set1_epi32(1);
+	const __m256i seven = _mm256_set1_epi32(7);
+
+	// Load the coordinates with a stride of 3 and calculate the paths like cs::getPathFromNDC
+	const __m256i stride = _mm256_setr_epi32(0, 3, 6, 9, 12, 15, 18, 21);
+	const float* coords = reinterpret_cast<const float*>(positions);
+	const __m256 resolution = _mm256_set1_ps(static_cast<float>(static_cast<int>(getResolution(numLevels)) - 1));
+	__m256i path[3];
+	for (int i = 0; i < 3; ++i) {
+		const __m256 ndc = _mm256_i32gather_ps(coords + i, stride, 4);
+		const __m256 normalized = _mm256_mul_ps(_mm256_add_ps(ndc, _mm256_set1_ps(1.0f)), _mm256_set1_ps(0.5f));
+		path[i] = _mm256_cvttps_epi32(_mm256_mul_ps(normalized, resolution));
+	}
+
+	__m256i offsets = _mm256_setzero_si256();
+	__m256i active = _mm256_set1_epi32(-1);
+	__m256i result = _mm256_set1_epi32(CompressedShadow::PARTIAL);
+
+	const int minLevel = tryLeafmasks ? 3 : 0;
+	for (int level = numLevels - 2; level >= minLevel && !_mm256_testz_si256(active, active); --level) {
+		const __m128i lvl = _mm_cvtsi32_si128(level);
+		const __m256i childShifts = _mm256_or_si256(
+				_mm256_slli_epi32(_mm256_and_si256(_mm256_srl_epi32(path[0], lvl), one), 1),
+				_mm256_or_si256(_mm256_slli_epi32(_mm256_and_si256(_mm256_srl_epi32(path[1], lvl), one), 2),
+				                _mm256_slli_epi32(_mm256_and_si256(_mm256_srl_epi32(path[2], lvl), one), 3)));
+
+		const __m256i childOffsets = testChildren(dag, offsets, childShifts, active, result);
+		offsets = _mm256_mask_i32gather_epi32(offsets, reinterpret_cast<const int*>(dag),
+				_mm256_add_epi32(offsets, _mm256_add_epi32(childOffsets, one)), active, 4);
+	}
+
+	if (tryLeafmasks && !_mm256_testz_si256(active, active)) {
+		// Level 2, so evaluate 1x1x8 and if necessary the 8x8x1 64-bit leafmask
+		const __m256i childShifts = _mm256_slli_epi32(_mm256_and_si256(path[2], seven), 1);
+		const __m256i childOffsets = testChildren(dag, offsets, childShifts, active, result);
+
+		__m256i index = _mm256_add_epi32(offsets, _mm256_add_epi32(_mm256_slli_epi32(childOffsets, 1), one));
+		if (leafmaskDictionary) {
+			index = _mm256_mask_i32gather_epi32(index, reinterpret_cast<const int*>(dag),
+					_mm256_add_epi32(offsets, _mm256_add_epi32(childOffsets, one)), active, 4);
+		}
+
+		const __m256i maskIndex = _mm256_add_epi32(_mm256_and_si256(path[0], seven),
+				_mm256_slli_epi32(_mm256_and_si256(path[1], seven), 3));
+		const __m256i leafmask = _mm256_mask_i32gather_epi32(_mm256_setzero_si256(), reinterpret_cast<const int*>(dag),
+				_mm256_add_epi32(index, _mm256_srli_epi32(maskIndex, 5)), active, 4);
+		const __m256i vis = _mm256_and_si256(_mm256_srlv_epi32(leafmask,
+				_mm256_and_si256(maskIndex, _mm256_set1_epi32(31))), one);
+		result = _mm256_blendv_epi8(result, vis, active);
+	}
+
+	alignas(32) int lanes[8];
+	_mm256_store_si256(reinterpret_cast<__m256i*>(lanes), result);
+	for (int i = 0; i < 8; ++i)
+		visibilities[i] = static_cast<uint8_t>(lanes[i]);
+}
+#endif
+
+void CompressedShadow::traverseBatch(const vec3* positions, size_t count, uint8_t* visibilities,
+		bool tryLeafmasks) const {
+	size_t i = 0;
+#ifdef TRAVERSE_AVX2
+	// The gathers use signed 32-bit offsets
+	if (__builtin_cpu_supports("avx2") && m_dag.size() <= static_cast<size_t>(numeric_limits<int>::max())) {
+		for (; i + 8 <= count; i += 8) {
+			traverse8AVX2(m_dag.data(), m_numLevels, tryLeafmasks, m_leafmaskDictionary,
+					positions + i, visibilities + i);
+		}
+	}
+#endif
+
+	// Other CPUs and the remaining positions interleave the traversals of the positions instead
+	if (i < count) {
+		vector<ivec3> paths;
+		paths.reserve(count - i);
+		for (size_t j = i; j < count; ++j)
+			paths.push_back(getPathFromNDC(positions[j], m_numLevels));
+
+		const auto encoding = tryLeafmasks ? getLeafmaskEncoding() : NO_LEAFMASKS;
+		traverseInterleaved(m_dag.data(), m_numLevels, encoding, paths.data(), nullptr, paths.size(), visibilities + i);
+	}
+}
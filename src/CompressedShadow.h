@@ -4,7 +4,8 @@
 #include "cpvs.h"
 
 class MinMaxHierarchy;
-class ShadowMap;
+class NodeStore;
+struct TileStats;
 
 /**
  * This central datastructure of the CPVS represents the DAG of voxels
@@ -25,6 +26,13 @@ public:
 		PARTIAL = 2
 	};
 
+	/** Specifies how the partially visible children of the nodes in level 2 are stored */
+	enum LeafmaskEncoding {
+		NO_LEAFMASKS,     // level 2 is a normal level with a pointer for every child
+		INLINE_LEAFMASKS, // every 64-bit leafmask is stored as two words in the node
+		LEAFMASK_POINTERS // every leafmask is a pointer into a table of unique leafmasks after the last level
+	};
+
 private:
 	CompressedShadow(uint numLevels);
 
@@ -39,21 +47,58 @@ public:
 
 	/**
 	 * Creates a CompressedShadow from a min-max hierarchy of depth values.
-	 * This will first create a Sparse Voxel Octree (SVO) from the min-max hierarchy,
-	 * then merge common subtrees to create the final DAG.
+	 * The DAG is built depth-first and common subtrees are merged as soon as they are finished,
+	 * so the uncompressed SVO is never created.
 	 *
 	 * @param zTileIndex Index in [0, zTileNum) which specifies which z-tile to create.
 	 * @param zTileNum Number of total z-tiles.
+	 * @param stats If not null, receives the durations of the phases, the nodes per level and the sizes of the DAG.
 	 */
 	static unique_ptr<CompressedShadow> create(const MinMaxHierarchy& minMax,
-			uint zTileIndex = 0, uint zTileNum = 1);
+			uint zTileIndex = 0, uint zTileNum = 1, TileStats* stats = nullptr);
+
+	/**
+	 * Builds the DAG of a shadow like create, but inserts all nodes into the given store, which can be shared
+	 * by several shadows (e.g. all tiles of a CompressedShadowContainer) and be used concurrently.
+	 * Identical subtrees of all shadows in the store are stored only once.
+	 *
+	 * @param stats If not null, receives the duration and the nodes per level before merging. The unique nodes
+	 * are only known for the whole store (see NodeStore::getNumNodesPerLevel).
+	 * @return The handle of the root node in the store.
+	 * @note All shadows in one store need to have the same number of levels and z-tiles.
+	 */
+	static uint createInStore(const MinMaxHierarchy& minMax, NodeStore& store,
+			uint zTileIndex = 0, uint zTileNum = 1, TileStats* stats = nullptr);
 
-	/*
-	 * Creates a CompressedShadow from a shadow map.
-	 * @note This will create a temporary min-max hierarchy.
+	/**
+	 * Creates a store for the nodes of shadows with the given number of levels.
+	 * @see createInStore
+	 */
+	static unique_ptr<NodeStore> createNodeStore(uint numLevels);
+
+	/**
+	 * Creates a CompressedShadow like create, but will first create the uncompressed Sparse Voxel Octree (SVO)
+	 * from the min-max hierarchy, then merge common subtrees and compress it to get the final DAG.
+	 * The result is identical, but this needs a lot more memory.
+	 *
+	 * @param stats If not null, receives the durations of constructSvo, mergeCommonSubtrees and compress, the nodes
+	 * per level before and after merging, and the sizes of the SVO and the DAG.
 	 */
-	static unique_ptr<CompressedShadow> create(const ShadowMap* shadowMap,
-			uint zTileIndex = 0, uint zTileNum = 1);
+	static unique_ptr<CompressedShadow> createFromSvo(const MinMaxHierarchy& minMax,
+			uint zTileIndex = 0, uint zTileNum = 1, TileStats* stats = nullptr);
+
+	/**
+	 * Reads a CompressedShadow which has been written with writeToFile.
+	 * @throws FileNotFound if the file can't be opened.
+	 * @throws LoadFileException if the file is invalid.
+	 */
+	static unique_ptr<CompressedShadow> readFromFile(const string& file);
+
+	/**
+	 * Writes the DAG to a binary file, e.g. to free memory while tiles are precomputed.
+	 * @throws FileNotFound if the file can't be opened.
+	 */
+	void writeToFile(const string& file) const;
 
 	/**
 	 * Traverses the sparse voxel DAG (on the CPU) for the given position
@@ -61,7 +106,14 @@ public:
 	 *
 	 * @note Useful for testing purposes!
 	 */
-	NodeVisibility traverse(const vec3 position, bool tryLeafmasks = true);
+	NodeVisibility traverse(const vec3 position, bool tryLeafmasks = true) const;
+
+	/**
+	 * Traverses the DAG like traverse for every position and stores the NodeVisibility of the position
+	 * at the same index in visibilities. Groups of 8 positions are traversed in lockstep with AVX2 gathers
+	 * if the CPU supports them, otherwise the traversals are interleaved (see cs::traverseInterleaved).
+	 */
+	void traverseBatch(const vec3* positions, size_t count, uint8_t* visibilities, bool tryLeafmasks = true) const;
 
 	/**
 	 * Returns the visibility of the whole shadow.
@@ -75,10 +127,45 @@ public:
 	inline const vector<uint>& getDAG() const {
 		return m_dag;
 	}
+
+	/**
+	 * Appends the DAG to the given one. Pointers in the DAG are relative to the root, so all pointers
+	 * are relocated by base, which is the offset of the root in the final (combined) DAG.
+	 */
+	void appendDAG(vector<uint>& dag, size_t base) const;
+
+	/**
+	 * Stores every unique 64-bit leafmask only once in a table after the last level, and replaces the
+	 * leafmasks in the nodes of level 2 with pointers into this table. Does nothing if no leafmasks are used
+	 * or the leafmasks have already been interned.
+	 *
+	 * @return The number of unique leafmasks.
+	 */
+	size_t internLeafmasks();
+
+	/**
+	 * Returns true if the leafmasks are stored in a table.
+	 * @see internLeafmasks
+	 */
+	inline bool hasLeafmaskDictionary() const {
+		return m_leafmaskDictionary;
+	}
+
+	/** Returns how the leafmasks of level 2 are stored */
+	LeafmaskEncoding getLeafmaskEncoding() const;
+
+	/** Returns how the leafmasks are stored in a DAG with the given number of levels */
+	static LeafmaskEncoding getLeafmaskEncoding(uint numLevels, bool leafmaskDictionary);
 	
 private:
 	/* Private member and helper functions */
 
+	/**
+	 * Constructs the compressed DAG directly, i.e. without creating the SVO first.
+	 * @see DagBuilder
+	 */
+	void constructDag(const MinMaxHierarchy& minMax, const ivec3 rootOffset, TileStats* stats);
+
 	/**
 	 * Constructs the sparse voxel octree in a 1-dimensional array.
 	 * The resulting datastructure is not compressed, i.e. every node has 8 pointers even if they
@@ -97,29 +184,36 @@ private:
 
 	/**
 	 * Merges common subtrees of an SVO to transform it into a directed acyclic graph (DAG).
+	 * The merged nodes of every level are moved to the beginning of the level.
 	 * @note Assumes an uncompressed SVO.
+	 * @return The number of nodes left in every level after merging.
 	 */
-	void mergeCommonSubtrees(const vector<uint>& levelOffsets);
+	vector<uint> mergeCommonSubtrees(const vector<uint>& levelOffsets);
 
-	/**
-	 * Helper function for merging common subtrees which updates the child pointers of the parent level
-	 * according to a given mapping.
-	 */
-	void updateParentPointers(const vector<uint>& levelOffsets, unordered_map<uint, uint>& mapping, uint parentLevel);
+	/** Returns the number of nodes in every level of the uncompressed SVO (before merging) */
+	vector<size_t> getNumNodesPerLevel(const vector<uint>& levelOffsets) const;
 
 	/**
-	 * Helper function which removes unused, i.e. all zero nodes from the DAG.
+	 * Helper function for merging common subtrees which updates the child pointers of the parent level
+	 * according to a given mapping of node numbers (as returned by cs::mergeLevel).
 	 */
-	void removeUnusedNodes(const vector<uint>& levelOffsets, const vector<uint>& numNodesPerLevel);
+	void updateParentPointers(const vector<uint>& levelOffsets, const vector<uint>& mapping, uint parentLevel);
 
 	/**
 	 * During the construction of the SVO/DAG each node will have 8 pointers to its children.
-	 * This function will compress this structure by removing all unnecessary pointers.
+	 * This function will compress this structure by removing all unnecessary pointers and all nodes
+	 * which have been removed by merging.
+	 *
+	 * The size of every compressed node is known from its childmask, so the new offsets are calculated
+	 * with a prefix sum and all pointers are rewritten in parallel. The new DAG is allocated exactly once.
+	 *
+	 * @param numNodesPerLevel Number of merged nodes in every level (as returned by mergeCommonSubtrees).
 	 */
-	void compress();
+	void compress(const vector<uint>& levelOffsets, const vector<uint>& numNodesPerLevel);
 
 private:
 	uint m_numLevels;
+	bool m_leafmaskDictionary;
 
 	vector<uint> m_dag;
 };
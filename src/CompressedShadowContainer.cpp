@@ -1,124 +1,586 @@
 #include "CompressedShadowContainer.h"
-#include "Texture.h"
+#include "CompressedShadowUtil.h"
+#include "DagArchive.h"
+#include "ThreadPool.h"
 
 #include <iostream>
 #include <iomanip>
+#include <fstream>
+#include <cstdio>
+#include <set>
+#include <algorithm>
+#include <exception>
+#include <atomic>
+
+#include <unistd.h>
 using namespace std;
 
-static const uint GRID_CELL_SHADOWED = 0xFFFFFFF;
-static const uint GRID_CELL_VISIBLE = 0xFFFFFFE;
+const uint CompressedShadowContainer::GRID_CELL_SHADOWED;
+const uint CompressedShadowContainer::GRID_CELL_VISIBLE;
 
-// Is called when the DAG is copied to the GPU
-void CompressedShadowContainer::initShader() {
-	m_traverseCS = make_unique<ShaderProgram>();
-	try {
-		m_traverseCS->addShaderFromFile(GL_COMPUTE_SHADER, "../shader/traverse.cs");
-		m_traverseCS->link();
-	} catch(ShaderException& exc) {
-		cout << exc.where() << " - " << exc.what() << endl;
-		std::terminate();
+
+CompressedShadowContainer::CompressedShadowContainer(unique_ptr<ContainerFile> file)
+	: m_length(file->getLength()), m_memoryBudget(0), m_residentSize(0), m_checkedStoreSize(0), m_trackChanges(false),
+	  m_leafmaskDictionary(false), m_usesLeafmaskDictionary(file->hasLeafmaskDictionary()),
+	  m_packedPointers(file->hasPackedPointers()), m_pointerWidths(file->getPointerWidths()),
+	  m_contiguousChildren(file->hasContiguousChildren()), m_filterSize(1), m_file(std::move(file))
+{
+	m_data.resize(m_file->getGridSize());
+	m_info.resize(m_file->getGridSize());
+
+	// Only the visibility of the shadows is known, their DAGs are not separated in the file
+	const uint* grid = m_file->getGrid();
+	for (size_t i = 0; i < m_info.size(); ++i) {
+		m_info[i].dagSize = 0;
+		m_info[i].numLevels = m_file->getNumLevels();
+
+		if (grid[i] == GRID_CELL_SHADOWED)
+			m_info[i].visibility = CompressedShadow::SHADOW;
+		else if (grid[i] == GRID_CELL_VISIBLE)
+			m_info[i].visibility = CompressedShadow::VISIBLE;
+		else
+			m_info[i].visibility = CompressedShadow::PARTIAL;
 	}
+}
 
-	m_traverseCS->bind();
-	m_traverseCS->addUniform("lightViewProj");
-	m_traverseCS->addUniform("width");
-	m_traverseCS->addUniform("height");
-	m_traverseCS->addUniform("filterSize");
-	m_traverseCS->addUniform("dag_levels");
-	m_traverseCS->addUniform("grid_levels");
+CompressedShadowContainer::~CompressedShadowContainer() {
+	freeOnCPU();
 }
 
-void CompressedShadowContainer::copyToGPU() {
-	assert(m_data.size() > 0);
-	initShader();
+void CompressedShadowContainer::set(unique_ptr<CompressedShadow> shadow, uint x, uint y, uint z) {
+	assert(!m_file);
+	const uint index = getIndex(x, y, z);
+
+	ShadowInfo info;
+	info.dagSize    = shadow->getDAG().size();
+	info.numLevels  = shadow->getNumLevels();
+	info.visibility = shadow->getTotalVisibility();
 
-	m_deviceDag = make_unique<SSBO>(combineDAGs(), GL_STATIC_READ);
+	const size_t bytes = info.dagSize * sizeof(uint);
+	bool keepInMemory = true;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+
+		// The shadow may replace an existing one after an update, which may have been written to a file
+		if (m_data[index])
+			m_residentSize -= m_data[index]->getDAG().size() * sizeof(uint);
+		if (!m_info[index].file.empty())
+			std::remove(m_info[index].file.c_str());
+		if (m_trackChanges)
+			m_dirty.push_back(index);
+
+		if (m_memoryBudget == 0 || m_residentSize + bytes <= m_memoryBudget)
+			m_residentSize += bytes;
+		else
+			keepInMemory = false;
+	}
+
+	if (keepInMemory) {
+		m_data[index] = std::move(shadow);
+	} else {
+		info.file = m_spillPrefix + std::to_string(x) + "_" + std::to_string(y) + "_" + std::to_string(z) + ".cpvs";
+		shadow->writeToFile(info.file);
+		m_data[index] = nullptr;
+	}
+	m_info[index] = std::move(info);
+}
 
-	m_deviceGrid = make_unique<SSBO>(createTopLevelGrid(), GL_STATIC_READ);
+void CompressedShadowContainer::setMemoryBudget(size_t budget, const string& directory) {
+	static std::atomic<uint> numContainers(0);
+
+	// Containers of this and of other processes may spill to the same directory, so every one gets its own prefix
+	m_memoryBudget = budget;
+	m_spillPrefix = directory + "/shadow_" + std::to_string(getpid()) + "_" + std::to_string(numContainers++) + "_";
+}
+
+void CompressedShadowContainer::shareSubtrees(uint numLevels) {
+	assert(m_memoryBudget == 0 && !m_file);
+	m_store = CompressedShadow::createNodeStore(numLevels);
+	m_roots.assign(m_info.size(), 0);
+	m_checkedStoreSize = 0;
+}
+
+void CompressedShadowContainer::setRoot(uint root, uint x, uint y, uint z) {
+	assert(m_store);
+	const uint index = getIndex(x, y, z);
+	m_roots[index] = root;
+
+	if (m_trackChanges) {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_dirty.push_back(index);
+	}
+}
+
+void CompressedShadowContainer::freeOnCPU() {
+	// Use the 'swap trick' to free all dynamic memory
+	std::vector<unique_ptr<CompressedShadow>> tmp;
+	m_data.swap(tmp);
+
+	m_store.reset();
+	std::vector<uint> tmpRoots;
+	m_roots.swap(tmpRoots);
+
+	for (auto& info : m_info) {
+		if (!info.file.empty()) {
+			std::remove(info.file.c_str());
+			info.file.clear();
+		}
+	}
+	m_residentSize = 0;
+
+	m_file.reset();
+}
 
+uint CompressedShadowContainer::getNumLevels() const {
+	assert(m_info.size() > 0);
 	// number of levels has to be the same in every DAG
-	glUniform1i((*m_traverseCS)["dag_levels"], m_data[0]->getNumLevels());
+	return m_store ? m_store->getNumLevels() : m_info[0].numLevels;
+}
 
-	const uint gridLevels = log8(m_data.size());
-	glUniform1i((*m_traverseCS)["grid_levels"], gridLevels);
+uint CompressedShadowContainer::getGridCell(size_t index, size_t dagOffset) const {
+	// Store a special value for shadow/visible if the entire grid cell is in shadow/visible.
+	// otherwise store the offset to the DAG
+	const auto visibility = m_info[index].visibility;
+	if (visibility == CompressedShadow::SHADOW)
+		return GRID_CELL_SHADOWED;
+	else if (visibility == CompressedShadow::VISIBLE)
+		return GRID_CELL_VISIBLE;
+	return dagOffset;
+}
 
-	glUniform1ui((*m_traverseCS)["filterSize"], m_filterSize);
+bool CompressedShadowContainer::hasShadowsOnDisk() const {
+	for (const auto& info : m_info) {
+		if (!info.file.empty())
+			return true;
+	}
+	return false;
 }
 
-inline void printSize(size_t size) {
-	cout << "\nThe size of the compressed shadow is " << std::fixed << std::setprecision(1) << size / static_cast<float>(1024) << "kb ";
+void CompressedShadowContainer::forEachShadow(std::function<void(const CompressedShadow&)> func) const {
+	for (size_t i = 0; i < m_info.size(); ++i) {
+		if (m_info[i].file.empty()) {
+			func(*m_data[i]);
+		} else {
+			auto shadow = CompressedShadow::readFromFile(m_info[i].file);
+			func(*shadow);
+		}
+	}
 }
 
-vector<uint> CompressedShadowContainer::combineDAGs() {
-	if (m_data.size() == 1) {
+// Like the size of the DAG (see GPUShadowContainer), the savings of the layouts are only printed with PRINT_CPVS_SIZE
 #ifdef PRINT_CPVS_SIZE
-		printSize(m_data[0]->getDAG().size() / 4.0f);
+inline void printLeafmaskSavings(size_t sizeBefore, size_t sizeAfter, size_t numUniqueLeafmasks) {
+	cout << "\nThe leafmask dictionary contains " << numUniqueLeafmasks << " unique leafmasks and changed the size by "
+		 << std::fixed << std::setprecision(1)
+		 << (static_cast<float>(sizeAfter) - static_cast<float>(sizeBefore)) * sizeof(uint) / 1024.0f << "kb ";
+}
+
+inline void printLayoutSavings(const char* layoutName, size_t sizeBefore, size_t sizeAfter) {
+	cout << "\nThe " << layoutName << " layout changed the size from " << std::fixed << std::setprecision(1)
+		 << sizeBefore * sizeof(uint) / 1024.0f << "kb to " << sizeAfter * sizeof(uint) / 1024.0f << "kb ";
+}
+#else
+inline void printLeafmaskSavings(size_t, size_t, size_t) { }
+
+inline void printLayoutSavings(const char*, size_t, size_t) { }
 #endif
-		return m_data[0]->getDAG();
+
+void CompressedShadowContainer::internLeafmasks() {
+	size_t sizeBefore = 0, sizeAfter = 0, numUniqueLeafmasks = 0;
+
+	for (size_t i = 0; i < m_data.size(); ++i) {
+		sizeBefore += m_info[i].dagSize;
+		numUniqueLeafmasks += m_data[i]->internLeafmasks();
+
+		m_info[i].dagSize = m_data[i]->getDAG().size();
+		sizeAfter += m_info[i].dagSize;
+
+		m_usesLeafmaskDictionary = m_data[i]->hasLeafmaskDictionary();
 	}
+	printLeafmaskSavings(sizeBefore, sizeAfter, numUniqueLeafmasks);
+}
+
+size_t CompressedShadowContainer::layoutSharedDAG(vector<uint>& dag, vector<uint>& grid,
+		NodeStore::Placement* placement) {
+	vector<uint> rootOffsets;
+	dag = m_store->layout(m_roots, &rootOffsets, placement);
+
+	// Roots of identical shadows are stored only once
+	const size_t numRoots = std::set<uint>(rootOffsets.begin(), rootOffsets.end()).size();
 
-	vector<uint> combinedDAG;
-	for (auto& csPtr : m_data) {
-		combinedDAG.insert(combinedDAG.end(), csPtr->getDAG().begin(), csPtr->getDAG().end());
+	if (m_leafmaskDictionary && m_store->hasLeafmasks()) {
+		const size_t sizeBefore = dag.size();
+
+		const size_t numUniqueLeafmasks = cs::internLeafmasks(dag, m_store->getNumLevels(), numRoots);
+		m_usesLeafmaskDictionary = true;
+		printLeafmaskSavings(sizeBefore, dag.size(), numUniqueLeafmasks);
 	}
 
-#ifdef PRINT_CPVS_SIZE
-	printSize(combinedDAG.size() / 4.0f);
-#endif
-	return combinedDAG;
+	grid.clear();
+	grid.reserve(m_roots.size());
+
+	for (size_t i = 0; i < m_roots.size(); ++i)
+		grid.push_back(getSharedGridCell(i, rootOffsets[i]));
+	return numRoots;
 }
 
-vector<uint> CompressedShadowContainer::createTopLevelGrid() {
-	vector<uint> grid;
-	grid.reserve(m_data.size());
+uint CompressedShadowContainer::getSharedGridCell(size_t index, uint rootOffset) const {
+	const uint childmask = m_store->getNode(m_roots[index])[0];
 
-	uint offset = 0;
-	for (auto& csPtr : m_data) {
-		auto visibility = csPtr->getTotalVisibility();
+	if (cs::isCompletelyShadowed(childmask))
+		return GRID_CELL_SHADOWED;
+	else if (cs::isCompletelyVisible(childmask))
+		return GRID_CELL_VISIBLE;
+	return rootOffset;
+}
 
-		// Store a special value for shadow/visible if the entire grid cell is in shadow/visible.
-		// otherwise store the offset to the DAG
-		if (visibility == CompressedShadow::SHADOW)
-			grid.push_back(GRID_CELL_SHADOWED);
-		else if (visibility == CompressedShadow::VISIBLE)
-			grid.push_back(GRID_CELL_VISIBLE);
-		else
-			grid.push_back(offset);
+bool CompressedShadowContainer::compactNodeStore() {
+	assert(m_store);
+	const size_t size = m_store->getSize();
+
+	// Finding the reachable nodes traverses the whole DAG, so only check again after the store has grown by 1/8
+	if (size < m_checkedStoreSize + m_checkedStoreSize / 8)
+		return false;
+	m_checkedStoreSize = size;
+
+	if (m_store->getReachableSize(m_roots) * 4 >= size * 3)
+		return false;
+
+	m_store = m_store->compact(m_roots);
+	m_checkedStoreSize = m_store->getSize();
+	return true;
+}
+
+
+CompressedShadow::LeafmaskEncoding CompressedShadowContainer::getSharedLeafmaskEncoding() const {
+	if (m_usesLeafmaskDictionary)
+		return CompressedShadow::LEAFMASK_POINTERS;
+	return m_store->hasLeafmasks() ? CompressedShadow::INLINE_LEAFMASKS : CompressedShadow::NO_LEAFMASKS;
+}
+
+void CompressedShadowContainer::layoutSharedDAG(vector<uint>& dag, vector<uint>& grid, const char* layoutName,
+		std::function<vector<uint>(const vector<uint>&, size_t, vector<uint>*)> transform) {
+	const size_t numRoots = layoutSharedDAG(dag, grid);
+	const size_t sizeBefore = dag.size();
 
-		offset += csPtr->getDAG().size();
+	// The offsets of partially visible cells are replaced by the offsets of their roots in the new layout
+	vector<uint> rootOffsets;
+	for (const uint cell : grid) {
+		if (cell != GRID_CELL_SHADOWED && cell != GRID_CELL_VISIBLE)
+			rootOffsets.push_back(cell);
 	}
-	return grid;
+	dag = transform(dag, numRoots, &rootOffsets);
+
+	auto root = rootOffsets.begin();
+	for (uint& cell : grid) {
+		if (cell != GRID_CELL_SHADOWED && cell != GRID_CELL_VISIBLE)
+			cell = *root++;
+	}
+	printLayoutSavings(layoutName, sizeBefore, dag.size());
 }
 
-void CompressedShadowContainer::evaluate(const Texture2D* positionsWS, const mat4& lightViewProj,
-		Texture2D* visibilities) {
-	GL_CHECK_ERROR("traverse - begin");
-	assert(m_traverseCS != nullptr);
-	m_traverseCS->bind();
+void CompressedShadowContainer::layoutPackedDAG(vector<uint>& dag, vector<uint>& grid) {
+	m_pointerWidths = 0;
+
+	if (m_store) {
+		layoutSharedDAG(dag, grid, "packed", [this](const vector<uint>& shared, size_t numRoots, vector<uint>* roots) {
+			return cs::packDAG(shared, getNumLevels(), getSharedLeafmaskEncoding(), m_pointerWidths, numRoots, roots);
+		});
+		return;
+	}
+
+	if (m_leafmaskDictionary && m_memoryBudget == 0)
+		internLeafmasks();
+
+	/* Every DAG may need wider pointers than the widths of the previous pass, in which case all DAGs are
+	 * packed again with the wider pointers. Usually the second pass doesn't change the widths anymore */
+	size_t sizeBefore;
+	uint pointerWidths;
+	do {
+		pointerWidths = m_pointerWidths;
+		dag.clear();
+		grid.clear();
+		sizeBefore = 0;
 
-	// Bind WS positions
-	positionsWS->bindImageAt(0, GL_READ_ONLY);
+		size_t index = 0;
+		forEachShadow([&](const CompressedShadow& shadow) {
+			uint shadowWidths = pointerWidths;
+			const auto packed = cs::packDAG(shadow.getDAG(), shadow.getNumLevels(), shadow.getLeafmaskEncoding(),
+					shadowWidths);
+			m_pointerWidths = cs::maxPointerWidths(m_pointerWidths, shadowWidths);
 
-	// Bind image for results
-	visibilities->bindImageAt(1, GL_WRITE_ONLY);
+			assert(2 * dag.size() < GRID_CELL_VISIBLE);
+			grid.push_back(getGridCell(index++, 2 * dag.size()));
+			dag.insert(dag.end(), packed.begin(), packed.end());
+			sizeBefore += shadow.getDAG().size();
+		});
+	} while (pointerWidths != m_pointerWidths);
+
+	printLayoutSavings("packed", sizeBefore, dag.size());
+}
+
+void CompressedShadowContainer::layoutContiguousDAG(vector<uint>& dag, vector<uint>& grid) {
+	if (m_store) {
+		layoutSharedDAG(dag, grid, "contiguous", [this](const vector<uint>& shared, size_t numRoots, vector<uint>* roots) {
+			return cs::layoutContiguousChildren(shared, getNumLevels(), getSharedLeafmaskEncoding(), numRoots, roots);
+		});
+		return;
+	}
+
+	if (m_leafmaskDictionary && m_memoryBudget == 0)
+		internLeafmasks();
+
+	// All pointers are relative, so the DAGs are simply stored one after another
+	size_t sizeBefore = 0, index = 0;
+	dag.clear();
+	grid.clear();
+
+	forEachShadow([&](const CompressedShadow& shadow) {
+		const auto contiguous = cs::layoutContiguousChildren(shadow.getDAG(), shadow.getNumLevels(),
+				shadow.getLeafmaskEncoding());
+
+		grid.push_back(getGridCell(index++, dag.size()));
+		dag.insert(dag.end(), contiguous.begin(), contiguous.end());
+		sizeBefore += shadow.getDAG().size();
+	});
+	printLayoutSavings("contiguous", sizeBefore, dag.size());
+}
 
-	// Bind dag and grid
-	m_deviceDag->bindAt(2);
-	m_deviceGrid->bindAt(3);
+void CompressedShadowContainer::writeToFile(const string& file) {
+	assert(m_info.size() > 0 && !m_file);
+	ofstream os(file, ios::binary);
+	if (!os.is_open())
+		throw FileNotFound("Could not open file for writing");
 
-	glUniformMatrix4fv((*m_traverseCS)["lightViewProj"], 1, GL_FALSE, glm::value_ptr(lightViewProj));
+	m_usesLeafmaskDictionary = false;
+	vector<uint> grid, dag;
+	uint64 dagSize = 0;
 
-	const GLuint width = positionsWS->getWidth();
-	const GLuint height = positionsWS->getHeight();
-	glUniform1ui((*m_traverseCS)["width"], width);
-	glUniform1ui((*m_traverseCS)["height"], height);
+	// True if the whole DAG is created in memory
+	const bool combined = m_store || m_packedPointers || m_contiguousChildren;
+	assert(!m_packedPointers || !m_contiguousChildren);
+
+	if (m_packedPointers) {
+		layoutPackedDAG(dag, grid);
+		dagSize = dag.size();
+	} else if (m_contiguousChildren) {
+		layoutContiguousDAG(dag, grid);
+		dagSize = dag.size();
+	} else if (m_store) {
+		layoutSharedDAG(dag, grid);
+		dagSize = dag.size();
+	} else {
+		if (m_leafmaskDictionary && m_memoryBudget == 0)
+			internLeafmasks();
+
+		grid.reserve(m_info.size());
+		for (size_t index = 0; index < m_info.size(); ++index) {
+			grid.push_back(getGridCell(index, dagSize));
+			dagSize += m_info[index].dagSize;
+		}
+	}
+
+	uint flags = m_usesLeafmaskDictionary ? static_cast<uint>(ContainerFile::LEAFMASK_DICTIONARY) : 0;
+	if (m_packedPointers)
+		flags |= ContainerFile::PACKED_POINTERS;
+	if (m_contiguousChildren)
+		flags |= ContainerFile::CONTIGUOUS_CHILDREN;
+	const auto header = ContainerFile::createHeader(m_length, getNumLevels(), flags, dagSize,
+			m_packedPointers ? m_pointerWidths : 0);
+	os.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+	ContainerFile::writePadding(os, header.gridOffset);
+	os.write(reinterpret_cast<const char*>(grid.data()), grid.size() * sizeof(uint));
+
+	ContainerFile::writePadding(os, header.dagOffset);
+	if (combined) {
+		os.write(reinterpret_cast<const char*>(dag.data()), dag.size() * sizeof(uint));
+	} else {
+		// Like the upload to the GPU, every DAG is relocated to its offset and written on its own
+		size_t offset = 0;
+		forEachShadow([&](const CompressedShadow& shadow) {
+			dag.clear();
+			shadow.appendDAG(dag, offset);
+			os.write(reinterpret_cast<const char*>(dag.data()), dag.size() * sizeof(uint));
+			offset += dag.size();
+		});
+	}
+}
+
+
+/* Archives start with this header, followed by the grid and every DAG as 64-bit size and DagArchive */
+struct ArchiveHeader {
+	uint magic;
+	uint version;
+	uint length;
+	uint numLevels;
+	uint flags;       // see ContainerFile::Flags
+	uint numSegments; // number of DAGs, which are stored one after another in the container file
+	uint64 dagSize;   // size of the combined DAG in words
+};
+
+constexpr uint ARCHIVE_MAGIC = 0x41565043; // "CPVA"
+constexpr uint ARCHIVE_VERSION = 1;
+
+/* Maximum number of decoded words which are kept in memory before they are written during extraction */
+constexpr size_t EXTRACT_BATCH_SIZE = 1 << 24;
+
+inline void writeSegment(ostream& os, const vector<uint8_t>& segment) {
+	const uint64 size = segment.size();
+	os.write(reinterpret_cast<const char*>(&size), sizeof(size));
+	os.write(reinterpret_cast<const char*>(segment.data()), segment.size());
+}
 
-	// Now calculate work group size and dispatch!
-	const GLuint localSize = 32;
-	const GLuint numGroupsX = ceil(width / static_cast<float>(localSize));
-	const GLuint numGroupsY = ceil(height / static_cast<float>(localSize));
-	glDispatchCompute(numGroupsX, numGroupsY, 1);
+/* Reads the next DAG of an archive of the given size in bytes */
+inline vector<uint8_t> readSegment(istream& is, uint64 archiveSize) {
+	uint64 size;
+	if (!is.read(reinterpret_cast<char*>(&size), sizeof(size)))
+		throw LoadFileException("Archive is truncated");
 
-	m_traverseCS->release();
-	GL_CHECK_ERROR("traverse - end");
+	// Checked before the allocation, so an invalid size can't exhaust the memory
+	if (size > archiveSize - static_cast<uint64>(is.tellg()))
+		throw LoadFileException("Archive is truncated");
+
+	vector<uint8_t> segment(size);
+	if (!is.read(reinterpret_cast<char*>(segment.data()), size))
+		throw LoadFileException("Archive is truncated");
+	return segment;
+}
+
+size_t CompressedShadowContainer::writeArchive(const string& file) {
+	assert(m_info.size() > 0 && !m_file);
+	ofstream os(file, ios::binary);
+	if (!os.is_open())
+		throw FileNotFound("Could not open file for writing");
+
+	m_usesLeafmaskDictionary = false;
+	vector<uint> grid, dag;
+	uint64 dagSize = 0;
+	size_t numRoots = 0;
+
+	if (m_store) {
+		numRoots = layoutSharedDAG(dag, grid);
+		dagSize = dag.size();
+	} else {
+		if (m_leafmaskDictionary && m_memoryBudget == 0)
+			internLeafmasks();
+
+		grid.reserve(m_info.size());
+		for (size_t index = 0; index < m_info.size(); ++index) {
+			grid.push_back(getGridCell(index, dagSize));
+			dagSize += m_info[index].dagSize;
+		}
+	}
+
+	ArchiveHeader header = {};
+	header.magic = ARCHIVE_MAGIC;
+	header.version = ARCHIVE_VERSION;
+	header.length = m_length;
+	header.numLevels = getNumLevels();
+	header.flags = m_usesLeafmaskDictionary ? static_cast<uint>(ContainerFile::LEAFMASK_DICTIONARY) : 0;
+	header.numSegments = m_store ? 1 : m_info.size();
+	header.dagSize = dagSize;
+	os.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	os.write(reinterpret_cast<const char*>(grid.data()), grid.size() * sizeof(uint));
+
+	if (m_store) {
+		writeSegment(os, DagArchive::compress(dag, header.numLevels, getSharedLeafmaskEncoding(), numRoots));
+	} else {
+		// The DAGs are compressed on their own and relocated to their offsets when they are extracted
+		forEachShadow([&](const CompressedShadow& shadow) {
+			writeSegment(os, DagArchive::compress(shadow.getDAG(), shadow.getNumLevels(), shadow.getLeafmaskEncoding()));
+		});
+	}
+	return os.tellp();
+}
+
+size_t CompressedShadowContainer::extractArchive(const string& archive, const string& file) {
+	ifstream is(archive, ios::binary | ios::ate);
+	if (!is.is_open())
+		throw FileNotFound("Archive not found");
+	const uint64 archiveSize = is.tellg();
+	is.seekg(0, ios::beg);
+
+	ArchiveHeader header;
+	if (!is.read(reinterpret_cast<char*>(&header), sizeof(header)))
+		throw LoadFileException("Invalid archive");
+
+	if (header.magic != ARCHIVE_MAGIC)
+		throw LoadFileException("Invalid archive");
+	if (header.version != ARCHIVE_VERSION)
+		throw LoadFileException("Unsupported version of the archive");
+
+	const uint64 gridSize = static_cast<uint64>(header.length) * header.length * header.length;
+	if (header.length == 0 || header.numSegments == 0 || gridSize > (archiveSize - sizeof(header)) / sizeof(uint))
+		throw LoadFileException("Invalid archive");
+
+	vector<uint> grid(gridSize);
+	if (!is.read(reinterpret_cast<char*>(grid.data()), gridSize * sizeof(uint)))
+		throw LoadFileException("Archive is truncated");
+
+	ofstream os(file, ios::binary);
+	if (!os.is_open())
+		throw FileNotFound("Could not open file for writing");
+
+	try {
+		const auto fileHeader = ContainerFile::createHeader(header.length, header.numLevels, header.flags,
+				header.dagSize);
+		os.write(reinterpret_cast<const char*>(&fileHeader), sizeof(fileHeader));
+
+		ContainerFile::writePadding(os, fileHeader.gridOffset);
+		os.write(reinterpret_cast<const char*>(grid.data()), grid.size() * sizeof(uint));
+		ContainerFile::writePadding(os, fileHeader.dagOffset);
+
+		/* Read the DAGs batch by batch, decode every batch in parallel and write it as soon as it is complete, so
+		 * only the compressed and the decoded DAGs of one batch are in memory */
+		vector<vector<uint8_t>> segments;
+		vector<uint64> bases; // offset of every DAG of the batch in the combined DAG
+		vector<uint> dag;
+		uint64 dagSize = 0;
+		std::exception_ptr error;
+		std::mutex errorMutex;
+
+		for (uint segmentNr = 0; segmentNr < header.numSegments; ) {
+			const uint64 batchBase = dagSize;
+			segments.clear();
+			bases.clear();
+
+			do {
+				segments.push_back(readSegment(is, archiveSize));
+				bases.push_back(dagSize);
+				dagSize += DagArchive::getDAGSize(segments.back().data(), segments.back().size());
+				++segmentNr;
+			} while (segmentNr < header.numSegments && dagSize - batchBase < EXTRACT_BATCH_SIZE);
+
+			if (dagSize > header.dagSize)
+				throw LoadFileException("Invalid archive");
+
+			dag.resize(dagSize - batchBase);
+			ThreadPool::getDefault().parallelFor(segments.size(), segments.size(), [&](uint, size_t begin, size_t end) {
+				for (size_t i = begin; i < end; ++i) {
+					try {
+						DagArchive::decompress(segments[i].data(), segments[i].size(),
+							dag.data() + bases[i] - batchBase, bases[i]);
+					} catch (...) {
+						// Tasks must not throw, so the exception is rethrown after the batch
+						std::lock_guard<std::mutex> lock(errorMutex);
+						error = std::current_exception();
+					}
+				}
+			});
+			if (error)
+				std::rethrow_exception(error);
+
+			os.write(reinterpret_cast<const char*>(dag.data()), dag.size() * sizeof(uint));
+		}
+
+		if (dagSize != header.dagSize || is.peek() != ifstream::traits_type::eof())
+			throw LoadFileException("Invalid archive");
+	} catch (...) {
+		// Don't leave an incomplete container file behind
+		os.close();
+		std::remove(file.c_str());
+		throw;
+	}
+	return os.tellp();
 }
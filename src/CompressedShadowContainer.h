@@ -3,92 +3,305 @@
 
 #include "cpvs.h"
 #include "CompressedShadow.h"
-#include "Buffer.h"
-#include "ShaderProgram.h"
+#include "NodeStore.h"
+#include "ContainerFile.h"
 
-class Texture2D;
+#include <functional>
+#include <mutex>
 
 /** Contains one or more CompressedShadows, which can be added sequentially to the container.
  *
- * The container can be moved to the GPU, thereby freeing all data on the CPU and moving them to the GPU.
- * After this all operations working on the CPU representation become unusable.
+ * The container only stores the shadows on the CPU. It can be written to a file or, as GPUShadowContainer,
+ * moved or copied to the GPU to evaluate the precomputed shadows.
  *
- * After the container has been moved or copied to the GPU the precomputed shadows can be evaluated.
+ * Optionally a memory budget can be set, in which case shadows are written to disk as soon as the budget
+ * is exceeded and read back one at a time when they are written to the file or copied to the GPU.
+ *
+ * Alternatively all shadows can share one node store (see shareSubtrees), so that identical subtrees
+ * of different tiles and z-slices are stored only once. The container then holds one DAG with one root
+ * per grid cell.
+ *
+ * A container written with writeToFile can be loaded again without baking, in which case the grid and the
+ * combined DAG are used directly from the memory-mapped file.
  */
 class CompressedShadowContainer {
 public:
 	/** Creates a container with a fixed length in one dimension of the 3D container. */
 	CompressedShadowContainer(uint length)
-		: m_length(length), m_filterSize(1)
+		: m_length(length), m_memoryBudget(0), m_residentSize(0), m_checkedStoreSize(0), m_trackChanges(false),
+		  m_leafmaskDictionary(false), m_usesLeafmaskDictionary(false), m_packedPointers(false), m_pointerWidths(0),
+		  m_contiguousChildren(false), m_filterSize(1)
 	{
 		m_data.resize(length * length * length);
+		m_info.resize(length * length * length);
 	}
 
 	/** Creates a container with a length of 1 and initializes it with the given precomputed shadow. */
 	CompressedShadowContainer(unique_ptr<CompressedShadow> shadow)
-		: m_length(1), m_filterSize(1)
+		: m_length(1), m_memoryBudget(0), m_residentSize(0), m_checkedStoreSize(0), m_trackChanges(false),
+		  m_leafmaskDictionary(false), m_usesLeafmaskDictionary(false), m_packedPointers(false), m_pointerWidths(0),
+		  m_contiguousChildren(false), m_filterSize(1)
 	{
-		m_data.push_back(std::move(shadow));
+		m_data.resize(1);
+		m_info.resize(1);
+		set(std::move(shadow), 0, 0, 0);
 	}
 
-	inline void set(unique_ptr<CompressedShadow> shadow, uint x, uint y, uint z) {
-		assert(x < m_length && y < m_length && z < m_length);
+	/**
+	 * Creates a container from a file written with writeToFile. The grid and the DAG are not copied, but
+	 * used from the mapped pages of the file. No shadows can be set in such a container.
+	 */
+	CompressedShadowContainer(unique_ptr<ContainerFile> file);
 
-		const uint lengthSquared = m_length * m_length;
-		m_data[z * lengthSquared + y * m_length + x] = std::move(shadow);
+	virtual ~CompressedShadowContainer();
+
+	/**
+	 * Sets the shadow at the given position. If a memory budget has been set and adding the shadow would exceed
+	 * it, the shadow is written to disk instead.
+	 *
+	 * @note Shadows at different positions can be set concurrently.
+	 */
+	void set(unique_ptr<CompressedShadow> shadow, uint x, uint y, uint z);
+
+	/**
+	 * Lets all shadows of the container share one node store, which can be retrieved with getNodeStore.
+	 * Instead of setting shadows, the roots of the shadows in the store are set with setRoot.
+	 *
+	 * @param numLevels Number of levels of every shadow.
+	 * @note Can't be combined with a memory budget and with shadows set by set.
+	 */
+	void shareSubtrees(uint numLevels);
+
+	/** Returns the shared node store or nullptr if the shadows don't share their subtrees. */
+	inline NodeStore* getNodeStore() {
+		return m_store.get();
 	}
 
+	/**
+	 * Returns the size of the DAG laid out from the shared node store, i.e. of the DAG which is written to a file
+	 * or copied to the GPU (before the leafmasks are interned).
+	 */
+	inline size_t getSharedDAGSize() const {
+		assert(m_store);
+		return m_store->getLayoutSize(m_roots);
+	}
+
+	/**
+	 * Sets the root of the shadow at the given position, which has been created in the shared node store.
+	 * @see CompressedShadow::createInStore
+	 * @note Roots at different positions can be set concurrently.
+	 */
+	void setRoot(uint root, uint x, uint y, uint z);
+
+	/**
+	 * Returns the shadow at the given position, or nullptr if it has been written to disk.
+	 */
 	const CompressedShadow* get(uint x, uint y, uint z) const {
-		assert(x < m_length && y < m_length && z < m_length);
+		return m_data[getIndex(x, y, z)].get();
+	}
 
-		const uint lengthSquared = m_length * m_length;
-		return m_data[z * lengthSquared + y * m_length + x].get();
+	/** Returns the number of shadows in one dimension of the container. */
+	inline uint getLength() const {
+		return m_length;
 	}
 
 	/**
-	 * Calculates the visibility/shadow of every world-space position in the given texture.
-	 * The result is a 2-dimensional texture of visibility values.
+	 * Limits the memory used for the shadows on the CPU. As soon as the budget is exceeded,
+	 * every further shadow is written to the given directory instead of being kept in memory.
+	 *
+	 * @param budget Budget in bytes, 0 means unlimited.
+	 * @param directory Existing directory for temporary files, which may be shared with other containers.
 	 */
-	void evaluate(const Texture2D* positionsWS, const mat4& lightViewProj, Texture2D* visibilities);
+	void setMemoryBudget(size_t budget, const string& directory);
 
-	/** Frees all dynamically allocated memory on the CPU. */
-	inline void freeOnCPU() {
-		// Use the 'swap trick' to free all dynamic memory
-		std::vector<unique_ptr<CompressedShadow>> tmp;
-		m_data.swap(tmp);
+	/** Returns the number of bytes used by the shadows which are kept in memory. */
+	inline size_t getResidentSize() const {
+		return m_residentSize;
 	}
 
-	/** Copy all shadows to the device memory. */
-	void copyToGPU();
+	/** Frees all dynamically allocated memory on the CPU and removes all shadows written to disk. */
+	void freeOnCPU();
+
+	/**
+	 * If enabled, unique 64-bit leafmasks are stored only once in a table when the shadows are combined.
+	 * @see CompressedShadow::internLeafmasks
+	 * @note Not supported together with a memory budget.
+	 */
+	inline void setLeafmaskDictionary(bool use) {
+		m_leafmaskDictionary = use;
+	}
 
-	/** Combines copyToGPU and freeOnCPU, i.e. copies the data to the GPU and free's it on the CPU */
-	inline void moveToGPU() {
-		copyToGPU();
-		freeOnCPU();
+	/**
+	 * If enabled, the combined DAG is packed with 16-bit childmasks and relative pointers of 1, 2 or 4 bytes
+	 * when it is written to a file or copied to the GPU, which needs a lot less memory.
+	 * The grid then stores the offsets of the DAGs in 16-bit units.
+	 * @see cs::packDAG
+	 * @note Can't be combined with contiguous children.
+	 */
+	inline void setPackedPointers(bool use) {
+		assert(!use || !m_contiguousChildren);
+		m_packedPointers = use;
 	}
 
-	/** Set the PCF filter size, i.e. it's width or height (which must be equal) */
+	/**
+	 * If enabled, the children of every node are stored contiguously when the combined DAG is written to a file
+	 * or copied to the GPU, so every node needs only one word with its childmask and one pointer.
+	 * @see cs::layoutContiguousChildren
+	 * @note Can't be combined with packed pointers.
+	 */
+	inline void setContiguousChildren(bool use) {
+		assert(!use || !m_packedPointers);
+		m_contiguousChildren = use;
+	}
+
+	/**
+	 * Sets the size of the PCF kernel, i.e. its width and height in voxels, with which the shadows are evaluated.
+	 * The samples of the kernel are counted together, see cs::countVisibleDAG.
+	 */
 	inline void setFilterSize(uint size) {
+		assert(size > 0);
 		m_filterSize = size;
 	}
 
-private:
-	void initShader();
+	inline uint getFilterSize() const {
+		return m_filterSize;
+	}
 
-	vector<uint> createTopLevelGrid();
+	/**
+	 * Writes the grid and the combined DAG of all shadows to a file, i.e. the data which is copied to the GPU.
+	 * Shadows exceeding the memory budget are read back one at a time. See ContainerFile for the layout.
+	 * @throws FileNotFound if the file can't be opened.
+	 */
+	void writeToFile(const string& file);
 
-	vector<uint> combineDAGs();
+	/**
+	 * Writes the grid and the combined DAG like writeToFile, but entropy-coded with DagArchive, which makes the
+	 * file much smaller for storage and transfer. The archive has to be extracted with extractArchive before
+	 * it can be loaded. The archive always contains the DAG with absolute pointers, i.e. it is neither packed nor
+	 * has contiguous children, even if the container is configured to use these layouts.
+	 *
+	 * @return The size of the archive in bytes.
+	 * @throws FileNotFound if the file can't be opened.
+	 */
+	size_t writeArchive(const string& file);
+
+	/**
+	 * Decodes an archive written with writeArchive and writes the container file. For containers without packed
+	 * pointers and contiguous children the file is identical to the one written by writeToFile, otherwise it
+	 * contains the DAG with absolute pointers. The DAGs are read in batches, which are decoded in parallel and
+	 * written as soon as they are decoded, so the memory doesn't grow with the size of the archive.
+	 * The container file is removed again if the archive turns out to be invalid.
+	 *
+	 * @return The size of the written container file in bytes.
+	 * @throws FileNotFound if one of the files can't be opened.
+	 * @throws LoadFileException if the archive is invalid.
+	 */
+	static size_t extractArchive(const string& archive, const string& file);
+
+	/** Returns the file the container has been loaded from, or nullptr if the shadows have been set. */
+	inline const ContainerFile* getMappedFile() const {
+		return m_file.get();
+	}
+
+protected:
+	/** Information about a shadow, which is kept even if the shadow is written to disk. */
+	struct ShadowInfo {
+		size_t dagSize;
+		uint numLevels;
+		CompressedShadow::NodeVisibility visibility;
+		string file; // empty if the shadow is kept in memory
+	};
+
+	/* Values of grid cells which are completely in shadow or visible. All other cells store the offset of their DAG */
+	static const uint GRID_CELL_SHADOWED = 0xFFFFFFF;
+	static const uint GRID_CELL_VISIBLE = 0xFFFFFFE;
+
+	inline uint getIndex(uint x, uint y, uint z) const {
+		assert(x < m_length && y < m_length && z < m_length);
+		return z * m_length * m_length + y * m_length + x;
+	}
+
+	/** Returns the number of levels of every shadow */
+	uint getNumLevels() const;
+
+	/** Returns the value of the grid cell with the given index if the DAG of its shadow is stored at dagOffset */
+	uint getGridCell(size_t index, size_t dagOffset) const;
+
+	/** Calls func with every shadow in order. Shadows written to disk are read one at a time. */
+	void forEachShadow(std::function<void(const CompressedShadow&)> func) const;
+
+	/**
+	 * Creates the DAG and the grid when all shadows share one node store.
+	 * @param placement If not null, receives the offsets of the nodes in the DAG, so the nodes of shadows which
+	 * are set later can be appended to it (see NodeStore::layout). Is invalid if a leafmask table is used.
+	 * @return The number of roots in the DAG.
+	 */
+	size_t layoutSharedDAG(vector<uint>& dag, vector<uint>& grid, NodeStore::Placement* placement = nullptr);
+
+	/** Returns the value of the grid cell with the given index if the root of its shadow is stored at rootOffset */
+	uint getSharedGridCell(size_t index, uint rootOffset) const;
 
-private:
+	/**
+	 * Replaces the shared node store by one with only the nodes of the current roots, if the nodes of replaced
+	 * shadows make up more than a quarter of it. The store is only checked after it has grown noticeably.
+	 * @return True if the store has been replaced, i.e. all handles and placements are invalid.
+	 * @note Must not be called concurrently with setRoot.
+	 */
+	bool compactNodeStore();
+
+	/** Returns the encoding of the leafmasks in the DAG created by layoutSharedDAG */
+	CompressedShadow::LeafmaskEncoding getSharedLeafmaskEncoding() const;
+
+	/**
+	 * Creates the shared DAG like above and transforms it into another layout (e.g. with cs::packDAG).
+	 * @param transform Returns the DAG in the new layout given the shared DAG and its number of roots, and
+	 * replaces the given offsets of roots with their offsets in the new layout.
+	 */
+	void layoutSharedDAG(vector<uint>& dag, vector<uint>& grid, const char* layoutName,
+			std::function<vector<uint>(const vector<uint>&, size_t, vector<uint>*)> transform);
+
+	/**
+	 * Creates the packed DAG of all shadows and the grid with offsets in 16-bit units, and sets m_pointerWidths.
+	 * The DAG of every shadow is packed on its own, but all of them use the same pointer widths.
+	 */
+	void layoutPackedDAG(vector<uint>& dag, vector<uint>& grid);
+
+	/** Creates the DAG of all shadows with contiguous children and the grid. See cs::layoutContiguousChildren */
+	void layoutContiguousDAG(vector<uint>& dag, vector<uint>& grid);
+
+	/** Interns the leafmasks of all shadows kept in memory and updates their sizes. */
+	void internLeafmasks();
+
+	bool hasShadowsOnDisk() const;
+
+protected:
 	uint m_length;
 	vector<unique_ptr<CompressedShadow>> m_data;
+	vector<ShadowInfo> m_info;
+
+	size_t m_memoryBudget;
+	size_t m_residentSize;
+	string m_spillPrefix; // directory and unique prefix of the files of the shadows written to disk
+	std::mutex m_mutex;
 
-	unique_ptr<SSBO> m_deviceDag;
-	unique_ptr<SSBO> m_deviceGrid;
+	unique_ptr<NodeStore> m_store;
+	vector<uint> m_roots;
+	size_t m_checkedStoreSize; // size of the store when compactNodeStore checked it the last time
 
-	unique_ptr<ShaderProgram> m_traverseCS;
+	bool m_trackChanges;  // if true, the indices of all shadows which are set are added to m_dirty
+	vector<uint> m_dirty;
+
+	bool m_leafmaskDictionary;
+	bool m_usesLeafmaskDictionary; // true if the combined DAG contains a leafmask table
+
+	bool m_packedPointers;
+	uint m_pointerWidths; // widths of the pointers of the packed DAG, see cs::packDAG
+
+	bool m_contiguousChildren;
 
 	uint m_filterSize;
+
+	unique_ptr<ContainerFile> m_file;
 };
 
 #endif
@@ -1,9 +1,15 @@
 #include "CompressedShadowUtil.h"
+#include "ThreadPool.h"
 
 /* For cout debugging :-) */
 #include <iostream>
 #include <glm/ext.hpp>
 
+#include <algorithm>
+#include <numeric>
+#include <unordered_map>
+#include <limits>
+
 using namespace std;
 using namespace cs;
 
@@ -14,22 +20,26 @@ void cs::setDepthOffset(uint off) {
 }
 
 inline uint getLevelHeight(const MinMaxHierarchy& minMax, uint level) {
-	return minMax.getLevel(level)->getHeight() * depthOffset;
+	return minMax.getSize(level) * depthOffset;
 }
 
 uint cs::createChildmask(const MinMaxHierarchy& minMax, uint level, const ivec3& offset) {
 	auto levelHeight = getLevelHeight(minMax, level);
 
+	// The offset is even, so the 2x2 values are in one tile of the hierarchy
+	const float* mins   = minMax.getMins(level);
+	const float* maxs   = minMax.getMaxs(level);
+	const size_t first  = minMax.getIndex(level, offset.x, offset.y);
+	const size_t stride = minMax.getRowStride(level);
+
 	uint childmask = 0;
 	for (uint z = 0; z < 2; ++z) {
 		for (uint y = 0; y < 2; ++y) {
 			for (uint x = 0; x < 2; ++x) {
 				uint offZ = z + offset.z;
-				uint offY = y + offset.y;
-				uint offX = x + offset.x;
 
-				auto min = minMax.getMin(level, offX, offY);
-				auto max = minMax.getMax(level, offX, offY);
+				auto min = mins[first + y * stride + x];
+				auto max = maxs[first + y * stride + x];
 
 				uint bits;
 				if (level > 0) {
@@ -59,15 +69,18 @@ uint cs::createChildmask(const MinMaxHierarchy& minMax, uint level, const ivec3&
 inline uint64 createLeafmask(const MinMaxHierarchy& minMax, const ivec3& offset) {
 	auto levelHeight = getLevelHeight(minMax, 0);
 
+	// The offset is a multiple of 8, so the 8x8 values are in one tile of the hierarchy
+	const float* depths = minMax.getMins(0);
+	const size_t first  = minMax.getIndex(0, offset.x, offset.y);
+	const size_t stride = minMax.getRowStride(0);
+
 	uint64 leafmask = 0;
 	uint index = 0;
 	for (uint y = 0; y < 8; ++y) {
-		float offY = offset.y + y;
+		const float* row = depths + first + y * stride;
 
 		for (uint x = 0; x < 8; ++x) {
-			float offX = offset.x + x;
-
-			auto min = minMax.getMin(0, offX, offY);
+			auto min = row[x];
 			uint64 bit = absoluteVisible(offset.z, offset.z + 1, min * levelHeight);
 			leafmask |= bit << index;
 
@@ -78,10 +91,18 @@ inline uint64 createLeafmask(const MinMaxHierarchy& minMax, const ivec3& offset)
 }
 
 std::pair<uint, vector<uint64>> cs::createChildmask1x1x8(const MinMaxHierarchy& minMax, const ivec3& offset) {
+	uint64 leafmasks[8];
+	const uint childmask = createChildmask1x1x8(minMax, offset, leafmasks);
+
+	vector<uint64> masks(leafmasks, leafmasks + getNumChildren(childmask));
+	return make_pair(childmask, masks);
+}
+
+uint cs::createChildmask1x1x8(const MinMaxHierarchy& minMax, const ivec3& offset, uint64* leafmasks) {
 	ivec3 offCorrected = offset * 4;
 
 	uint childmask = 0;
-	vector<uint64> masks;
+	uint numMasks = 0;
 	for (uint z = 0; z < 8; ++z) {
 		uint64 leafmask = createLeafmask(minMax, offCorrected);
 		++offCorrected.z;
@@ -92,26 +113,843 @@ std::pair<uint, vector<uint64>> cs::createChildmask1x1x8(const MinMaxHierarchy&
 			childmask |= 0 << (z * 2);
 		else {
 			childmask |= 0x2 << (z * 2);
-			masks.push_back(leafmask);
+			leafmasks[numMasks++] = leafmask;
 		}
 	}
-	return make_pair(childmask, masks);
+	return childmask;
 }
 
-vector<ivec3> cs::getChildCoordinates(uint childmask, const ivec3& parentOffset) {
-	vector<ivec3> result;
+void cs::appendChildCoordinates(uint childmask, const ivec3& parentOffset, vector<ivec3>& coords) {
 	for (uint i = 0; i < 8; ++i) {
 		if (isPartial(childmask, i)) {
-			/* Decide whether to add 1 in the x, y, z direction.
-			 * This code relies on the order of the children (and has to...) */
+			coords.emplace_back(getChildCoordinate(i, parentOffset));
+		}
+	}
+}
+
+uint cs::getNumThreads() {
+	return ThreadPool::getDefault().getNumThreads();
+}
+
+void cs::parallelFor(size_t size, uint numChunks, std::function<void(uint, size_t, size_t)> func) {
+	ThreadPool::getDefault().parallelFor(size, numChunks, std::move(func));
+}
+
+// Under this number of nodes a level is merged by a single thread
+constexpr size_t PARALLEL_MERGE_THRESHOLD = 1 << 14;
+
+// Number of shards (i.e. independent hash tables) per thread
+constexpr uint SHARDS_PER_THREAD = 4;
+
+vector<uint> cs::mergeLevelParallel(const uint* oldBegin, size_t numNodes, uint* newBegin, uint nodeSize,
+		uint* numNodesLeft, uint numThreads) {
+	if (numThreads == 0)
+		numThreads = getNumThreads();
+
+	if (numNodes < PARALLEL_MERGE_THRESHOLD || numThreads == 1)
+		return mergeLevel(oldBegin, oldBegin + numNodes * nodeSize, newBegin, nodeSize, numNodesLeft);
+
+	const uint numShards = numThreads * SHARDS_PER_THREAD;
+
+	/* 1. Hash all nodes and sort them into shards. Every chunk keeps its own list per shard,
+	 * so the node numbers within a shard stay sorted after concatenating the chunks in order */
+	vector<uint64> hashes(numNodes);
+	vector<vector<vector<uint>>> chunkShards(numThreads, vector<vector<uint>>(numShards));
+
+	parallelFor(numNodes, numThreads, [&](uint chunk, size_t begin, size_t end) {
+		for (size_t nodeNr = begin; nodeNr < end; ++nodeNr) {
+			const uint64 hash = hashNode(oldBegin + nodeNr * nodeSize, nodeSize);
+			hashes[nodeNr] = hash;
+
+			// Use the upper bits for the shard, the lower bits are used as index into the hash table
+			chunkShards[chunk][(hash >> 32) % numShards].push_back(nodeNr);
+		}
+	});
+
+	/* 2. Deduplicate every shard independently, i.e. find the first occurrence of every node */
+	vector<uint> representative(numNodes);
+
+	parallelFor(numShards, numThreads, [&](uint, size_t shardBegin, size_t shardEnd) {
+		for (size_t shard = shardBegin; shard < shardEnd; ++shard) {
+			size_t shardSize = 0;
+			for (const auto& shards : chunkShards)
+				shardSize += shards[shard].size();
+
+			const size_t capacity = getHashTableCapacity(shardSize);
+			vector<uint> table(capacity, 0); // old node number + 1 for every occupied slot
+
+			for (const auto& shards : chunkShards) {
+				for (const uint nodeNr : shards[shard]) {
+					const uint* node = oldBegin + nodeNr * nodeSize;
+					size_t slot = hashes[nodeNr] & (capacity - 1);
+
+					while (table[slot] != 0) {
+						const uint candidate = table[slot] - 1;
+						if (isEqualSubtree(node, oldBegin + candidate * nodeSize, nodeSize))
+							break;
+						slot = (slot + 1) & (capacity - 1);
+					}
+
+					if (table[slot] == 0)
+						table[slot] = nodeNr + 1;
+					representative[nodeNr] = table[slot] - 1;
+				}
+			}
+		}
+	});
+
+	/* 3. Count unique nodes per chunk and calculate the first new node number of every chunk */
+	vector<uint> chunkOffsets(numThreads + 1, 0);
+
+	parallelFor(numNodes, numThreads, [&](uint chunk, size_t begin, size_t end) {
+		uint unique = 0;
+		for (size_t nodeNr = begin; nodeNr < end; ++nodeNr) {
+			if (representative[nodeNr] == nodeNr)
+				++unique;
+		}
+		chunkOffsets[chunk + 1] = unique;
+	});
+	std::partial_sum(chunkOffsets.begin(), chunkOffsets.end(), chunkOffsets.begin());
+
+	/* 4. Copy unique nodes to their final position, then map duplicates to their representative */
+	vector<uint> result(numNodes);
+
+	parallelFor(numNodes, numThreads, [&](uint chunk, size_t begin, size_t end) {
+		uint newNodeNr = chunkOffsets[chunk];
+		for (size_t nodeNr = begin; nodeNr < end; ++nodeNr) {
+			if (representative[nodeNr] == nodeNr) {
+				const uint* node = oldBegin + nodeNr * nodeSize;
+				std::copy(node, node + nodeSize, newBegin + newNodeNr * nodeSize);
+				result[nodeNr] = newNodeNr++;
+			}
+		}
+	});
+
+	parallelFor(numNodes, numThreads, [&](uint, size_t begin, size_t end) {
+		for (size_t nodeNr = begin; nodeNr < end; ++nodeNr) {
+			// The representative is always the first occurrence, so it has already been assigned
+			if (representative[nodeNr] != nodeNr)
+				result[nodeNr] = result[representative[nodeNr]];
+		}
+	});
+
+	*numNodesLeft = chunkOffsets[numThreads];
+	return result;
+}
+
+vector<size_t> cs::getLevelOffsets(const vector<uint>& dag, uint numLevels, CompressedShadow::LeafmaskEncoding encoding,
+		size_t numRoots) {
+	const uint rootLevel = numLevels - 2;
+	const uint minLevel = (encoding == CompressedShadow::NO_LEAFMASKS) ? 0 : 2;
+
+	vector<size_t> offsets(numLevels, dag.size());
+	offsets[rootLevel + 1] = 0;
+
+	size_t levelEnd = 0;
+	for (size_t rootNr = 0; rootNr < numRoots; ++rootNr)
+		levelEnd += getCompressedNodeSize(rootLevel, dag[levelEnd], encoding);
+
+	/* Levels are stored one after another, so the end of the next level is known
+	 * as soon as all nodes of the current level have been visited */
+	for (uint level = rootLevel; level >= minLevel; --level) {
+		offsets[level] = levelEnd;
+		if (level == minLevel)
+			break;
+
+		size_t nextLevelEnd = levelEnd;
+		for (size_t offset = offsets[level + 1]; offset < levelEnd; ) {
+			const uint numChildren = getNumChildren(dag[offset]);
+
+			for (uint i = 1; i <= numChildren; ++i) {
+				const uint child = dag[offset + i];
+				nextLevelEnd = std::max<size_t>(nextLevelEnd, child + getCompressedNodeSize(level - 1, dag[child], encoding));
+			}
+			offset += 1 + numChildren;
+		}
+		levelEnd = nextLevelEnd;
+	}
+	return offsets;
+}
+
+size_t cs::internLeafmasks(vector<uint>& dag, uint numLevels, size_t numRoots) {
+	assert(numLevels > 4);
+	const auto offsets = getLevelOffsets(dag, numLevels, CompressedShadow::INLINE_LEAFMASKS, numRoots);
+
+	const size_t leafBegin = offsets[3];
+	const size_t leafEnd = offsets[2];
+
+	/* Rebuild level 2 with the index of every leafmask in the table */
+	vector<uint> leafLevel;
+	leafLevel.reserve(leafEnd - leafBegin);
+
+	vector<uint64> table;
+	unordered_map<uint64, uint> tableIndices;
+
+	// New offset of every node in level 2 (relative to the beginning of the level)
+	vector<uint> newOffsets(leafEnd - leafBegin);
+
+	for (size_t offset = leafBegin; offset < leafEnd; ) {
+		const uint childmask = dag[offset];
+		const uint numChildren = getNumChildren(childmask);
+
+		newOffsets[offset - leafBegin] = leafLevel.size();
+		leafLevel.push_back(childmask);
+
+		for (uint childNr = 0; childNr < numChildren; ++childNr) {
+			const uint64 leafmask = dag[offset + 1 + 2 * childNr] | (static_cast<uint64>(dag[offset + 2 + 2 * childNr]) << 32);
+
+			auto inserted = tableIndices.emplace(leafmask, table.size());
+			if (inserted.second)
+				table.push_back(leafmask);
+			leafLevel.push_back(inserted.first->second);
+		}
+		offset += 1 + 2 * numChildren;
+	}
+
+	const size_t tableBegin = leafBegin + leafLevel.size();
+	assert(tableBegin + table.size() * 2 < std::numeric_limits<uint>::max());
+
+	/* Turn the indices into pointers to the table */
+	for (size_t offset = 0; offset < leafLevel.size(); ) {
+		const uint numChildren = getNumChildren(leafLevel[offset]);
+		for (uint i = 1; i <= numChildren; ++i)
+			leafLevel[offset + i] = tableBegin + 2 * leafLevel[offset + i];
+		offset += 1 + numChildren;
+	}
+
+	/* Update the pointers of level 3 */
+	for (size_t offset = offsets[4]; offset < offsets[3]; ) {
+		const uint numChildren = getNumChildren(dag[offset]);
+		for (uint i = 1; i <= numChildren; ++i)
+			dag[offset + i] = leafBegin + newOffsets[dag[offset + i] - leafBegin];
+		offset += 1 + numChildren;
+	}
+
+	dag.resize(leafBegin);
+	dag.insert(dag.end(), leafLevel.begin(), leafLevel.end());
+	for (const uint64 leafmask : table) {
+		dag.push_back(leafmask);
+		dag.push_back(leafmask >> 32);
+	}
+	return table.size();
+}
+
+/* Returns the size of a node in a packed DAG in 16-bit units */
+inline size_t getPackedNodeSize(uint level, uint childmask, CompressedShadow::LeafmaskEncoding encoding,
+		uint pointerWidths) {
+	const uint numChildren = getNumChildren(childmask);
+	const size_t dataSize = (encoding == CompressedShadow::INLINE_LEAFMASKS && level == 2) ? 8 * numChildren
+		: numChildren * getPointerWidth(pointerWidths, level);
+	return 1 + (dataSize + 1) / 2;
+}
+
+vector<uint> cs::packDAG(const vector<uint>& dag, uint numLevels, CompressedShadow::LeafmaskEncoding encoding,
+		uint& pointerWidths, size_t numRoots, vector<uint>* rootOffsets) {
+	assert(numLevels <= 17);
+	const uint rootLevel = numLevels - 2;
+	const uint minLevel = (encoding == CompressedShadow::NO_LEAFMASKS) ? 0 : 2;
+	const auto offsets = getLevelOffsets(dag, numLevels, encoding, numRoots);
+	const size_t tableBegin = offsets[minLevel];
+
+	// Levels whose nodes contain pointers (level 2 only points to the leafmask table)
+	auto hasPointers = [&](uint level) {
+		return level > minLevel || (level == 2 && encoding == CompressedShadow::LEAFMASK_POINTERS);
+	};
+
+	/* The distance to the children depends on the size of the nodes in between, i.e. on the widths of the
+	 * pointers. So the nodes are laid out and the pointers widened until all children can be addressed */
+	vector<uint> newOffsets(dag.size()); // offset in the packed DAG of every node and leafmask of the table
+	size_t packedSize;
+
+	for (;;) {
+		size_t newOffset = 0;
+		for (uint level = rootLevel; ; --level) {
+			for (size_t offset = offsets[level + 1]; offset < offsets[level];
+					offset += getCompressedNodeSize(level, dag[offset], encoding)) {
+				newOffsets[offset] = newOffset;
+				newOffset += getPackedNodeSize(level, dag[offset], encoding, pointerWidths);
+			}
+			if (level == minLevel)
+				break;
+		}
+		for (size_t offset = tableBegin; offset < dag.size(); offset += 2) {
+			newOffsets[offset] = newOffset;
+			newOffset += 4;
+		}
+		packedSize = newOffset;
+		assert(packedSize < std::numeric_limits<uint>::max());
+
+		uint neededWidths = pointerWidths;
+		for (uint level = rootLevel; hasPointers(level); --level) {
+			size_t maxDistance = 0;
+			for (size_t offset = offsets[level + 1]; offset < offsets[level];
+					offset += getCompressedNodeSize(level, dag[offset], encoding)) {
+				const uint numChildren = getNumChildren(dag[offset]);
+				for (uint i = 1; i <= numChildren; ++i)
+					maxDistance = std::max<size_t>(maxDistance, newOffsets[dag[offset + i]] - newOffsets[offset]);
+			}
+
+			uint width = 0; // base-2 logarithm of the width in bytes
+			while (width < 2 && (maxDistance >> (8u << width)) != 0)
+				++width;
+			neededWidths = maxPointerWidths(neededWidths, width << (2 * level));
+		}
+
+		if (neededWidths == pointerWidths)
+			break;
+		pointerWidths = neededWidths;
+	}
+
+	/* Write the nodes and the leafmask table */
+	vector<uint> packed((packedSize + 1) / 2, 0);
+	auto write = [&packed](size_t byteOffset, uint64 value, uint width) {
+		for (uint i = 0; i < width; ++i, ++byteOffset)
+			packed[byteOffset >> 2] |= static_cast<uint>((value >> (8 * i)) & 0xFF) << ((byteOffset & 3) * 8);
+	};
+
+	for (uint level = rootLevel; ; --level) {
+		const uint width = getPointerWidth(pointerWidths, level);
+
+		for (size_t offset = offsets[level + 1]; offset < offsets[level];
+				offset += getCompressedNodeSize(level, dag[offset], encoding)) {
+			const size_t byteOffset = 2 * newOffsets[offset];
+			const uint numChildren = getNumChildren(dag[offset]);
+			write(byteOffset, dag[offset], 2);
+
+			if (level == 2 && encoding == CompressedShadow::INLINE_LEAFMASKS) {
+				for (uint i = 0; i < numChildren; ++i) {
+					const uint64 leafmask = dag[offset + 1 + 2 * i] | (static_cast<uint64>(dag[offset + 2 + 2 * i]) << 32);
+					write(byteOffset + 2 + 8 * i, leafmask, 8);
+				}
+			} else if (hasPointers(level)) {
+				for (uint i = 0; i < numChildren; ++i)
+					write(byteOffset + 2 + width * i, newOffsets[dag[offset + 1 + i]] - newOffsets[offset], width);
+			}
+		}
+		if (level == minLevel)
+			break;
+	}
+	for (size_t offset = tableBegin; offset < dag.size(); offset += 2)
+		write(2 * newOffsets[offset], dag[offset] | (static_cast<uint64>(dag[offset + 1]) << 32), 8);
+
+	if (rootOffsets) {
+		for (uint& root : *rootOffsets)
+			root = newOffsets[root];
+	}
+	return packed;
+}
+
+CompressedShadow::NodeVisibility cs::traverseDAG(const uint* dag, size_t root, uint numLevels,
+		CompressedShadow::LeafmaskEncoding encoding, const ivec3& path) {
+	const int minLevel = (encoding == CompressedShadow::NO_LEAFMASKS) ? 0 : 3;
+	size_t offset = root;
+
+	for (int level = numLevels - 2; level >= minLevel; --level) {
+		const int lvlBit = 1 << level;
+		const uint childIndex = ((path.x & lvlBit) ? 1 : 0) + ((path.y & lvlBit) ? 2 : 0) + ((path.z & lvlBit) ? 4 : 0);
+		const uint childmask = dag[offset];
+
+		if (isVisible(childmask, childIndex))
+			return CompressedShadow::VISIBLE;
+		else if (isShadowed(childmask, childIndex))
+			return CompressedShadow::SHADOW;
+
+		offset = dag[offset + 1 + getPartialChildIndex(childmask, childIndex)];
+	}
+
+	if (encoding == CompressedShadow::NO_LEAFMASKS)
+		return CompressedShadow::PARTIAL;
+
+	// Level 2, so evaluate 1x1x8 and if necessary the 8x8x1 64-bit leafmask
+	const uint childIndex = path.z & 0x7;
+	const uint childmask = dag[offset];
+
+	if (isVisible(childmask, childIndex))
+		return CompressedShadow::VISIBLE;
+	else if (isShadowed(childmask, childIndex))
+		return CompressedShadow::SHADOW;
+
+	const uint childNr = getPartialChildIndex(childmask, childIndex);
+	size_t leafmask = offset + 1 + 2 * childNr;
+	if (encoding == CompressedShadow::LEAFMASK_POINTERS)
+		leafmask = dag[offset + 1 + childNr];
+
+	const uint maskIndex = (path.x & 0x7) + 8 * (path.y & 0x7);
+	const uint half = dag[leafmask + (maskIndex < 32 ? 0 : 1)];
+	return (half & (1u << (maskIndex & 31))) ? CompressedShadow::VISIBLE : CompressedShadow::SHADOW;
+}
+
+// Number of traversals which are interleaved by traverseInterleaved
+constexpr uint INTERLEAVED_GROUP_SIZE = 16;
+
+// Steps of an interleaved traversal which don't read a node of a level
+constexpr int LEAFMASK_STEP = -2;
+constexpr int FINISHED_STEP = -3;
+
+/* State of one traversal of cs::traverseInterleaved */
+struct InterleavedTraversal {
+	size_t offset; // offset of the node which is read in the next step, or of the word of the leafmask
+	int level;     // level of the node or one of the steps above
+	size_t index;  // index of the voxel
+};
+
+void cs::traverseInterleaved(const uint* dag, uint numLevels, CompressedShadow::LeafmaskEncoding encoding,
+		const ivec3* paths, const uint* roots, size_t count, uint8_t* visibilities) {
+	const int minLevel = (encoding == CompressedShadow::NO_LEAFMASKS) ? 0 : 3;
+
+	InterleavedTraversal group[INTERLEAVED_GROUP_SIZE];
+	size_t next = 0;
+
+	// Starts the traversal of the next voxel, returns false if all voxels have been started
+	auto start = [&](InterleavedTraversal& traversal) {
+		if (next == count) {
+			traversal.level = FINISHED_STEP;
+			return false;
+		}
+		traversal.index = next++;
+		traversal.offset = roots ? roots[traversal.index] : 0;
+		traversal.level = numLevels - 2;
+		__builtin_prefetch(dag + traversal.offset);
+		return true;
+	};
 
-			uint maskX = (0x1 & i) ? 1 : 0; // maskX is 1 <=> i is 1, 3, 5, 7
-			uint maskY = (0x2 & i) ? 1 : 0; // maskY is 1 <=> i is 2, 3, 6, 7
-			uint maskZ = (0x4 & i) ? 1 : 0; // maskZ is 1 <=> i is 4, 5, 6, 7
+	uint numActive = 0;
+	for (auto& traversal : group) {
+		if (start(traversal))
+			++numActive;
+	}
+
+	while (numActive > 0) {
+		for (auto& traversal : group) {
+			if (traversal.level == FINISHED_STEP)
+				continue;
+
+			const ivec3& path = paths[traversal.index];
+			int visibility = -1; // set as soon as the traversal is finished
+
+			if (traversal.level == LEAFMASK_STEP) {
+				const uint maskIndex = (path.x & 0x7) + 8 * (path.y & 0x7);
+				visibility = (dag[traversal.offset] & (1u << (maskIndex & 31))) ? CompressedShadow::VISIBLE
+						: CompressedShadow::SHADOW;
+			} else if (traversal.level >= minLevel) {
+				const int lvlBit = 1 << traversal.level;
+				const uint childIndex = ((path.x & lvlBit) ? 1 : 0) + ((path.y & lvlBit) ? 2 : 0)
+						+ ((path.z & lvlBit) ? 4 : 0);
+				const uint childmask = dag[traversal.offset];
+
+				if (isVisible(childmask, childIndex)) {
+					visibility = CompressedShadow::VISIBLE;
+				} else if (isShadowed(childmask, childIndex)) {
+					visibility = CompressedShadow::SHADOW;
+				} else if (traversal.level == 0) {
+					visibility = CompressedShadow::PARTIAL;
+				} else {
+					traversal.offset = dag[traversal.offset + 1 + getPartialChildIndex(childmask, childIndex)];
+					--traversal.level;
+				}
+			} else {
+				// Level 2, so evaluate 1x1x8 and if necessary find the word of the 8x8x1 64-bit leafmask
+				const uint childIndex = path.z & 0x7;
+				const uint childmask = dag[traversal.offset];
+
+				if (isVisible(childmask, childIndex)) {
+					visibility = CompressedShadow::VISIBLE;
+				} else if (isShadowed(childmask, childIndex)) {
+					visibility = CompressedShadow::SHADOW;
+				} else {
+					const uint childNr = getPartialChildIndex(childmask, childIndex);
+					size_t leafmask = traversal.offset + 1 + 2 * childNr;
+					if (encoding == CompressedShadow::LEAFMASK_POINTERS)
+						leafmask = dag[traversal.offset + 1 + childNr];
+
+					const uint maskIndex = (path.x & 0x7) + 8 * (path.y & 0x7);
+					traversal.offset = leafmask + (maskIndex < 32 ? 0 : 1);
+					traversal.level = LEAFMASK_STEP;
+				}
+			}
+
+			if (visibility < 0) {
+				// Continue with the next traversal while the node is loaded
+				__builtin_prefetch(dag + traversal.offset);
+			} else {
+				visibilities[traversal.index] = static_cast<uint8_t>(visibility);
+				if (!start(traversal))
+					--numActive;
+			}
+		}
+	}
+}
+
+CompressedShadow::NodeVisibility cs::traversePacked(const uint* dag, size_t root, uint numLevels,
+		uint pointerWidths, CompressedShadow::LeafmaskEncoding encoding, const ivec3& path) {
+	const int minLevel = (encoding == CompressedShadow::NO_LEAFMASKS) ? 0 : 3;
+	size_t offset = root;
+
+	for (int level = numLevels - 2; level >= minLevel; --level) {
+		const int lvlBit = 1 << level;
+		const uint childIndex = ((path.x & lvlBit) ? 1 : 0) + ((path.y & lvlBit) ? 2 : 0) + ((path.z & lvlBit) ? 4 : 0);
+		const uint childmask = readPacked(dag, 2 * offset, 2);
+
+		if (isVisible(childmask, childIndex))
+			return CompressedShadow::VISIBLE;
+		else if (isShadowed(childmask, childIndex))
+			return CompressedShadow::SHADOW;
+
+		const uint width = getPointerWidth(pointerWidths, level);
+		offset += readPacked(dag, 2 * offset + 2 + width * getPartialChildIndex(childmask, childIndex), width);
+	}
+
+	if (encoding == CompressedShadow::NO_LEAFMASKS)
+		return CompressedShadow::PARTIAL;
+
+	// Level 2, so evaluate 1x1x8 and if necessary the 8x8x1 64-bit leafmask
+	const uint childIndex = path.z & 0x7;
+	const uint childmask = readPacked(dag, 2 * offset, 2);
+
+	if (isVisible(childmask, childIndex))
+		return CompressedShadow::VISIBLE;
+	else if (isShadowed(childmask, childIndex))
+		return CompressedShadow::SHADOW;
+
+	const uint childNr = getPartialChildIndex(childmask, childIndex);
+	size_t leafmask = 2 * offset + 2 + 8 * childNr;
+	if (encoding == CompressedShadow::LEAFMASK_POINTERS) {
+		const uint width = getPointerWidth(pointerWidths, 2);
+		leafmask = 2 * (offset + readPacked(dag, 2 * offset + 2 + width * childNr, width));
+	}
+
+	const uint maskIndex = (path.x & 0x7) + 8 * (path.y & 0x7);
+	const uint half = readPacked(dag, leafmask + (maskIndex < 32 ? 0 : 4), 4);
+	return (half & (1u << (maskIndex & 31))) ? CompressedShadow::VISIBLE : CompressedShadow::SHADOW;
+}
+
+/* Nodes which are stored contiguously in a DAG with contiguous children */
+struct ChildGroup {
+	uint parent;       // offset of the parent in the compressed DAG, or of the root for the group of a root
+	bool root;         // true if the group only contains the root itself
+	bool leafmasks;    // true if the group contains the leafmasks (or pointers to them) of a node in level 2
+	size_t firstChild; // index of the first child of the group in 'far'
+};
+
+vector<uint> cs::layoutContiguousChildren(const vector<uint>& dag, uint numLevels,
+		CompressedShadow::LeafmaskEncoding encoding, size_t numRoots, vector<uint>* rootOffsets) {
+	constexpr uint NO_GROUP = std::numeric_limits<uint>::max();
+	constexpr size_t MAX_NEAR_POINTER = (1u << (32 - CONTIGUOUS_POINTER_SHIFT)) - 1;
+
+	const uint rootLevel = numLevels - 2;
+	const bool leafmasks = encoding != CompressedShadow::NO_LEAFMASKS;
+	const auto offsets = getLevelOffsets(dag, numLevels, encoding, numRoots);
+	const size_t tableBegin = offsets[leafmasks ? 2 : 0];
+	const uint leafmaskSize = (encoding == CompressedShadow::LEAFMASK_POINTERS) ? 1 : 2;
+
+	/* Order the groups depth-first, so that the children of most nodes are close to them. Every root is a group
+	 * of its own, followed by its subtree */
+	vector<ChildGroup> groups;
+	vector<uint> childGroup(dag.size(), NO_GROUP); // group with the children of every node
+	vector<uint> rootGroup(dag.size(), NO_GROUP);
+	size_t numChildren = 0;
+
+	std::function<void(uint, uint)> addChildren = [&](uint node, uint level) {
+		if (!hasPartialChildren(dag[node]) || childGroup[node] != NO_GROUP)
+			return;
+
+		const bool isLeafmasks = leafmasks && level == 2;
+		childGroup[node] = groups.size();
+		groups.push_back({node, false, isLeafmasks, numChildren});
+		if (isLeafmasks)
+			return;
+
+		const uint nodeChildren = getNumChildren(dag[node]);
+		numChildren += nodeChildren;
+		for (uint i = 1; i <= nodeChildren; ++i)
+			addChildren(dag[node + i], level - 1);
+	};
+
+	for (size_t root = offsets[rootLevel + 1]; root < offsets[rootLevel];
+			root += getCompressedNodeSize(rootLevel, dag[root], encoding)) {
+		rootGroup[root] = groups.size();
+		groups.push_back({static_cast<uint>(root), true, false, numChildren++});
+		addChildren(root, rootLevel);
+	}
+
+	auto getNumNodes = [&dag](const ChildGroup& group) {
+		return group.root ? 1 : getNumChildren(dag[group.parent]);
+	};
+	auto getNode = [&dag](const ChildGroup& group, uint i) {
+		return group.root ? group.parent : dag[group.parent + 1 + i];
+	};
+
+	/* Start with far pointers for all nodes, then use near pointers for all children which are close enough.
+	 * Removing the unused far pointers only moves the groups closer to each other, so the near pointers stay valid */
+	vector<char> far(numChildren, 1);
+	vector<size_t> positions(groups.size() + 1);
+
+	auto calcPositions = [&]() {
+		positions[0] = 0;
+		for (size_t groupNr = 0; groupNr < groups.size(); ++groupNr) {
+			const ChildGroup& group = groups[groupNr];
+			size_t size = leafmaskSize * getNumChildren(dag[group.parent]);
+
+			if (!group.leafmasks) {
+				size = getNumNodes(group);
+				for (uint i = 0; i < getNumNodes(group); ++i) {
+					if (hasPartialChildren(dag[getNode(group, i)]) && far[group.firstChild + i])
+						++size;
+				}
+			}
+			positions[groupNr + 1] = positions[groupNr] + size;
+		}
+		assert(positions.back() + dag.size() - tableBegin < std::numeric_limits<uint>::max());
+	};
+
+	calcPositions();
+	for (size_t groupNr = 0; groupNr < groups.size(); ++groupNr) {
+		const ChildGroup& group = groups[groupNr];
+		if (group.leafmasks)
+			continue;
+
+		for (uint i = 0; i < getNumNodes(group); ++i) {
+			const uint node = getNode(group, i);
+			if (!hasPartialChildren(dag[node]))
+				continue;
+
+			const size_t position = positions[groupNr] + i;
+			const size_t children = positions[childGroup[node]];
+			far[group.firstChild + i] = children < position || children - position > MAX_NEAR_POINTER;
+		}
+	}
+	calcPositions();
+
+	/* Write the nodes with their pointers, the far pointers and the leafmasks. The leafmask table is appended */
+	vector<uint> result(positions.back());
+	result.insert(result.end(), dag.begin() + tableBegin, dag.end());
+
+	for (size_t groupNr = 0; groupNr < groups.size(); ++groupNr) {
+		const ChildGroup& group = groups[groupNr];
+		const size_t begin = positions[groupNr];
+
+		if (group.leafmasks) {
+			for (uint i = 0; i < getNumChildren(dag[group.parent]); ++i) {
+				if (encoding == CompressedShadow::LEAFMASK_POINTERS) {
+					// The pointer to the table is relative to itself
+					const size_t leafmask = positions.back() + dag[group.parent + 1 + i] - tableBegin;
+					result[begin + i] = leafmask - (begin + i);
+				} else {
+					result[begin + 2 * i] = dag[group.parent + 1 + 2 * i];
+					result[begin + 2 * i + 1] = dag[group.parent + 2 + 2 * i];
+				}
+			}
+			continue;
+		}
+
+		const uint numNodes = getNumNodes(group);
+		size_t farPointer = begin + numNodes;
+
+		for (uint i = 0; i < numNodes; ++i) {
+			const uint childmask = dag[getNode(group, i)];
+			const size_t position = begin + i;
+			result[position] = childmask;
+
+			if (!hasPartialChildren(childmask))
+				continue;
 
-			result.emplace_back(ivec3((parentOffset.x + maskX) * 2,
-						(parentOffset.y + maskY) * 2, (parentOffset.z + maskZ) * 2));
+			const size_t children = positions[childGroup[getNode(group, i)]];
+			if (far[group.firstChild + i]) {
+				result[position] |= CONTIGUOUS_FAR_BIT | ((farPointer - position) << CONTIGUOUS_POINTER_SHIFT);
+				result[farPointer] = static_cast<uint>(children - farPointer); // may be negative
+				++farPointer;
+			} else {
+				assert(children > position && children - position <= MAX_NEAR_POINTER);
+				result[position] |= (children - position) << CONTIGUOUS_POINTER_SHIFT;
+			}
 		}
+		assert(farPointer == positions[groupNr + 1]);
+	}
+
+	if (rootOffsets) {
+		for (uint& root : *rootOffsets)
+			root = positions[rootGroup[root]];
 	}
 	return result;
 }
+
+CompressedShadow::NodeVisibility cs::traverseContiguous(const uint* dag, size_t root, uint numLevels,
+		CompressedShadow::LeafmaskEncoding encoding, const ivec3& path) {
+	const int minLevel = (encoding == CompressedShadow::NO_LEAFMASKS) ? 0 : 3;
+	size_t offset = root;
+
+	for (int level = numLevels - 2; level >= minLevel; --level) {
+		const int lvlBit = 1 << level;
+		const uint childIndex = ((path.x & lvlBit) ? 1 : 0) + ((path.y & lvlBit) ? 2 : 0) + ((path.z & lvlBit) ? 4 : 0);
+		const uint childmask = dag[offset] & 0xFFFF;
+
+		if (isVisible(childmask, childIndex))
+			return CompressedShadow::VISIBLE;
+		else if (isShadowed(childmask, childIndex))
+			return CompressedShadow::SHADOW;
+
+		offset = getContiguousChildren(dag, offset) + getPartialChildIndex(childmask, childIndex);
+	}
+
+	if (encoding == CompressedShadow::NO_LEAFMASKS)
+		return CompressedShadow::PARTIAL;
+
+	// Level 2, so evaluate 1x1x8 and if necessary the 8x8x1 64-bit leafmask
+	const uint childIndex = path.z & 0x7;
+	const uint childmask = dag[offset] & 0xFFFF;
+
+	if (isVisible(childmask, childIndex))
+		return CompressedShadow::VISIBLE;
+	else if (isShadowed(childmask, childIndex))
+		return CompressedShadow::SHADOW;
+
+	const uint childNr = getPartialChildIndex(childmask, childIndex);
+	size_t leafmask = getContiguousChildren(dag, offset) + 2 * childNr;
+	if (encoding == CompressedShadow::LEAFMASK_POINTERS) {
+		const size_t pointer = getContiguousChildren(dag, offset) + childNr;
+		leafmask = pointer + dag[pointer];
+	}
+
+	const uint maskIndex = (path.x & 0x7) + 8 * (path.y & 0x7);
+	const uint half = dag[leafmask + (maskIndex < 32 ? 0 : 1)];
+	return (half & (1u << (maskIndex & 31))) ? CompressedShadow::VISIBLE : CompressedShadow::SHADOW;
+}
+
+/* Accessors of the nodes of the different layouts of a DAG, which are used by countVisible */
+struct AbsoluteLayout {
+	const uint* dag;
+	CompressedShadow::LeafmaskEncoding encoding;
+
+	inline uint getChildmask(size_t node) const {
+		return dag[node];
+	}
+
+	inline size_t getChild(size_t node, uint childmask, uint childIndex, int) const {
+		return dag[node + 1 + getPartialChildIndex(childmask, childIndex)];
+	}
+
+	inline uint64 getLeafmask(size_t node, uint childmask, uint childIndex) const {
+		const uint childNr = getPartialChildIndex(childmask, childIndex);
+		const size_t leafmask = (encoding == CompressedShadow::LEAFMASK_POINTERS) ? dag[node + 1 + childNr]
+				: node + 1 + 2 * childNr;
+		return dag[leafmask] | (static_cast<uint64>(dag[leafmask + 1]) << 32);
+	}
+};
+
+struct PackedLayout {
+	const uint* dag;
+	CompressedShadow::LeafmaskEncoding encoding;
+	uint pointerWidths;
+
+	inline uint getChildmask(size_t node) const {
+		return readPacked(dag, 2 * node, 2);
+	}
+
+	inline size_t getChild(size_t node, uint childmask, uint childIndex, int level) const {
+		const uint width = getPointerWidth(pointerWidths, level);
+		return node + readPacked(dag, 2 * node + 2 + width * getPartialChildIndex(childmask, childIndex), width);
+	}
+
+	inline uint64 getLeafmask(size_t node, uint childmask, uint childIndex) const {
+		const uint childNr = getPartialChildIndex(childmask, childIndex);
+		size_t leafmask = 2 * node + 2 + 8 * childNr;
+		if (encoding == CompressedShadow::LEAFMASK_POINTERS) {
+			const uint width = getPointerWidth(pointerWidths, 2);
+			leafmask = 2 * (node + readPacked(dag, 2 * node + 2 + width * childNr, width));
+		}
+		return readPacked(dag, leafmask, 4) | (static_cast<uint64>(readPacked(dag, leafmask + 4, 4)) << 32);
+	}
+};
+
+struct ContiguousLayout {
+	const uint* dag;
+	CompressedShadow::LeafmaskEncoding encoding;
+
+	inline uint getChildmask(size_t node) const {
+		return dag[node] & 0xFFFF;
+	}
+
+	inline size_t getChild(size_t node, uint childmask, uint childIndex, int) const {
+		return getContiguousChildren(dag, node) + getPartialChildIndex(childmask, childIndex);
+	}
+
+	inline uint64 getLeafmask(size_t node, uint childmask, uint childIndex) const {
+		const uint childNr = getPartialChildIndex(childmask, childIndex);
+		size_t leafmask = getContiguousChildren(dag, node) + 2 * childNr;
+		if (encoding == CompressedShadow::LEAFMASK_POINTERS) {
+			const size_t pointer = getContiguousChildren(dag, node) + childNr;
+			leafmask = pointer + dag[pointer];
+		}
+		return dag[leafmask] | (static_cast<uint64>(dag[leafmask + 1]) << 32);
+	}
+};
+
+/**
+ * Counts the visible voxels of the rectangle [min, max] at z in the node at the given offset, whose children have
+ * a size of 2^level voxels. See cs::countVisibleDAG
+ */
+template<typename Layout>
+uint countVisible(const Layout& layout, size_t node, int level, int minLevel, const ivec2& min, const ivec2& max, int z) {
+	const uint childmask = layout.getChildmask(node);
+
+	if (level < minLevel) {
+		// Level 2, so the rectangle is inside one 8x8x1 leafmask
+		const uint childIndex = z & 0x7;
+		if (isVisible(childmask, childIndex))
+			return (max.x - min.x + 1) * (max.y - min.y + 1);
+		else if (isShadowed(childmask, childIndex))
+			return 0;
+
+		const uint64 leafmask = layout.getLeafmask(node, childmask, childIndex);
+		return POPCOUNT64(leafmask & getLeafmaskRect(min, max));
+	}
+
+	// The node is aligned to its size, which is twice the size of its children
+	const int childSize = 1 << level;
+	const ivec2 origin = min & ~(2 * childSize - 1);
+	const uint zIndex = (z & childSize) ? 4 : 0;
+
+	uint visible = 0;
+	for (int y = 0; y < 2; ++y) {
+		for (int x = 0; x < 2; ++x) {
+			const ivec2 childMin = glm::max(min, origin + ivec2(x, y) * childSize);
+			const ivec2 childMax = glm::min(max, origin + ivec2(x + 1, y + 1) * childSize - 1);
+			if (childMin.x > childMax.x || childMin.y > childMax.y)
+				continue;
+
+			const uint childIndex = x + 2 * y + zIndex;
+			if (isShadowed(childmask, childIndex))
+				continue;
+
+			if (isVisible(childmask, childIndex) || level == 0) {
+				visible += (childMax.x - childMin.x + 1) * (childMax.y - childMin.y + 1);
+			} else {
+				const size_t child = layout.getChild(node, childmask, childIndex, level);
+				visible += countVisible(layout, child, level - 1, minLevel, childMin, childMax, z);
+			}
+		}
+	}
+	return visible;
+}
+
+inline int getMinLevel(CompressedShadow::LeafmaskEncoding encoding) {
+	return (encoding == CompressedShadow::NO_LEAFMASKS) ? 0 : 3;
+}
+
+uint cs::countVisibleDAG(const uint* dag, size_t root, uint numLevels, CompressedShadow::LeafmaskEncoding encoding,
+		const ivec2& min, const ivec2& max, int z) {
+	const AbsoluteLayout layout = { dag, encoding };
+	return countVisible(layout, root, numLevels - 2, getMinLevel(encoding), min, max, z);
+}
+
+uint cs::countVisiblePacked(const uint* dag, size_t root, uint numLevels, uint pointerWidths,
+		CompressedShadow::LeafmaskEncoding encoding, const ivec2& min, const ivec2& max, int z) {
+	const PackedLayout layout = { dag, encoding, pointerWidths };
+	return countVisible(layout, root, numLevels - 2, getMinLevel(encoding), min, max, z);
+}
+
+uint cs::countVisibleContiguous(const uint* dag, size_t root, uint numLevels,
+		CompressedShadow::LeafmaskEncoding encoding, const ivec2& min, const ivec2& max, int z) {
+	const ContiguousLayout layout = { dag, encoding };
+	return countVisible(layout, root, numLevels - 2, getMinLevel(encoding), min, max, z);
+}
@@ -5,6 +5,9 @@
 #include "MinMaxHierarchy.h"
 #include "CompressedShadow.h"
 
+#include <algorithm>
+#include <functional>
+
 namespace cs {
 	constexpr uint NODE_SIZE = 9; // childmask + 8 pointers (unused pointers will be removed with 'compress')
 	constexpr uint LEAF_SIZE = 17; // childmask + 8 64-bit leafmask
@@ -23,10 +26,32 @@ namespace cs {
 	extern std::pair<uint, vector<uint64>> createChildmask1x1x8(const MinMaxHierarchy& minMax, const ivec3& offset);
 
 	/**
-	 * Given the parents childmask and coordinates, this returns the coordinates of all partially visible children.
-	 * Basically this returns the parents offset + minimum point of the childs AABB for all children.
+	 * Same as above, but writes the 0..8 leafmasks to the given array (which must have space for 8 values)
+	 * instead of allocating a vector.
+	 * @return The 16-bit childmask.
 	 */
-	extern vector<ivec3> getChildCoordinates(uint childmask, const ivec3& parentOffset);
+	extern uint createChildmask1x1x8(const MinMaxHierarchy& minMax, const ivec3& offset, uint64* leafmasks);
+
+	/**
+	 * Returns the coordinates of the child with the given index, i.e. the parents offset + minimum point of
+	 * the childs AABB.
+	 * @param childIndex The number of the child, i.e. in the range [0-7]
+	 */
+	inline ivec3 getChildCoordinate(uint childIndex, const ivec3& parentOffset) {
+		/* Decide whether to add 1 in the x, y, z direction.
+		 * This code relies on the order of the children (and has to...) */
+		const int maskX = (0x1 & childIndex) ? 1 : 0; // maskX is 1 <=> i is 1, 3, 5, 7
+		const int maskY = (0x2 & childIndex) ? 1 : 0; // maskY is 1 <=> i is 2, 3, 6, 7
+		const int maskZ = (0x4 & childIndex) ? 1 : 0; // maskZ is 1 <=> i is 4, 5, 6, 7
+
+		return ivec3((parentOffset.x + maskX) * 2, (parentOffset.y + maskY) * 2, (parentOffset.z + maskZ) * 2);
+	}
+
+	/**
+	 * Given the parents childmask and coordinates, this appends the coordinates of all partially visible children
+	 * to coords, in the order of their child index. Appending lets the caller reuse one buffer for a whole level.
+	 */
+	extern void appendChildCoordinates(uint childmask, const ivec3& parentOffset, vector<ivec3>& coords);
 
 	/**
 	 * Compares a min and max z-coordinate and a min/max depth value (probably from the min-max hierarchy)
@@ -74,6 +99,25 @@ namespace cs {
 		return ivec3(ndc.x * resolution, ndc.y * resolution, ndc.z * resolution);
 	}
 
+	/** Inserts two zero bits between every bit of the lower 21 bits of the given value */
+	inline uint64 spreadBits3(uint64 value) {
+		value &= 0x1FFFFF;
+		value = (value | value << 32) & 0x1F00000000FFFF;
+		value = (value | value << 16) & 0x1F0000FF0000FF;
+		value = (value | value << 8)  & 0x100F00F00F00F00F;
+		value = (value | value << 4)  & 0x10C30C30C30C30C3;
+		value = (value | value << 2)  & 0x1249249249249249;
+		return value;
+	}
+
+	/**
+	 * Returns the Morton code (Z-order) of the given coordinates, of which the lower 21 bits are used.
+	 * The bits of x, y and z are interleaved in the order of the children of a node.
+	 */
+	inline uint64 getMortonCode(const ivec3& coords) {
+		return spreadBits3(coords.x) | (spreadBits3(coords.y) << 1) | (spreadBits3(coords.z) << 2);
+	}
+
 	/**
 	 * Returns the number of partially visible children in a 16-bit childmask.
 	 */
@@ -93,6 +137,14 @@ namespace cs {
 		return mask & childmask;
 	}
 
+	/**
+	 * Returns the number of partially visible children before the given child, i.e. the index of its pointer.
+	 * \param childIndex The number of the child, i.e. in the range [0-7]
+	 */
+	inline uint getPartialChildIndex(uint childmask, uint childIndex) {
+		return POPCOUNT(childmask & 0xAAAA & ((1u << (childIndex * 2)) - 1));
+	}
+
 	/**
 	 * Returns true if the given nodemask has at least one partial child
 	 */
@@ -144,42 +196,278 @@ namespace cs {
 		return true;
 	}
 
+	/**
+	 * Calculates a hash value of a node, i.e. of the childmask and all pointers (or leafmasks).
+	 */
+	template<typename It>
+	inline uint64 hashNode(It node, uint nodeSize) {
+		uint64 hash = 0xcbf29ce484222325;
+		for (uint i = 0; i < nodeSize; ++i, ++node) {
+			hash ^= *node;
+			hash *= 0x100000001b3;
+		}
+		// Mix the upper bits into the lower ones, since the table uses the lower bits as index
+		return hash ^ (hash >> 29);
+	}
+
+	/**
+	 * Returns the capacity of an open-addressed hash table for the given number of elements,
+	 * i.e. a power of two which keeps the load factor below 0.5.
+	 */
+	inline size_t getHashTableCapacity(size_t numElements) {
+		size_t capacity = 16;
+		while (capacity < numElements * 2)
+			capacity <<= 1;
+		return capacity;
+	}
+
 	/**
 	 * Merges all identical subtrees in one level and writes them to ItNew.
-	 * @return Maps the old offsets to the nodes to the new offsets, so the parents can be updated.
+	 * Every node is hashed and looked up in an open-addressed hash table, so merging is linear
+	 * in the size of the level.
+	 *
+	 * @return Maps the old node numbers to the new node numbers, so the parents can be updated.
 	 *
-	 * @note The resulting mapping is in the range [0, number of nodes * NODE_SIZE); you may need
-	 * to add the level offset.
+	 * @note The resulting mapping contains node numbers, i.e. you need to multiply with the node size
+	 * and add the level offset to get offsets into the dag.
 	 */
 	template<typename ItOld, typename ItNew>
-	unordered_map<uint, uint> mergeLevel(ItOld oldBegin, ItOld oldEnd, ItNew newBegin, uint nodeSize,
+	vector<uint> mergeLevel(ItOld oldBegin, ItOld oldEnd, ItNew newBegin, uint nodeSize,
 			uint* numNodesLeft) {
-		unordered_map<uint, uint> result;
+		const size_t numNodes = std::distance(oldBegin, oldEnd) / nodeSize;
+		vector<uint> result(numNodes);
+
+		// Stores the new node number + 1 for every occupied slot, i.e. 0 marks an empty slot
+		const size_t capacity = getHashTableCapacity(numNodes);
+		vector<uint> table(capacity, 0);
+
+		uint numNewNodes = 0;
 
-		ItNew newCurrent = newBegin;
-		ItNew newPos; // for finding merging opportunities, i.e. will be repeatedly iterated up to newCurrent
-		uint pos; // similar to newPos but contains an offset in the level for creating the result map
-		
 		ItOld oldCurrent = oldBegin;
-		for (uint i = 0; oldCurrent != oldEnd; oldCurrent += nodeSize, i += nodeSize) {
+		for (size_t nodeNr = 0; nodeNr < numNodes; ++nodeNr, oldCurrent += nodeSize) {
+			size_t slot = hashNode(oldCurrent, nodeSize) & (capacity - 1);
 
-			for (pos = 0, newPos = newBegin; newPos != newCurrent; newPos += nodeSize, pos += nodeSize) {
-				if (isEqualSubtree(oldCurrent, newPos, nodeSize)) {
+			/* Linear probing until either an identical node or an empty slot is found */
+			while (table[slot] != 0) {
+				const uint candidate = table[slot] - 1;
+				if (isEqualSubtree(oldCurrent, newBegin + candidate * nodeSize, nodeSize))
 					break;
-				}
+				slot = (slot + 1) & (capacity - 1);
 			}
-			result[i] = pos;
 
-			if (newPos == newCurrent) {
+			if (table[slot] == 0) {
 				// Insert the node since it can't be merged
-				std::copy(oldCurrent, oldCurrent + nodeSize, newCurrent);
-				newCurrent += nodeSize;
+				std::copy(oldCurrent, oldCurrent + nodeSize, newBegin + numNewNodes * nodeSize);
+				table[slot] = ++numNewNodes;
 			}
+			result[nodeNr] = table[slot] - 1;
 		}
-		*numNodesLeft = std::distance(newBegin, newCurrent) / nodeSize;
+		*numNodesLeft = numNewNodes;
 
 		return result;
 	}
+
+	/**
+	 * Returns the number of threads used for processing a level in parallel.
+	 */
+	extern uint getNumThreads();
+
+	/**
+	 * Splits the range [0, size) into one contiguous chunk per thread and calls func(chunkNr, begin, end)
+	 * for every chunk in the default ThreadPool. Returns after all chunks have been processed.
+	 */
+	extern void parallelFor(size_t size, uint numChunks, std::function<void(uint, size_t, size_t)> func);
+
+	/**
+	 * Parallel version of mergeLevel for large levels.
+	 *
+	 * The nodes are hashed in parallel and distributed into shards by their hash value. Every shard has its
+	 * own hash table and is deduplicated by one thread, which keeps the first occurrence of a node.
+	 * A prefix sum over the number of unique nodes per chunk then assigns the new node numbers, so the
+	 * result is identical to the single-threaded mergeLevel.
+	 *
+	 * @param numNodes Number of nodes starting at oldBegin.
+	 * @param numThreads Number of threads to use, or 0 to use all hardware threads.
+	 * @return Maps the old node numbers to the new node numbers (see mergeLevel).
+	 */
+	extern vector<uint> mergeLevelParallel(const uint* oldBegin, size_t numNodes, uint* newBegin, uint nodeSize,
+			uint* numNodesLeft, uint numThreads = 0);
+
+	/**
+	 * Returns the size of a node in a compressed DAG.
+	 */
+	inline uint getCompressedNodeSize(uint level, uint childmask, CompressedShadow::LeafmaskEncoding encoding) {
+		const uint numChildren = getNumChildren(childmask);
+		return (encoding == CompressedShadow::INLINE_LEAFMASKS && level == 2) ? 1 + 2 * numChildren : 1 + numChildren;
+	}
+
+	/**
+	 * Returns the offsets of all levels of a compressed DAG, which stores its levels one after another,
+	 * starting with numRoots nodes in the highest level (numLevels - 2).
+	 * Level l is stored in [offsets[l + 1], offsets[l]).
+	 */
+	extern vector<size_t> getLevelOffsets(const vector<uint>& dag, uint numLevels, CompressedShadow::LeafmaskEncoding encoding,
+			size_t numRoots = 1);
+
+	/**
+	 * Replaces every (inline) leafmask of level 2 with a pointer into a table of unique leafmasks,
+	 * which is appended to the DAG. Pointers of level 3 are updated accordingly.
+	 *
+	 * @param numRoots Number of nodes in the highest level (see getLevelOffsets).
+	 * @return The number of unique leafmasks.
+	 */
+	extern size_t internLeafmasks(vector<uint>& dag, uint numLevels, size_t numRoots = 1);
+
+	/**
+	 * Returns the width in bytes (1, 2 or 4) of the pointers of the given level of a packed DAG.
+	 * @param pointerWidths The widths of all levels, 2 bits per level (see packDAG).
+	 */
+	inline uint getPointerWidth(uint pointerWidths, uint level) {
+		return 1u << ((pointerWidths >> (2 * level)) & 0x3);
+	}
+
+	/** Returns the widths of the pointers of all levels which are needed by both packed DAGs */
+	inline uint maxPointerWidths(uint pointerWidths1, uint pointerWidths2) {
+		uint result = 0;
+		for (uint level = 0; level < 16; ++level)
+			result |= std::max((pointerWidths1 >> (2 * level)) & 0x3, (pointerWidths2 >> (2 * level)) & 0x3) << (2 * level);
+		return result;
+	}
+
+	/**
+	 * Packs a compressed DAG into a layout which needs a lot less memory:
+	 * - nodes are addressed in 16-bit units and start with a 16-bit childmask
+	 * - the childmask is followed by the pointers to the partially visible children, which are relative to the
+	 *   node (children are always stored after their parents) and have a width of 1, 2 or 4 bytes per level
+	 * - inline leafmasks are stored as 8 bytes, pointers to the leafmask table like child pointers
+	 * - every node is padded to a multiple of 16 bits and the DAG to a multiple of 32 bits
+	 *
+	 * All values are little-endian, i.e. byte b of the DAG is stored in the bits (b % 4) * 8 of word b / 4.
+	 *
+	 * @param pointerWidths The minimum widths of the pointers, 2 bits per level with the base-2 logarithm of the
+	 * width in bytes. Is set to the widths which are used, i.e. the smallest widths (at least the minimum ones)
+	 * which can address all children.
+	 * @param numRoots Number of nodes in the highest level (see getLevelOffsets).
+	 * @param rootOffsets If not null, offsets of roots in the DAG, which are replaced by their offset in 16-bit
+	 * units in the packed DAG.
+	 */
+	extern vector<uint> packDAG(const vector<uint>& dag, uint numLevels, CompressedShadow::LeafmaskEncoding encoding,
+			uint& pointerWidths, size_t numRoots = 1, vector<uint>* rootOffsets = nullptr);
+
+	/** Reads a value with a width of 1, 2 or 4 bytes from a packed DAG. Values wider than 1 byte are 16-bit aligned. */
+	inline uint readPacked(const uint* dag, size_t byteOffset, uint width) {
+		if (width == 1)
+			return (dag[byteOffset >> 2] >> ((byteOffset & 3) * 8)) & 0xFF;
+
+		const uint lower = (dag[byteOffset >> 2] >> ((byteOffset & 2) * 8)) & 0xFFFF;
+		if (width == 2)
+			return lower;
+		return lower | (readPacked(dag, byteOffset + 2, 2) << 16);
+	}
+
+	/**
+	 * Traverses a DAG with absolute pointers (e.g. the combined DAG of a container) like CompressedShadow::traverse
+	 * for the given voxel of the DAG.
+	 * @param root Offset of the root node.
+	 */
+	extern CompressedShadow::NodeVisibility traverseDAG(const uint* dag, size_t root, uint numLevels,
+			CompressedShadow::LeafmaskEncoding encoding, const ivec3& path);
+
+	/**
+	 * Traverses a DAG with absolute pointers like traverseDAG for every given voxel, and stores the NodeVisibility
+	 * of the voxel at the same index in visibilities.
+	 *
+	 * The traversals of a group of voxels are interleaved (asynchronous memory access chaining): every traversal is
+	 * a small state machine, which prefetches the next node it reads and hands over to the next traversal of the
+	 * group instead of waiting for the node. Finished traversals are replaced with the next voxel, so the loads of
+	 * all traversals of the group overlap, which hides the latency of nodes which aren't cached.
+	 *
+	 * @param roots Offset of the root for every voxel, or nullptr if all voxels are traversed from offset 0.
+	 */
+	extern void traverseInterleaved(const uint* dag, uint numLevels, CompressedShadow::LeafmaskEncoding encoding,
+			const ivec3* paths, const uint* roots, size_t count, uint8_t* visibilities);
+
+	/**
+	 * Traverses a packed DAG like CompressedShadow::traverse for the given voxel of the DAG.
+	 * @param root Offset of the root in 16-bit units.
+	 */
+	extern CompressedShadow::NodeVisibility traversePacked(const uint* dag, size_t root, uint numLevels,
+			uint pointerWidths, CompressedShadow::LeafmaskEncoding encoding, const ivec3& path);
+
+	/* Bits of a node in a DAG with contiguous children, see layoutContiguousChildren */
+	constexpr uint CONTIGUOUS_FAR_BIT = 1 << 16;
+	constexpr uint CONTIGUOUS_POINTER_SHIFT = 17;
+
+	/**
+	 * Lays out a compressed DAG so that the children of every node are stored contiguously, i.e. every node
+	 * needs only one word:
+	 * - the lower 16 bits are the childmask
+	 * - the upper 15 bits point to the children relative to the node, child i is stored at the offset of
+	 *   the children + getPartialChildIndex(childmask, i)
+	 * - if bit 16 (far) is set, the upper 15 bits instead point to a far pointer, which stores the offset of the
+	 *   children relative to the far pointer as signed 32-bit value. Far pointers are stored after the children
+	 *   of a node
+	 *
+	 * Nodes with several parents are copied into the children of every parent, but their own children are stored
+	 * only once. The children of the nodes in level 2 are their leafmasks (2 words per partially visible child),
+	 * or with LEAFMASK_POINTERS pointers to the leafmask table relative to the pointer, which is appended to
+	 * the DAG. All pointers are relative, so the DAG can be moved.
+	 *
+	 * @param numRoots Number of nodes in the highest level (see getLevelOffsets).
+	 * @param rootOffsets If not null, offsets of roots in the DAG, which are replaced by their offsets in the
+	 * new layout.
+	 */
+	extern vector<uint> layoutContiguousChildren(const vector<uint>& dag, uint numLevels,
+			CompressedShadow::LeafmaskEncoding encoding, size_t numRoots = 1, vector<uint>* rootOffsets = nullptr);
+
+	/** Returns the offset of the children of the node at the given offset in a DAG with contiguous children */
+	inline size_t getContiguousChildren(const uint* dag, size_t offset) {
+		const uint node = dag[offset];
+		const size_t pointer = offset + (node >> CONTIGUOUS_POINTER_SHIFT);
+		if (node & CONTIGUOUS_FAR_BIT)
+			return pointer + static_cast<int>(dag[pointer]);
+		return pointer;
+	}
+
+	/**
+	 * Traverses a DAG with contiguous children like CompressedShadow::traverse for the given voxel of the DAG.
+	 * @param root Offset of the root node.
+	 */
+	extern CompressedShadow::NodeVisibility traverseContiguous(const uint* dag, size_t root, uint numLevels,
+			CompressedShadow::LeafmaskEncoding encoding, const ivec3& path);
+
+	/**
+	 * Returns the bits of a 64-bit leafmask (i.e. 8x8 voxels) which are in the rectangle [min, max] of the xy-plane.
+	 * Only the lower 3 bits of the coordinates are used, the rectangle must be inside one leafmask.
+	 */
+	inline uint64 getLeafmaskRect(const ivec2& min, const ivec2& max) {
+		const uint64 row = ((1u << ((max.x & 0x7) + 1)) - 1) & ~((1u << (min.x & 0x7)) - 1);
+		uint64 rect = 0;
+		for (int y = min.y & 0x7; y <= (max.y & 0x7); ++y)
+			rect |= row << (8 * y);
+		return rect;
+	}
+
+	/**
+	 * Counts the visible voxels in the rectangle [min, max] of the xy-plane at the given z in the DAG with the
+	 * given root, i.e. the visible samples of a PCF kernel. The coordinates are voxels of the DAG and the rectangle
+	 * must be inside the DAG. Like the traversal, voxels which are still partially visible without leafmasks
+	 * are visible.
+	 *
+	 * All samples share the path to the smallest node containing the rectangle. The rectangle is split among the
+	 * children of every node, and children which are completely visible or in shadow are counted as a whole.
+	 * Parts of the rectangle inside one leafmask are counted with one POPCOUNT.
+	 */
+	extern uint countVisibleDAG(const uint* dag, size_t root, uint numLevels, CompressedShadow::LeafmaskEncoding encoding,
+			const ivec2& min, const ivec2& max, int z);
+
+	/** Same as countVisibleDAG for a packed DAG, see traversePacked */
+	extern uint countVisiblePacked(const uint* dag, size_t root, uint numLevels, uint pointerWidths,
+			CompressedShadow::LeafmaskEncoding encoding, const ivec2& min, const ivec2& max, int z);
+
+	/** Same as countVisibleDAG for a DAG with contiguous children, see traverseContiguous */
+	extern uint countVisibleContiguous(const uint* dag, size_t root, uint numLevels,
+			CompressedShadow::LeafmaskEncoding encoding, const ivec2& min, const ivec2& max, int z);
 };
 
 #endif
@@ -0,0 +1,102 @@
+#include "ContainerFile.h"
+
+#include <ostream>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+const uint ContainerFile::MAGIC;
+const uint ContainerFile::VERSION;
+const size_t ContainerFile::ALIGNMENT;
+
+static_assert(sizeof(ContainerFile::Header) == 64, "The header of a container file must have 64 bytes");
+
+inline uint64 alignOffset(uint64 offset) {
+	return (offset + ContainerFile::ALIGNMENT - 1) / ContainerFile::ALIGNMENT * ContainerFile::ALIGNMENT;
+}
+
+ContainerFile::Header ContainerFile::createHeader(uint length, uint numLevels, uint flags, uint64 dagSize,
+		uint pointerWidths) {
+	Header header = {};
+	header.magic         = MAGIC;
+	header.version       = VERSION;
+	header.length        = length;
+	header.numLevels     = numLevels;
+	header.flags         = flags;
+	header.pointerWidths = pointerWidths;
+	header.gridSize      = static_cast<uint64>(length) * length * length;
+	header.gridOffset    = alignOffset(sizeof(Header));
+	header.dagSize       = dagSize;
+	header.dagOffset     = alignOffset(header.gridOffset + header.gridSize * sizeof(uint));
+	return header;
+}
+
+void ContainerFile::writePadding(ostream& os, uint64 offset) {
+	const uint64 position = os.tellp();
+	assert(position <= offset);
+	const vector<char> zeros(offset - position, 0);
+	os.write(zeros.data(), zeros.size());
+}
+
+ContainerFile::ContainerFile(const string& file)
+	: m_mapping(nullptr), m_mappingSize(0), m_header(nullptr), m_grid(nullptr), m_dag(nullptr)
+{
+	const int fd = open(file.c_str(), O_RDONLY);
+	if (fd < 0)
+		throw FileNotFound("Precomputed shadow file not found");
+
+	struct stat fileStat;
+	if (fstat(fd, &fileStat) != 0 || static_cast<size_t>(fileStat.st_size) < sizeof(Header)) {
+		close(fd);
+		throw LoadFileException("Invalid precomputed shadow file");
+	}
+	m_mappingSize = fileStat.st_size;
+
+	m_mapping = mmap(nullptr, m_mappingSize, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (m_mapping == MAP_FAILED) {
+		m_mapping = nullptr;
+		throw LoadFileException("Could not map precomputed shadow file into memory");
+	}
+
+	try {
+		m_header = static_cast<const Header*>(m_mapping);
+		validateHeader();
+	} catch (...) {
+		munmap(m_mapping, m_mappingSize);
+		throw;
+	}
+
+	const char* bytes = static_cast<const char*>(m_mapping);
+	m_grid = reinterpret_cast<const uint*>(bytes + m_header->gridOffset);
+	m_dag = reinterpret_cast<const uint*>(bytes + m_header->dagOffset);
+}
+
+ContainerFile::~ContainerFile() {
+	if (m_mapping)
+		munmap(m_mapping, m_mappingSize);
+}
+
+void ContainerFile::validateHeader() const {
+	if (m_header->magic != MAGIC)
+		throw LoadFileException("Invalid precomputed shadow file");
+
+	if (m_header->version != VERSION)
+		throw LoadFileException("Unsupported version of the precomputed shadow file");
+
+	const uint64 length = m_header->length;
+	if (length == 0 || m_header->gridSize != length * length * length || m_header->numLevels <= 3)
+		throw LoadFileException("Invalid precomputed shadow file");
+
+	// The sections must be aligned, so they can be used from the mapping as they are
+	if (m_header->gridOffset % ALIGNMENT != 0 || m_header->dagOffset % ALIGNMENT != 0
+			|| m_header->gridOffset < sizeof(Header) || m_header->dagSize > m_mappingSize / sizeof(uint)
+			|| m_header->gridOffset + m_header->gridSize * sizeof(uint) > m_header->dagOffset
+			|| m_header->dagOffset + m_header->dagSize * sizeof(uint) > m_mappingSize)
+		throw LoadFileException("Precomputed shadow file is truncated");
+}
@@ -0,0 +1,120 @@
+#ifndef CONTAINER_FILE_H
+#define CONTAINER_FILE_H
+
+#include "cpvs.h"
+
+#include <iosfwd>
+
+/**
+ * A precomputed shadow written by CompressedShadowContainer::writeToFile, which is memory-mapped instead of
+ * being loaded. The grid and the DAG are used directly from the mapped pages, i.e. nothing is parsed or copied.
+ *
+ * Layout of the file (native byte order, i.e. little-endian on all supported platforms):
+ * - a header of 64 bytes (see Header)
+ * - the top-level grid of length^3 32-bit cells, starting at a multiple of ALIGNMENT
+ * - the combined DAG of all cells as 32-bit words with absolute pointers (or packed with relative pointers),
+ *   starting at a multiple of ALIGNMENT
+ *
+ * The sections are aligned to pages, so both can be passed to the GPU or traversed on the CPU as they are.
+ */
+class ContainerFile {
+public:
+	static const uint MAGIC = 0x43565043; // "CPVC"
+	static const uint VERSION = 3;
+	static const size_t ALIGNMENT = 4096;
+
+	enum Flags : uint {
+		LEAFMASK_DICTIONARY = 0x1,
+		PACKED_POINTERS     = 0x2, // the DAG is packed with relative pointers (see cs::packDAG)
+		CONTIGUOUS_CHILDREN = 0x4  // the children of every node are stored contiguously (see cs::layoutContiguousChildren)
+	};
+
+	struct Header {
+		uint magic;
+		uint version;
+		uint length;     // number of grid cells in one dimension
+		uint numLevels;  // number of levels of every DAG
+		uint flags;
+		uint pointerWidths; // widths of the pointers of a packed DAG, see cs::packDAG
+		uint64 gridOffset; // in bytes from the beginning of the file
+		uint64 gridSize;   // in words
+		uint64 dagOffset;  // in bytes from the beginning of the file
+		uint64 dagSize;    // in words
+		uint64 padding;
+	};
+
+	/**
+	 * Creates the header of a file with the given contents, i.e. calculates the offsets of the grid and the DAG.
+	 */
+	static Header createHeader(uint length, uint numLevels, uint flags, uint64 dagSize, uint pointerWidths = 0);
+
+	/** Writes zeros until the stream is at the given offset from the beginning of the file. */
+	static void writePadding(std::ostream& os, uint64 offset);
+
+	/**
+	 * Maps the given file into memory.
+	 * @throws FileNotFound if the file can't be opened.
+	 * @throws LoadFileException if the file is no valid container file of the current version.
+	 */
+	explicit ContainerFile(const string& file);
+	~ContainerFile();
+
+	ContainerFile(const ContainerFile&) = delete;
+	ContainerFile& operator=(const ContainerFile&) = delete;
+
+	inline uint getLength() const {
+		return m_header->length;
+	}
+
+	inline uint getNumLevels() const {
+		return m_header->numLevels;
+	}
+
+	inline bool hasLeafmaskDictionary() const {
+		return m_header->flags & LEAFMASK_DICTIONARY;
+	}
+
+	inline bool hasPackedPointers() const {
+		return m_header->flags & PACKED_POINTERS;
+	}
+
+	inline bool hasContiguousChildren() const {
+		return m_header->flags & CONTIGUOUS_CHILDREN;
+	}
+
+	inline uint getPointerWidths() const {
+		return m_header->pointerWidths;
+	}
+
+	/** Returns the top-level grid with getGridSize() cells, see CompressedShadowContainer::getGridCell */
+	inline const uint* getGrid() const {
+		return m_grid;
+	}
+
+	inline size_t getGridSize() const {
+		return m_header->gridSize;
+	}
+
+	/** Returns the combined DAG with getDAGSize() words */
+	inline const uint* getDAG() const {
+		return m_dag;
+	}
+
+	inline size_t getDAGSize() const {
+		return m_header->dagSize;
+	}
+
+private:
+	void validateHeader() const;
+
+private:
+	void* m_mapping;
+	size_t m_mappingSize;
+
+	/* Point into the mapping */
+	const Header* m_header;
+	const uint* m_grid;
+	const uint* m_dag;
+};
+
+#endif
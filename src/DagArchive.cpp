@@ -0,0 +1,526 @@
+#include "DagArchive.h"
+#include "CompressedShadowUtil.h"
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstring>
+#include <limits>
+
+using namespace std;
+using namespace cs;
+
+/* Probabilities of the rANS coder are quantized to 1 / 2^SCALE_BITS */
+constexpr uint SCALE_BITS = 12;
+constexpr uint SCALE = 1 << SCALE_BITS;
+
+/* Lower bound of the normalized state, i.e. the state is in [RANS_L, 2^31) and renormalized bytewise */
+constexpr uint RANS_L = 1u << 23;
+
+/* Number of symbols of a stream which are coded independently of the rest */
+constexpr size_t BLOCK_SIZE = 1 << 16;
+
+constexpr uint NO_NODE = std::numeric_limits<uint>::max();
+
+enum Stream {
+	CHILDMASKS_LOW,
+	CHILDMASKS_HIGH,
+	POINTERS,
+	LEAFMASKS,
+	LEAFMASK_POINTERS,
+	NUM_STREAMS
+};
+
+inline void invalidArchive() {
+	throw LoadFileException("Invalid DAG archive");
+}
+
+/* Appends values in native byte order */
+template<typename T>
+inline void put(vector<uint8_t>& out, T value) {
+	const size_t size = out.size();
+	out.resize(size + sizeof(T));
+	memcpy(out.data() + size, &value, sizeof(T));
+}
+
+/* Reads values from an archive and throws if the archive ends too early */
+struct ArchiveReader {
+	const uint8_t* current;
+	const uint8_t* end;
+
+	template<typename T>
+	inline T get() {
+		T value;
+		memcpy(&value, skip(sizeof(T)), sizeof(T));
+		return value;
+	}
+
+	inline const uint8_t* skip(size_t size) {
+		if (static_cast<size_t>(end - current) < size)
+			invalidArchive();
+		const uint8_t* begin = current;
+		current += size;
+		return begin;
+	}
+};
+
+inline void putVarint(vector<uint8_t>& out, uint64 value) {
+	while (value >= 0x80) {
+		out.push_back(static_cast<uint8_t>(value) | 0x80);
+		value >>= 7;
+	}
+	out.push_back(static_cast<uint8_t>(value));
+}
+
+inline uint64 getVarint(const vector<uint8_t>& in, size_t& pos) {
+	uint64 value = 0;
+	for (uint shift = 0; shift < 64; shift += 7) {
+		if (pos >= in.size())
+			invalidArchive();
+		const uint8_t byte = in[pos++];
+		value |= static_cast<uint64>(byte & 0x7F) << shift;
+		if (!(byte & 0x80))
+			return value;
+	}
+	invalidArchive();
+	return 0;
+}
+
+/*
+ * Codes the node numbers of the children of one level relative to the previous one. Since nodes are mostly stored
+ * in the order they are first referenced, the next node which hasn't been referenced yet is coded as 0.
+ */
+struct PointerCoder {
+	uint64 previous = 0;
+	uint64 next = 0;
+
+	inline void encode(uint64 number, vector<uint8_t>& out) {
+		const int64_t delta = static_cast<int64_t>(number - previous);
+		putVarint(out, number == next ? 0 : 1 + ((static_cast<uint64>(delta) << 1) ^ static_cast<uint64>(delta >> 63)));
+		update(number);
+	}
+
+	inline uint64 decode(const vector<uint8_t>& in, size_t& pos) {
+		const uint64 code = getVarint(in, pos);
+		uint64 number = next;
+		if (code != 0) {
+			const uint64 zigzag = code - 1;
+			number = previous + ((zigzag >> 1) ^ (~(zigzag & 1) + 1));
+		}
+		update(number);
+		return number;
+	}
+
+	inline void update(uint64 number) {
+		previous = number;
+		next = std::max(next, number + 1);
+	}
+};
+
+/* Frequencies of the symbols of a stream, which sum up to SCALE */
+struct SymbolStats {
+	array<uint, 256> freq;
+	array<uint, 256> start; // cumulative frequencies
+
+	void calcStarts() {
+		uint sum = 0;
+		for (uint s = 0; s < 256; ++s) {
+			start[s] = sum;
+			sum += freq[s];
+		}
+	}
+};
+
+SymbolStats createStats(const vector<uint8_t>& symbols) {
+	array<uint64, 256> counts = {};
+	for (const uint8_t s : symbols)
+		counts[s]++;
+
+	SymbolStats stats;
+	stats.freq.fill(0);
+
+	uint sum = 0;
+	for (uint s = 0; s < 256; ++s) {
+		if (counts[s] > 0) {
+			stats.freq[s] = std::max<uint64>(1, counts[s] * SCALE / symbols.size());
+			sum += stats.freq[s];
+		}
+	}
+
+	/* Rounding changed the sum by at most the number of symbols, which is corrected with the most frequent one */
+	if (!symbols.empty()) {
+		while (sum != SCALE) {
+			uint& maxFreq = *std::max_element(stats.freq.begin(), stats.freq.end());
+			if (sum < SCALE) {
+				maxFreq += SCALE - sum;
+				sum = SCALE;
+			} else {
+				maxFreq--;
+				sum--;
+			}
+		}
+	}
+	stats.calcStarts();
+	return stats;
+}
+
+/* Encodes the symbols backwards, so the decoder reads the bytes forwards */
+void encodeBlock(const uint8_t* symbols, size_t numSymbols, const SymbolStats& stats, vector<uint8_t>& out) {
+	// Every symbol needs at most SCALE_BITS bits, plus the final state
+	vector<uint8_t> buffer(numSymbols * 2 + 8);
+	uint8_t* ptr = buffer.data() + buffer.size();
+
+	uint x = RANS_L;
+	for (size_t i = numSymbols; i-- > 0; ) {
+		const uint freq = stats.freq[symbols[i]];
+		const uint xMax = ((RANS_L >> SCALE_BITS) << 8) * freq;
+		while (x >= xMax) {
+			*--ptr = static_cast<uint8_t>(x & 0xFF);
+			x >>= 8;
+		}
+		x = ((x / freq) << SCALE_BITS) + (x % freq) + stats.start[symbols[i]];
+	}
+
+	ptr -= sizeof(x);
+	memcpy(ptr, &x, sizeof(x));
+	out.insert(out.end(), ptr, buffer.data() + buffer.size());
+}
+
+/* Returns false if the block is invalid */
+bool decodeBlock(const uint8_t* data, size_t size, const SymbolStats& stats, const array<uint8_t, SCALE>& slotToSymbol,
+		uint8_t* symbols, size_t numSymbols) {
+	const uint8_t* end = data + size;
+	if (size < sizeof(uint))
+		return false;
+
+	uint x;
+	memcpy(&x, data, sizeof(x));
+	data += sizeof(x);
+
+	for (size_t i = 0; i < numSymbols; ++i) {
+		const uint slot = x & (SCALE - 1);
+		const uint8_t s = slotToSymbol[slot];
+		symbols[i] = s;
+
+		x = stats.freq[s] * (x >> SCALE_BITS) + slot - stats.start[s];
+		while (x < RANS_L) {
+			if (data == end)
+				return false;
+			x = (x << 8) | *data++;
+		}
+	}
+	return x == RANS_L && data == end;
+}
+
+void writeStream(const vector<uint8_t>& symbols, vector<uint8_t>& out) {
+	const SymbolStats stats = createStats(symbols);
+
+	put<uint64>(out, symbols.size());
+
+	const uint numUsed = std::count_if(stats.freq.begin(), stats.freq.end(), [](uint f) { return f > 0; });
+	put<uint16_t>(out, numUsed);
+	for (uint s = 0; s < 256; ++s) {
+		if (stats.freq[s] > 0) {
+			put<uint8_t>(out, s);
+			put<uint16_t>(out, stats.freq[s]);
+		}
+	}
+
+	/* The directory with the size of every block is followed by the blocks */
+	const uint numBlocks = (symbols.size() + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	const size_t directory = out.size();
+	out.resize(out.size() + numBlocks * sizeof(uint));
+
+	for (uint blockNr = 0; blockNr < numBlocks; ++blockNr) {
+		const size_t begin = blockNr * BLOCK_SIZE;
+		const size_t numSymbols = std::min(BLOCK_SIZE, symbols.size() - begin);
+
+		const size_t blockBegin = out.size();
+		encodeBlock(symbols.data() + begin, numSymbols, stats, out);
+
+		const uint blockSize = out.size() - blockBegin;
+		memcpy(out.data() + directory + blockNr * sizeof(uint), &blockSize, sizeof(uint));
+	}
+}
+
+inline void putLeafmask(vector<uint8_t>& out, uint low, uint high) {
+	const uint64 leafmask = low | (static_cast<uint64>(high) << 32);
+	for (uint byte = 0; byte < 8; ++byte)
+		out.push_back(static_cast<uint8_t>(leafmask >> (byte * 8)));
+}
+
+vector<uint8_t> DagArchive::compress(const vector<uint>& dag, uint numLevels,
+		CompressedShadow::LeafmaskEncoding encoding, size_t numRoots) {
+	const uint rootLevel = numLevels - 2;
+	const uint minLevel = (encoding == CompressedShadow::NO_LEAFMASKS) ? 0 : 2;
+	const auto offsets = getLevelOffsets(dag, numLevels, encoding, numRoots);
+
+	/* Number every node in its level */
+	vector<uint> nodeNumbers(dag.size(), NO_NODE);
+	vector<uint64> numNodes(numLevels, 0);
+
+	for (uint level = rootLevel; ; --level) {
+		for (size_t offset = offsets[level + 1]; offset < offsets[level];
+				offset += getCompressedNodeSize(level, dag[offset], encoding))
+			nodeNumbers[offset] = numNodes[level]++;
+
+		if (level == minLevel)
+			break;
+	}
+
+	const size_t tableBegin = offsets[minLevel];
+	assert(encoding == CompressedShadow::LEAFMASK_POINTERS || tableBegin == dag.size());
+	assert((dag.size() - tableBegin) % 2 == 0);
+	const size_t tableSize = (dag.size() - tableBegin) / 2;
+
+	/* Split the DAG into the streams */
+	array<vector<uint8_t>, NUM_STREAMS> streams;
+
+	for (uint level = rootLevel; ; --level) {
+		PointerCoder pointers, leafmaskPointers;
+
+		for (size_t offset = offsets[level + 1]; offset < offsets[level]; ) {
+			const uint childmask = dag[offset];
+			const uint numChildren = getNumChildren(childmask);
+			assert(childmask <= 0xFFFF);
+
+			streams[CHILDMASKS_LOW].push_back(childmask & 0xFF);
+			streams[CHILDMASKS_HIGH].push_back(childmask >> 8);
+
+			for (uint childNr = 0; childNr < numChildren; ++childNr) {
+				if (level == 2 && encoding == CompressedShadow::INLINE_LEAFMASKS) {
+					putLeafmask(streams[LEAFMASKS], dag[offset + 1 + 2 * childNr], dag[offset + 2 + 2 * childNr]);
+				} else if (level == 2 && encoding == CompressedShadow::LEAFMASK_POINTERS) {
+					const uint pointer = dag[offset + 1 + childNr];
+					assert(pointer >= tableBegin && (pointer - tableBegin) % 2 == 0);
+					leafmaskPointers.encode((pointer - tableBegin) / 2, streams[LEAFMASK_POINTERS]);
+				} else {
+					const uint pointer = dag[offset + 1 + childNr];
+					assert(level > minLevel && pointer >= offsets[level] && pointer < offsets[level - 1]);
+					assert(nodeNumbers[pointer] != NO_NODE);
+					pointers.encode(nodeNumbers[pointer], streams[POINTERS]);
+				}
+			}
+			offset += getCompressedNodeSize(level, childmask, encoding);
+		}
+
+		if (level == minLevel)
+			break;
+	}
+
+	for (size_t i = 0; i < tableSize; ++i)
+		putLeafmask(streams[LEAFMASKS], dag[tableBegin + 2 * i], dag[tableBegin + 2 * i + 1]);
+
+	/* Header */
+	vector<uint8_t> archive;
+	put<uint>(archive, numLevels);
+	put<uint>(archive, encoding);
+	put<uint64>(archive, numRoots);
+	put<uint64>(archive, dag.size());
+	put<uint64>(archive, tableSize);
+	for (uint level = rootLevel; ; --level) {
+		put<uint64>(archive, numNodes[level]);
+		if (level == minLevel)
+			break;
+	}
+
+	for (const auto& stream : streams)
+		writeStream(stream, archive);
+	return archive;
+}
+
+size_t DagArchive::getDAGSize(const uint8_t* archive, size_t size) {
+	ArchiveReader reader = {archive, archive + size};
+	reader.skip(2 * sizeof(uint) + sizeof(uint64));
+	return reader.get<uint64>();
+}
+
+/* A block of a stream in an archive */
+struct Block {
+	uint stream;
+	const uint8_t* data;
+	size_t size;
+	size_t firstSymbol;
+	size_t numSymbols;
+};
+
+void DagArchive::decompress(const uint8_t* archive, size_t size, uint* dag, size_t base) {
+	ArchiveReader reader = {archive, archive + size};
+
+	const uint numLevels = reader.get<uint>();
+	const uint encodingValue = reader.get<uint>();
+	const uint64 numRoots = reader.get<uint64>();
+	const uint64 dagSize = reader.get<uint64>();
+	const uint64 tableSize = reader.get<uint64>();
+
+	if (numLevels <= 3 || numLevels > 32 || encodingValue > CompressedShadow::LEAFMASK_POINTERS)
+		invalidArchive();
+	if (base + dagSize > std::numeric_limits<uint>::max() || tableSize > dagSize)
+		invalidArchive();
+
+	const auto encoding = static_cast<CompressedShadow::LeafmaskEncoding>(encodingValue);
+	const uint rootLevel = numLevels - 2;
+	const uint minLevel = (encoding == CompressedShadow::NO_LEAFMASKS) ? 0 : 2;
+
+	vector<uint64> numNodes(numLevels, 0);
+	for (uint level = rootLevel; ; --level) {
+		numNodes[level] = reader.get<uint64>();
+		if (numNodes[level] > dagSize)
+			invalidArchive();
+		if (level == minLevel)
+			break;
+	}
+	if (numNodes[rootLevel] != numRoots)
+		invalidArchive();
+
+	/* Read the frequencies and the directories of all streams */
+	array<SymbolStats, NUM_STREAMS> stats;
+	array<array<uint8_t, SCALE>, NUM_STREAMS> slotToSymbol;
+	array<vector<uint8_t>, NUM_STREAMS> streams;
+	vector<Block> blocks;
+
+	for (uint streamNr = 0; streamNr < NUM_STREAMS; ++streamNr) {
+		// A symbol with a probability of 1 needs no bits, so the number of symbols is only limited by the DAG
+		const uint64 numSymbols = reader.get<uint64>();
+		if (numSymbols > 10 * dagSize + 16)
+			invalidArchive();
+
+		auto& freq = stats[streamNr].freq;
+		freq.fill(0);
+		const uint numUsed = reader.get<uint16_t>();
+		for (uint i = 0; i < numUsed; ++i) {
+			const uint8_t s = reader.get<uint8_t>();
+			freq[s] = reader.get<uint16_t>();
+		}
+		stats[streamNr].calcStarts();
+
+		if (numUsed > 0 && stats[streamNr].start[255] + freq[255] != SCALE)
+			invalidArchive();
+
+		for (uint s = 0; s < 256; ++s) {
+			for (uint slot = stats[streamNr].start[s]; slot < stats[streamNr].start[s] + freq[s]; ++slot)
+				slotToSymbol[streamNr][slot] = s;
+		}
+
+		const uint numBlocks = (numSymbols + BLOCK_SIZE - 1) / BLOCK_SIZE;
+		const uint8_t* directory = reader.skip(numBlocks * sizeof(uint));
+
+		for (uint blockNr = 0; blockNr < numBlocks; ++blockNr) {
+			uint blockSize;
+			memcpy(&blockSize, directory + blockNr * sizeof(uint), sizeof(uint));
+
+			Block block;
+			block.stream = streamNr;
+			block.size = blockSize;
+			block.data = reader.skip(blockSize);
+			block.firstSymbol = blockNr * BLOCK_SIZE;
+			block.numSymbols = std::min<size_t>(BLOCK_SIZE, numSymbols - block.firstSymbol);
+			blocks.push_back(block);
+		}
+		streams[streamNr].resize(numSymbols);
+	}
+
+	/* Entropy decoding is the expensive part, so all blocks of all streams are decoded in parallel */
+	std::atomic<bool> valid(true);
+	auto decodeBlocks = [&](uint, size_t begin, size_t end) {
+		for (size_t i = begin; i < end; ++i) {
+			const Block& block = blocks[i];
+			if (!decodeBlock(block.data, block.size, stats[block.stream], slotToSymbol[block.stream],
+					streams[block.stream].data() + block.firstSymbol, block.numSymbols))
+				valid = false;
+		}
+	};
+	if (!blocks.empty())
+		ThreadPool::getDefault().parallelFor(blocks.size(), blocks.size(), decodeBlocks);
+	if (!valid)
+		invalidArchive();
+
+	/* Restore the childmasks and the offsets of all nodes */
+	vector<vector<uint>> nodeOffsets(numLevels);
+	size_t numChildmasks = 0;
+	size_t offset = 0;
+
+	for (uint level = rootLevel; ; --level) {
+		nodeOffsets[level].reserve(numNodes[level]);
+
+		for (uint64 nodeNr = 0; nodeNr < numNodes[level]; ++nodeNr, ++numChildmasks) {
+			if (numChildmasks >= streams[CHILDMASKS_LOW].size() || numChildmasks >= streams[CHILDMASKS_HIGH].size())
+				invalidArchive();
+
+			const uint childmask = streams[CHILDMASKS_LOW][numChildmasks]
+				| (static_cast<uint>(streams[CHILDMASKS_HIGH][numChildmasks]) << 8);
+			const uint nodeSize = getCompressedNodeSize(level, childmask, encoding);
+
+			if (offset + nodeSize > dagSize || (level == minLevel && minLevel == 0 && nodeSize > 1))
+				invalidArchive();
+
+			nodeOffsets[level].push_back(offset);
+			dag[offset] = childmask;
+			offset += nodeSize;
+		}
+
+		if (level == minLevel)
+			break;
+	}
+
+	const size_t tableBegin = offset;
+	if (tableBegin + 2 * tableSize != dagSize)
+		invalidArchive();
+
+	/* Restore the pointers and leafmasks */
+	size_t pointerPos = 0, leafmaskPos = 0, leafmaskPointerPos = 0;
+	const auto& leafmasks = streams[LEAFMASKS];
+
+	auto getLeafmask = [&](uint* words) {
+		if (leafmaskPos + 8 > leafmasks.size())
+			invalidArchive();
+
+		uint64 leafmask = 0;
+		for (uint byte = 0; byte < 8; ++byte)
+			leafmask |= static_cast<uint64>(leafmasks[leafmaskPos++]) << (byte * 8);
+		words[0] = static_cast<uint>(leafmask);
+		words[1] = static_cast<uint>(leafmask >> 32);
+	};
+
+	// Level 0 has no children, level 2 has leafmasks instead of children if they are used
+	const uint lastLevel = (minLevel == 0) ? 1 : 2;
+	for (uint level = rootLevel; level >= lastLevel; --level) {
+		PointerCoder pointers, leafmaskPointers;
+
+		for (const uint nodeOffset : nodeOffsets[level]) {
+			uint* node = dag + nodeOffset;
+			const uint numChildren = getNumChildren(node[0]);
+
+			for (uint childNr = 0; childNr < numChildren; ++childNr) {
+				if (level == 2 && encoding == CompressedShadow::INLINE_LEAFMASKS) {
+					getLeafmask(node + 1 + 2 * childNr);
+				} else if (level == 2 && encoding == CompressedShadow::LEAFMASK_POINTERS) {
+					const uint64 index = leafmaskPointers.decode(streams[LEAFMASK_POINTERS], leafmaskPointerPos);
+					if (index >= tableSize)
+						invalidArchive();
+					node[1 + childNr] = base + tableBegin + 2 * index;
+				} else {
+					const uint64 number = pointers.decode(streams[POINTERS], pointerPos);
+					if (number >= nodeOffsets[level - 1].size())
+						invalidArchive();
+					node[1 + childNr] = base + nodeOffsets[level - 1][number];
+				}
+			}
+		}
+	}
+
+	for (uint64 i = 0; i < tableSize; ++i)
+		getLeafmask(dag + tableBegin + 2 * i);
+
+	if (pointerPos != streams[POINTERS].size() || leafmaskPos != leafmasks.size()
+			|| leafmaskPointerPos != streams[LEAFMASK_POINTERS].size() || numChildmasks != streams[CHILDMASKS_LOW].size()
+			|| numChildmasks != streams[CHILDMASKS_HIGH].size())
+		invalidArchive();
+}
+
+vector<uint> DagArchive::decompress(const vector<uint8_t>& archive) {
+	vector<uint> dag(getDAGSize(archive.data(), archive.size()));
+	decompress(archive.data(), archive.size(), dag.data());
+	return dag;
+}
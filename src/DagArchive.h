@@ -0,0 +1,48 @@
+#ifndef DAG_ARCHIVE_H
+#define DAG_ARCHIVE_H
+
+#include "cpvs.h"
+#include "CompressedShadow.h"
+
+/**
+ * Entropy-coded archival encoding of a DAG, which is much smaller than the DAG itself and restores it exactly.
+ *
+ * The DAG is split into streams of bytes with similar statistics:
+ * - the low and high bytes of the 16-bit childmasks
+ * - the child pointers, as varints of the difference to the previous pointer of the level. Pointers are
+ *   stored as node numbers in the child level, and the (most common) pointer to the first node which
+ *   hasn't been referenced yet is stored as 0
+ * - the bytes of the 64-bit leafmasks (inline or of the leafmask table)
+ * - the pointers into the leafmask table, like the child pointers
+ *
+ * Every stream is coded with a static order-0 rANS coder in independent blocks, so the blocks of all streams
+ * can be decoded in parallel.
+ *
+ * @note Only supports DAGs whose levels are stored one after another, i.e. those of CompressedShadow and
+ * the shared DAG of a CompressedShadowContainer (see cs::getLevelOffsets).
+ */
+class DagArchive {
+public:
+	/**
+	 * Compresses the DAG with the given number of levels and leafmask encoding.
+	 * @param numRoots Number of nodes in the highest level.
+	 */
+	static vector<uint8_t> compress(const vector<uint>& dag, uint numLevels,
+			CompressedShadow::LeafmaskEncoding encoding, size_t numRoots = 1);
+
+	/** Returns the size in words of the DAG compressed in the given archive. */
+	static size_t getDAGSize(const uint8_t* archive, size_t size);
+
+	/**
+	 * Restores the DAG compressed in the given archive. All pointers are relocated by base, like
+	 * CompressedShadow::appendDAG, and the DAG is written to dag, which must have space for getDAGSize words.
+	 * The blocks of the streams are decoded in parallel in the default ThreadPool.
+	 *
+	 * @throws LoadFileException if the archive is invalid.
+	 */
+	static void decompress(const uint8_t* archive, size_t size, uint* dag, size_t base = 0);
+
+	static vector<uint> decompress(const vector<uint8_t>& archive);
+};
+
+#endif
@@ -0,0 +1,55 @@
+#include "DagBuilder.h"
+#include "CompressedShadowUtil.h"
+#include "MinMaxHierarchy.h"
+#include "NodeStore.h"
+
+using namespace std;
+
+DagBuilder::DagBuilder(const MinMaxHierarchy& minMax, NodeStore& store)
+	: m_minMax(minMax), m_store(store), m_numLevels(store.getNumLevels()), m_leafmasks(store.hasLeafmasks()),
+	  m_numBuiltNodes(m_numLevels - 1, 0)
+{
+}
+
+uint DagBuilder::build(const ivec3& rootOffset) {
+	return buildNode(m_numLevels - 2, rootOffset);
+}
+
+uint DagBuilder::buildNode(uint level, const ivec3& offset) {
+	uint node[cs::NODE_SIZE];
+	node[0] = cs::createChildmask(m_minMax, level, offset);
+
+	uint nodeSize = 1;
+	for (uint childNr = 0; childNr < 8; ++childNr) {
+		if (!cs::isPartial(node[0], childNr))
+			continue;
+
+		// Level 0 is always either visible or in shadow
+		assert(level > 0);
+
+		const ivec3 childOffset = cs::getChildCoordinate(childNr, offset);
+		if (isLeafLevel(level - 1))
+			node[nodeSize++] = buildLeafNode(childOffset);
+		else
+			node[nodeSize++] = buildNode(level - 1, childOffset);
+	}
+
+	++m_numBuiltNodes[level];
+	return m_store.insert(level, node, nodeSize);
+}
+
+uint DagBuilder::buildLeafNode(const ivec3& offset) {
+	uint64 leafmasks[8];
+
+	uint node[cs::LEAF_SIZE];
+	node[0] = cs::createChildmask1x1x8(m_minMax, offset, leafmasks);
+
+	const uint numChildren = cs::getNumChildren(node[0]);
+	for (uint childNr = 0; childNr < numChildren; ++childNr) {
+		node[childNr * 2 + 1] = leafmasks[childNr];
+		node[childNr * 2 + 2] = leafmasks[childNr] >> 32;
+	}
+
+	++m_numBuiltNodes[2];
+	return m_store.insert(2, node, 1 + 2 * numChildren);
+}
@@ -0,0 +1,67 @@
+#ifndef DAG_BUILDER_H
+#define DAG_BUILDER_H
+
+#include "cpvs.h"
+
+class MinMaxHierarchy;
+
+class NodeStore;
+
+/**
+ * Builds the compressed DAG of a CompressedShadow directly from a min-max hierarchy,
+ * without materialising the uncompressed SVO.
+ *
+ * The hierarchy is walked depth-first and every node is hash-consed in a NodeStore as soon as all of its
+ * children are finished, i.e. identical subtrees are merged immediately. Only unique nodes are stored,
+ * so the peak memory is close to the size of the final DAG.
+ *
+ * Several builders (e.g. for different tiles) may insert into the same store concurrently, in which case
+ * identical subtrees are shared between all of them.
+ *
+ * The layout of a single root is identical to constructing the SVO, merging common subtrees and compressing it.
+ */
+class DagBuilder {
+public:
+	DagBuilder(const MinMaxHierarchy& minMax, NodeStore& store);
+
+	~DagBuilder() = default;
+
+	DagBuilder(const DagBuilder&) = delete;
+	DagBuilder& operator=(const DagBuilder&) = delete;
+
+	/**
+	 * Builds the DAG for the root node at the given offset and returns the handle of the root in the store.
+	 * @see NodeStore::layout
+	 */
+	uint build(const ivec3& rootOffset);
+
+	/**
+	 * Returns the number of nodes which have been built in every level, i.e. the number of nodes of the SVO
+	 * before common subtrees are merged.
+	 */
+	inline const vector<size_t>& getNumBuiltNodes() const {
+		return m_numBuiltNodes;
+	}
+
+private:
+	/** Recursively builds the node at the given level and offset and returns its handle. */
+	uint buildNode(uint level, const ivec3& offset);
+
+	/** Builds a 1x1x8 node with leafmasks (at level 2) and returns its handle. */
+	uint buildLeafNode(const ivec3& offset);
+
+	inline bool isLeafLevel(uint level) const {
+		return m_leafmasks && level == 2;
+	}
+
+private:
+	const MinMaxHierarchy& m_minMax;
+	NodeStore& m_store;
+
+	const uint m_numLevels;
+	const bool m_leafmasks;
+
+	vector<size_t> m_numBuiltNodes;
+};
+
+#endif
@@ -1,16 +1,17 @@
 #include "DeferredRenderer.h"
-#include "Scene.h"
-#include "MinMaxHierarchy.h"
-#include "CompressedShadowContainer.h"
+#include "BuildStats.h"
+#include "GLScene.h"
+#include "DepthFile.h"
+#include "DepthRasterizer.h"
 
-#include <thread>
 #include <glm/ext.hpp>
+#include <chrono>
 #include <iostream>
 using namespace std;
 
 DeferredRenderer::DeferredRenderer(const DirectionalLight& light, GLuint width, GLuint height) 
 	: m_fullscreenQuad(vec2(-1.0), vec2(1.0)), m_gBuffer(width, height, true), m_dirLight(light),
-	m_useReferenceShadow(false)
+	m_useReferenceShadow(false), m_precomputedSize(0)
 {
 	loadShaders();
 	initFbos();
@@ -116,8 +117,7 @@ void DeferredRenderer::renderSceneForSM(const Scene* scene, const mat4& P, const
 	glUniformMatrix4fv(m_create_sm["P"], 1, GL_FALSE, glm::value_ptr(P));
 
 	for (const auto& mesh : scene->meshes) {
-		mesh.bind();
-		mesh.draw();
+		GLScene::draw(mesh);
 	}
 }
 
@@ -147,91 +147,113 @@ unique_ptr<ShadowMap> DeferredRenderer::renderShadowMap(const Scene* scene, uint
 	return make_unique<ShadowMap>(shadowFbo.getDepthTexture());
 }
 
-void createShadowTiles(CompressedShadowContainer* shadows, const MinMaxHierarchy& minMax,
-		uint x, uint y, uint numSlices) {
+DepthSource DeferredRenderer::createDepthSource(const Scene* scene, Fbo& shadowFbo, uint numTiles,
+		const DepthFile* depthFile) {
+	const uint tileSize = shadowFbo.getWidth();
+
+	if (depthFile) {
+		return DepthSource("read", [depthFile, tileSize](uint x, uint y) {
+			return depthFile->createImageF(x, y, tileSize);
+		}, true);
+	} else if (m_bakeSettings.cpuRasterizer) {
+		// The rasterizer needs no GL context, so the tiles are rendered in the thread pool
+		return DepthSource("rasterize", [this, scene, numTiles, tileSize](uint x, uint y) {
+			const auto P = m_dirLight.getSubProjection(scene->boundingBox, x, y, numTiles);
+			return DepthRasterizer().render(scene, P, m_dirLight.getViewTransform(), tileSize);
+		}, false);
+	}
+
+	return DepthSource("render", [this, scene, &shadowFbo, numTiles](uint x, uint y) {
+		const auto P = m_dirLight.getSubProjection(scene->boundingBox, x, y, numTiles);
+		renderSceneForSM(scene, P, m_dirLight.getViewTransform());
 
-	vector<std::thread> shadowThreads;
-	shadowThreads.reserve(numSlices);
+		ShadowMap sm(shadowFbo.getDepthTexture());
+		return sm.createImageF();
+	}, true);
+}
 
-	for (uint tile = 0; tile < numSlices; ++tile) {
-		shadowThreads.emplace_back(std::thread([shadows, &minMax, numSlices, x, y, tile]() {
-				shadows->set(CompressedShadow::create(minMax, tile, numSlices), x, y, tile); }));
+void DeferredRenderer::precomputeShadows(const Scene* scene, uint size, uint pcfSize,
+		const BakeSettings& settings, BuildStats* stats) {
+	unique_ptr<DepthFile> depthFile;
+	if (!settings.depthFile.empty()) {
+		depthFile = make_unique<DepthFile>(settings.depthFile);
+		size = depthFile->getWidth();
 	}
 
-	for (auto& thread : shadowThreads)
-		thread.join();
-}
+	m_precomputedSize = size;
+	m_bakeSettings = settings;
 
-unique_ptr<CompressedShadowContainer> DeferredRenderer::renderWithTiles(const Scene* scene, const mat4& V,
-		const DirectionalLight& light, Fbo& shadowFbo, uint numSlices) {
+	const ShadowBaker baker(size, settings);
+	auto shadowFbo = beginTileRendering(baker.getTileSize());
 
-	auto shadows = make_unique<CompressedShadowContainer>(numSlices);
+	m_precomputedShadow = make_unique<GPUShadowContainer>(baker.getNumTiles());
+	baker.configure(*m_precomputedShadow);
 
-	for (uint y = 0; y < numSlices; ++y) {
-		for (uint x = 0; x < numSlices; ++x) {
-			const auto P = light.getSubProjection(scene->boundingBox, x, y, numSlices);
+	auto t0 = chrono::steady_clock::now();
+	baker.bake(*m_precomputedShadow, createDepthSource(scene, *shadowFbo, baker.getNumTiles(), depthFile.get()),
+			stats);
+	if (stats)
+		stats->addPhase("bake", chrono::duration<double>(chrono::steady_clock::now() - t0).count());
 
-			renderSceneForSM(scene, P, V);
+	m_precomputedShadow->setFilterSize(pcfSize);
 
-			ShadowMap sm(shadowFbo.getDepthTexture());
-			MinMaxHierarchy mm(sm.createImageF());
+	t0 = chrono::steady_clock::now();
+	if (settings.keepForUpdates)
+		m_precomputedShadow->copyToGPU();
+	else
+		m_precomputedShadow->moveToGPU();
+	if (stats)
+		stats->addPhase("copyToGPU", chrono::duration<double>(chrono::steady_clock::now() - t0).count());
 
-			createShadowTiles(shadows.get(), mm, x, y, numSlices);
-		}
-#ifdef PRINT_PROGRESS
-		cout << ((y + 1) / static_cast<float>(numSlices)) * 100 << "% ";
-		cout.flush();
-#endif
-	}
-	return shadows;
+	endTileRendering();
+	GL_CHECK_ERROR("DeferredRenderer::precomputeShadows - end: ");
 }
 
-inline uint getTileSize(uint size) {
-	GLint maxSize = 8192;
+void DeferredRenderer::loadPrecomputedShadows(const string& file, uint pcfSize) {
+	m_precomputedShadow = make_unique<GPUShadowContainer>(make_unique<ContainerFile>(file));
+	m_precomputedShadow->setFilterSize(pcfSize);
+	m_precomputedShadow->moveToGPU();
 
-	/* My GPU has a maximum texture size of 16K which could be useful for tiling
-	 * very high resolutions (> 128K), but otherwise seems to slow down performance for 
-	 * lower resolutions. As a heuristic 8K seems fine. */
-	//glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxSize);
+	m_precomputedSize = 0;
+	m_bakeSettings = BakeSettings();
+	GL_CHECK_ERROR("DeferredRenderer::loadPrecomputedShadows - end: ");
+}
 
-	if (size < maxSize) maxSize = size;
+void DeferredRenderer::updateShadows(const Scene* scene, const AABB& lightSpaceBox) {
+	assert(m_precomputedShadow != nullptr && m_bakeSettings.keepForUpdates && m_bakeSettings.depthFile.empty());
 
-	return maxSize;
-}
+	const ShadowBaker baker(m_precomputedSize, m_bakeSettings);
+	auto shadowFbo = beginTileRendering(baker.getTileSize());
 
-void DeferredRenderer::precomputeShadows(const Scene* scene, uint size, uint pcfSize) {
-	const uint tileSize = getTileSize(size);
-	const uint numTiles = size / tileSize;
+	baker.update(*m_precomputedShadow, createDepthSource(scene, *shadowFbo, baker.getNumTiles(), nullptr),
+		lightSpaceBox);
 
+	m_precomputedShadow->updateGPU();
+
+	endTileRendering();
+	GL_CHECK_ERROR("DeferredRenderer::updateShadows - end: ");
+}
+
+unique_ptr<Fbo> DeferredRenderer::beginTileRendering(uint tileSize) {
 	glViewport(0, 0, tileSize, tileSize);
 
-	const auto V = m_dirLight.getViewTransform();
 	m_create_sm.bind();
 
 	setNearAndFarPlane(m_create_sm, m_dirLight);
 	setShadowMappingState();
 
 	// create FBO with floating point depth
-	Fbo shadowFbo(tileSize, tileSize, false);
-	shadowFbo.bind();
-	shadowFbo.setDepthTexture(GL_DEPTH_COMPONENT32, GL_DEPTH_COMPONENT, GL_FLOAT);
+	auto shadowFbo = make_unique<Fbo>(tileSize, tileSize, false);
+	shadowFbo->bind();
+	shadowFbo->setDepthTexture(GL_DEPTH_COMPONENT32, GL_DEPTH_COMPONENT, GL_FLOAT);
 	glDrawBuffer(GL_NONE);
 
-	if (numTiles == 1) {
-		const auto P = m_dirLight.getProjection();
-		renderSceneForSM(scene, P, V);
-
-		ShadowMap sm(shadowFbo.getDepthTexture());
-		m_precomputedShadow = make_unique<CompressedShadowContainer>(CompressedShadow::create(&sm));
-	} else {
-		m_precomputedShadow = renderWithTiles(scene, V, m_dirLight, shadowFbo, numTiles);
-	}
-	m_precomputedShadow->setFilterSize(pcfSize);
-	m_precomputedShadow->moveToGPU();
+	return shadowFbo;
+}
 
+void DeferredRenderer::endTileRendering() {
 	glDisable(GL_POLYGON_OFFSET_FILL);
 	m_create_sm.release();
-	GL_CHECK_ERROR("DeferredRenderer::precomputeShadows - end: ");
 }
 
 void DeferredRenderer::renderQuad(const Quad& quad) {
@@ -308,8 +330,7 @@ void DeferredRenderer::renderScene(Camera* cam, const Scene* scene) {
 			currentMat = mesh.material;
 		}
 
-		mesh.bind();
-		mesh.draw();
+		GLScene::draw(mesh);
 	}
 
 	m_geometry.release();
@@ -1,17 +1,18 @@
 #ifndef DEFERRED_RENDERER_H
 #define DEFERRED_RENDERER_H
 
-#include "cpvs.h"
+#include "cpvsGL.h"
 #include "ShaderProgram.h"
 #include "Quad.h"
 #include "Fbo.h"
 #include "Light.h"
 #include "ShadowMap.h"
-#include "CompressedShadow.h"
-#include "CompressedShadowContainer.h"
+#include "GPUShadowContainer.h"
+#include "ShadowBaker.h"
 #include "Camera.h"
 
 class Scene;
+class DepthFile;
 
 class DeferredRenderer {
 public:
@@ -28,7 +29,34 @@ public:
 	 */
 	unique_ptr<ShadowMap> renderShadowMap(const Scene* scene, uint size);
 
-	void precomputeShadows(const Scene* scene, uint size, uint pcfSize);
+	/**
+	 * Precomputes the shadows of the scene with the given size and moves them to the GPU.
+	 * @param stats If not null, receives the statistics of baking (see ShadowBaker::bake) and the durations of
+	 * baking and copying the shadows to the GPU.
+	 * @throws FileNotFound, LoadFileException if a depth file is specified but can't be loaded.
+	 */
+	void precomputeShadows(const Scene* scene, uint size, uint pcfSize,
+			const BakeSettings& settings = BakeSettings(), BuildStats* stats = nullptr);
+
+	/**
+	 * Loads precomputed shadows written with CompressedShadowContainer::writeToFile (e.g. by cpvs_bake) and
+	 * moves them to the GPU. The shadows must have been baked for the same scene and light direction.
+	 * @throws FileNotFound, LoadFileException if the file can't be loaded.
+	 */
+	void loadPrecomputedShadows(const string& file, uint pcfSize);
+
+	/**
+	 * Rebuilds the precomputed shadows in the given region after the scene has been edited.
+	 *
+	 * Only the xy-tiles overlapping the region are rendered again. Of these only the z-tiles from the front of
+	 * the region to the far plane are rebuilt, since moved geometry changes the visibility of all voxels behind it.
+	 * The container then patches the DAG and the grid on the GPU.
+	 *
+	 * @param lightSpaceBox Bounding box in the normalized device coordinates of the light, i.e. in [-1, 1]^3, which
+	 * contains the changed geometry before and after the edit (see DirectionalLight::getLightSpaceBounds).
+	 * @note Requires precomputeShadows with BakeSettings::keepForUpdates and without a depth file.
+	 */
+	void updateShadows(const Scene* scene, const AABB& lightSpaceBox);
 
 	/** Render the given texture using a special shader program to visualize a depth map. */
 	void renderDepthTexture(const Texture2D* tex);
@@ -55,9 +83,16 @@ private:
 	/** Renders the scene to create a shadow map. */
 	void renderSceneForSM(const Scene* scene, const mat4& P, const mat4& V);
 
-	/** Render multiple shadow map tiles from which the precomputed shadow will be created */
-	unique_ptr<CompressedShadowContainer> renderWithTiles(const Scene* scene, const mat4& V,
-		const DirectionalLight& light, Fbo& shadowFbo, uint numSlices);
+	/** Binds the shader and state for rendering shadow map tiles and returns the FBO to render them into. */
+	unique_ptr<Fbo> beginTileRendering(uint tileSize);
+
+	void endTileRendering();
+
+	/**
+	 * Returns the source of the depth tiles from which the precomputed shadow will be created, i.e. shadow maps
+	 * rendered into the given FBO, the CPU rasterizer or the depth file if it is not null.
+	 */
+	DepthSource createDepthSource(const Scene* scene, Fbo& shadowFbo, uint numTiles, const DepthFile* depthFile);
 
 	static void renderQuad(const Quad& quad);
 
@@ -79,7 +114,11 @@ private:
 	DirectionalLight m_dirLight;
 
 	bool m_useReferenceShadow;
-	unique_ptr<CompressedShadowContainer> m_precomputedShadow;
+	unique_ptr<GPUShadowContainer> m_precomputedShadow;
+
+	/* Size and settings of the precomputed shadows, which are needed for updates */
+	uint m_precomputedSize;
+	BakeSettings m_bakeSettings;
 	unique_ptr<Texture2D> m_visibilities;
 
 	shared_ptr<Texture2D> m_shadowMap;
@@ -0,0 +1,130 @@
+#include "DepthFile.h"
+
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+DepthFile::DepthFile(const string& file)
+	: m_mapping(nullptr), m_mappingSize(0), m_values(nullptr), m_width(0), m_swapBytes(false)
+{
+	const int fd = open(file.c_str(), O_RDONLY);
+	if (fd < 0)
+		throw FileNotFound("Depth file not found");
+
+	struct stat fileStat;
+	if (fstat(fd, &fileStat) != 0 || fileStat.st_size == 0) {
+		close(fd);
+		throw LoadFileException("Could not read depth file");
+	}
+	m_mappingSize = fileStat.st_size;
+
+	m_mapping = mmap(nullptr, m_mappingSize, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (m_mapping == MAP_FAILED) {
+		m_mapping = nullptr;
+		throw LoadFileException("Could not map depth file into memory");
+	}
+
+	try {
+		parseHeader(m_mappingSize);
+	} catch (...) {
+		munmap(m_mapping, m_mappingSize);
+		throw;
+	}
+}
+
+DepthFile::~DepthFile() {
+	if (m_mapping)
+		munmap(m_mapping, m_mappingSize);
+}
+
+void DepthFile::parseHeader(size_t fileSize) {
+	const char* bytes = static_cast<const char*>(m_mapping);
+	size_t dataOffset = 0;
+	size_t width, height;
+
+	if (fileSize > 2 && bytes[0] == 'P' && bytes[1] == 'f') {
+		/* PFM: "Pf\n<width> <height>\n<scale>\n" followed by the values,
+		 * where a negative scale indicates little-endian values */
+		istringstream header(string(bytes, std::min<size_t>(fileSize, 256)));
+		string magic;
+		float scale;
+		header >> magic >> width >> height >> scale;
+
+		if (!header)
+			throw LoadFileException("Invalid PFM header");
+
+		// Exactly one whitespace character follows the scale
+		dataOffset = static_cast<size_t>(header.tellg()) + 1;
+
+		const bool littleEndian = scale < 0.0f;
+		const uint one = 1;
+		const bool hostLittleEndian = *reinterpret_cast<const char*>(&one) == 1;
+		m_swapBytes = littleEndian != hostLittleEndian;
+	} else {
+		/* Raw floats, the file must be square */
+		width = std::sqrt(fileSize / sizeof(float));
+		height = width;
+
+		// Don't silently ignore the values of a file which isn't square or has trailing bytes
+		if (width * height * sizeof(float) != fileSize)
+			throw LoadFileException("Raw depth file must contain exactly width * width floats");
+	}
+
+	if (width != height || !isPowerOfTwo(width))
+		throw LoadFileException("Depth file must be square and a power of two");
+
+	if (dataOffset + width * height * sizeof(float) > fileSize)
+		throw LoadFileException("Depth file is too small");
+
+	m_width = width;
+	m_values = reinterpret_cast<const float*>(bytes + dataOffset);
+}
+
+inline float swapBytes(float val) {
+	uint bits;
+	std::memcpy(&bits, &val, sizeof(bits));
+	bits = __builtin_bswap32(bits);
+	std::memcpy(&val, &bits, sizeof(bits));
+	return val;
+}
+
+ImageF DepthFile::createImageF(uint x, uint y, uint tileSize) const {
+	assert((x + 1) * tileSize <= m_width && (y + 1) * tileSize <= m_width);
+
+	ImageF img(tileSize, tileSize, 1);
+	float* dst = img.data();
+
+	// The values may not be aligned after the PFM header, so copy them bytewise
+	const char* src = reinterpret_cast<const char*>(m_values);
+	for (size_t row = 0; row < tileSize; ++row) {
+		const size_t srcIndex = (y * tileSize + row) * m_width + x * tileSize;
+		std::memcpy(dst + row * tileSize, src + srcIndex * sizeof(float), tileSize * sizeof(float));
+	}
+
+	if (m_swapBytes) {
+		for (size_t i = 0; i < tileSize * tileSize; ++i)
+			dst[i] = swapBytes(dst[i]);
+	}
+	return img;
+}
+
+void DepthFile::writePFM(const ImageF& img, const string& file) {
+	assert(img.getNumChannels() == 1);
+
+	ofstream os(file, ios::binary);
+	if (!os.is_open())
+		throw FileNotFound("Could not open file for writing");
+
+	// This assumes a little-endian host, which is indicated by the negative scale
+	os << "Pf\n" << img.getWidth() << " " << img.getHeight() << "\n-1.0\n";
+	os.write(reinterpret_cast<const char*>(img.data()), img.getWidth() * img.getHeight() * sizeof(float));
+}
@@ -0,0 +1,61 @@
+#ifndef DEPTH_FILE_H
+#define DEPTH_FILE_H
+
+#include "cpvs.h"
+#include "Image.h"
+
+/**
+ * A (possibly very large) depth map on disk which is memory-mapped instead of being loaded.
+ *
+ * Supported are PFM files with one channel ("Pf") and raw files containing width * width 32-bit floats.
+ * Tiles are copied from the mapped pages on demand, so only the parts of the file which are actually
+ * needed will be paged in.
+ *
+ * @note The rows are expected to be stored from bottom to top, i.e. in the same order as in PFM files
+ * and OpenGL textures.
+ */
+class DepthFile {
+public:
+	/**
+	 * Maps the given file into memory.
+	 * @throws FileNotFound if the file can't be opened.
+	 * @throws LoadFileException if the file is no valid PFM/raw depth map or not square.
+	 */
+	DepthFile(const string& file);
+	~DepthFile();
+
+	DepthFile(const DepthFile&) = delete;
+	DepthFile& operator=(const DepthFile&) = delete;
+
+	inline size_t getWidth() const {
+		return m_width;
+	}
+
+	inline size_t getHeight() const {
+		return m_width;
+	}
+
+	/**
+	 * Copies the tile (x, y) of size tileSize * tileSize to an image in the host memory.
+	 * Tiles are numbered like the sub-projections of a DirectionalLight, i.e. starting at the bottom left.
+	 */
+	ImageF createImageF(uint x, uint y, uint tileSize) const;
+
+	/**
+	 * Writes a 1-channel image as little-endian PFM file.
+	 */
+	static void writePFM(const ImageF& img, const string& file);
+
+private:
+	void parseHeader(size_t fileSize);
+
+private:
+	void* m_mapping;
+	size_t m_mappingSize;
+
+	const float* m_values; // points into the mapping, after the header
+	size_t m_width;
+	bool m_swapBytes;
+};
+
+#endif
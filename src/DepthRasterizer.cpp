@@ -0,0 +1,313 @@
+#include "DepthRasterizer.h"
+#include "Scene.h"
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+using namespace std;
+
+// Width and height of a bin in pixels, must be a multiple of 4
+constexpr uint BIN_SIZE = 64;
+
+// Vertices are snapped to 1/SUBPIXEL_STEPS pixels like on the GPU
+constexpr float SUBPIXEL_STEPS = 256.0f;
+
+// Minimum resolvable difference of a 24-bit depth buffer, which is scaled by the units of the polygon offset
+constexpr float MIN_RESOLVABLE_DEPTH = 1.0f / (1 << 24);
+
+// Setup and rasterization are split into more chunks than threads for load balancing
+constexpr uint CHUNKS_PER_THREAD = 4;
+
+/**
+ * A triangle after the setup. The edge functions and the depth plane are relative to the first vertex,
+ * so their values stay small for large images.
+ */
+struct RasterTriangle {
+	float originX, originY;
+
+	// Edge i is a[i] * x + b[i] * y + c[i], which is positive inside the triangle
+	float a[3], b[3], c[3];
+	bool topLeft[3];
+
+	// Depth plane in window coordinates and the polygon offset
+	float z0, dzdx, dzdy, offset;
+
+	// Covered pixels (inclusive)
+	int minX, minY, maxX, maxY;
+};
+
+/* Triangles of one chunk of the setup and their indices for every bin */
+struct SetupChunk {
+	vector<RasterTriangle> triangles;
+	vector<vector<uint>> bins;
+};
+
+/* Returns the position in window coordinates with snapped x and y */
+inline vec3 toWindow(const mat4& MVP, const vec3& pos, float size) {
+	const vec4 clip = MVP * vec4(pos, 1.0f);
+	const vec3 ndc = vec3(clip) / clip.w;
+
+	const vec2 xy = (vec2(ndc) * 0.5f + 0.5f) * size;
+	return vec3(glm::round(xy * SUBPIXEL_STEPS) / SUBPIXEL_STEPS, ndc.z * 0.5f + 0.5f);
+}
+
+/**
+ * Computes the edge functions, the depth plane and the covered pixels of a triangle in window coordinates.
+ * Returns false if the triangle is culled or doesn't cover any pixel center.
+ */
+bool setupTriangle(vec3 v0, vec3 v1, vec3 v2, int size, float offsetFactor, float offsetUnits,
+		bool cullBackFaces, RasterTriangle& tri) {
+	// The snapped coordinates are exact in double, so is the area. Front faces are counter-clockwise.
+	double area = (double(v1.x) - v0.x) * (double(v2.y) - v0.y) - (double(v2.x) - v0.x) * (double(v1.y) - v0.y);
+	if (area == 0.0 || (area < 0.0 && cullBackFaces))
+		return false;
+
+	if (area < 0.0) {
+		std::swap(v1, v2);
+		area = -area;
+	}
+
+	// Entirely in front of the near plane or behind the far plane
+	if (std::max({ v0.z, v1.z, v2.z }) < 0.0f || std::min({ v0.z, v1.z, v2.z }) > 1.0f)
+		return false;
+
+	tri.minX = std::max(0, static_cast<int>(std::ceil(std::min({ v0.x, v1.x, v2.x }) - 0.5f)));
+	tri.minY = std::max(0, static_cast<int>(std::ceil(std::min({ v0.y, v1.y, v2.y }) - 0.5f)));
+	tri.maxX = std::min(size - 1, static_cast<int>(std::floor(std::max({ v0.x, v1.x, v2.x }) - 0.5f)));
+	tri.maxY = std::min(size - 1, static_cast<int>(std::floor(std::max({ v0.y, v1.y, v2.y }) - 0.5f)));
+	if (tri.minX > tri.maxX || tri.minY > tri.maxY)
+		return false;
+
+	tri.originX = v0.x;
+	tri.originY = v0.y;
+
+	const vec3 v[3] = { v0, v1, v2 };
+	for (uint i = 0; i < 3; ++i) {
+		const vec3& from = v[i];
+		const vec3& to = v[(i + 1) % 3];
+
+		tri.a[i] = from.y - to.y;
+		tri.b[i] = to.x - from.x;
+		tri.c[i] = static_cast<float>(double(tri.a[i]) * (double(v0.x) - from.x) + double(tri.b[i]) * (double(v0.y) - from.y));
+
+		// Pixel centers exactly on an edge belong to the triangle if it is a left edge or a top edge
+		tri.topLeft[i] = tri.a[i] > 0.0f || (tri.a[i] == 0.0f && tri.b[i] < 0.0f);
+	}
+
+	const double x1 = double(v1.x) - v0.x, y1 = double(v1.y) - v0.y, z1 = double(v1.z) - v0.z;
+	const double x2 = double(v2.x) - v0.x, y2 = double(v2.y) - v0.y, z2 = double(v2.z) - v0.z;
+
+	tri.z0 = v0.z;
+	tri.dzdx = static_cast<float>((z1 * y2 - z2 * y1) / area);
+	tri.dzdy = static_cast<float>((z2 * x1 - z1 * x2) / area);
+
+	// Like glPolygonOffset: maximum depth slope * factor + minimum resolvable difference * units
+	tri.offset = std::max(std::abs(tri.dzdx), std::abs(tri.dzdy)) * offsetFactor + MIN_RESOLVABLE_DEPTH * offsetUnits;
+	return true;
+}
+
+/**
+ * Returns false if the triangle certainly doesn't cover any pixel center in [x0, x1] x [y0, y1].
+ * The edges are evaluated at the corner which maximizes them, with a small tolerance for rounding errors.
+ */
+inline bool overlapsRect(const RasterTriangle& tri, int x0, int y0, int x1, int y1) {
+	for (uint i = 0; i < 3; ++i) {
+		const float px = (tri.a[i] > 0.0f ? x1 : x0) + 0.5f - tri.originX;
+		const float py = (tri.b[i] > 0.0f ? y1 : y0) + 0.5f - tri.originY;
+		const float tolerance = (std::abs(tri.a[i]) + std::abs(tri.b[i])) / SUBPIXEL_STEPS;
+
+		if (tri.a[i] * px + tri.b[i] * py + tri.c[i] < -tolerance)
+			return false;
+	}
+	return true;
+}
+
+/* Rasterizes the pixels [x0, x1] x [y0, y1] of the triangle one after another */
+void rasterizeScalar(const RasterTriangle& tri, int x0, int y0, int x1, int y1, float* depths, uint stride) {
+	for (int y = y0; y <= y1; ++y) {
+		const float py = (y + 0.5f) - tri.originY;
+
+		float rowE[3];
+		for (uint i = 0; i < 3; ++i)
+			rowE[i] = tri.b[i] * py + tri.c[i];
+		const float rowZ = tri.z0 + tri.dzdy * py;
+
+		float* row = depths + static_cast<size_t>(y) * stride;
+		for (int x = x0; x <= x1; ++x) {
+			const float px = (x + 0.5f) - tri.originX;
+
+			bool inside = true;
+			for (uint i = 0; i < 3; ++i) {
+				const float e = tri.a[i] * px + rowE[i];
+				inside &= e > 0.0f || (tri.topLeft[i] && e == 0.0f);
+			}
+
+			// Pixels outside of the clip volume are clipped, for affine projections this is the same as clipping the triangle
+			const float z = tri.dzdx * px + rowZ;
+			if (!inside || z < 0.0f || z > 1.0f)
+				continue;
+
+			const float depth = std::min(std::max(z + tri.offset, 0.0f), 1.0f);
+			if (depth < row[x])
+				row[x] = depth;
+		}
+	}
+}
+
+#ifdef __SSE2__
+/*
+ * Rasterizes the pixels [x0, x1] x [y0, y1] of the triangle, 4 pixels at once. x0 is rounded down to a multiple
+ * of 4, so the row must contain at least the next multiple of 4 after x1. Computes the same values as rasterizeScalar.
+ */
+void rasterizeSSE2(const RasterTriangle& tri, int x0, int y0, int x1, int y1, float* depths, uint stride) {
+	const __m128 pixelOffsets = _mm_setr_ps(0.5f, 1.5f, 2.5f, 3.5f);
+	const __m128 originX = _mm_set1_ps(tri.originX);
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 one = _mm_set1_ps(1.0f);
+	const __m128 dzdx = _mm_set1_ps(tri.dzdx);
+	const __m128 offset = _mm_set1_ps(tri.offset);
+
+	__m128 a[3], topLeft[3];
+	for (uint i = 0; i < 3; ++i) {
+		a[i] = _mm_set1_ps(tri.a[i]);
+		topLeft[i] = _mm_castsi128_ps(_mm_set1_epi32(tri.topLeft[i] ? -1 : 0));
+	}
+
+	x0 &= ~3;
+	for (int y = y0; y <= y1; ++y) {
+		const float py = (y + 0.5f) - tri.originY;
+
+		__m128 rowE[3];
+		for (uint i = 0; i < 3; ++i)
+			rowE[i] = _mm_set1_ps(tri.b[i] * py + tri.c[i]);
+		const __m128 rowZ = _mm_set1_ps(tri.z0 + tri.dzdy * py);
+
+		float* row = depths + static_cast<size_t>(y) * stride;
+		for (int x = x0; x <= x1; x += 4) {
+			const __m128 px = _mm_sub_ps(_mm_add_ps(_mm_set1_ps(static_cast<float>(x)), pixelOffsets), originX);
+
+			__m128 mask = _mm_castsi128_ps(_mm_set1_epi32(-1));
+			for (uint i = 0; i < 3; ++i) {
+				const __m128 e = _mm_add_ps(_mm_mul_ps(a[i], px), rowE[i]);
+				const __m128 inside = _mm_or_ps(_mm_cmpgt_ps(e, zero), _mm_and_ps(topLeft[i], _mm_cmpeq_ps(e, zero)));
+				mask = _mm_and_ps(mask, inside);
+			}
+			if (_mm_movemask_ps(mask) == 0)
+				continue;
+
+			const __m128 z = _mm_add_ps(_mm_mul_ps(dzdx, px), rowZ);
+			mask = _mm_and_ps(mask, _mm_and_ps(_mm_cmpge_ps(z, zero), _mm_cmple_ps(z, one)));
+
+			const __m128 depth = _mm_min_ps(_mm_max_ps(_mm_add_ps(z, offset), zero), one);
+			const __m128 old = _mm_loadu_ps(row + x);
+			mask = _mm_and_ps(mask, _mm_cmplt_ps(depth, old));
+
+			_mm_storeu_ps(row + x, _mm_or_ps(_mm_and_ps(mask, depth), _mm_andnot_ps(mask, old)));
+		}
+	}
+}
+#endif
+
+DepthRasterizer::DepthRasterizer(float offsetFactor, float offsetUnits, bool cullBackFaces)
+	: m_offsetFactor(offsetFactor), m_offsetUnits(offsetUnits), m_cullBackFaces(cullBackFaces)
+{
+}
+
+ImageF DepthRasterizer::render(const Scene* scene, const mat4& P, const mat4& V, uint size) const {
+	ImageF depths(size, size, 1);
+	std::fill(depths.data(), depths.data() + static_cast<size_t>(size) * size, 1.0f);
+
+	const mat4 MVP = P * V;
+	const uint binSize = std::min(BIN_SIZE, size);
+	const uint binsPerRow = (size + binSize - 1) / binSize;
+	const uint numBins = binsPerRow * binsPerRow;
+
+	/* The triangles of all meshes are numbered consecutively */
+	vector<size_t> firstTriangle(1, 0);
+	for (const auto& mesh : scene->meshes) {
+		if (mesh.indices.size() != mesh.numFaces * 3 || (mesh.numFaces > 0 && mesh.positions.empty()))
+			throw std::invalid_argument("The positions and indices of the meshes must be kept on the CPU");
+		firstTriangle.push_back(firstTriangle.back() + mesh.indices.size() / 3);
+	}
+	const size_t numTriangles = firstTriangle.back();
+
+	ThreadPool& pool = ThreadPool::getDefault();
+	const uint maxChunks = pool.getNumThreads() * CHUNKS_PER_THREAD;
+
+	/* Set up the triangles and sort them into the bins */
+	const uint numSetupChunks = std::max<size_t>(1, std::min<size_t>(numTriangles, maxChunks));
+	vector<SetupChunk> chunks(numSetupChunks);
+
+	pool.parallelFor(numTriangles, numSetupChunks, [&](uint chunkNr, size_t begin, size_t end) {
+		SetupChunk& chunk = chunks[chunkNr];
+		chunk.bins.resize(numBins);
+
+		size_t meshNr = std::upper_bound(firstTriangle.begin(), firstTriangle.end(), begin) - firstTriangle.begin() - 1;
+		for (size_t t = begin; t < end; ++t) {
+			while (t >= firstTriangle[meshNr + 1])
+				++meshNr;
+
+			const Mesh& mesh = scene->meshes[meshNr];
+			const uint* indices = &mesh.indices[(t - firstTriangle[meshNr]) * 3];
+
+			RasterTriangle tri;
+			if (!setupTriangle(toWindow(MVP, mesh.positions[indices[0]], size), toWindow(MVP, mesh.positions[indices[1]], size),
+					toWindow(MVP, mesh.positions[indices[2]], size), size, m_offsetFactor, m_offsetUnits, m_cullBackFaces, tri))
+				continue;
+
+			const uint triangleNr = chunk.triangles.size();
+			for (int binY = tri.minY / binSize; binY <= tri.maxY / static_cast<int>(binSize); ++binY) {
+				for (int binX = tri.minX / binSize; binX <= tri.maxX / static_cast<int>(binSize); ++binX) {
+					const int x0 = std::max<int>(tri.minX, binX * binSize);
+					const int y0 = std::max<int>(tri.minY, binY * binSize);
+					const int x1 = std::min<int>(tri.maxX, (binX + 1) * binSize - 1);
+					const int y1 = std::min<int>(tri.maxY, (binY + 1) * binSize - 1);
+
+					if (overlapsRect(tri, x0, y0, x1, y1))
+						chunk.bins[binY * binsPerRow + binX].push_back(triangleNr);
+				}
+			}
+			chunk.triangles.push_back(tri);
+		}
+	});
+
+	/* Rasterize the bins, every bin is written by one thread only */
+#ifdef __SSE2__
+	const bool useSSE2 = size % 4 == 0;
+#endif
+	float* data = depths.data();
+
+	pool.parallelFor(numBins, std::min(numBins, maxChunks), [&](uint, size_t begin, size_t end) {
+		for (size_t bin = begin; bin < end; ++bin) {
+			const int binX0 = (bin % binsPerRow) * binSize;
+			const int binY0 = (bin / binsPerRow) * binSize;
+
+			for (const auto& chunk : chunks) {
+				for (uint triangleNr : chunk.bins[bin]) {
+					const RasterTriangle& tri = chunk.triangles[triangleNr];
+
+					const int x0 = std::max<int>(tri.minX, binX0);
+					const int y0 = std::max<int>(tri.minY, binY0);
+					const int x1 = std::min<int>(tri.maxX, binX0 + binSize - 1);
+					const int y1 = std::min<int>(tri.maxY, binY0 + binSize - 1);
+
+#ifdef __SSE2__
+					if (useSSE2) {
+						rasterizeSSE2(tri, x0, y0, x1, y1, data, size);
+						continue;
+					}
+#endif
+					rasterizeScalar(tri, x0, y0, x1, y1, data, size);
+				}
+			}
+		}
+	});
+
+	return depths;
+}
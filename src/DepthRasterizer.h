@@ -0,0 +1,46 @@
+#ifndef DEPTH_RASTERIZER_H
+#define DEPTH_RASTERIZER_H
+
+#include "cpvs.h"
+#include "Image.h"
+
+struct Scene;
+
+/**
+ * Renders the depths of a scene on the CPU, so shadows can be baked without rendering the shadow maps with
+ * OpenGL and reading them back.
+ *
+ * The triangles are set up and sorted into square bins of the image in parallel, afterwards the bins are
+ * rasterized in parallel. Inside a bin 4 pixels are processed at once with SSE2, without SSE2 a scalar loop
+ * computing exactly the same values is used.
+ *
+ * Rasterization follows OpenGL with the state used for the shadow maps: pixel centers are sampled, vertices are
+ * snapped to 1/256 pixels, shared edges follow the top-left rule, back faces are culled, the depth test is
+ * GL_LESS and the depths are offset like glPolygonOffset. The depths of an image are in [0, 1].
+ *
+ * @note Only affine projections (i.e. orthographic projections like the one of DirectionalLight) are supported.
+ * @note The meshes must have been loaded with their positions and indices on the CPU
+ * (see AssimpScene::loadScene).
+ */
+class DepthRasterizer {
+public:
+	/**
+	 * @param offsetFactor, offsetUnits Polygon offset, see glPolygonOffset. The defaults are the values used by
+	 * DeferredRenderer for the shadow maps.
+	 */
+	explicit DepthRasterizer(float offsetFactor = 1.1f, float offsetUnits = 4.0f, bool cullBackFaces = true);
+
+	/**
+	 * Renders all meshes of the scene with the given view and projection into a size x size image, which is
+	 * cleared with 1. Like the images of ShadowMap::createImageF the first row is the bottom row.
+	 * @throws std::invalid_argument if the positions or indices of a mesh aren't on the CPU.
+	 */
+	ImageF render(const Scene* scene, const mat4& P, const mat4& V, uint size) const;
+
+private:
+	float m_offsetFactor;
+	float m_offsetUnits;
+	bool m_cullBackFaces;
+};
+
+#endif
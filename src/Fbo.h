@@ -1,7 +1,7 @@
 #ifndef FBO_H
 #define FBO_H
 
-#include "cpvs.h"
+#include "cpvsGL.h"
 #include "Texture.h"
 
 /** Represents a framebuffer object */
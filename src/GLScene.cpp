@@ -0,0 +1,53 @@
+#include "GLScene.h"
+
+GLScene::~GLScene() {
+	for (const auto& mesh : meshes)
+		glDeleteVertexArrays(1, &mesh.vao);
+	glDeleteBuffers(m_buffers.size(), m_buffers.data());
+}
+
+unique_ptr<Scene> GLScene::upload(unique_ptr<Scene> scene, bool keepOnCPU) {
+	auto glScene = unique_ptr<GLScene>(new GLScene(std::move(*scene)));
+	GLuint buffer;
+
+	for (auto& mesh : glScene->meshes) {
+		glGenVertexArrays(1, &(mesh.vao));
+		glBindVertexArray(mesh.vao);
+
+		glGenBuffers(1, &buffer);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, buffer);
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(uint) * mesh.indices.size(), mesh.indices.data(), GL_STATIC_DRAW);
+		glScene->m_buffers.push_back(buffer);
+
+		if (!mesh.positions.empty()) {
+			glGenBuffers(1, &buffer);
+			glBindBuffer(GL_ARRAY_BUFFER, buffer);
+			glBufferData(GL_ARRAY_BUFFER, sizeof(vec3) * mesh.positions.size(), mesh.positions.data(), GL_STATIC_DRAW);
+			glScene->m_buffers.push_back(buffer);
+
+			glEnableVertexAttribArray(vPosLoc);
+			glVertexAttribPointer(vPosLoc, 3, GL_FLOAT, 0, 0, 0);
+		}
+
+		if (!mesh.normals.empty()) {
+			glGenBuffers(1, &buffer);
+			glBindBuffer(GL_ARRAY_BUFFER, buffer);
+			glBufferData(GL_ARRAY_BUFFER, sizeof(vec3) * mesh.normals.size(), mesh.normals.data(), GL_STATIC_DRAW);
+			glScene->m_buffers.push_back(buffer);
+
+			glEnableVertexAttribArray(vNormalLoc);
+			glVertexAttribPointer(vNormalLoc, 3, GL_FLOAT, 0, 0, 0);
+		}
+
+		glBindVertexArray(0);
+
+		// Use the 'swap trick' to free the memory
+		vector<vec3>().swap(mesh.normals);
+		if (!keepOnCPU) {
+			vector<vec3>().swap(mesh.positions);
+			vector<uint>().swap(mesh.indices);
+		}
+	}
+
+	return std::move(glScene);
+}
@@ -0,0 +1,39 @@
+#ifndef GL_SCENE_H
+#define GL_SCENE_H
+
+#include "cpvsGL.h"
+#include "Scene.h"
+
+/**
+ * A scene whose meshes have been uploaded to the GPU. The VAOs and buffers are deleted together with the scene.
+ */
+struct GLScene : public Scene {
+	enum AttributeLocation {
+		vPosLoc = 0,
+		vNormalLoc,
+		vTexCoordLoc,
+	};
+
+	~GLScene();
+
+	/**
+	 * Creates a VAO for every mesh of the scene.
+	 * @param keepOnCPU If true, the positions and indices are kept on the CPU as well (e.g. for DepthRasterizer),
+	 * otherwise all data of the meshes on the CPU is freed.
+	 */
+	static unique_ptr<Scene> upload(unique_ptr<Scene> scene, bool keepOnCPU = false);
+
+	/** Draws the mesh, which must have been uploaded */
+	static inline void draw(const Mesh& mesh) {
+		glBindVertexArray(mesh.vao);
+		glDrawElements(GL_TRIANGLES, mesh.numFaces * 3, GL_UNSIGNED_INT, 0);
+	}
+
+private:
+	GLScene(Scene&& scene)
+		: Scene(std::move(scene)) { }
+
+	vector<GLuint> m_buffers;
+};
+
+#endif
@@ -0,0 +1,296 @@
+#include "GPUShadowContainer.h"
+#include "Texture.h"
+
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+using namespace std;
+
+inline void printSize(size_t size) {
+	cout << "\nThe size of the compressed shadow is " << std::fixed << std::setprecision(1) << size / static_cast<float>(1024) << "kb ";
+}
+
+/* Returns the number of words reserved in the DAG on the GPU for updates, i.e. for shadows which grow or nodes
+ * which are appended, so most updates don't upload everything again */
+inline size_t getUpdateReserve(size_t dagSize) {
+	return dagSize / 4;
+}
+
+// Is called when the DAG is copied to the GPU
+void GPUShadowContainer::initShader() {
+	m_traverseCS = make_unique<ShaderProgram>();
+	try {
+		m_traverseCS->addShaderFromFile(GL_COMPUTE_SHADER, "../shader/traverse.cs");
+		m_traverseCS->link();
+	} catch(ShaderException& exc) {
+		cout << exc.where() << " - " << exc.what() << endl;
+		std::terminate();
+	}
+
+	m_traverseCS->bind();
+	m_traverseCS->addUniform("lightViewProj");
+	m_traverseCS->addUniform("width");
+	m_traverseCS->addUniform("height");
+	m_traverseCS->addUniform("filterSize");
+	m_traverseCS->addUniform("dag_levels");
+	m_traverseCS->addUniform("grid_levels");
+	m_traverseCS->addUniform("leafmask_dictionary");
+	m_traverseCS->addUniform("packed_pointers");
+	m_traverseCS->addUniform("pointer_widths");
+	m_traverseCS->addUniform("contiguous_children");
+}
+
+void GPUShadowContainer::upload(bool reserve) {
+	assert(m_info.size() > 0);
+	initShader();
+
+	if (m_file) {
+		// The file already contains the grid and the DAG in the layout used on the GPU
+		uploadMappedFile();
+	} else {
+		m_usesLeafmaskDictionary = false;
+
+		if (m_packedPointers || m_contiguousChildren) {
+			uploadCompactDAG();
+		} else if (m_store) {
+			uploadSharedDAG(reserve ? getUpdateReserve(m_store->getSize()) : 0);
+		} else {
+			if (m_leafmaskDictionary && m_memoryBudget == 0)
+				internLeafmasks();
+
+			size_t dagSize = 0;
+			for (const auto& info : m_info)
+				dagSize += info.dagSize;
+			uploadDAGs(reserve ? getUpdateReserve(dagSize) : 0);
+		}
+	}
+	m_dirty.clear();
+	m_trackChanges = !m_file;
+
+	glUniform1i((*m_traverseCS)["dag_levels"], getNumLevels());
+
+	const uint gridLevels = log8(m_info.size());
+	glUniform1i((*m_traverseCS)["grid_levels"], gridLevels);
+
+	glUniform1ui((*m_traverseCS)["filterSize"], m_filterSize);
+	glUniform1i((*m_traverseCS)["leafmask_dictionary"], m_usesLeafmaskDictionary);
+	glUniform1i((*m_traverseCS)["packed_pointers"], m_packedPointers);
+	glUniform1ui((*m_traverseCS)["pointer_widths"], m_pointerWidths);
+	glUniform1i((*m_traverseCS)["contiguous_children"], m_contiguousChildren);
+}
+
+void GPUShadowContainer::uploadSharedDAG(size_t reserve) {
+	vector<uint> dag, grid;
+	m_placement = NodeStore::Placement();
+	layoutSharedDAG(dag, grid, &m_placement);
+#ifdef PRINT_CPVS_SIZE
+	printSize(dag.size() * sizeof(uint));
+#endif
+	m_deviceDagSize = dag.size();
+	m_deviceDagCapacity = dag.size() + reserve;
+	m_deviceDag = make_unique<SSBO>(m_deviceDagCapacity * sizeof(uint), GL_STATIC_READ);
+	m_deviceDag->setSubData(0, dag);
+	m_deviceGrid = make_unique<SSBO>(grid, GL_STATIC_READ);
+}
+
+void GPUShadowContainer::updateSharedDAG() {
+	// The handles change if the nodes of replaced shadows are removed from the store
+	const bool compacted = compactNodeStore();
+
+	// The leafmask table is created from the whole DAG, so new leafmasks can't be appended to it
+	if (compacted || m_usesLeafmaskDictionary) {
+		m_usesLeafmaskDictionary = false;
+		uploadSharedDAG(getUpdateReserve(m_store->getSize()));
+		m_traverseCS->bind();
+		glUniform1i((*m_traverseCS)["leafmask_dictionary"], m_usesLeafmaskDictionary);
+		return;
+	}
+
+	vector<uint> roots;
+	for (uint index : m_dirty)
+		roots.push_back(m_roots[index]);
+
+	/* Nodes which are already on the GPU (e.g. subtrees shared with other tiles) are referenced, only the new
+	 * nodes are appended. The nodes of the replaced shadows stay in the buffer until it is uploaded again */
+	vector<uint> rootOffsets;
+	NodeStore::Placement placement = m_placement;
+	const vector<uint> dag = m_store->layout(roots, &rootOffsets, &placement);
+
+	if (m_deviceDagSize + dag.size() > m_deviceDagCapacity) {
+		uploadSharedDAG(getUpdateReserve(m_store->getSize()));
+		return;
+	}
+
+	m_deviceDag->setSubData(m_deviceDagSize * sizeof(uint), dag);
+	m_deviceDagSize += dag.size();
+	m_placement = std::move(placement);
+
+	for (size_t i = 0; i < m_dirty.size(); ++i) {
+		const uint index = m_dirty[i];
+		m_deviceGrid->setSubData(index * sizeof(uint), vector<uint>(1, getSharedGridCell(index, rootOffsets[i])));
+	}
+}
+
+void GPUShadowContainer::uploadCompactDAG() {
+	vector<uint> dag, grid;
+	if (m_packedPointers)
+		layoutPackedDAG(dag, grid);
+	else
+		layoutContiguousDAG(dag, grid);
+#ifdef PRINT_CPVS_SIZE
+	printSize(dag.size() * sizeof(uint));
+#endif
+	m_deviceDag = make_unique<SSBO>(dag, GL_STATIC_READ);
+	m_deviceGrid = make_unique<SSBO>(grid, GL_STATIC_READ);
+}
+
+void GPUShadowContainer::uploadMappedFile() {
+#ifdef PRINT_CPVS_SIZE
+	printSize(m_file->getDAGSize() * sizeof(uint));
+#endif
+	m_deviceDag = make_unique<SSBO>(m_file->getDAG(), m_file->getDAGSize(), GL_STATIC_READ);
+	m_deviceGrid = make_unique<SSBO>(m_file->getGrid(), m_file->getGridSize(), GL_STATIC_READ);
+}
+
+void GPUShadowContainer::uploadDAGs(size_t reserve) {
+	size_t dagSize = 0;
+	for (const auto& info : m_info)
+		dagSize += info.dagSize;
+
+	m_deviceDagSize = dagSize;
+	m_deviceDagCapacity = dagSize + reserve;
+	m_deviceDag = make_unique<SSBO>(m_deviceDagCapacity * sizeof(uint), GL_STATIC_READ);
+	m_slots.resize(m_info.size());
+
+	/* Upload one DAG after another, so the combined DAG never has to be kept in memory.
+	 * Pointers are absolute, so every DAG is relocated to the offset it is uploaded to */
+	size_t offset = 0, index = 0;
+	vector<uint> dag;
+	forEachShadow([&](const CompressedShadow& shadow) {
+		dag.clear();
+		shadow.appendDAG(dag, offset);
+		m_deviceDag->setSubData(offset * sizeof(uint), dag);
+
+		m_slots[index].offset = offset;
+		m_slots[index].capacity = dag.size();
+
+		offset += dag.size();
+		++index;
+	});
+#ifdef PRINT_CPVS_SIZE
+	printSize(dagSize * sizeof(uint));
+#endif
+	m_deviceGrid = make_unique<SSBO>(createTopLevelGrid(), GL_STATIC_READ);
+}
+
+void GPUShadowContainer::updateGPU() {
+	assert(m_deviceDag != nullptr && m_deviceGrid != nullptr && !m_file);
+	if (m_dirty.empty())
+		return;
+
+	std::sort(m_dirty.begin(), m_dirty.end());
+	m_dirty.erase(std::unique(m_dirty.begin(), m_dirty.end()), m_dirty.end());
+
+	if (m_packedPointers || m_contiguousChildren) {
+		// The pointers may need to be wider or farther after the update, so the whole DAG is laid out again
+		uploadCompactDAG();
+		m_dirty.clear();
+
+		m_traverseCS->bind();
+		glUniform1ui((*m_traverseCS)["pointer_widths"], m_pointerWidths);
+		return;
+	}
+
+	if (m_store) {
+		updateSharedDAG();
+		m_dirty.clear();
+		return;
+	}
+
+	if (m_usesLeafmaskDictionary) {
+		for (uint index : m_dirty) {
+			m_data[index]->internLeafmasks();
+			m_info[index].dagSize = m_data[index]->getDAG().size();
+		}
+	}
+
+	/* DAGs which don't fit into their old slot are appended to the used part of the buffer */
+	size_t appendSize = 0;
+	for (uint index : m_dirty) {
+		if (m_info[index].dagSize > m_slots[index].capacity)
+			appendSize += m_info[index].dagSize;
+	}
+
+	if (m_deviceDagSize + appendSize > m_deviceDagCapacity) {
+		// Upload everything again (without the gaps of replaced DAGs) and reserve space for further updates
+		uploadDAGs(getUpdateReserve(m_deviceDagSize) + appendSize);
+		m_dirty.clear();
+		return;
+	}
+
+	vector<uint> dag;
+	for (uint index : m_dirty) {
+		Slot& slot = m_slots[index];
+		if (m_info[index].dagSize > slot.capacity) {
+			slot.offset = m_deviceDagSize;
+			slot.capacity = m_info[index].dagSize;
+			m_deviceDagSize += slot.capacity;
+		}
+
+		dag.clear();
+		if (m_info[index].file.empty())
+			m_data[index]->appendDAG(dag, slot.offset);
+		else
+			CompressedShadow::readFromFile(m_info[index].file)->appendDAG(dag, slot.offset);
+
+		m_deviceDag->setSubData(slot.offset * sizeof(uint), dag);
+		m_deviceGrid->setSubData(index * sizeof(uint), vector<uint>(1, getGridCell(index)));
+	}
+	m_dirty.clear();
+}
+
+uint GPUShadowContainer::getGridCell(size_t index) const {
+	return CompressedShadowContainer::getGridCell(index, m_slots[index].offset);
+}
+
+vector<uint> GPUShadowContainer::createTopLevelGrid() {
+	vector<uint> grid;
+	grid.reserve(m_info.size());
+
+	for (size_t index = 0; index < m_info.size(); ++index)
+		grid.push_back(getGridCell(index));
+	return grid;
+}
+
+void GPUShadowContainer::evaluate(const Texture2D* positionsWS, const mat4& lightViewProj,
+		Texture2D* visibilities) {
+	GL_CHECK_ERROR("traverse - begin");
+	assert(m_traverseCS != nullptr);
+	m_traverseCS->bind();
+
+	// Bind WS positions
+	positionsWS->bindImageAt(0, GL_READ_ONLY);
+
+	// Bind image for results
+	visibilities->bindImageAt(1, GL_WRITE_ONLY);
+
+	// Bind dag and grid
+	m_deviceDag->bindAt(2);
+	m_deviceGrid->bindAt(3);
+
+	glUniformMatrix4fv((*m_traverseCS)["lightViewProj"], 1, GL_FALSE, glm::value_ptr(lightViewProj));
+
+	const GLuint width = positionsWS->getWidth();
+	const GLuint height = positionsWS->getHeight();
+	glUniform1ui((*m_traverseCS)["width"], width);
+	glUniform1ui((*m_traverseCS)["height"], height);
+
+	// Now calculate work group size and dispatch!
+	const GLuint localSize = 32;
+	const GLuint numGroupsX = ceil(width / static_cast<float>(localSize));
+	const GLuint numGroupsY = ceil(height / static_cast<float>(localSize));
+	glDispatchCompute(numGroupsX, numGroupsY, 1);
+
+	m_traverseCS->release();
+	GL_CHECK_ERROR("traverse - end");
+}
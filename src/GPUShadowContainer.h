@@ -0,0 +1,130 @@
+#ifndef GPU_SHADOW_CONTAINER_H
+#define GPU_SHADOW_CONTAINER_H
+
+#include "cpvsGL.h"
+#include "CompressedShadowContainer.h"
+#include "Buffer.h"
+#include "ShaderProgram.h"
+
+class Texture2D;
+
+/**
+ * A CompressedShadowContainer which can be moved to the GPU, thereby freeing all data on the CPU and moving
+ * them to the GPU. After this all operations working on the CPU representation become unusable.
+ *
+ * After the container has been moved or copied to the GPU the precomputed shadows can be evaluated.
+ *
+ * Shadows can be replaced after the container has been copied to the GPU (e.g. after the scene has been edited),
+ * in which case updateGPU patches the DAG and the grid on the GPU instead of uploading everything again.
+ */
+class GPUShadowContainer : public CompressedShadowContainer {
+public:
+	/** Creates a container with a fixed length in one dimension of the 3D container. */
+	GPUShadowContainer(uint length)
+		: CompressedShadowContainer(length), m_deviceDagSize(0), m_deviceDagCapacity(0)
+	{ }
+
+	/** Creates a container with a length of 1 and initializes it with the given precomputed shadow. */
+	GPUShadowContainer(unique_ptr<CompressedShadow> shadow)
+		: CompressedShadowContainer(std::move(shadow)), m_deviceDagSize(0), m_deviceDagCapacity(0)
+	{ }
+
+	/** Creates a container from a memory-mapped file, whose grid and DAG are copied to the GPU as they are. */
+	GPUShadowContainer(unique_ptr<ContainerFile> file)
+		: CompressedShadowContainer(std::move(file)), m_deviceDagSize(0), m_deviceDagCapacity(0)
+	{ }
+
+	~GPUShadowContainer() = default;
+
+	/**
+	 * Calculates the visibility/shadow of every world-space position in the given texture.
+	 * The result is a 2-dimensional texture of visibility values.
+	 */
+	void evaluate(const Texture2D* positionsWS, const mat4& lightViewProj, Texture2D* visibilities);
+
+	/**
+	 * Copy all shadows to the device memory. The shadows are kept on the CPU, so they can be updated later, and
+	 * the DAG on the GPU gets space for updates (see updateGPU).
+	 */
+	inline void copyToGPU() {
+		upload(true);
+	}
+
+	/**
+	 * Copies all shadows which have been set since the last copyToGPU/updateGPU to the device memory.
+	 *
+	 * A shadow is written to its old place in the DAG if it fits, otherwise it is appended after the used part of
+	 * the buffer, and only the affected cells of the grid are changed. If all shadows share one node store, only
+	 * the nodes which aren't on the GPU yet are appended, i.e. the new nodes of the rebuilt shadows. Only if the
+	 * buffer is full, everything is uploaded again (with space reserved for further updates), which also removes
+	 * the nodes of replaced shadows from the GPU.
+	 * If the DAG is packed or has contiguous children, the whole DAG is laid out and uploaded again.
+	 *
+	 * @note Requires the shadows on the CPU, i.e. copyToGPU instead of moveToGPU, and is not supported for
+	 * containers loaded from a file.
+	 */
+	void updateGPU();
+
+	/** Combines copyToGPU and freeOnCPU, i.e. copies the data to the GPU and free's it on the CPU */
+	inline void moveToGPU() {
+		upload(false);
+		freeOnCPU();
+	}
+
+private:
+	/** Part of the DAG on the GPU which is used by one shadow. */
+	struct Slot {
+		size_t offset;
+		size_t capacity;
+	};
+
+	void initShader();
+
+	/**
+	 * Copies all shadows to the device memory.
+	 * @param reserve If true, additional space for updates is reserved in the DAG on the GPU.
+	 */
+	void upload(bool reserve);
+
+	vector<uint> createTopLevelGrid();
+
+	/** Returns the value of the grid cell with the given index, i.e. either a special value or an offset to the DAG */
+	uint getGridCell(size_t index) const;
+
+	/**
+	 * Uploads the DAGs of all shadows one after another and creates the grid.
+	 * @param reserve Number of additional words in the buffer for updates.
+	 */
+	void uploadDAGs(size_t reserve);
+
+	/**
+	 * Uploads the DAG of the shared node store and remembers the offsets of its nodes for updates.
+	 * @param reserve Number of additional words in the buffer for updates.
+	 */
+	void uploadSharedDAG(size_t reserve);
+
+	/** Appends the new nodes of the dirty shadows to the shared DAG on the GPU, see updateGPU */
+	void updateSharedDAG();
+
+	/**
+	 * Uploads the packed DAG or the DAG with contiguous children of all shadows.
+	 * @see CompressedShadowContainer::setPackedPointers, CompressedShadowContainer::setContiguousChildren
+	 */
+	void uploadCompactDAG();
+
+	/** Uploads the grid and the DAG directly from the pages of the mapped file */
+	void uploadMappedFile();
+
+private:
+	unique_ptr<SSBO> m_deviceDag;
+	unique_ptr<SSBO> m_deviceGrid;
+
+	vector<Slot> m_slots;
+	NodeStore::Placement m_placement; // offsets of the nodes of the shared store on the GPU
+	size_t m_deviceDagSize;     // number of used words in the DAG on the GPU
+	size_t m_deviceDagCapacity;
+
+	unique_ptr<ShaderProgram> m_traverseCS;
+};
+
+#endif
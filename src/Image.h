@@ -16,6 +16,12 @@ public:
 
 	~Image() = default;
 
+	Image(const Image&) = default;
+	Image& operator=(const Image&) = default;
+
+	Image(Image&&) = default;
+	Image& operator=(Image&&) = default;
+
 	/**
 	 * Set image from pointer to values which must be at least width * height * numChannels.
 	 */
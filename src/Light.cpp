@@ -1,5 +1,6 @@
 #include "Light.h"
 #include <glm/ext.hpp>
+#include <limits>
 
 const vec3 up(0, 1, 0);
 
@@ -30,3 +31,21 @@ mat4 DirectionalLight::getSubProjection(const AABB& bbox, uint x, uint y, uint n
 
 	return glm::ortho(subMinX, subMinX + subSize.x, subMinY, subMinY + subSize.y, minLS.z, maxLS.z);
 }
+
+AABB DirectionalLight::getLightSpaceBounds(const AABB& worldBox) const {
+	AABB box;
+	box.min = vec3(std::numeric_limits<float>::max());
+	box.max = vec3(std::numeric_limits<float>::lowest());
+
+	for (uint corner = 0; corner < 8; ++corner) {
+		const vec3 pos((corner & 1) ? worldBox.max.x : worldBox.min.x,
+		               (corner & 2) ? worldBox.max.y : worldBox.min.y,
+		               (corner & 4) ? worldBox.max.z : worldBox.min.z);
+
+		// The projection is orthographic, so w is always 1
+		const vec3 ndc = vec3(m_viewProj * vec4(pos, 1.0));
+		box.min = glm::min(box.min, ndc);
+		box.max = glm::max(box.max, ndc);
+	}
+	return box;
+}
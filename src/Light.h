@@ -41,6 +41,12 @@ public:
 
 	mat4 getSubProjection(const AABB& bbox, uint x, uint y, uint numSubDivisions) const;
 
+	/**
+	 * Transforms a bounding box from world space to the normalized device coordinates of the light,
+	 * i.e. returns the bounding box of the transformed corners.
+	 */
+	AABB getLightSpaceBounds(const AABB& worldBox) const;
+
 private:
 	void calcViewTransform(const AABB& bbox);
 	
@@ -1,97 +1,162 @@
 #include "MinMaxHierarchy.h"
-#include <cmath>
-#include <thread>
-#include <functional>
+#include "ThreadPool.h"
+#include <algorithm>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 // Under this threshold stop processing in parallel
 #define PARALLEL_THRESHOLD 256
 
-MinMaxHierarchy::MinMaxHierarchy(const ImageF& orig)
-	: m_root(orig)
-{
-	assert(orig.getWidth() == orig.getHeight());
-	const size_t size = orig.getWidth();
-	assert(isPowerOfTwo(size));
-
-	// num of levels (without root)
-	const size_t numLevels = std::ceil(log2(size));
-	m_levels.reserve(numLevels);
+// Width and height of the blocks which are reduced through several levels at once. A block of the root has 16 KB
+// and the blocks of the levels above it a fraction of that, so they are still in the L1 cache when they are read.
+constexpr size_t BLOCK_SIZE = 64;
 
-	ImageF level1 = constructLevelFromRoot(orig);
-	m_levels.push_back(std::move(level1));
+constexpr size_t MinMaxHierarchy::TILE_SIZE;
 
-	for (size_t i = 0; i < numLevels - 1; ++i) {
-		ImageF newLevel = constructLevel(m_levels[i]);
-		m_levels.push_back(std::move(newLevel));
-	}
+MinMaxHierarchy::MinMaxHierarchy(const ImageF& orig, Layout layout)
+	: m_root(orig), m_size(m_root.getWidth()), m_layout(layout)
+{
+	constructLevels();
 }
 
-inline float find(float a, float b, float c, float d, std::function<float(float, float)> pred) {
-	float abRes = pred(a, b);
-	float cdRes = pred(c, d);
-	return pred(abRes, cdRes);
+MinMaxHierarchy::MinMaxHierarchy(ImageF&& orig, Layout layout)
+	: m_root(std::move(orig)), m_size(m_root.getWidth()), m_layout(layout)
+{
+	constructLevels();
 }
 
-void setRow(const ImageF& in, ImageF& out, size_t row, size_t channel, size_t outChannel, std::function<float(float, float)> pred) {
-	for (int x = 0; x < in.getWidth(); x += 2) {
-		float val = find(in.get(x, row, channel), in.get(x + 1, row, channel),
-				in.get(x, row + 1, channel), in.get(x + 1, row + 1, channel), pred);
-
-		out.set(x / 2, row / 2, outChannel, val);
-	}
+/* Returns the number of values which are allocated for a level of the given size */
+inline size_t getPlaneSize(size_t levelSize, MinMaxHierarchy::Layout layout) {
+	if (layout == MinMaxHierarchy::TILED)
+		levelSize = std::max(levelSize, MinMaxHierarchy::TILE_SIZE);
+	return levelSize * levelSize;
 }
 
-inline void constructRange(const ImageF& in, ImageF& out, size_t begin, size_t end, size_t minInChannel, size_t maxInChannel) {
-	for (int y = begin; y < end; y += 2) {
-		setRow(in, out, y, minInChannel, 0, std::min<float>);
-		setRow(in, out, y, maxInChannel, 1, std::max<float>);
-	}
-}
+void MinMaxHierarchy::createTiledRoot() {
+	m_tiledRoot.reset(new float[getPlaneSize(m_size, TILED)]);
 
-ImageF MinMaxHierarchy::constructLevel(const ImageF& in) const {
-	const size_t inSize = in.getWidth();
-	const size_t newSize = inSize / 2;
-	ImageF res(newSize, newSize, 2);
+	const float* rows = m_root.data();
+	float* tiles = m_tiledRoot.get();
+	const size_t rowLength = std::min(m_size, TILE_SIZE);
 
-	if (inSize >= PARALLEL_THRESHOLD) {
-		const size_t perThreadWork = inSize / 4;
-		assert(perThreadWork >= 2);
+	auto copyRows = [&](uint, size_t begin, size_t end) {
+		for (size_t y = begin; y < end; ++y) {
+			for (size_t x = 0; x < m_size; x += TILE_SIZE)
+				std::copy_n(rows + y * m_size + x, rowLength, tiles + getIndex(0, x, y));
+		}
+	};
 
-		std::thread task1{constructRange, std::cref(in), std::ref(res), 0, perThreadWork, MIN_CH, MAX_CH};
-		std::thread task2{constructRange, std::cref(in), std::ref(res), perThreadWork, 2 * perThreadWork, MIN_CH, MAX_CH};
-		std::thread task3{constructRange, std::cref(in), std::ref(res), 2 * perThreadWork, 3 * perThreadWork, MIN_CH, MAX_CH};
-		constructRange(in, res, 3 * perThreadWork, inSize, MIN_CH, MAX_CH);
-
-		task1.join();
-		task2.join();
-		task3.join();
+	if (m_size < PARALLEL_THRESHOLD) {
+		copyRows(0, 0, m_size);
 	} else {
-		constructRange(in, res, 0, inSize, MIN_CH, MAX_CH);
+		ThreadPool& pool = ThreadPool::getDefault();
+		pool.parallelFor(m_size, pool.getNumThreads() * 4, copyRows);
 	}
 
-	return res;
+	// Free the original image, so the hierarchy doesn't need more memory than with the ROW_MAJOR layout
+	m_root = ImageF(0, 0, 1);
 }
 
-ImageF MinMaxHierarchy::constructLevelFromRoot(const ImageF& in) const {
-	const size_t inSize = in.getWidth();
-	const size_t newSize = inSize / 2;
-	ImageF res(newSize, newSize, 2);
+void MinMaxHierarchy::constructLevels() {
+	assert(m_root.getWidth() == m_root.getHeight());
+	assert(isPowerOfTwo(m_size));
 
-	if (inSize >= PARALLEL_THRESHOLD) {
-		const size_t perThreadWork = inSize / 4;
-		assert(perThreadWork >= 2);
+	// num of levels (without root)
+	const size_t numLevels = __builtin_ctzll(m_size);
+	m_mins.reserve(numLevels);
+	m_maxs.reserve(numLevels);
+
+	if (m_layout == TILED)
+		createTiledRoot();
+
+	const float* root = (m_layout == TILED) ? m_tiledRoot.get() : m_root.data();
+	m_minPlanes.push_back(root);
+	m_maxPlanes.push_back(root);
+	for (size_t level = 1; level <= numLevels; ++level) {
+		const size_t planeSize = getPlaneSize(getSize(level), m_layout);
+		m_mins.emplace_back(new float[planeSize]);
+		m_maxs.emplace_back(new float[planeSize]);
+		m_minPlanes.push_back(m_mins.back().get());
+		m_maxPlanes.push_back(m_maxs.back().get());
+	}
+
+	/* Every block of the root is reduced up to the level where it's a single value, then the blocks of that level
+	 * and so on, i.e. most levels are computed while the level below is in the cache instead of one pass per level */
+	ThreadPool& pool = ThreadPool::getDefault();
+	size_t level = 0;
+	while (level < numLevels) {
+		const size_t levelSize = getSize(level);
+		const size_t blockSize = std::min(BLOCK_SIZE, levelSize);
+		const size_t numBlocks = levelSize / blockSize;
+
+		// Blocks are written to disjoint parts of the levels, so they can be processed in any order
+		auto reduceBlocks = [&](uint, size_t begin, size_t end) {
+			for (size_t block = begin; block < end; ++block)
+				reduceBlock(level, (block % numBlocks) * blockSize, (block / numBlocks) * blockSize, blockSize);
+		};
+
+		if (levelSize < PARALLEL_THRESHOLD)
+			reduceBlocks(0, 0, numBlocks * numBlocks);
+		else
+			pool.parallelFor(numBlocks * numBlocks, pool.getNumThreads() * 4, reduceBlocks);
+
+		level += __builtin_ctzll(blockSize);
+	}
+}
 
-		std::thread task1{constructRange, std::cref(in), std::ref(res), 0, perThreadWork, 0, 0};
-		std::thread task2{constructRange, std::cref(in), std::ref(res), perThreadWork, 2 * perThreadWork, 0, 0};
-		std::thread task3{constructRange, std::cref(in), std::ref(res), 2 * perThreadWork, 3 * perThreadWork, 0,0};
-		constructRange(in, res, 3 * perThreadWork, inSize, 0, 0);
+/*
+ * Computes a row of the next level from two rows of the minima and two rows of the maxima, i.e. every value is the
+ * minimum (maximum) of the 2x2 values below it.
+ */
+inline void reduceRows(const float* min0, const float* min1, const float* max0, const float* max1,
+		float* minOut, float* maxOut, size_t outWidth) {
+	size_t x = 0;
+
+#ifdef __SSE2__
+	// Minima of 2 rows of 8 values, whose even and odd values are then combined to 4 values
+	for (; x + 4 <= outWidth; x += 4) {
+		const __m128 minLo = _mm_min_ps(_mm_loadu_ps(min0 + 2 * x), _mm_loadu_ps(min1 + 2 * x));
+		const __m128 minHi = _mm_min_ps(_mm_loadu_ps(min0 + 2 * x + 4), _mm_loadu_ps(min1 + 2 * x + 4));
+		_mm_storeu_ps(minOut + x, _mm_min_ps(_mm_shuffle_ps(minLo, minHi, _MM_SHUFFLE(2, 0, 2, 0)),
+				_mm_shuffle_ps(minLo, minHi, _MM_SHUFFLE(3, 1, 3, 1))));
+
+		const __m128 maxLo = _mm_max_ps(_mm_loadu_ps(max0 + 2 * x), _mm_loadu_ps(max1 + 2 * x));
+		const __m128 maxHi = _mm_max_ps(_mm_loadu_ps(max0 + 2 * x + 4), _mm_loadu_ps(max1 + 2 * x + 4));
+		_mm_storeu_ps(maxOut + x, _mm_max_ps(_mm_shuffle_ps(maxLo, maxHi, _MM_SHUFFLE(2, 0, 2, 0)),
+				_mm_shuffle_ps(maxLo, maxHi, _MM_SHUFFLE(3, 1, 3, 1))));
+	}
+#endif
 
-		task1.join();
-		task2.join();
-		task3.join();
-	} else {
-		constructRange(in, res, 0, inSize, 0, 0);
+	for (; x < outWidth; ++x) {
+		minOut[x] = std::min(std::min(min0[2 * x], min0[2 * x + 1]), std::min(min1[2 * x], min1[2 * x + 1]));
+		maxOut[x] = std::max(std::max(max0[2 * x], max0[2 * x + 1]), std::max(max1[2 * x], max1[2 * x + 1]));
 	}
+}
 
-	return res;
+void MinMaxHierarchy::reduceBlock(size_t level, size_t x, size_t y, size_t blockSize) {
+	for (; blockSize > 1; ++level) {
+		const float* minIn = m_minPlanes[level];
+		const float* maxIn = m_maxPlanes[level];
+		float* minOut = m_mins[level].get(); // m_mins starts at level 1
+		float* maxOut = m_maxs[level].get();
+
+		blockSize /= 2;
+		x /= 2;
+		y /= 2;
+
+		// With tiles a row is only contiguous for TILE_SIZE values of this level, i.e. half as many of the next one
+		const size_t segment = (m_layout == TILED) ? std::min(blockSize, TILE_SIZE / 2) : blockSize;
+
+		for (size_t row = y; row < y + blockSize; ++row) {
+			for (size_t column = x; column < x + blockSize; column += segment) {
+				const size_t in0 = getIndex(level, 2 * column, 2 * row);
+				const size_t in1 = getIndex(level, 2 * column, 2 * row + 1);
+				const size_t out = getIndex(level + 1, column, row);
+
+				reduceRows(minIn + in0, minIn + in1, maxIn + in0, maxIn + in1, minOut + out, maxOut + out, segment);
+			}
+		}
+	}
 }
@@ -3,40 +3,53 @@
 
 #include "cpvs.h"
 #include "Image.h"
-#include "Texture.h"
 
 /**
  * A min-max hierarchy can be created from an Image (with 1 channel, e.g. depth values)
  * and will contain in every level (except level 0, the original image) a min-max value.
  */
 class MinMaxHierarchy {
-private:
-	enum Channel {
-		MIN_CH = 0,
-		MAX_CH = 1
-	};
 public:
+	/**
+	 * Memory layout of the values of every level.
+	 */
+	enum Layout {
+		ROW_MAJOR, // like the original image
+		TILED      // tiles of 8x8 values, see getIndex
+	};
+
+	/** Width and height of a tile of the TILED layout */
+	static constexpr size_t TILE_SIZE = 8;
+
 	/**
 	 * Creates a min-max hierarchy for the given Image.
 	 * @param orig Image where width equals height and are both a power of two.
 	 */
-	MinMaxHierarchy(const ImageF& orig);
+	MinMaxHierarchy(const ImageF& orig, Layout layout = ROW_MAJOR);
+
+	/**
+	 * Creates a min-max hierarchy and takes ownership of the given image, i.e. without copying it.
+	 * For the TILED layout the image is copied into tiles and freed afterwards.
+	 */
+	MinMaxHierarchy(ImageF&& orig, Layout layout = ROW_MAJOR);
 
 	~MinMaxHierarchy() = default;
 
+	// The planes point into the levels, which keep their memory when they are moved but not when they are copied
+	MinMaxHierarchy(const MinMaxHierarchy&) = delete;
+	MinMaxHierarchy& operator=(const MinMaxHierarchy&) = delete;
+
+	MinMaxHierarchy(MinMaxHierarchy&&) = default;
+	MinMaxHierarchy& operator=(MinMaxHierarchy&&) = default;
+
 	/**
 	 * Returns the minimum at (x, y) of the given level.
 	 * @note For level 0 min == max
 	 */
 	inline float getMin(size_t level, size_t x, size_t y) const {
-		if (level == 0) {
-			//assert(checkBounds(m_root, x, y));
-			return m_root.get(x, y, 0);
-		}
-
 		// The assertion costs a lot of performance, so disable it since everything seems to work
-		//assert(checkBounds(m_levels[level - 1], x, y));
-		return m_levels[level - 1].get(x, y, MIN_CH);
+		//assert(x < getSize(level) && y < getSize(level));
+		return m_minPlanes[level][getIndex(level, x, y)];
 	}
 
 	/**
@@ -44,51 +57,102 @@ public:
 	 * @note For level 0 min == max
 	 */
 	inline float getMax(size_t level, size_t x, size_t y) const {
-		if (level == 0) {
-			//assert(checkBounds(m_root, x, y));
-			return m_root.get(x, y, 0);
-		}
-	
 		// see above
-		//assert(checkBounds(m_levels[level - 1], x, y));
-		return m_levels[level - 1].get(x, y, MAX_CH);
+		//assert(x < getSize(level) && y < getSize(level));
+		return m_maxPlanes[level][getIndex(level, x, y)];
 	}
 
 	/**
 	 * Returns the number of levels the hierarchy has (including the original image)
 	 */
 	int getNumLevels() const {
-		return m_levels.size() + 1;
+		return m_minPlanes.size();
 	}
 
 	/**
-	 * Returns a level of the hierarchy.
+	 * Returns the width and height of a level.
 	 */
-	inline const ImageF* getLevel(size_t level) const {
-		if (level == 0)
-			return &m_root;
-		else
-			return &m_levels[level-1];
+	inline size_t getSize(size_t level) const {
+		return m_size >> level;
+	}
+
+	inline Layout getLayout() const {
+		return m_layout;
+	}
+
+	/**
+	 * Returns the minima of the level, whose value (x, y) is at getIndex(level, x, y). For level 0 the minima are
+	 * the maxima.
+	 */
+	inline const float* getMins(size_t level) const {
+		return m_minPlanes[level];
 	}
 
-private:
 	/**
-	 * Constructs a new level for the given one (which can't be level 0!)
+	 * Returns the maxima of the level, see getMins.
 	 */
-	ImageF constructLevel(const ImageF& in) const;
+	inline const float* getMaxs(size_t level) const {
+		return m_maxPlanes[level];
+	}
 
 	/**
-	 * The first level 0 only contains 1 channel, therefore it needs to be processed differently.
+	 * Returns the offset from the index of (x, y) to the one of (x, y + 1) in the level, if both are in the same
+	 * tile. So neighbourhoods inside a tile, e.g. the 2x2 values at even or the 8x8 values at multiples of 8
+	 * coordinates, can be read from one index instead of computing the index of every value.
 	 */
-	ImageF constructLevelFromRoot(const ImageF& in) const;
+	inline size_t getRowStride(size_t level) const {
+		return (m_layout == TILED) ? TILE_SIZE : getSize(level);
+	}
 
-	inline bool checkBounds(const ImageF& img, size_t x, size_t y) const {
-		return x < img.getWidth() && y < img.getHeight();
+	/**
+	 * Returns the index of (x, y) in the values of the level.
+	 *
+	 * With the TILED layout the tiles are stored row by row and the values inside a tile too. So the 2x2 values
+	 * of a node at even coordinates (see cs::createChildmask) are in one cache line and the 8x8 values of a
+	 * leafmask are in one tile, instead of being spread over 2 or 8 rows of the level. Levels smaller than a tile
+	 * are stored in a single, partially used tile.
+	 */
+	inline size_t getIndex(size_t level, size_t x, size_t y) const {
+		if (m_layout == TILED) {
+			const size_t tile = (y / TILE_SIZE) * (getSize(level) / TILE_SIZE) + x / TILE_SIZE;
+			return tile * TILE_SIZE * TILE_SIZE + (y % TILE_SIZE) * TILE_SIZE + x % TILE_SIZE;
+		}
+		return y * getSize(level) + x;
 	}
 
 private:
-	const ImageF m_root;
-	vector<ImageF> m_levels;
+	/**
+	 * Constructs all levels from the root image.
+	 */
+	void constructLevels();
+
+	/**
+	 * Copies the root image into tiles, which are then used as level 0.
+	 */
+	void createTiledRoot();
+
+	/**
+	 * Computes the levels above the given one for the block of blockSize * blockSize values at (x, y) of the level,
+	 * up to the level where the block is a single value.
+	 */
+	void reduceBlock(size_t level, size_t x, size_t y, size_t blockSize);
+
+private:
+	ImageF m_root;
+	size_t m_size;
+	Layout m_layout;
+
+	/* Level 0 in the TILED layout, m_root is empty then */
+	unique_ptr<float[]> m_tiledRoot;
+
+	/* The minima and maxima of levels 1 to n are stored in separate planes, which aren't initialized (unlike an
+	 * ImageF) since every value is written while constructing the levels */
+	vector<unique_ptr<float[]>> m_mins;
+	vector<unique_ptr<float[]>> m_maxs;
+
+	/* Values of all levels including the root, i.e. the minima and maxima of level 0 are both the root */
+	vector<const float*> m_minPlanes;
+	vector<const float*> m_maxPlanes;
 };
 
 #endif
@@ -0,0 +1,286 @@
+#include "NodeStore.h"
+#include "CompressedShadowUtil.h"
+
+#include <limits>
+using namespace std;
+
+/* A handle consists of the stripe in the upper bits and the index of the node in the stripe */
+constexpr uint STRIPE_BITS = 6;
+constexpr uint NUM_STRIPES = 1 << STRIPE_BITS;
+constexpr uint INDEX_BITS  = 32 - STRIPE_BITS;
+constexpr uint INDEX_MASK  = (1 << INDEX_BITS) - 1;
+
+constexpr uint NO_OFFSET = std::numeric_limits<uint>::max();
+
+inline uint getStripeNr(uint handle) {
+	return handle >> INDEX_BITS;
+}
+
+inline uint getIndex(uint handle) {
+	return handle & INDEX_MASK;
+}
+
+/* Hashes the node and its level, since identical nodes in different levels must not be merged */
+inline uint64 hashNode(uint level, const uint* node, uint nodeSize) {
+	return cs::hashNode(node, nodeSize) ^ (level * 0x9E3779B97F4A7C15);
+}
+
+NodeStore::NodeStore(uint numLevels, bool leafmasks)
+	: m_numLevels(numLevels), m_leafmasks(leafmasks), m_stripes(new Stripe[NUM_STRIPES])
+{
+	assert(m_numLevels > 3);
+}
+
+inline uint NodeStore::getNodeSize(uint level, uint childmask) const {
+	const uint numChildren = cs::getNumChildren(childmask);
+	return isLeafLevel(level) ? 1 + 2 * numChildren : 1 + numChildren;
+}
+
+uint NodeStore::insert(uint level, const uint* node, uint nodeSize) {
+	const uint64 hash = hashNode(level, node, nodeSize);
+
+	// Use the upper bits for the stripe, the lower bits are used as index into the hash table
+	const uint stripeNr = hash >> (64 - STRIPE_BITS);
+	Stripe& stripe = m_stripes[stripeNr];
+
+	std::lock_guard<std::mutex> lock(stripe.mutex);
+
+	// Keep the load factor below 0.5
+	if ((stripe.nodeOffsets.size() + 1) * 2 > stripe.table.size())
+		growTable(stripe);
+
+	const size_t mask = stripe.table.size() - 1;
+	size_t slot = hash & mask;
+
+	while (stripe.table[slot] != 0) {
+		const uint candidate = stripe.table[slot] - 1;
+		const auto stored = stripe.nodes.begin() + stripe.nodeOffsets[candidate];
+
+		// Nodes with different childmasks differ in the first element, so the size needs no extra check
+		if (*stored == level && cs::isEqualSubtree(node, stored + 1, nodeSize))
+			return (stripeNr << INDEX_BITS) | candidate;
+
+		slot = (slot + 1) & mask;
+	}
+
+	const uint index = stripe.nodeOffsets.size();
+	assert(index < INDEX_MASK);
+
+	stripe.nodeOffsets.push_back(stripe.nodes.size());
+	stripe.nodes.push_back(level);
+	stripe.nodes.insert(stripe.nodes.end(), node, node + nodeSize);
+
+	stripe.table[slot] = index + 1;
+	return (stripeNr << INDEX_BITS) | index;
+}
+
+void NodeStore::growTable(Stripe& stripe) {
+	const size_t capacity = std::max<size_t>(16, stripe.table.size() * 2);
+	stripe.table.assign(capacity, 0);
+
+	const size_t mask = capacity - 1;
+
+	for (uint index = 0; index < stripe.nodeOffsets.size(); ++index) {
+		const uint* stored = &stripe.nodes[stripe.nodeOffsets[index]];
+		const uint level = stored[0];
+		const uint* node = stored + 1;
+
+		size_t slot = hashNode(level, node, getNodeSize(level, node[0])) & mask;
+		while (stripe.table[slot] != 0)
+			slot = (slot + 1) & mask;
+
+		stripe.table[slot] = index + 1;
+	}
+}
+
+const uint* NodeStore::getNode(uint handle) const {
+	const Stripe& stripe = m_stripes[getStripeNr(handle)];
+	// Skip the level
+	return &stripe.nodes[stripe.nodeOffsets[getIndex(handle)] + 1];
+}
+
+size_t NodeStore::getNumNodes() const {
+	size_t numNodes = 0;
+	for (uint stripeNr = 0; stripeNr < NUM_STRIPES; ++stripeNr)
+		numNodes += m_stripes[stripeNr].nodeOffsets.size();
+	return numNodes;
+}
+
+vector<size_t> NodeStore::getNumNodesPerLevel() const {
+	vector<size_t> numNodes(m_numLevels - 1, 0);
+	for (uint stripeNr = 0; stripeNr < NUM_STRIPES; ++stripeNr) {
+		const Stripe& stripe = m_stripes[stripeNr];
+		for (uint offset : stripe.nodeOffsets)
+			++numNodes[stripe.nodes[offset]];
+	}
+	return numNodes;
+}
+
+size_t NodeStore::getSize() const {
+	size_t size = 0;
+	for (uint stripeNr = 0; stripeNr < NUM_STRIPES; ++stripeNr)
+		size += m_stripes[stripeNr].nodes.size();
+	return size;
+}
+
+vector<vector<uint>> NodeStore::getReachableNodes(const vector<uint>& roots) const {
+	const uint rootLevel = m_numLevels - 2;
+	const uint minLevel  = m_leafmasks ? 2 : 0;
+
+	vector<vector<bool>> visited(NUM_STRIPES);
+	for (uint stripeNr = 0; stripeNr < NUM_STRIPES; ++stripeNr)
+		visited[stripeNr].assign(m_stripes[stripeNr].nodeOffsets.size(), false);
+
+	vector<vector<uint>> nodes(m_numLevels - 1);
+	auto visit = [&](uint handle, vector<uint>& levelNodes) {
+		vector<bool>& stripeVisited = visited[getStripeNr(handle)];
+		if (!stripeVisited[getIndex(handle)]) {
+			stripeVisited[getIndex(handle)] = true;
+			levelNodes.push_back(handle);
+		}
+	};
+
+	for (const uint root : roots)
+		visit(root, nodes[rootLevel]);
+
+	for (uint lvl = rootLevel; lvl > minLevel; --lvl) {
+		for (const uint handle : nodes[lvl]) {
+			const uint* node = getNode(handle);
+			const uint numChildren = cs::getNumChildren(node[0]);
+
+			for (uint childNr = 0; childNr < numChildren; ++childNr)
+				visit(node[childNr + 1], nodes[lvl - 1]);
+		}
+	}
+	return nodes;
+}
+
+size_t NodeStore::getReachableSize(const vector<uint>& roots) const {
+	const auto nodes = getReachableNodes(roots);
+
+	// Every node is stored with its level
+	size_t size = 0;
+	for (uint lvl = 0; lvl < nodes.size(); ++lvl) {
+		for (const uint handle : nodes[lvl])
+			size += 1 + getNodeSize(lvl, getNode(handle)[0]);
+	}
+	return size;
+}
+
+size_t NodeStore::getLayoutSize(const vector<uint>& roots) const {
+	const auto nodes = getReachableNodes(roots);
+
+	size_t size = 0;
+	for (uint lvl = 0; lvl < nodes.size(); ++lvl) {
+		for (const uint handle : nodes[lvl])
+			size += getNodeSize(lvl, getNode(handle)[0]);
+	}
+	return size;
+}
+
+unique_ptr<NodeStore> NodeStore::compact(vector<uint>& roots) const {
+	auto store = make_unique<NodeStore>(m_numLevels, m_leafmasks);
+	const auto nodes = getReachableNodes(roots);
+
+	/* The new handle of every reachable node, per stripe */
+	vector<vector<uint>> handles(NUM_STRIPES);
+	for (uint stripeNr = 0; stripeNr < NUM_STRIPES; ++stripeNr)
+		handles[stripeNr].resize(m_stripes[stripeNr].nodeOffsets.size());
+
+	auto getHandle = [&](uint handle) -> uint& {
+		return handles[getStripeNr(handle)][getIndex(handle)];
+	};
+
+	/* Insert the nodes bottom up, so the children of a node already have their new handles */
+	vector<uint> node;
+	for (uint lvl = 0; lvl < nodes.size(); ++lvl) {
+		for (const uint handle : nodes[lvl]) {
+			const uint* oldNode = getNode(handle);
+			node.assign(oldNode, oldNode + getNodeSize(lvl, oldNode[0]));
+
+			if (!isLeafLevel(lvl)) {
+				for (size_t i = 1; i < node.size(); ++i)
+					node[i] = getHandle(node[i]);
+			}
+			getHandle(handle) = store->insert(lvl, node.data(), node.size());
+		}
+	}
+
+	for (uint& root : roots)
+		root = getHandle(root);
+	return store;
+}
+
+vector<uint> NodeStore::layout(const vector<uint>& roots, vector<uint>* rootOffsets, Placement* placement) const {
+	const uint rootLevel = m_numLevels - 2;
+	const uint minLevel  = m_leafmasks ? 2 : 0;
+
+	/* The final offset of every node, per stripe. Also used to mark nodes which have been ordered.
+	 * Nodes inserted since a previous layout are added to its placement */
+	Placement newPlacement;
+	Placement& placed = placement ? *placement : newPlacement;
+
+	placed.offsets.resize(NUM_STRIPES);
+	for (uint stripeNr = 0; stripeNr < NUM_STRIPES; ++stripeNr)
+		placed.offsets[stripeNr].resize(m_stripes[stripeNr].nodeOffsets.size(), NO_OFFSET);
+
+	auto getOffset = [&](uint handle) -> uint& {
+		return placed.offsets[getStripeNr(handle)][getIndex(handle)];
+	};
+
+	/* Find the order of the nodes in every level, i.e. the order in which they are first referenced
+	 * by their (already ordered) parents, and calculate their offsets */
+	const size_t firstOffset = placed.size;
+	size_t dagSize = placed.size;
+
+	auto append = [&](uint handle, uint nodeLevel, vector<uint>& order) {
+		uint& offset = getOffset(handle);
+		if (offset == NO_OFFSET) {
+			assert(dagSize < NO_OFFSET);
+			offset = dagSize;
+			dagSize += getNodeSize(nodeLevel, getNode(handle)[0]);
+			order.push_back(handle);
+		}
+	};
+
+	vector<vector<uint>> order(m_numLevels - 1);
+	for (const uint root : roots)
+		append(root, rootLevel, order[rootLevel]);
+
+	for (uint lvl = rootLevel; lvl > minLevel; --lvl) {
+		for (const uint handle : order[lvl]) {
+			const uint* node = getNode(handle);
+			const uint numChildren = cs::getNumChildren(node[0]);
+
+			for (uint childNr = 0; childNr < numChildren; ++childNr)
+				append(node[childNr + 1], lvl - 1, order[lvl - 1]);
+		}
+	}
+
+	/* Copy nodes and replace child handles with offsets */
+	vector<uint> dag;
+	dag.reserve(dagSize - firstOffset);
+
+	for (int lvl = rootLevel; lvl >= static_cast<int>(minLevel); --lvl) {
+		for (const uint handle : order[lvl]) {
+			const uint* node = getNode(handle);
+			const uint nodeSize = getNodeSize(lvl, node[0]);
+
+			if (isLeafLevel(lvl)) {
+				dag.insert(dag.end(), node, node + nodeSize);
+			} else {
+				dag.push_back(node[0]);
+				for (uint i = 1; i < nodeSize; ++i)
+					dag.push_back(getOffset(node[i]));
+			}
+		}
+	}
+
+	if (rootOffsets) {
+		rootOffsets->clear();
+		for (const uint root : roots)
+			rootOffsets->push_back(getOffset(root));
+	}
+	placed.size = dagSize;
+	return dag;
+}
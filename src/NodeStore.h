@@ -0,0 +1,143 @@
+#ifndef NODE_STORE_H
+#define NODE_STORE_H
+
+#include "cpvs.h"
+
+#include <mutex>
+
+/**
+ * A thread-safe store of unique DAG nodes, i.e. a hash-consing table keyed on the level and the
+ * contents of a node.
+ *
+ * Nodes are stored as childmask followed by either the handles of their children or the 64-bit leafmasks.
+ * Inserting a node which already exists returns the handle of the existing node, so identical subtrees are
+ * stored only once, even if they are inserted by different builders (e.g. tiles or z-slices) concurrently.
+ *
+ * The store is split into stripes by the hash of a node, and every stripe is protected by its own lock,
+ * so concurrent builders rarely block each other.
+ *
+ * @see DagBuilder
+ */
+class NodeStore {
+public:
+	/**
+	 * Offsets of the nodes which have been laid out into one DAG, so later layouts can append only the nodes
+	 * which aren't in it yet (see layout).
+	 */
+	struct Placement {
+		vector<vector<uint>> offsets; // offset of every node per stripe
+		size_t size = 0;              // number of words of the DAG
+	};
+
+	/**
+	 * @param numLevels Number of levels of the DAGs in this store.
+	 * @param leafmasks If true, level 2 stores 1x1x8 nodes with 64-bit leafmasks.
+	 */
+	NodeStore(uint numLevels, bool leafmasks);
+	~NodeStore() = default;
+
+	NodeStore(const NodeStore&) = delete;
+	NodeStore& operator=(const NodeStore&) = delete;
+
+	/**
+	 * Inserts the node into the store if it doesn't exist yet and returns its handle.
+	 * @note Can be called concurrently.
+	 */
+	uint insert(uint level, const uint* node, uint nodeSize);
+
+	/**
+	 * Returns a pointer to the node with the given handle, starting with its childmask.
+	 * @note Must not be called concurrently with insert.
+	 */
+	const uint* getNode(uint handle) const;
+
+	/**
+	 * Returns the total number of unique nodes.
+	 */
+	size_t getNumNodes() const;
+
+	/**
+	 * Returns the number of unique nodes in every level.
+	 * @note Must not be called concurrently with insert.
+	 */
+	vector<size_t> getNumNodesPerLevel() const;
+
+	/**
+	 * Returns the number of words used by all nodes, incl. the level stored with every node.
+	 * @note Must not be called concurrently with insert.
+	 */
+	size_t getSize() const;
+
+	inline uint getNumLevels() const {
+		return m_numLevels;
+	}
+
+	inline bool hasLeafmasks() const {
+		return m_leafmasks;
+	}
+
+	/**
+	 * Writes all nodes reachable from the given roots (which must be at the highest level) to a single DAG
+	 * in the compressed layout, i.e. level by level, with absolute pointers for every partially visible child.
+	 * Nodes are ordered by their first reference, starting with the roots.
+	 *
+	 * @param rootOffsets If not null, receives the offset of every root in the DAG.
+	 * @param placement If not null, the nodes of a previous layout with this placement are referenced instead of
+	 * being written again. Only the new nodes are returned, which are placed after the previous DAG, and are
+	 * added to the placement.
+	 * @note Must not be called concurrently with insert.
+	 */
+	vector<uint> layout(const vector<uint>& roots, vector<uint>* rootOffsets = nullptr,
+			Placement* placement = nullptr) const;
+
+	/**
+	 * Returns the number of words used by the nodes reachable from the given roots, see getSize.
+	 * The difference to getSize is used by nodes which aren't referenced anymore, e.g. of replaced shadows.
+	 * @note Must not be called concurrently with insert.
+	 */
+	size_t getReachableSize(const vector<uint>& roots) const;
+
+	/**
+	 * Returns the size of the DAG which layout writes for the given roots, i.e. of the reachable nodes without
+	 * their levels.
+	 * @note Must not be called concurrently with insert.
+	 */
+	size_t getLayoutSize(const vector<uint>& roots) const;
+
+	/**
+	 * Creates a store which contains only the nodes reachable from the given roots, and replaces the roots by
+	 * their handles in the new store.
+	 * @note Must not be called concurrently with insert.
+	 */
+	unique_ptr<NodeStore> compact(vector<uint>& roots) const;
+
+private:
+	/**
+	 * A part of the hash table and the nodes. Every node is stored as level followed by the node itself.
+	 */
+	struct Stripe {
+		std::mutex mutex;
+		vector<uint> nodes;
+		vector<uint> nodeOffsets; // offset of every node in 'nodes'
+		vector<uint> table; // open-addressed hash table storing the local node index + 1
+	};
+
+	void growTable(Stripe& stripe);
+
+	/** Returns the handles of all nodes reachable from the roots per level, in the order of their first reference */
+	vector<vector<uint>> getReachableNodes(const vector<uint>& roots) const;
+
+	inline uint getNodeSize(uint level, uint childmask) const;
+
+	inline bool isLeafLevel(uint level) const {
+		return m_leafmasks && level == 2;
+	}
+
+private:
+	const uint m_numLevels;
+	const bool m_leafmasks;
+
+	unique_ptr<Stripe[]> m_stripes;
+};
+
+#endif
@@ -5,7 +5,7 @@
 #ifndef AW_QUAD_H
 #define AW_QUAD_H
 
-#include "cpvs.h"
+#include "cpvsGL.h"
 
 class Quad {
 protected:
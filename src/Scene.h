@@ -20,22 +20,22 @@ struct Material {
 };
 
 struct Mesh {
-	GLuint vao;
-	GLuint numFaces;
+	uint vao; // 0 if the mesh hasn't been uploaded to the GPU (see GLScene)
+	uint numFaces;
 	Material material;
 	AABB boundingBox;
 
-	inline void bind() const {
-		glBindVertexArray(vao);
-	}
+	/** Data on the CPU, which is freed when the mesh is uploaded to the GPU unless it is kept */
+	vector<vec3> positions;
+	vector<vec3> normals;
+	vector<uint> indices;
 
-	inline void draw() const {
-		glDrawElements(GL_TRIANGLES, numFaces * 3, GL_UNSIGNED_INT, 0);
-	}
+	Mesh() : vao(0), numFaces(0) { }
 };
 
 struct Scene {
 	Scene() = default;
+	virtual ~Scene() = default;
 
 	Scene(const Scene& rhs) = delete;
 	Scene& operator=(const Scene& rhs) = delete;
@@ -43,11 +43,6 @@ struct Scene {
 	Scene(Scene&& rhs) = default;
 	Scene& operator=(Scene&& rhs) = default;
 
-	inline ~Scene() {
-		for (const auto& mesh : meshes)
-			glDeleteVertexArrays(1, &mesh.vao);
-	}
-
 	AABB boundingBox;
 	std::vector<Mesh> meshes;
 };
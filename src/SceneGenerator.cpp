@@ -0,0 +1,194 @@
+#include "SceneGenerator.h"
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <stdexcept>
+using namespace std;
+
+/* Returns a random value in [0, 1) for the given cell, which only depends on the cell and the seed */
+inline float randomValue(ivec2 cell, uint seed) {
+	uint h = seed * 0x9E3779B9u;
+	h ^= static_cast<uint>(cell.x) * 0x85EBCA6Bu;
+	h = (h ^ (h >> 16)) * 0x7FEB352Du;
+	h ^= static_cast<uint>(cell.y) * 0xC2B2AE35u;
+	h = (h ^ (h >> 15)) * 0x846CA68Bu;
+	h ^= h >> 16;
+	return (h >> 8) / static_cast<float>(1 << 24);
+}
+
+/* Value noise in [0, 1], i.e. random values at the integer positions which are interpolated smoothly */
+inline float valueNoise(vec2 p, uint seed) {
+	const vec2 cell = glm::floor(p);
+	const ivec2 i(cell);
+	vec2 f = p - cell;
+	f = f * f * (3.0f - 2.0f * f);
+
+	const float bottom = glm::mix(randomValue(i, seed), randomValue(i + ivec2(1, 0), seed), f.x);
+	const float top = glm::mix(randomValue(i + ivec2(0, 1), seed), randomValue(i + ivec2(1, 1), seed), f.x);
+	return glm::mix(bottom, top, f.y);
+}
+
+/* Sum of octaves of value noise with doubled frequencies and halved amplitudes, normalized to [0, 1] */
+inline float fractalNoise(vec2 p, uint seed, uint numOctaves) {
+	float sum = 0.0f, amplitude = 1.0f, totalAmplitude = 0.0f;
+	for (uint octave = 0; octave < numOctaves; ++octave) {
+		sum += amplitude * valueNoise(p, seed + octave);
+		totalAmplitude += amplitude;
+		amplitude *= 0.5f;
+		p *= 2.0f;
+	}
+	return sum / totalAmplitude;
+}
+
+float getTerrainHeight(vec2 uv, uint seed) {
+	return 0.1f + 0.6f * fractalNoise(uv * 8.0f, seed, 8);
+}
+
+float getCityHeight(vec2 uv, uint seed) {
+	constexpr float numBlocks = 48.0f;
+	constexpr float streetWidth = 0.15f;
+	constexpr float groundHeight = 0.02f;
+
+	const vec2 block = uv * numBlocks;
+	const vec2 inBlock = glm::fract(block);
+	if (inBlock.x < streetWidth || inBlock.y < streetWidth)
+		return groundHeight;
+
+	// Every tenth block is an empty square, the others have 2x2 buildings
+	const ivec2 blockIndex(glm::floor(block));
+	if (randomValue(blockIndex, seed) < 0.1f)
+		return groundHeight;
+
+	const float lotSize = (1.0f - streetWidth) * 0.5f;
+	const ivec2 lot(inBlock.x >= streetWidth + lotSize, inBlock.y >= streetWidth + lotSize);
+	const float r = randomValue(blockIndex * 2 + lot, seed + 1);
+	return 0.05f + 0.55f * r * r;
+}
+
+float getFoliageHeight(vec2 uv, uint seed) {
+	const float ground = 0.05f + 0.05f * valueNoise(uv * 4.0f, seed);
+
+	// The canopy is high-frequency noise, with gaps where it is below a threshold
+	const float canopy = fractalNoise(uv * 256.0f, seed + 16, 5);
+	if (canopy < 0.45f)
+		return ground;
+	return 0.2f + 0.5f * canopy;
+}
+
+float getSparseHeight(vec2 uv, uint seed) {
+	constexpr float numCells = 128.0f;
+	const float ground = 0.05f + 0.02f * valueNoise(uv * 4.0f, seed);
+
+	// Few cells contain a round object (e.g. a tree or a pole) at a random position inside the cell
+	const vec2 p = uv * numCells;
+	const ivec2 cell(glm::floor(p));
+	if (randomValue(cell, seed + 1) >= 0.03f)
+		return ground;
+
+	const float radius = 0.1f + 0.15f * randomValue(cell, seed + 2);
+	const vec2 center = vec2(cell) + radius + (1.0f - 2.0f * radius) * vec2(randomValue(cell, seed + 3),
+			randomValue(cell, seed + 4));
+	if (glm::length(p - center) > radius)
+		return ground;
+	return 0.2f + 0.4f * randomValue(cell, seed + 5);
+}
+
+SceneGenerator::Shape SceneGenerator::getShape(const string& name) {
+	for (Shape shape : {TERRAIN, CITY, FOLIAGE, SPARSE}) {
+		if (name == getShapeName(shape))
+			return shape;
+	}
+	throw std::invalid_argument("Unknown shape " + name);
+}
+
+const char* SceneGenerator::getShapeName(Shape shape) {
+	switch (shape) {
+	case TERRAIN: return "terrain";
+	case CITY:    return "city";
+	case FOLIAGE: return "foliage";
+	case SPARSE:  return "sparse";
+	}
+	return "";
+}
+
+float SceneGenerator::getHeight(vec2 uv) const {
+	switch (m_shape) {
+	case TERRAIN: return getTerrainHeight(uv, m_seed);
+	case CITY:    return getCityHeight(uv, m_seed);
+	case FOLIAGE: return getFoliageHeight(uv, m_seed);
+	case SPARSE:  return getSparseHeight(uv, m_seed);
+	}
+	return 0.0f;
+}
+
+ImageF SceneGenerator::createDepths(uint size) const {
+	return createTile(size, size, 0, 0);
+}
+
+ImageF SceneGenerator::createTile(uint size, uint tileSize, uint x, uint y) const {
+	assert(isPowerOfTwo(size) && tileSize <= size);
+
+	ImageF depths(tileSize, tileSize, 1);
+	float* data = depths.data();
+
+	// The depths are sampled at the centers of the pixels
+	ThreadPool& pool = ThreadPool::getDefault();
+	pool.parallelFor(tileSize, pool.getNumThreads() * 4, [&](uint, size_t begin, size_t end) {
+		for (size_t row = begin; row < end; ++row) {
+			for (uint column = 0; column < tileSize; ++column) {
+				const vec2 pixel(x * tileSize + column + 0.5f, y * tileSize + row + 0.5f);
+				data[row * tileSize + column] = 1.0f - getHeight(pixel / static_cast<float>(size));
+			}
+		}
+	});
+	return depths;
+}
+
+unique_ptr<Scene> SceneGenerator::createScene(uint resolution) const {
+	assert(resolution > 0);
+	const uint numVertices = resolution + 1;
+
+	vector<float> heights(numVertices * numVertices);
+	for (uint v = 0; v < numVertices; ++v) {
+		for (uint u = 0; u < numVertices; ++u)
+			heights[v * numVertices + u] = getHeight(vec2(u, v) / static_cast<float>(resolution));
+	}
+
+	Mesh mesh;
+	mesh.material.diffuseColor = vec3(0.7f);
+	mesh.positions.reserve(numVertices * numVertices);
+	mesh.normals.reserve(numVertices * numVertices);
+
+	const float spacing = 2.0f / resolution;
+	for (uint v = 0; v < numVertices; ++v) {
+		for (uint u = 0; u < numVertices; ++u) {
+			mesh.positions.emplace_back(u * spacing - 1.0f, heights[v * numVertices + u], 1.0f - v * spacing);
+
+			// Central differences, which are one-sided at the border
+			const uint u0 = (u > 0) ? u - 1 : u, u1 = (u < resolution) ? u + 1 : u;
+			const uint v0 = (v > 0) ? v - 1 : v, v1 = (v < resolution) ? v + 1 : v;
+			const float dx = (heights[v * numVertices + u1] - heights[v * numVertices + u0]) / ((u1 - u0) * spacing);
+			const float dz = -(heights[v1 * numVertices + u] - heights[v0 * numVertices + u]) / ((v1 - v0) * spacing);
+			mesh.normals.push_back(glm::normalize(vec3(-dx, 1.0f, -dz)));
+		}
+	}
+
+	// Two counter-clockwise triangles (seen from above) per quad
+	mesh.numFaces = 2 * resolution * resolution;
+	mesh.indices.reserve(mesh.numFaces * 3);
+	for (uint v = 0; v < resolution; ++v) {
+		for (uint u = 0; u < resolution; ++u) {
+			const uint i = v * numVertices + u;
+			mesh.indices.insert(mesh.indices.end(), {i, i + 1, i + numVertices + 1, i, i + numVertices + 1,
+					i + numVertices});
+		}
+	}
+
+	mesh.boundingBox.min = vec3(-1.0f, *std::min_element(heights.begin(), heights.end()), -1.0f);
+	mesh.boundingBox.max = vec3(1.0f, *std::max_element(heights.begin(), heights.end()), 1.0f);
+
+	auto scene = make_unique<Scene>();
+	scene->boundingBox = mesh.boundingBox;
+	scene->meshes.push_back(std::move(mesh));
+	return scene;
+}
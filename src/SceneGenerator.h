@@ -0,0 +1,64 @@
+#ifndef SCENE_GENERATOR_H
+#define SCENE_GENERATOR_H
+
+#include "cpvs.h"
+#include "Image.h"
+#include "Scene.h"
+
+/**
+ * Generates procedural heightfields, from which depth maps of any size and matching scenes are created, e.g. for
+ * benchmarks and tests at production scale.
+ *
+ * The heightfield is a function of the position in [0, 1]^2 and the seed only, so the depth maps of all sizes and
+ * all their tiles fit together, and the output is the same on every machine (no std:: distributions are used,
+ * whose results depend on the standard library).
+ *
+ * The depth map is the one of a light straight above the scene, whose near plane is at height 1 and far plane at
+ * height 0, i.e. the depth is 1 - height. Like the tiles of a DepthFile, the rows start at the bottom.
+ */
+class SceneGenerator {
+public:
+	enum Shape {
+		TERRAIN, // smooth hills and valleys (fractal value noise)
+		CITY,    // blocks of boxes with different heights, separated by streets
+		FOLIAGE, // high-frequency canopy with gaps to the ground
+		SPARSE   // open field with a few small, scattered objects
+	};
+
+	SceneGenerator(Shape shape, uint seed = 0)
+		: m_shape(shape), m_seed(seed)
+	{ }
+
+	/**
+	 * Returns the shape with the given name ("terrain", "city", "foliage" or "sparse").
+	 * @throws std::invalid_argument if there is no such shape.
+	 */
+	static Shape getShape(const string& name);
+
+	static const char* getShapeName(Shape shape);
+
+	/** Returns the height in [0, 1] of the heightfield at the given position in [0, 1]^2 */
+	float getHeight(vec2 uv) const;
+
+	/** Creates the depth map of the given size, which must be a power of two */
+	ImageF createDepths(uint size) const;
+
+	/**
+	 * Creates the tile (x, y) of size tileSize * tileSize of the depth map of the given size, e.g. for a DepthSource.
+	 * Tiles are numbered like the sub-projections of a DirectionalLight, i.e. starting at the bottom left.
+	 */
+	ImageF createTile(uint size, uint tileSize, uint x, uint y) const;
+
+	/**
+	 * Creates the heightfield as a mesh of resolution * resolution quads in [-1, 1] (x) * [0, 1] (y) * [-1, 1] (z),
+	 * whose vertices are sampled from the same heightfield as the depth maps. The position u of the heightfield
+	 * is the x-axis and v the negative z-axis.
+	 */
+	unique_ptr<Scene> createScene(uint resolution) const;
+
+private:
+	Shape m_shape;
+	uint m_seed;
+};
+
+#endif
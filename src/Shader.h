@@ -5,7 +5,7 @@
 #ifndef AW_SHADER_H
 #define AW_SHADER_H
 
-#include "cpvs.h"
+#include "cpvsGL.h"
 
 class ShaderException {
 public:
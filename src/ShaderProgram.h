@@ -5,7 +5,7 @@
 #ifndef AW_SHADERPROGRAM_H
 #define AW_SHADERPROGRAM_H
 
-#include "cpvs.h"
+#include "cpvsGL.h"
 #include "Shader.h"
 #include <unordered_map>
 
@@ -0,0 +1,169 @@
+#include "ShadowBaker.h"
+#include "BuildStats.h"
+#include "CompressedShadowContainer.h"
+#include "MinMaxHierarchy.h"
+#include "ThreadPool.h"
+#include "TaskGraph.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <stdexcept>
+using namespace std;
+
+/* Number of xy-tiles whose depths and min-max hierarchies may be in memory at the same time */
+constexpr uint MAX_TILES_IN_FLIGHT = 2;
+
+/* Intermediate results of one xy-tile, which are freed after its last task has finished */
+struct TileState {
+	ImageF depths = ImageF(0, 0, 1);
+	unique_ptr<MinMaxHierarchy> minMax;
+};
+
+/*
+ * Adds the tasks creating the min-max hierarchy of the xy-tile (x, y) after the depths have been created by the
+ * given task and the tasks creating its z-tiles [firstSlice, numSlices). Returns the ids of the latter.
+ */
+vector<TaskGraph::TaskId> addShadowTileTasks(TaskGraph& graph, CompressedShadowContainer* shadows,
+		const shared_ptr<TileState>& state, TaskGraph::TaskId depthTask, uint x, uint y, uint numSlices,
+		uint firstSlice, MinMaxHierarchy::Layout layout, BuildStats* stats) {
+
+	// The hierarchy takes ownership of the depths, so only one copy of every tile is in memory (see tiledMinMax)
+	const auto minMaxTask = graph.add("min-max", [state, layout, stats]() {
+		const auto t0 = chrono::steady_clock::now();
+		state->minMax = make_unique<MinMaxHierarchy>(std::move(state->depths), layout);
+		if (stats)
+			stats->addPhase("minMaxHierarchy", chrono::duration<double>(chrono::steady_clock::now() - t0).count());
+	}, {depthTask});
+
+	NodeStore* store = shadows->getNodeStore();
+
+	vector<TaskGraph::TaskId> buildTasks;
+	buildTasks.reserve(numSlices - firstSlice);
+
+	for (uint tile = firstSlice; tile < numSlices; ++tile) {
+		buildTasks.push_back(graph.add("build", [shadows, store, state, numSlices, x, y, tile, stats]() {
+			TileStats tileStats;
+			TileStats* tileStatsPtr = stats ? &tileStats : nullptr;
+
+			if (store) {
+				shadows->setRoot(CompressedShadow::createInStore(*state->minMax, *store, tile, numSlices, tileStatsPtr),
+						x, y, tile);
+			} else {
+				shadows->set(CompressedShadow::create(*state->minMax, tile, numSlices, tileStatsPtr), x, y, tile);
+			}
+
+			if (stats)
+				stats->addTile(x, y, tile, std::move(tileStats));
+		}, {minMaxTask}));
+	}
+	return buildTasks;
+}
+
+ShadowBaker::ShadowBaker(uint size, const BakeSettings& settings)
+	: m_tileSize(getTileSize(size)), m_numTiles(size / m_tileSize), m_settings(settings)
+{ }
+
+uint ShadowBaker::getTileSize(uint size) {
+	// Caps the memory of the depths and the min-max hierarchy of one tile
+	return std::min(size, 8192u);
+}
+
+void ShadowBaker::configure(CompressedShadowContainer& shadows) const {
+	assert(shadows.getLength() == m_numTiles);
+	if (m_settings.packedPointers && m_settings.contiguousChildren)
+		throw std::invalid_argument("Packed pointers can't be combined with contiguous children");
+
+	// A shared store can't be written to disk, so it is only used without a memory budget
+	if (m_settings.shareSubtrees && m_settings.memoryBudget == 0)
+		shadows.shareSubtrees(std::ceil(log2(m_tileSize)) + 1);
+	else
+		shadows.setMemoryBudget(m_settings.memoryBudget, m_settings.spillDirectory);
+
+	shadows.setLeafmaskDictionary(m_settings.leafmaskDictionary);
+	shadows.setPackedPointers(m_settings.packedPointers);
+	shadows.setContiguousChildren(m_settings.contiguousChildren);
+}
+
+void ShadowBaker::bake(CompressedShadowContainer& shadows, const DepthSource& depths, BuildStats* stats) const {
+	bakeTiles(shadows, depths, ivec2(0), ivec2(m_numTiles - 1), 0, stats);
+
+	// The tiles share the nodes of the store, so the unique nodes and the DAG size are only known for all of them
+	if (stats && shadows.getNodeStore()) {
+		stats->setNumMergedNodes(shadows.getNodeStore()->getNumNodesPerLevel());
+		stats->setSharedDagSize(shadows.getSharedDAGSize(), shadows.getNodeStore()->getSize());
+	}
+}
+
+void ShadowBaker::update(CompressedShadowContainer& shadows, const DepthSource& depths,
+		const AABB& lightSpaceBox) const {
+	const int numTiles = m_numTiles;
+
+	// Tiles are numbered like the grid cells, starting at -1 in NDC
+	auto getTile = [numTiles](float ndc) {
+		return glm::clamp(static_cast<int>(std::floor((ndc + 1.0f) * 0.5f * numTiles)), 0, numTiles - 1);
+	};
+
+	const ivec2 minTile(getTile(lightSpaceBox.min.x), getTile(lightSpaceBox.min.y));
+	const ivec2 maxTile(getTile(lightSpaceBox.max.x), getTile(lightSpaceBox.max.y));
+
+	bakeTiles(shadows, depths, minTile, maxTile, getTile(lightSpaceBox.min.z), nullptr);
+}
+
+void ShadowBaker::bakeTiles(CompressedShadowContainer& shadows, const DepthSource& depths, const ivec2& minTile,
+		const ivec2& maxTile, uint firstSlice, BuildStats* stats) const {
+	/*
+	 * The depths of one xy-tile after another are created (e.g. rendered on the thread owning the GL context).
+	 * The min-max hierarchy and the z-tiles are created in the thread pool, so they overlap with creating the
+	 * depths of the next tiles.
+	 */
+	TaskGraph graph;
+	vector<TaskGraph::TaskId> depthTasks;
+	vector<vector<TaskGraph::TaskId>> buildTasks;
+
+	const uint numSlices = m_numTiles;
+	const auto& createTile = depths.createTile;
+	const auto layout = m_settings.tiledMinMax ? MinMaxHierarchy::TILED : MinMaxHierarchy::ROW_MAJOR;
+
+#ifdef PRINT_PROGRESS
+	const uint numXYTiles = (maxTile.x - minTile.x + 1) * (maxTile.y - minTile.y + 1);
+	auto numFinishedTiles = make_shared<std::atomic<uint>>(0);
+#endif
+
+	for (uint y = minTile.y; y <= static_cast<uint>(maxTile.y); ++y) {
+		for (uint x = minTile.x; x <= static_cast<uint>(maxTile.x); ++x) {
+			const uint xyTile = depthTasks.size();
+			auto state = make_shared<TileState>();
+
+			vector<TaskGraph::TaskId> dependencies;
+			if (xyTile > 0)
+				dependencies.push_back(depthTasks.back());
+			if (xyTile >= MAX_TILES_IN_FLIGHT) {
+				const auto& previous = buildTasks[xyTile - MAX_TILES_IN_FLIGHT];
+				dependencies.insert(dependencies.end(), previous.begin(), previous.end());
+			}
+
+			depthTasks.push_back(graph.add(depths.stage, [state, &createTile, x, y]() {
+				state->depths = createTile(x, y);
+			}, dependencies, depths.mainThread));
+
+			buildTasks.push_back(addShadowTileTasks(graph, &shadows, state, depthTasks.back(), x, y, numSlices,
+				firstSlice, layout, stats));
+
+#ifdef PRINT_PROGRESS
+			graph.add("progress", [numFinishedTiles, numXYTiles]() {
+				const uint numTiles = ++(*numFinishedTiles);
+				cout << (numTiles / static_cast<float>(numXYTiles)) * 100 << "% ";
+				cout.flush();
+			}, buildTasks.back());
+#endif
+		}
+	}
+
+	graph.run(ThreadPool::getDefault());
+
+#ifdef PRINT_PROGRESS
+	graph.printUtilisation(cout, ThreadPool::getDefault().getNumThreads() + 1);
+#endif
+}
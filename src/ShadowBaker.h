@@ -0,0 +1,147 @@
+#ifndef SHADOW_BAKER_H
+#define SHADOW_BAKER_H
+
+#include "cpvs.h"
+#include "Image.h"
+#include "BoundingVolumes.h"
+
+#include <functional>
+
+class CompressedShadowContainer;
+class BuildStats;
+
+/**
+ * Settings for precomputing shadows, which allow baking shadows larger than the available memory.
+ */
+struct BakeSettings {
+	BakeSettings()
+		: memoryBudget(0), spillDirectory("."), shareSubtrees(true), leafmaskDictionary(false), packedPointers(false),
+		contiguousChildren(false), keepForUpdates(false), cpuRasterizer(false), tiledMinMax(false) { }
+
+	/** Budget in bytes for the precomputed shadows kept in memory, 0 means unlimited. */
+	size_t memoryBudget;
+
+	/** Directory for the shadows which exceed the memory budget. */
+	string spillDirectory;
+
+	/**
+	 * If true, all tiles and z-slices insert their nodes into one shared store, so that identical subtrees
+	 * are stored only once. Is ignored when a memory budget is set.
+	 */
+	bool shareSubtrees;
+
+	/** If true, unique 64-bit leafmasks are stored in a table (see CompressedShadow::internLeafmasks). */
+	bool leafmaskDictionary;
+
+	/**
+	 * If true, the DAG is packed with relative pointers (see CompressedShadowContainer::setPackedPointers).
+	 * Can't be combined with contiguousChildren.
+	 */
+	bool packedPointers;
+
+	/** If true, the children of every node are stored contiguously (see CompressedShadowContainer::setContiguousChildren). */
+	bool contiguousChildren;
+
+	/**
+	 * If true, the shadows are kept on the CPU after they have been copied to the GPU, so they can be
+	 * rebuilt partially with DeferredRenderer::updateShadows after the scene has been edited.
+	 */
+	bool keepForUpdates;
+
+	/**
+	 * If not empty, the depth tiles are read from this memory-mapped raw/PFM file instead of being rendered.
+	 * The size of the precomputed shadow is then given by the file.
+	 */
+	string depthFile;
+
+	/**
+	 * If true, the depth tiles are rendered on the CPU with DepthRasterizer instead of OpenGL. The tiles are then
+	 * rendered in the thread pool instead of the thread owning the GL context.
+	 * @note Requires a scene uploaded with GLScene::upload(scene, true).
+	 */
+	bool cpuRasterizer;
+
+	/**
+	 * If true, the min-max hierarchies of the tiles use the TILED layout (see MinMaxHierarchy::Layout), so the
+	 * values read for a node or a leafmask are adjacent in memory. Needs an additional copy of a depth tile while
+	 * its hierarchy is created.
+	 */
+	bool tiledMinMax;
+};
+
+/**
+ * Creates the depths of the xy-tile (x, y), e.g. by rendering a shadow map with OpenGL, rasterizing the
+ * scene on the CPU or reading a depth file.
+ */
+struct DepthSource {
+	DepthSource(const string& stage, std::function<ImageF(uint x, uint y)> createTile, bool mainThread)
+		: stage(stage), createTile(std::move(createTile)), mainThread(mainThread) { }
+
+	/** Name of the stage in the task graph, e.g. "render" */
+	string stage;
+
+	std::function<ImageF(uint x, uint y)> createTile;
+
+	/** If true, the tiles are created by the thread calling ShadowBaker::bake (e.g. the one owning the GL context) */
+	bool mainThread;
+};
+
+/**
+ * Bakes the precomputed shadow of a given size into a CompressedShadowContainer without any dependency on OpenGL.
+ *
+ * The shadow is split into numTiles x numTiles xy-tiles with their own depth map, each of which is split into
+ * numTiles z-tiles. The depths of one xy-tile after another are created by a DepthSource, while the min-max
+ * hierarchies and the z-tiles are created in the thread pool.
+ */
+class ShadowBaker {
+public:
+	/** @param size Size of the precomputed shadow in every dimension, must be a power of two. */
+	ShadowBaker(uint size, const BakeSettings& settings = BakeSettings());
+
+	/** Returns the size of the depth map of a tile for a precomputed shadow of the given size */
+	static uint getTileSize(uint size);
+
+	inline uint getTileSize() const {
+		return m_tileSize;
+	}
+
+	/** Returns the number of tiles in every dimension, i.e. the length of the container */
+	inline uint getNumTiles() const {
+		return m_numTiles;
+	}
+
+	/**
+	 * Applies the settings to a container of length getNumTiles(), i.e. either shares the subtrees of all tiles
+	 * or sets the memory budget.
+	 * @throws std::invalid_argument if packed pointers and contiguous children are both enabled.
+	 */
+	void configure(CompressedShadowContainer& shadows) const;
+
+	/**
+	 * Creates all tiles of the configured container.
+	 * @param stats If not null, receives the statistics of every tile and the duration of the min-max hierarchies.
+	 */
+	void bake(CompressedShadowContainer& shadows, const DepthSource& depths, BuildStats* stats = nullptr) const;
+
+	/**
+	 * Creates the tiles again which are affected by the change of the geometry in the given region.
+	 *
+	 * Only the xy-tiles overlapping the region are created again. Of these only the z-tiles from the front of
+	 * the region to the far plane are rebuilt, since moved geometry changes the visibility of all voxels behind it.
+	 *
+	 * @param lightSpaceBox Bounding box in the normalized device coordinates of the light, i.e. in [-1, 1]^3.
+	 */
+	void update(CompressedShadowContainer& shadows, const DepthSource& depths, const AABB& lightSpaceBox) const;
+
+private:
+	/** Creates the z-tiles [firstSlice, numTiles) of all xy-tiles in [minTile, maxTile] */
+	void bakeTiles(CompressedShadowContainer& shadows, const DepthSource& depths, const ivec2& minTile,
+			const ivec2& maxTile, uint firstSlice, BuildStats* stats) const;
+
+private:
+	uint m_tileSize;
+	uint m_numTiles;
+	BakeSettings m_settings;
+};
+
+#endif
@@ -1,7 +1,7 @@
 #ifndef SHADOW_MAP_H
 #define SHADOW_MAP_H
 
-#include "cpvs.h"
+#include "cpvsGL.h"
 #include "Fbo.h"
 #include "Texture.h"
 #include "Image.h"
@@ -0,0 +1,204 @@
+#include "TaskGraph.h"
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <ostream>
+
+using namespace std;
+typedef std::chrono::steady_clock Clock;
+
+inline double getSeconds(Clock::time_point begin, Clock::time_point end) {
+	return std::chrono::duration<double>(end - begin).count();
+}
+
+TaskGraph::TaskId TaskGraph::add(const string& stage, std::function<void()> func,
+		const vector<TaskId>& dependencies, bool mainThread) {
+	auto stageIt = std::find(m_stages.begin(), m_stages.end(), stage);
+	if (stageIt == m_stages.end())
+		stageIt = m_stages.insert(m_stages.end(), stage);
+
+	const TaskId id = m_tasks.size();
+
+	auto task = make_unique<Task>();
+	task->stage = stageIt - m_stages.begin();
+	task->func = std::move(func);
+	task->dependencies = dependencies;
+	task->mainThread = mainThread;
+	task->duration = 0.0;
+
+	// Dependencies always have a smaller id, i.e. the ids are a topological order
+	for (TaskId dependency : dependencies) {
+		assert(dependency < id);
+		m_tasks[dependency]->dependents.push_back(id);
+	}
+
+	m_tasks.push_back(std::move(task));
+	return id;
+}
+
+void TaskGraph::run(ThreadPool& pool) {
+	const auto begin = Clock::now();
+
+	m_numScheduled = 0;
+	m_numFinished = 0;
+	m_exception = nullptr;
+	m_mainThreadTasks.clear();
+
+	for (auto& task : m_tasks)
+		task->numUnfinished = task->dependencies.size();
+
+	for (TaskId id = 0; id < m_tasks.size(); ++id) {
+		if (m_tasks[id]->dependencies.empty())
+			schedule(id, pool);
+	}
+
+	/*
+	 * Execute the main thread tasks until all tasks have finished. After an exception the dependents of the
+	 * failed task are never scheduled, but the tasks which are already in the pool have to be waited for.
+	 */
+	std::unique_lock<std::mutex> lock(m_mutex);
+	while (true) {
+		if (!m_mainThreadTasks.empty()) {
+			const TaskId id = m_mainThreadTasks.front();
+			m_mainThreadTasks.pop_front();
+
+			lock.unlock();
+			execute(id, pool);
+			lock.lock();
+			continue;
+		}
+
+		if (m_numFinished == (m_exception ? m_numScheduled : m_tasks.size()))
+			break;
+
+		m_changed.wait(lock);
+	}
+	lock.unlock();
+
+	m_wallTime = getSeconds(begin, Clock::now());
+
+	if (m_exception)
+		std::rethrow_exception(m_exception);
+}
+
+void TaskGraph::schedule(TaskId id, ThreadPool& pool) {
+	std::unique_lock<std::mutex> lock(m_mutex);
+	++m_numScheduled;
+
+	if (m_tasks[id]->mainThread) {
+		m_mainThreadTasks.push_back(id);
+		m_changed.notify_all();
+	} else {
+		lock.unlock();
+		pool.submit([this, id, &pool]() { execute(id, pool); });
+	}
+}
+
+void TaskGraph::execute(TaskId id, ThreadPool& pool) {
+	Task& task = *m_tasks[id];
+
+	bool failed = false;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		failed = m_exception != nullptr;
+	}
+
+	if (!failed) {
+		const auto begin = Clock::now();
+		try {
+			task.func();
+		} catch (...) {
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if (!m_exception)
+				m_exception = std::current_exception();
+			failed = true;
+		}
+		task.duration = getSeconds(begin, Clock::now());
+	}
+
+	// Free everything captured by the task (e.g. images) as soon as possible
+	task.func = nullptr;
+
+	if (!failed) {
+		for (TaskId dependent : task.dependents) {
+			if (--m_tasks[dependent]->numUnfinished == 0)
+				schedule(dependent, pool);
+		}
+	}
+
+	// Notify while holding the lock, since run may return and destroy the graph as soon as it is released
+	std::lock_guard<std::mutex> lock(m_mutex);
+	++m_numFinished;
+	m_changed.notify_all();
+}
+
+vector<double> TaskGraph::calcCriticalPath(vector<TaskId>& predecessors) const {
+	vector<double> finish(m_tasks.size(), 0.0);
+	predecessors.assign(m_tasks.size(), m_tasks.size());
+
+	for (TaskId id = 0; id < m_tasks.size(); ++id) {
+		double start = 0.0;
+		for (TaskId dependency : m_tasks[id]->dependencies) {
+			if (finish[dependency] > start) {
+				start = finish[dependency];
+				predecessors[id] = dependency;
+			}
+		}
+		finish[id] = start + m_tasks[id]->duration;
+	}
+	return finish;
+}
+
+vector<TaskGraph::StageStats> TaskGraph::getStageStats() const {
+	vector<StageStats> stats(m_stages.size());
+	for (uint stage = 0; stage < m_stages.size(); ++stage) {
+		stats[stage].name = m_stages[stage];
+		stats[stage].numTasks = 0;
+		stats[stage].busyTime = 0.0;
+		stats[stage].criticalPathTime = 0.0;
+	}
+
+	for (const auto& task : m_tasks) {
+		stats[task->stage].numTasks++;
+		stats[task->stage].busyTime += task->duration;
+	}
+
+	if (m_tasks.empty())
+		return stats;
+
+	/* Follow the critical path backwards from the task which finished last */
+	vector<TaskId> predecessors;
+	const auto finish = calcCriticalPath(predecessors);
+
+	TaskId id = std::max_element(finish.begin(), finish.end()) - finish.begin();
+	while (id < m_tasks.size()) {
+		stats[m_tasks[id]->stage].criticalPathTime += m_tasks[id]->duration;
+		id = predecessors[id];
+	}
+	return stats;
+}
+
+void TaskGraph::printUtilisation(std::ostream& os, uint numThreads) const {
+	const auto stats = getStageStats();
+
+	double criticalPath = 0.0;
+	for (const auto& stage : stats)
+		criticalPath += stage.criticalPathTime;
+
+	os << "\nBake: " << std::fixed << std::setprecision(3) << m_wallTime << "s wall time, "
+	   << criticalPath << "s critical path, " << numThreads << " threads\n";
+
+	for (const auto& stage : stats) {
+		const double utilisation = m_wallTime > 0.0 ? stage.busyTime / (m_wallTime * numThreads) : 0.0;
+		const double criticalShare = criticalPath > 0.0 ? stage.criticalPathTime / criticalPath : 0.0;
+
+		os << "  " << std::left << std::setw(10) << stage.name << std::right
+		   << std::setw(6) << stage.numTasks << " tasks, "
+		   << std::setprecision(3) << stage.busyTime << "s busy, "
+		   << std::setprecision(1) << utilisation * 100.0 << "% utilisation, "
+		   << criticalShare * 100.0 << "% of critical path\n";
+	}
+	os.flush();
+}
@@ -0,0 +1,104 @@
+#ifndef TASK_GRAPH_H
+#define TASK_GRAPH_H
+
+#include "cpvs.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <iosfwd>
+#include <mutex>
+
+class ThreadPool;
+
+/**
+ * A graph of tasks with dependencies, which are executed in a ThreadPool as soon as all of their
+ * dependencies have finished.
+ *
+ * Every task belongs to a named stage (e.g. "render" or "min-max"). Tasks which have to run on the thread
+ * calling run (e.g. everything using OpenGL) are marked as main thread tasks, all other tasks run in the pool.
+ *
+ * The time spent in every task is measured, so the utilisation of every stage and the critical path
+ * can be reported after the graph has been run.
+ */
+class TaskGraph {
+public:
+	typedef size_t TaskId;
+
+	/** Measurements of one stage after the graph has been run */
+	struct StageStats {
+		string name;
+		size_t numTasks;
+		double busyTime;         // sum of the durations of all tasks in seconds
+		double criticalPathTime; // time of the tasks of this stage on the critical path
+	};
+
+	TaskGraph() = default;
+	~TaskGraph() = default;
+
+	TaskGraph(const TaskGraph&) = delete;
+	TaskGraph& operator=(const TaskGraph&) = delete;
+
+	/**
+	 * Adds a task which will be executed after all given tasks have finished.
+	 * @param mainThread If true, the task is executed by the thread calling run.
+	 */
+	TaskId add(const string& stage, std::function<void()> func, const vector<TaskId>& dependencies = {},
+			bool mainThread = false);
+
+	/**
+	 * Executes all tasks and returns after all of them have finished.
+	 * If a task throws an exception, no further tasks are started and the first exception is rethrown.
+	 */
+	void run(ThreadPool& pool);
+
+	/** Returns the measurements of all stages in the order they have been added */
+	vector<StageStats> getStageStats() const;
+
+	/** Returns the wall time of the last run in seconds */
+	inline double getWallTime() const {
+		return m_wallTime;
+	}
+
+	/**
+	 * Prints the busy time, the utilisation of the threads and the share of the critical path of every stage.
+	 */
+	void printUtilisation(std::ostream& os, uint numThreads) const;
+
+private:
+	struct Task {
+		uint stage;
+		std::function<void()> func;
+		vector<TaskId> dependencies;
+		vector<TaskId> dependents;
+		bool mainThread;
+
+		std::atomic<uint> numUnfinished; // number of unfinished dependencies
+		double duration;
+	};
+
+	void schedule(TaskId id, ThreadPool& pool);
+
+	void execute(TaskId id, ThreadPool& pool);
+
+	/** Returns the duration of the critical path ending in every task */
+	vector<double> calcCriticalPath(vector<TaskId>& predecessors) const;
+
+private:
+	vector<unique_ptr<Task>> m_tasks;
+	vector<string> m_stages;
+
+	/* State during run */
+	std::mutex m_mutex;
+	std::condition_variable m_changed;
+	std::deque<TaskId> m_mainThreadTasks;
+	size_t m_numScheduled;
+	size_t m_numFinished;
+	std::exception_ptr m_exception;
+
+	double m_wallTime = 0.0;
+};
+
+#endif
@@ -1,7 +1,7 @@
 #ifndef TEXTURE_H
 #define TEXTURE_H
 
-#include "cpvs.h"
+#include "cpvsGL.h"
 #include "Image.h"
 
 class TextureBase {
@@ -0,0 +1,146 @@
+#include "ThreadPool.h"
+
+using namespace std;
+
+/* The pool and the number of the worker which is running on this thread */
+static thread_local const ThreadPool* currentPool = nullptr;
+static thread_local int currentWorkerNr = -1;
+
+ThreadPool::ThreadPool(uint numThreads)
+	: m_numPending(0), m_nextQueue(0), m_stop(false)
+{
+	if (numThreads == 0)
+		numThreads = std::max(1u, std::thread::hardware_concurrency());
+
+	for (uint i = 0; i < numThreads; ++i)
+		m_queues.push_back(make_unique<Queue>());
+
+	m_threads.reserve(numThreads);
+	for (uint i = 0; i < numThreads; ++i)
+		m_threads.emplace_back(&ThreadPool::runWorker, this, i);
+}
+
+ThreadPool::~ThreadPool() {
+	{
+		std::lock_guard<std::mutex> lock(m_sleepMutex);
+		m_stop = true;
+	}
+	m_wakeUp.notify_all();
+
+	for (auto& thread : m_threads)
+		thread.join();
+}
+
+ThreadPool& ThreadPool::getDefault() {
+	static ThreadPool pool;
+	return pool;
+}
+
+int ThreadPool::getWorkerNr() const {
+	return currentPool == this ? currentWorkerNr : -1;
+}
+
+void ThreadPool::submit(std::function<void()> task) {
+	const int workerNr = getWorkerNr();
+	const uint queueNr = workerNr >= 0 ? workerNr : m_nextQueue++ % m_queues.size();
+
+	{
+		Queue& queue = *m_queues[queueNr];
+		std::lock_guard<std::mutex> lock(queue.mutex);
+		// Counted before the task can be popped, so the counter never drops below the number of queued tasks
+		++m_numPending;
+		queue.tasks.push_back(std::move(task));
+	}
+
+	// Lock the mutex, so a worker can't miss the notification between checking for tasks and waiting
+	{
+		std::lock_guard<std::mutex> lock(m_sleepMutex);
+	}
+	m_wakeUp.notify_one();
+}
+
+bool ThreadPool::popTask(int workerNr, std::function<void()>& task) {
+	// Newest task of the own queue first, since its data is probably still in the cache
+	if (workerNr >= 0) {
+		Queue& queue = *m_queues[workerNr];
+		std::lock_guard<std::mutex> lock(queue.mutex);
+		if (!queue.tasks.empty()) {
+			task = std::move(queue.tasks.back());
+			queue.tasks.pop_back();
+			--m_numPending;
+			return true;
+		}
+	}
+
+	// Steal the oldest task of another queue
+	const uint numQueues = m_queues.size();
+	const uint first = workerNr >= 0 ? workerNr + 1 : 0;
+
+	for (uint i = 0; i < numQueues; ++i) {
+		Queue& queue = *m_queues[(first + i) % numQueues];
+		std::lock_guard<std::mutex> lock(queue.mutex);
+		if (!queue.tasks.empty()) {
+			task = std::move(queue.tasks.front());
+			queue.tasks.pop_front();
+			--m_numPending;
+			return true;
+		}
+	}
+	return false;
+}
+
+bool ThreadPool::runPendingTask() {
+	std::function<void()> task;
+	if (!popTask(getWorkerNr(), task))
+		return false;
+
+	task();
+	return true;
+}
+
+void ThreadPool::runWorker(uint workerNr) {
+	currentPool = this;
+	currentWorkerNr = workerNr;
+
+	std::function<void()> task;
+	while (true) {
+		if (popTask(workerNr, task)) {
+			task();
+			task = nullptr;
+			continue;
+		}
+
+		std::unique_lock<std::mutex> lock(m_sleepMutex);
+		m_wakeUp.wait(lock, [this]() { return m_stop || m_numPending > 0; });
+
+		if (m_stop)
+			return;
+	}
+}
+
+void ThreadPool::parallelFor(size_t size, uint numChunks, std::function<void(uint, size_t, size_t)> func) {
+	numChunks = std::max(numChunks, 1u);
+	const size_t chunkSize = (size + numChunks - 1) / numChunks;
+
+	std::atomic<uint> numRemaining(numChunks - 1);
+
+	// The calling thread processes the last chunk itself
+	for (uint chunk = 0; chunk + 1 < numChunks; ++chunk) {
+		const size_t begin = std::min(size, chunk * chunkSize);
+		const size_t end   = std::min(size, begin + chunkSize);
+
+		submit([&func, &numRemaining, chunk, begin, end]() {
+			func(chunk, begin, end);
+			--numRemaining;
+		});
+	}
+
+	const size_t lastBegin = std::min(size, (numChunks - 1) * chunkSize);
+	func(numChunks - 1, lastBegin, size);
+
+	// Help with other tasks instead of blocking a thread
+	while (numRemaining > 0) {
+		if (!runPendingTask())
+			std::this_thread::yield();
+	}
+}
@@ -0,0 +1,87 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include "cpvs.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+/**
+ * A persistent pool of worker threads with work stealing.
+ *
+ * Every worker has its own queue. Tasks submitted by a worker are pushed to its own queue and the worker
+ * processes its queue in LIFO order, while idle workers steal the oldest tasks from other queues.
+ * Tasks submitted by other threads are distributed round-robin.
+ *
+ * Threads waiting for tasks of the pool (e.g. in parallelFor) execute pending tasks themselves,
+ * so tasks can safely wait for other tasks.
+ */
+class ThreadPool {
+public:
+	/**
+	 * Starts the given number of workers, 0 means one worker per hardware thread.
+	 */
+	explicit ThreadPool(uint numThreads = 0);
+	~ThreadPool();
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	/**
+	 * Returns the pool used for baking shadows, which is created on first use.
+	 */
+	static ThreadPool& getDefault();
+
+	inline uint getNumThreads() const {
+		return m_threads.size();
+	}
+
+	/**
+	 * Adds a task to the pool. Tasks must not throw.
+	 */
+	void submit(std::function<void()> task);
+
+	/**
+	 * Executes one pending task in the calling thread, if there is any.
+	 * @return True if a task has been executed.
+	 */
+	bool runPendingTask();
+
+	/**
+	 * Splits the range [0, size) into numChunks contiguous chunks and calls func(chunkNr, begin, end) for every
+	 * chunk in the pool. The calling thread processes the last chunk and helps until all chunks are finished.
+	 * A numChunks of 0 is treated as 1, i.e. the calling thread processes the whole range.
+	 */
+	void parallelFor(size_t size, uint numChunks, std::function<void(uint, size_t, size_t)> func);
+
+private:
+	struct Queue {
+		std::mutex mutex;
+		std::deque<std::function<void()>> tasks;
+	};
+
+	void runWorker(uint workerNr);
+
+	/** Pops a task from the own queue (if the thread is a worker) or steals one from another queue */
+	bool popTask(int workerNr, std::function<void()>& task);
+
+	/** Returns the number of the calling thread if it is a worker of this pool, otherwise -1 */
+	int getWorkerNr() const;
+
+private:
+	vector<unique_ptr<Queue>> m_queues;
+	vector<std::thread> m_threads;
+
+	std::atomic<size_t> m_numPending;
+	std::atomic<uint> m_nextQueue;
+
+	std::mutex m_sleepMutex;
+	std::condition_variable m_wakeUp;
+	bool m_stop;
+};
+
+#endif
@@ -8,9 +8,8 @@
 #include <memory>
 #include <exception>
 #include <cmath>
-
-#include <GL/glew.h>
-#include <GLFW/glfw3.h>
+#include <array>
+#include <cstdint>
 
 using std::string;
 using std::vector;
@@ -36,20 +35,10 @@ using ivec4 = glm::ivec4;
 /* Some common functions and macros */
 #define CPVS_SAFE_DELETE(ptr) { if (ptr != NULL) delete ptr; }
 
-#ifndef NDEBUG
-	#define GL_CHECK_ERROR(X) checkGLErrors(X)
-#else
-	#define GL_CHECK_ERROR(X)
-#endif
-
-#define GL_ASSERT_NO_ERROR() assert(glGetError() == GL_NO_ERROR);
-
 // Counts the number of set bits.
 // Builtin exists for clang and gcc
 #define POPCOUNT(x) __builtin_popcount(x)
-
-/** Checks for OpenGL errors and outputs an error string */
-extern void checkGLErrors(const std::string &str);
+#define POPCOUNT64(x) __builtin_popcountll(x)
 
 /** Returns true if the parameter is a power of two */
 inline constexpr bool isPowerOfTwo(int x) {
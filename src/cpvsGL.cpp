@@ -1,4 +1,4 @@
-#include "cpvs.h"
+#include "cpvsGL.h"
 #include <iostream>
 
 using namespace std;
@@ -0,0 +1,25 @@
+#ifndef CPVS_GL_H
+#define CPVS_GL_H
+
+/*
+ * Common header of everything using OpenGL. The core (DAG creation, min-max hierarchy, container on the CPU,
+ * baking) only includes cpvs.h, so it can be built and run without OpenGL.
+ */
+
+#include "cpvs.h"
+
+#include <GL/glew.h>
+#include <GLFW/glfw3.h>
+
+#ifndef NDEBUG
+	#define GL_CHECK_ERROR(X) checkGLErrors(X)
+#else
+	#define GL_CHECK_ERROR(X)
+#endif
+
+#define GL_ASSERT_NO_ERROR() assert(glGetError() == GL_NO_ERROR);
+
+/** Checks for OpenGL errors and outputs an error string */
+extern void checkGLErrors(const std::string &str);
+
+#endif
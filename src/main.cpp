@@ -9,15 +9,17 @@ using namespace std::chrono;
 
 #include <AntTweakBar.h>
 
-#include "cpvs.h"
+#include "cpvsGL.h"
 #include "ShaderProgram.h"
 #include "Camera.h"
 #include "DeferredRenderer.h"
 
 #include "AssimpScene.h"
+#include "GLScene.h"
 
 #include "MinMaxHierarchy.h"
 #include "CompressedShadow.h"
+#include "BuildStats.h"
 
 
 /* Settings and globals */
@@ -31,6 +33,15 @@ const GLuint WINDOW_HEIGHT = 512;
 GLuint cpvs_size = 4096;
 GLuint pcf_size = 1;
 
+/* Settings for baking very large shadows */
+BakeSettings bakeSettings;
+
+/* Precomputed shadow which is loaded instead of being baked, if not empty */
+string shadowFile;
+
+/* File the statistics of baking are written to as JSON, if not empty */
+string statsFile;
+
 const GLuint REF_SM_SIZE    = 8192;
 const vec3   lightDirection = {0.25, 1, 0};
 
@@ -165,7 +176,7 @@ inline unique_ptr<Scene> loadSceneFromArguments(const string& file) {
 	try {
 		cout << "Loading scene... "; cout.flush();
 		auto t0 = high_resolution_clock::now();
-		auto ptr = AssimpScene::loadScene(file);
+		auto ptr = GLScene::upload(AssimpScene::loadScene(file), bakeSettings.cpuRasterizer);
 		cout << "done after ";
 		printDurationToNow(t0);
 		return ptr;
@@ -181,6 +192,17 @@ inline void printHelpAndExit() {
 		 << "\t--help Prints this help test and exits\n"
 		 << "\t--size=[size of precomputed shadow, e.g. 8196. Must be a power of two]\n"
 		 << "\t--pcf=[size of PCF kernel]\n"
+		 << "\t--budget=[memory budget for the precomputed shadow in MB, the rest is written to disk]\n"
+		 << "\t--spill-dir=[directory for the parts of the shadow exceeding the budget]\n"
+		 << "\t--depth-file=[raw/PFM depth map which is used instead of rendering the shadow map]\n"
+		 << "\t--no-shared-dag (store the DAG of every tile separately instead of sharing common subtrees)\n"
+		 << "\t--leafmask-dict (store every unique 64-bit leafmask only once in a table)\n"
+		 << "\t--packed-pointers (store the DAG with 16-bit childmasks and relative 8/16/32-bit pointers)\n"
+		 << "\t--contiguous-children (store the children of every node contiguously and only one pointer per node)\n"
+		 << "\t--tiled-minmax (store the min-max hierarchies in tiles of 8x8 values instead of rows)\n"
+		 << "\t--cpu-raster (render the depth tiles on the CPU instead of the GPU)\n"
+		 << "\t--shadow-file=[precomputed shadow written by cpvs_bake for the same scene, which is loaded instead of baking]\n"
+		 << "\t--stats=[file the timings, node counts and sizes of baking are written to as JSON]\n"
 		 << "\tpath to scene file or default file which will be loaded"
 	   	 << endl;
 	closeApp(EXIT_SUCCESS);
@@ -211,11 +233,38 @@ unique_ptr<Scene> parseArguments(int argc, char **argv) {
 			cpvs_size = parseSize(&argv[paramNr][7], true);
 		} else if (param.substr(0, 5) == "--pcf") {
 			pcf_size = parseSize(&argv[paramNr][6], false);
-		}else {
+		} else if (param.substr(0, 8) == "--budget") {
+			bakeSettings.memoryBudget = static_cast<size_t>(parseSize(&argv[paramNr][9], false)) * 1024 * 1024;
+		} else if (param.substr(0, 11) == "--spill-dir") {
+			bakeSettings.spillDirectory = param.substr(12);
+		} else if (param.substr(0, 12) == "--depth-file") {
+			bakeSettings.depthFile = param.substr(13);
+		} else if (param == "--no-shared-dag") {
+			bakeSettings.shareSubtrees = false;
+		} else if (param == "--leafmask-dict") {
+			bakeSettings.leafmaskDictionary = true;
+		} else if (param == "--packed-pointers") {
+			bakeSettings.packedPointers = true;
+		} else if (param == "--contiguous-children") {
+			bakeSettings.contiguousChildren = true;
+		} else if (param == "--tiled-minmax") {
+			bakeSettings.tiledMinMax = true;
+		} else if (param == "--cpu-raster") {
+			bakeSettings.cpuRasterizer = true;
+		} else if (param.substr(0, 13) == "--shadow-file") {
+			shadowFile = param.substr(14);
+		} else if (param.substr(0, 7) == "--stats") {
+			statsFile = param.substr(8);
+		} else {
 			sceneFile = param;
 		}
 	}
 
+	if (bakeSettings.packedPointers && bakeSettings.contiguousChildren) {
+		cerr << "--packed-pointers can't be combined with --contiguous-children\n";
+		std::exit(EXIT_FAILURE);
+	}
+
 	return loadSceneFromArguments(sceneFile);
 }
 
@@ -226,9 +275,25 @@ void initRenderSystem(const Scene* scene) {
 }
 
 void createPrecomputedShadows(const Scene* scene) {
-	cout << "Precomputing shadows... "; cout.flush();
+	cout << (shadowFile.empty() ? "Precomputing shadows... " : "Loading precomputed shadows... "); cout.flush();
 	auto t0 = chrono::high_resolution_clock::now();
-	renderSystem->precomputeShadows(scene, cpvs_size, pcf_size);
+	try {
+		if (shadowFile.empty()) {
+			BuildStats stats;
+			renderSystem->precomputeShadows(scene, cpvs_size, pcf_size, bakeSettings,
+					statsFile.empty() ? nullptr : &stats);
+			if (!statsFile.empty())
+				stats.writeJSON(statsFile);
+		} else {
+			renderSystem->loadPrecomputedShadows(shadowFile, pcf_size);
+		}
+	} catch (FileNotFound& exc) {
+		cerr << exc.what() << endl;
+		closeApp(EXIT_FAILURE);
+	} catch (LoadFileException& exc) {
+		cerr << exc.what() << endl;
+		closeApp(EXIT_FAILURE);
+	}
 	cout << "\n... done after ";
 	printDurationToNow(t0);
 }
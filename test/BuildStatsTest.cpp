@@ -0,0 +1,102 @@
+#include "BuildStats.h"
+#include "CompressedShadow.h"
+#include "CompressedShadowContainer.h"
+#include "MinMaxHierarchy.h"
+#include "ShadowBaker.h"
+#include "gtest/gtest.h"
+
+#include <numeric>
+#include <sstream>
+
+// contains test depths{8x8, 16x16, 32x32}
+#include "TestImages.h"
+
+inline bool hasPhase(const TileStats& stats, const string& name) {
+	for (const auto& phase : stats.phases) {
+		if (phase.first == name)
+			return phase.second >= 0.0;
+	}
+	return false;
+}
+
+TEST(BuildStatsTest, testTileStats) {
+	ImageF img8(8, 8, 1), img16(16, 16, 1), img32(32, 32, 1);
+	img8.setAll(getDepths8x8());
+	img16.setAll(getDepths16x16());
+	img32.setAll(getDepths32x32());
+
+	for (const ImageF* img : {&img8, &img16, &img32}) {
+		MinMaxHierarchy mm(*img);
+
+		TileStats direct, fromSvo;
+		const auto shadow = CompressedShadow::create(mm, 0, 1, &direct);
+		CompressedShadow::createFromSvo(mm, 0, 1, &fromSvo);
+
+		ASSERT_TRUE(hasPhase(direct, "build"));
+		ASSERT_TRUE(hasPhase(direct, "layout"));
+		ASSERT_TRUE(hasPhase(fromSvo, "constructSvo"));
+		ASSERT_TRUE(hasPhase(fromSvo, "mergeCommonSubtrees"));
+		ASSERT_TRUE(hasPhase(fromSvo, "compress"));
+
+		// Both build the same SVO and merge it to the same DAG
+		ASSERT_EQ(shadow->getNumLevels() - 1, direct.numNodes.size());
+		ASSERT_EQ(fromSvo.numNodes, direct.numNodes) << img->getWidth();
+		ASSERT_EQ(fromSvo.numMergedNodes, direct.numMergedNodes) << img->getWidth();
+		ASSERT_EQ(1u, direct.numNodes.back());
+
+		for (size_t level = 0; level < direct.numNodes.size(); ++level)
+			ASSERT_LE(direct.numMergedNodes[level], direct.numNodes[level]);
+
+		ASSERT_EQ(shadow->getDAG().size(), direct.dagSize);
+		ASSERT_EQ(shadow->getDAG().size(), fromSvo.dagSize);
+		ASSERT_GE(direct.peakDagSize, direct.dagSize);
+		ASSERT_GT(fromSvo.peakDagSize, fromSvo.dagSize);
+	}
+}
+
+TEST(BuildStatsTest, testBakeStats) {
+	ImageF img(32, 32, 1);
+	img.setAll(getDepths32x32());
+	const DepthSource depths("read", [&img](uint, uint) { return img; }, false);
+	const ShadowBaker baker(32);
+
+	// Shared store: the unique nodes are only known for the whole store
+	{
+		BuildStats stats;
+		CompressedShadowContainer shadows(baker.getNumTiles());
+		baker.configure(shadows);
+		baker.bake(shadows, depths, &stats);
+		ASSERT_EQ(1u, stats.getNumTiles());
+
+		std::ostringstream os;
+		stats.writeJSON(os);
+		const string json = os.str();
+		ASSERT_NE(string::npos, json.find("\"minMaxHierarchy\""));
+		ASSERT_NE(string::npos, json.find("\"mergedNodes\""));
+		ASSERT_NE(string::npos, json.find("\"mergeRatios\""));
+		ASSERT_NE(string::npos, json.find("\"x\": 0, \"y\": 0, \"z\": 0"));
+
+		const size_t dagBytes = shadows.getSharedDAGSize() * sizeof(uint);
+		const size_t storeBytes = shadows.getNodeStore()->getSize() * sizeof(uint);
+		ASSERT_GT(dagBytes, 0u);
+		ASSERT_NE(string::npos, json.find("\"dagBytes\": " + std::to_string(dagBytes)));
+		ASSERT_NE(string::npos, json.find("\"peakDagBytes\": " + std::to_string(storeBytes)));
+	}
+
+	// Separate DAGs have their own sizes
+	{
+		BuildStats stats;
+		CompressedShadowContainer shadows(baker.getNumTiles());
+		BakeSettings settings;
+		settings.shareSubtrees = false;
+		ShadowBaker(32, settings).bake(shadows, depths, &stats);
+
+		std::ostringstream os;
+		stats.writeJSON(os);
+		const size_t dagBytes = shadows.get(0, 0, 0)->getDAG().size() * sizeof(uint);
+		ASSERT_NE(string::npos, os.str().find("\"dagBytes\": " + std::to_string(dagBytes)));
+	}
+
+	BuildStats stats;
+	ASSERT_THROW(stats.writeJSON("/doesNotExist/stats.json"), FileNotFound);
+}
@@ -0,0 +1,151 @@
+#include "CPUShadowContainer.h"
+#include "CompressedShadowUtil.h"
+#include "MinMaxHierarchy.h"
+#include "gtest/gtest.h"
+
+#include <cstdio>
+#include <random>
+#include <set>
+
+// contains depths32x32
+#include "TestImages.h"
+#include "TestShadows.h"
+
+TEST(CPUShadowContainerTest, testMortonCode) {
+	ASSERT_EQ(0u, cs::getMortonCode(ivec3(0, 0, 0)));
+	ASSERT_EQ(0x7u, cs::getMortonCode(ivec3(1, 1, 1)));
+	ASSERT_EQ(0x38u, cs::getMortonCode(ivec3(2, 2, 2)));
+	ASSERT_EQ(uint64(1) << 62, cs::getMortonCode(ivec3(0, 0, 1 << 20)));
+	ASSERT_EQ(0x7FFFFFFFFFFFFFFFu, cs::getMortonCode(ivec3((1 << 21) - 1)));
+}
+
+TEST(CPUShadowContainerTest, testBucketsOfCoherentGrid) {
+	// A regular grid of positions covers all buckets, i.e. all bits of the buckets are used
+	for (uint numLevels : { 7, 9 }) {
+		const uint bucketShift = CPUShadowContainer::getBucketShift(numLevels);
+
+		std::set<uint64> buckets;
+		for (uint z = 0; z < 64; ++z) {
+			for (uint y = 0; y < 64; ++y) {
+				for (uint x = 0; x < 64; ++x) {
+					const vec3 ndc = (vec3(x, y, z) + 0.5f) / 32.0f - 1.0f;
+					buckets.insert(cs::getMortonCode(cs::getPathFromNDC(ndc, numLevels)) >> bucketShift);
+				}
+			}
+		}
+		ASSERT_EQ(size_t(1) << CPUShadowContainer::BUCKET_BITS, buckets.size()) << numLevels << " levels";
+	}
+}
+
+TEST(CPUShadowContainerTest, testEvaluate) {
+	const string file = "cpuContainerTest.cpvc";
+
+	ImageF img(32, 32, 1);
+	img.setAll(getDepths32x32());
+	MinMaxHierarchy mm(img);
+
+	// The shadows of the two z-slices, every cell with the same z uses the same one
+	vector<unique_ptr<CompressedShadow>> expected;
+	for (uint z = 0; z < 2; ++z)
+		expected.push_back(CompressedShadow::create(mm, z, 2));
+
+	// Random positions, some of which are outside the volume of the shadow, and coherent positions of a surface with
+	// several positions per voxel, which are evaluated without sorting them
+	ImageF randomPositions(64, 64, 4), surfacePositions(64, 64, 4);
+	std::mt19937 rng(42);
+	std::uniform_real_distribution<float> dist(-1.1f, 1.1f);
+	for (size_t i = 0; i < 64 * 64 * 4; ++i)
+		randomPositions.data()[i] = dist(rng);
+
+	for (uint y = 0; y < 64; ++y) {
+		for (uint x = 0; x < 64; ++x) {
+			const vec2 xy = (vec2(x, y) + 0.5f) / 128.0f - 0.25f;
+			const vec4 position(xy, 0.9f * std::sin(3.0f * xy.x + xy.y), 1.0f);
+			std::copy_n(glm::value_ptr(position), 4, surfacePositions.data() + (y * 64 + x) * 4);
+		}
+	}
+
+	for (bool shared : { false, true }) {
+		for (int layout : { 0, 1, 2 }) {
+			for (bool dictionary : { false, true }) {
+				for (bool fromFile : { false, true }) {
+					auto shadows = std::make_unique<CPUShadowContainer>(2);
+					setTestShadows(*shadows, mm, shared);
+					shadows->setLeafmaskDictionary(dictionary);
+					shadows->setPackedPointers(layout == 1);
+					shadows->setContiguousChildren(layout == 2);
+
+					if (fromFile) {
+						shadows->writeToFile(file);
+						shadows = std::make_unique<CPUShadowContainer>(std::make_unique<ContainerFile>(file));
+					}
+					shadows->combineDAGs();
+					ASSERT_EQ(mm.getNumLevels() + 1, shadows->getTotalNumLevels());
+
+					for (const ImageF* positions : { &randomPositions, &surfacePositions }) {
+						ImageF visibilities(64, 64, 1);
+						shadows->evaluate(*positions, mat4(1.0f), visibilities);
+
+						for (uint i = 0; i < 64 * 64; ++i) {
+							const vec3 ndc = glm::make_vec3(positions->data() + i * 4);
+
+							float visibility = 1.0f;
+							if (glm::all(glm::lessThanEqual(glm::abs(ndc), vec3(1.0f)))) {
+								// Traverse the shadow of the grid cell at the same voxel
+								const ivec3 path = cs::getPathFromNDC(ndc, shadows->getTotalNumLevels());
+								const vec3 pos = (vec3(path % 32) + 0.5f) / 31.0f * 2.0f - 1.0f;
+								if (expected[path.z / 32]->traverse(pos) == CompressedShadow::SHADOW)
+									visibility = 0.0f;
+							}
+							ASSERT_EQ(visibility, visibilities.data()[i]) << "pixel " << i << ", shared " << shared
+								<< ", layout " << layout << ", dictionary " << dictionary << ", file " << fromFile
+								<< ", surface " << (positions == &surfacePositions);
+						}
+					}
+				}
+			}
+		}
+	}
+	std::remove(file.c_str());
+}
+
+TEST(CPUShadowContainerTest, testFilteredTraversal) {
+	ImageF img(32, 32, 1);
+	img.setAll(getDepths32x32());
+	MinMaxHierarchy mm(img);
+
+	std::mt19937 rng(7);
+	for (bool shared : { false, true }) {
+		for (int layout : { 0, 1, 2 }) {
+			CPUShadowContainer shadows(2);
+			setTestShadows(shadows, mm, shared);
+			shadows.setLeafmaskDictionary(shared);
+			shadows.setPackedPointers(layout == 1);
+			shadows.setContiguousChildren(layout == 2);
+			shadows.combineDAGs();
+
+			const int resolution = cs::getResolution(shadows.getTotalNumLevels());
+			for (uint filterSize : { 1, 2, 3, 5, 8, 17 }) {
+				shadows.setFilterSize(filterSize);
+
+				for (int i = 0; i < 500; ++i) {
+					const ivec3 path(rng() % resolution, rng() % resolution, rng() % resolution);
+
+					// Every sample of the kernel on its own
+					int visible = 0;
+					const int begin = -static_cast<int>(filterSize / 2);
+					for (int y = begin; y < begin + static_cast<int>(filterSize); ++y) {
+						for (int x = begin; x < begin + static_cast<int>(filterSize); ++x) {
+							const ivec3 sample = path + ivec3(x, y, 0);
+							if (sample.x < 0 || sample.y < 0 || sample.x >= resolution || sample.y >= resolution
+									|| shadows.traverse(sample) != CompressedShadow::SHADOW)
+								++visible;
+						}
+					}
+					ASSERT_FLOAT_EQ(static_cast<float>(visible) / (filterSize * filterSize), shadows.traverseFiltered(path))
+						<< "shared " << shared << ", layout " << layout << ", filter size " << filterSize;
+				}
+			}
+		}
+	}
+}
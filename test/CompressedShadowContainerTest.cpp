@@ -0,0 +1,274 @@
+#include "CompressedShadowContainer.h"
+#include "CompressedShadowUtil.h"
+#include "ContainerFile.h"
+#include "MinMaxHierarchy.h"
+#include "ShadowBaker.h"
+#include "gtest/gtest.h"
+
+#include <cstdio>
+#include <fstream>
+
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// contains depths32x32
+#include "TestImages.h"
+#include "TestShadows.h"
+
+TEST(CompressedShadowContainerTest, testWriteSeparateDAGs) {
+	const string file = "containerTest.cpvc";
+
+	ImageF img(32, 32, 1);
+	img.setAll(getDepths32x32());
+	MinMaxHierarchy mm(img);
+
+	// Every cell contains a z-tile of the same depths
+	CompressedShadowContainer shadows(2);
+	vector<unique_ptr<CompressedShadow>> expected;
+	for (uint z = 0; z < 2; ++z) {
+		for (uint y = 0; y < 2; ++y) {
+			for (uint x = 0; x < 2; ++x) {
+				shadows.set(CompressedShadow::create(mm, z, 2), x, y, z);
+				expected.push_back(CompressedShadow::create(mm, z, 2));
+			}
+		}
+	}
+	shadows.writeToFile(file);
+
+	ContainerFile contents(file);
+	ASSERT_EQ(2u, contents.getLength());
+	ASSERT_EQ(expected[0]->getNumLevels(), contents.getNumLevels());
+	ASSERT_FALSE(contents.hasLeafmaskDictionary());
+
+	// The sections are page aligned in the mapping
+	ASSERT_EQ(0u, reinterpret_cast<uintptr_t>(contents.getGrid()) % ContainerFile::ALIGNMENT);
+	ASSERT_EQ(0u, reinterpret_cast<uintptr_t>(contents.getDAG()) % ContainerFile::ALIGNMENT);
+
+	// The DAGs are stored one after another with absolute pointers
+	vector<uint> dag;
+	for (size_t i = 0; i < expected.size(); ++i) {
+		const size_t offset = dag.size();
+		expected[i]->appendDAG(dag, offset);
+
+		if (expected[i]->getTotalVisibility() == CompressedShadow::PARTIAL)
+			ASSERT_EQ(offset, contents.getGrid()[i]) << "cell " << i;
+		else
+			ASSERT_GE(contents.getGrid()[i], 0xFFFFFFEu) << "cell " << i;
+	}
+	ASSERT_EQ(dag, vector<uint>(contents.getDAG(), contents.getDAG() + contents.getDAGSize()));
+
+	std::remove(file.c_str());
+}
+
+TEST(CompressedShadowContainerTest, testWriteBakedSharedDAG) {
+	const string file = "containerTest.cpvc";
+
+	ImageF img(32, 32, 1);
+	img.setAll(getDepths32x32());
+	const DepthSource depths("read", [&img](uint, uint) { return img; }, false);
+
+	const ShadowBaker baker(32);
+	ASSERT_EQ(1u, baker.getNumTiles());
+	ASSERT_EQ(32u, baker.getTileSize());
+
+	CompressedShadowContainer shadows(baker.getNumTiles());
+	baker.configure(shadows);
+	baker.bake(shadows, depths);
+	ASSERT_NE(nullptr, shadows.getNodeStore());
+	shadows.writeToFile(file);
+
+	// A single shadow laid out from the shared store is identical to the one created on its own
+	MinMaxHierarchy mm(img);
+	const auto expected = CompressedShadow::create(mm);
+
+	{
+		// Load the container again, which uses the mapped file
+		CompressedShadowContainer loaded(std::make_unique<ContainerFile>(file));
+		const ContainerFile* contents = loaded.getMappedFile();
+		ASSERT_NE(nullptr, contents);
+
+		ASSERT_EQ(1u, loaded.getLength());
+		ASSERT_EQ(expected->getNumLevels(), contents->getNumLevels());
+		ASSERT_EQ(0u, contents->getGrid()[0]);
+		ASSERT_EQ(expected->getDAG(), vector<uint>(contents->getDAG(), contents->getDAG() + contents->getDAGSize()));
+	}
+	std::remove(file.c_str());
+}
+
+TEST(CompressedShadowContainerTest, testFileErrors) {
+	const string file = "containerTest.cpvc";
+
+	CompressedShadowContainer shadows(1);
+	shadows.set(CompressedShadow::create(MinMaxHierarchy(ImageF(8, 8, 1))), 0, 0, 0);
+	ASSERT_THROW(shadows.writeToFile("doesNotExist/containerTest.cpvc"), FileNotFound);
+	ASSERT_THROW(ContainerFile("doesNotExist.cpvc"), FileNotFound);
+
+	// Cut off the end of the DAG
+	shadows.writeToFile(file);
+	{
+		ContainerFile contents(file);
+		ASSERT_EQ(shadows.get(0, 0, 0)->getNumLevels(), contents.getNumLevels());
+	}
+	std::ifstream is(file, std::ios::binary);
+	vector<char> bytes((std::istreambuf_iterator<char>(is)), std::istreambuf_iterator<char>());
+	is.close();
+
+	std::ofstream os(file, std::ios::binary | std::ios::trunc);
+	os.write(bytes.data(), bytes.size() - sizeof(uint));
+	os.close();
+	ASSERT_THROW(ContainerFile{file}, LoadFileException);
+
+	std::remove(file.c_str());
+}
+
+TEST(CompressedShadowContainerTest, testWritePackedPointers) {
+	const string file = "containerTest.cpvc";
+
+	ImageF img(32, 32, 1);
+	img.setAll(getDepths32x32());
+	MinMaxHierarchy mm(img);
+
+	// The cells are ordered by z, y and x
+	vector<unique_ptr<CompressedShadow>> expected;
+	for (uint i = 0; i < 8; ++i)
+		expected.push_back(CompressedShadow::create(mm, i / 4, 2));
+
+	for (bool shared : { false, true }) {
+		CompressedShadowContainer shadows(2);
+		setTestShadows(shadows, mm, shared);
+		shadows.setPackedPointers(true);
+		shadows.writeToFile(file);
+
+		ContainerFile contents(file);
+		ASSERT_TRUE(contents.hasPackedPointers());
+		const auto encoding = expected[0]->getLeafmaskEncoding();
+
+		// Every cell is traversed like its own shadow
+		for (size_t i = 0; i < expected.size(); ++i) {
+			const uint root = contents.getGrid()[i];
+			if (expected[i]->getTotalVisibility() != CompressedShadow::PARTIAL) {
+				ASSERT_GE(root, 0xFFFFFFEu);
+				continue;
+			}
+
+			for (uint z = 0; z < 32; ++z) {
+				for (uint y = 0; y < 32; ++y) {
+					for (uint x = 0; x < 32; ++x) {
+						const ivec3 path(x, y, z);
+						const vec3 pos = (vec3(path) + 0.5f) / 31.0f * 2.0f - 1.0f;
+						ASSERT_EQ(cs::getPathFromNDC(pos, mm.getNumLevels()), path);
+
+						ASSERT_EQ(expected[i]->traverse(pos), cs::traversePacked(contents.getDAG(), root,
+								contents.getNumLevels(), contents.getPointerWidths(), encoding, path));
+					}
+				}
+			}
+		}
+	}
+	std::remove(file.c_str());
+}
+
+TEST(CompressedShadowContainerTest, testWriteContiguousChildren) {
+	const string file = "containerTest.cpvc";
+
+	ImageF img(32, 32, 1);
+	img.setAll(getDepths32x32());
+	MinMaxHierarchy mm(img);
+	const auto expected = CompressedShadow::create(mm, 1, 2);
+	ASSERT_EQ(CompressedShadow::PARTIAL, expected->getTotalVisibility());
+
+	for (bool shared : { false, true }) {
+		for (bool dictionary : { false, true }) {
+			CompressedShadowContainer shadows(2);
+			setTestShadows(shadows, mm, shared, 1);
+			shadows.setLeafmaskDictionary(dictionary);
+			shadows.setContiguousChildren(true);
+			shadows.writeToFile(file);
+
+			ContainerFile contents(file);
+			ASSERT_TRUE(contents.hasContiguousChildren());
+			ASSERT_EQ(dictionary, contents.hasLeafmaskDictionary());
+			const auto encoding = dictionary ? CompressedShadow::LEAFMASK_POINTERS : CompressedShadow::INLINE_LEAFMASKS;
+
+			for (size_t i = 0; i < 8; ++i) {
+				const uint root = contents.getGrid()[i];
+				for (uint z = 0; z < 32; ++z) {
+					for (uint y = 0; y < 32; ++y) {
+						for (uint x = 0; x < 32; ++x) {
+							const ivec3 path(x, y, z);
+							const vec3 pos = (vec3(path) + 0.5f) / 31.0f * 2.0f - 1.0f;
+							ASSERT_EQ(expected->traverse(pos), cs::traverseContiguous(contents.getDAG(), root,
+									contents.getNumLevels(), encoding, path)) << shared << dictionary;
+						}
+					}
+				}
+			}
+		}
+	}
+	std::remove(file.c_str());
+}
+
+TEST(CompressedShadowContainerTest, testSpillToSharedDirectory) {
+	ImageF img(32, 32, 1);
+	img.setAll(getDepths32x32());
+	MinMaxHierarchy mm(img);
+
+	// Both containers exceed their budget and write the shadow of the same cell to the same directory
+	CompressedShadowContainer first(1), second(1);
+	first.setMemoryBudget(1, ".");
+	second.setMemoryBudget(1, ".");
+	first.set(CompressedShadow::create(mm, 0, 2), 0, 0, 0);
+	second.set(CompressedShadow::create(mm, 1, 2), 0, 0, 0);
+	ASSERT_EQ(0u, first.getResidentSize());
+	ASSERT_EQ(0u, second.getResidentSize());
+
+	for (uint z = 0; z < 2; ++z) {
+		const string file = "containerTest.cpvc";
+		(z == 0 ? first : second).writeToFile(file);
+
+		vector<uint> expected;
+		CompressedShadow::create(mm, z, 2)->appendDAG(expected, 0);
+
+		ContainerFile contents(file);
+		ASSERT_EQ(expected, vector<uint>(contents.getDAG(), contents.getDAG() + contents.getDAGSize())) << "z " << z;
+		std::remove(file.c_str());
+	}
+}
+
+/* Returns the number of files in the directory, without . and .. */
+static size_t countFiles(const string& directory) {
+	DIR* dir = opendir(directory.c_str());
+	size_t numFiles = 0;
+	while (const dirent* entry = readdir(dir)) {
+		if (entry->d_name[0] != '.')
+			++numFiles;
+	}
+	closedir(dir);
+	return numFiles;
+}
+
+TEST(CompressedShadowContainerTest, testReplaceSpilledShadow) {
+	ImageF img(32, 32, 1);
+	img.setAll(getDepths32x32());
+	MinMaxHierarchy mm(img);
+
+	const string directory = "spillTest";
+	mkdir(directory.c_str(), 0755);
+
+	CompressedShadowContainer shadows(1);
+	shadows.setMemoryBudget(1, directory);
+	shadows.set(CompressedShadow::create(mm), 0, 0, 0);
+	ASSERT_EQ(1u, countFiles(directory));
+
+	// The file of the replaced shadow is removed, also if the new one stays in memory
+	shadows.set(CompressedShadow::create(mm), 0, 0, 0);
+	ASSERT_EQ(1u, countFiles(directory));
+
+	shadows.setMemoryBudget(0, directory);
+	shadows.set(CompressedShadow::create(mm), 0, 0, 0);
+	ASSERT_EQ(0u, countFiles(directory));
+	ASSERT_GT(shadows.getResidentSize(), 0u);
+
+	rmdir(directory.c_str());
+}
@@ -1,11 +1,10 @@
 #include "CompressedShadow.h"
+#include "CompressedShadowUtil.h"
 #include "Image.h"
 #include "MinMaxHierarchy.h"
 #include "gtest/gtest.h"
 
 #include <glm/ext.hpp>
-#include <GL/glew.h>
-#include <GLFW/glfw3.h>
 
 // contains test depths{8x8, 16x16, 32x32}
 #include "TestImages.h"
@@ -24,18 +23,6 @@ protected:
 	virtual ~CompressedShadowTest() {
 	}
 
-	virtual void SetUp() {
-//		ASSERT_TRUE(glfwInit());
-//		auto window = glfwCreateWindow(1, 1, "unit test", nullptr, nullptr);
-//		glfwMakeContextCurrent(window);
-//		auto err = glewInit();
-//		ASSERT_EQ(GLEW_OK, err);
-	}
-
-
-	virtual void TearDown() {
-//		glfwTerminate();
-	}
 protected:
 	ImageF img8;
 	ImageF img16;
@@ -157,3 +144,197 @@ unique_ptr<CompressedShadow> createShadow(const vector<float>& depths, uint size
 	MinMaxHierarchy mm(img);
 	return CompressedShadow::create(mm);
 }
+
+TEST_F(CompressedShadowTest, testDirectConstructionEqualsSvo) {
+	for (const ImageF* img : { &img8, &img16, &img32 }) {
+		MinMaxHierarchy mm(*img);
+
+		auto direct = CompressedShadow::create(mm);
+		auto fromSvo = CompressedShadow::createFromSvo(mm);
+		ASSERT_EQ(fromSvo->getDAG(), direct->getDAG());
+	}
+}
+
+TEST_F(CompressedShadowTest, testWriteAndReadFile) {
+	const string file = "compressedShadowTest.cpvs";
+
+	MinMaxHierarchy mm(img32);
+	auto csPtr = CompressedShadow::create(mm);
+	csPtr->writeToFile(file);
+
+	auto loaded = CompressedShadow::readFromFile(file);
+	std::remove(file.c_str());
+
+	ASSERT_EQ(csPtr->getNumLevels(), loaded->getNumLevels());
+	ASSERT_EQ(csPtr->getDAG(), loaded->getDAG());
+}
+
+TEST_F(CompressedShadowTest, testLeafmaskDictionary) {
+	MinMaxHierarchy mm(img32);
+	auto inlineMasks = CompressedShadow::create(mm);
+	auto dictionary = CompressedShadow::create(mm);
+
+	ASSERT_GT(dictionary->internLeafmasks(), 0);
+	ASSERT_TRUE(dictionary->hasLeafmaskDictionary());
+
+	// Interning twice does nothing
+	const auto dag = dictionary->getDAG();
+	ASSERT_EQ(0, dictionary->internLeafmasks());
+	ASSERT_EQ(dag, dictionary->getDAG());
+
+	for (uint z = 0; z < 32; ++z) {
+		for (uint y = 0; y < 32; ++y) {
+			for (uint x = 0; x < 32; ++x) {
+				const vec3 pos = convertToNdc(vec3(x, y, z) / 32.0f);
+				ASSERT_EQ(inlineMasks->traverse(pos), dictionary->traverse(pos));
+			}
+		}
+	}
+
+	const string file = "compressedShadowDictionaryTest.cpvs";
+	dictionary->writeToFile(file);
+	auto loaded = CompressedShadow::readFromFile(file);
+	std::remove(file.c_str());
+
+	ASSERT_TRUE(loaded->hasLeafmaskDictionary());
+	ASSERT_EQ(dictionary->getDAG(), loaded->getDAG());
+}
+
+TEST_F(CompressedShadowTest, testPackedPointers) {
+	for (const ImageF* img : { &img8, &img16, &img32 }) {
+		MinMaxHierarchy mm(*img);
+
+		for (bool dictionary : { false, true }) {
+			auto shadow = CompressedShadow::create(mm);
+			if (dictionary)
+				shadow->internLeafmasks();
+
+			// The smallest widths and 32-bit pointers on every level (which must not change) are traversed alike
+			uint smallestWidths = 0;
+			uint widestWidths = 0xAAAAAAAA;
+			const auto packed = cs::packDAG(shadow->getDAG(), shadow->getNumLevels(), shadow->getLeafmaskEncoding(),
+					smallestWidths);
+			const auto widest = cs::packDAG(shadow->getDAG(), shadow->getNumLevels(), shadow->getLeafmaskEncoding(),
+					widestWidths);
+			ASSERT_EQ(0xAAAAAAAA, widestWidths);
+			ASSERT_LT(packed.size(), shadow->getDAG().size());
+
+			const bool useLeafmasks = shadow->getLeafmaskEncoding() != CompressedShadow::NO_LEAFMASKS;
+			const uint res = img->getWidth();
+			for (uint z = 0; z < res; ++z) {
+				for (uint y = 0; y < res; ++y) {
+					for (uint x = 0; x < res; ++x) {
+						const vec3 pos = convertToNdc(vec3(x, y, z) / static_cast<float>(res));
+						const ivec3 path = cs::getPathFromNDC(pos, shadow->getNumLevels());
+						const auto expected = shadow->traverse(pos, useLeafmasks);
+
+						ASSERT_EQ(expected, cs::traversePacked(packed.data(), 0, shadow->getNumLevels(), smallestWidths,
+								shadow->getLeafmaskEncoding(), path));
+						ASSERT_EQ(expected, cs::traversePacked(widest.data(), 0, shadow->getNumLevels(), widestWidths,
+								shadow->getLeafmaskEncoding(), path));
+					}
+				}
+			}
+		}
+	}
+}
+
+TEST_F(CompressedShadowTest, testContiguousChildren) {
+	for (const ImageF* img : { &img8, &img16, &img32 }) {
+		MinMaxHierarchy mm(*img);
+
+		for (bool dictionary : { false, true }) {
+			auto shadow = CompressedShadow::create(mm);
+			if (dictionary)
+				shadow->internLeafmasks();
+
+			const auto dag = cs::layoutContiguousChildren(shadow->getDAG(), shadow->getNumLevels(),
+					shadow->getLeafmaskEncoding());
+			const bool useLeafmasks = shadow->getLeafmaskEncoding() != CompressedShadow::NO_LEAFMASKS;
+
+			const uint res = img->getWidth();
+			for (uint z = 0; z < res; ++z) {
+				for (uint y = 0; y < res; ++y) {
+					for (uint x = 0; x < res; ++x) {
+						const vec3 pos = convertToNdc(vec3(x, y, z) / static_cast<float>(res));
+						const ivec3 path = cs::getPathFromNDC(pos, shadow->getNumLevels());
+
+						ASSERT_EQ(shadow->traverse(pos, useLeafmasks),
+								cs::traverseContiguous(dag.data(), 0, shadow->getNumLevels(), shadow->getLeafmaskEncoding(), path));
+					}
+				}
+			}
+		}
+	}
+}
+
+TEST_F(CompressedShadowTest, testTraverseBatch) {
+	for (const ImageF* img : { &img8, &img16, &img32 }) {
+		MinMaxHierarchy mm(*img);
+
+		for (bool dictionary : { false, true }) {
+			auto shadow = CompressedShadow::create(mm);
+			if (dictionary)
+				shadow->internLeafmasks();
+			const bool useLeafmasks = shadow->getLeafmaskEncoding() != CompressedShadow::NO_LEAFMASKS;
+
+			// One position in every voxel and a few more, so the last positions don't fill a whole batch
+			vector<vec3> positions;
+			const uint res = img->getWidth();
+			for (uint z = 0; z < res; ++z) {
+				for (uint y = 0; y < res; ++y) {
+					for (uint x = 0; x < res; ++x)
+						positions.push_back(convertToNdc(vec3(x, y, z) / static_cast<float>(res)));
+				}
+			}
+			positions.insert(positions.end(), { vec3(-1.0f), vec3(1.0f), vec3(0.3f, -0.7f, 0.1f) });
+
+			vector<uint8_t> visibilities(positions.size());
+			shadow->traverseBatch(positions.data(), positions.size(), visibilities.data(), useLeafmasks);
+
+			for (size_t i = 0; i < positions.size(); ++i)
+				ASSERT_EQ(shadow->traverse(positions[i], useLeafmasks), visibilities[i]) << i;
+		}
+	}
+}
+
+TEST_F(CompressedShadowTest, testTraverseInterleaved) {
+	for (const ImageF* img : { &img8, &img16, &img32 }) {
+		MinMaxHierarchy mm(*img);
+
+		for (bool dictionary : { false, true }) {
+			auto shadow = CompressedShadow::create(mm);
+			if (dictionary)
+				shadow->internLeafmasks();
+			const uint numLevels = shadow->getNumLevels();
+			const auto encoding = shadow->getLeafmaskEncoding();
+
+			// Every voxel in reverse order, so traversals of different depths run next to each other
+			vector<ivec3> paths;
+			const int res = img->getWidth();
+			for (int z = res - 1; z >= 0; --z) {
+				for (int y = res - 1; y >= 0; --y) {
+					for (int x = res - 1; x >= 0; --x)
+						paths.push_back(ivec3(x, y, z));
+				}
+			}
+
+			vector<uint8_t> visibilities(paths.size());
+			cs::traverseInterleaved(shadow->getDAG().data(), numLevels, encoding, paths.data(), nullptr,
+					paths.size(), visibilities.data());
+			for (size_t i = 0; i < paths.size(); ++i)
+				ASSERT_EQ(cs::traverseDAG(shadow->getDAG().data(), 0, numLevels, encoding, paths[i]), visibilities[i]) << i;
+
+			// Roots which aren't at the start of the DAG
+			const size_t base = 5;
+			vector<uint> dag(base, 0);
+			shadow->appendDAG(dag, base);
+			const vector<uint> roots(paths.size(), base);
+
+			vector<uint8_t> relocated(paths.size());
+			cs::traverseInterleaved(dag.data(), numLevels, encoding, paths.data(), roots.data(), paths.size(),
+					relocated.data());
+			ASSERT_EQ(visibilities, relocated);
+		}
+	}
+}
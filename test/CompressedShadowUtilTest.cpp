@@ -26,6 +26,12 @@ TEST(getNumChildrenTest, testDifferentValues) {
 	ASSERT_EQ(2, getNumChildren(mask));
 }
 
+vector<ivec3> getChildCoordinates(uint childmask, const ivec3& parentOffset) {
+	vector<ivec3> coords;
+	appendChildCoordinates(childmask, parentOffset, coords);
+	return coords;
+}
+
 TEST(getChildCoordinatesTest, testChild0) {
 	uint mask = 2;
 	ivec3 parentOffset(0, 0, 0);
@@ -63,6 +69,17 @@ TEST(getChildCoordinatesTest, testChild7) {
 	ASSERT_EQ(ivec3(2, 2, 2), getChildCoordinates(mask, parentOffset)[0]); 
 }
 
+TEST(getChildCoordinatesTest, testAppendInChildOrder) {
+	vector<ivec3> coords { ivec3(-1) };
+	appendChildCoordinates(0x8802, ivec3(1, 2, 3), coords);
+
+	ASSERT_EQ(4, coords.size());
+	ASSERT_EQ(ivec3(-1), coords[0]);
+	ASSERT_EQ(ivec3(2, 4, 6), coords[1]);
+	ASSERT_EQ(ivec3(4, 4, 8), coords[2]);
+	ASSERT_EQ(ivec3(4, 6, 8), coords[3]);
+}
+
 
 TEST(isEqualSubtreeTest, testEqual) {
 	vector<uint> node { 0xAAAA, 10, 42, 0, 0, 1, 2, 3, 4 };
@@ -90,8 +107,36 @@ TEST(mergeLevelTest, testSimpleLevel) {
 	uint nodes;
 	auto mapping = mergeLevel(dag.begin(), dag.end(), res.begin(), NODE_SIZE, &nodes);
 
+	ASSERT_EQ(3, mapping.size());
+	ASSERT_EQ(2, nodes);
+
 	ASSERT_EQ(0, mapping[0]);
-	ASSERT_EQ(NODE_SIZE, mapping[NODE_SIZE]);
+	ASSERT_EQ(1, mapping[1]);
+	ASSERT_EQ(0, mapping[2]);
 
 	ASSERT_EQ(0xAAA0, res[NODE_SIZE]);
 }
+
+TEST(mergeLevelTest, testParallelEqualsSequential) {
+	// Create a large level with many duplicates, so it is actually merged in parallel
+	const uint numNodes = 1 << 16;
+	vector<uint> dag(numNodes * NODE_SIZE);
+	for (uint nodeNr = 0; nodeNr < numNodes; ++nodeNr) {
+		const uint variant = (nodeNr * 2654435761u) % 5003;
+		dag[nodeNr * NODE_SIZE] = 0xAAAA;
+		for (uint i = 1; i < NODE_SIZE; ++i)
+			dag[nodeNr * NODE_SIZE + i] = (variant * i) % 97;
+	}
+
+	vector<uint> seqRes(dag.size());
+	uint seqNodes;
+	auto seqMapping = mergeLevel(dag.begin(), dag.end(), seqRes.begin(), NODE_SIZE, &seqNodes);
+
+	vector<uint> parRes(dag.size());
+	uint parNodes;
+	auto parMapping = mergeLevelParallel(dag.data(), numNodes, parRes.data(), NODE_SIZE, &parNodes, 4);
+
+	ASSERT_EQ(seqNodes, parNodes);
+	ASSERT_EQ(seqMapping, parMapping);
+	ASSERT_TRUE(std::equal(seqRes.begin(), seqRes.begin() + seqNodes * NODE_SIZE, parRes.begin()));
+}
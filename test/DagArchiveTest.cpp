@@ -0,0 +1,136 @@
+#include "DagArchive.h"
+#include "CompressedShadowContainer.h"
+#include "MinMaxHierarchy.h"
+#include "ShadowBaker.h"
+#include "gtest/gtest.h"
+
+#include <cstdio>
+#include <fstream>
+
+// contains test depths{8x8, 16x16, 32x32}
+#include "TestImages.h"
+
+inline vector<char> readFile(const string& file) {
+	std::ifstream is(file, std::ios::binary);
+	return vector<char>((std::istreambuf_iterator<char>(is)), std::istreambuf_iterator<char>());
+}
+
+TEST(DagArchiveTest, testRoundTrip) {
+	ImageF img8(8, 8, 1), img16(16, 16, 1), img32(32, 32, 1);
+	img8.setAll(getDepths8x8());
+	img16.setAll(getDepths16x16());
+	img32.setAll(getDepths32x32());
+
+	for (const ImageF* img : {&img8, &img16, &img32}) {
+		MinMaxHierarchy mm(*img);
+
+		for (bool dictionary : {false, true}) {
+			auto shadow = CompressedShadow::create(mm);
+			if (dictionary)
+				shadow->internLeafmasks();
+
+			const auto& dag = shadow->getDAG();
+			const auto archive = DagArchive::compress(dag, shadow->getNumLevels(), shadow->getLeafmaskEncoding());
+			ASSERT_EQ(dag.size(), DagArchive::getDAGSize(archive.data(), archive.size()));
+			ASSERT_EQ(dag, DagArchive::decompress(archive)) << "width " << img->getWidth() << ", encoding "
+				<< shadow->getLeafmaskEncoding();
+
+			// Relocating the pointers while decoding is the same as appending the DAG
+			const size_t base = 123;
+			vector<uint> expected(base, 0);
+			shadow->appendDAG(expected, base);
+
+			vector<uint> relocated(base + dag.size(), 0);
+			DagArchive::decompress(archive.data(), archive.size(), relocated.data() + base, base);
+			ASSERT_EQ(expected, relocated);
+		}
+	}
+}
+
+TEST(DagArchiveTest, testInvalidArchive) {
+	ImageF img(32, 32, 1);
+	img.setAll(getDepths32x32());
+	MinMaxHierarchy mm(img);
+	auto shadow = CompressedShadow::create(mm);
+
+	auto archive = DagArchive::compress(shadow->getDAG(), shadow->getNumLevels(), shadow->getLeafmaskEncoding());
+	vector<uint> dag(shadow->getDAG().size());
+
+	// Truncated archives
+	for (size_t size : {size_t(0), size_t(10), archive.size() / 2, archive.size() - 1})
+		ASSERT_THROW(DagArchive::decompress(archive.data(), size, dag.data()), LoadFileException) << size;
+
+	// The number of levels is out of range
+	archive[0] = 0xFF;
+	ASSERT_THROW(DagArchive::decompress(archive), LoadFileException);
+}
+
+TEST(DagArchiveTest, testExtractContainer) {
+	const string file = "archiveTest.cpvc";
+	const string archive = "archiveTest.cpva";
+	const string extracted = "archiveTest.extracted.cpvc";
+
+	ImageF img(32, 32, 1);
+	img.setAll(getDepths32x32());
+	MinMaxHierarchy mm(img);
+
+	// Separate DAGs, which are relocated to their offsets when they are extracted
+	{
+		CompressedShadowContainer shadows(2);
+		for (uint z = 0; z < 2; ++z) {
+			for (uint y = 0; y < 2; ++y) {
+				for (uint x = 0; x < 2; ++x)
+					shadows.set(CompressedShadow::create(mm, z, 2), x, y, z);
+			}
+		}
+		shadows.setLeafmaskDictionary(true);
+		shadows.writeToFile(file);
+
+		const size_t archiveSize = shadows.writeArchive(archive);
+		ASSERT_EQ(readFile(archive).size(), archiveSize);
+		ASSERT_EQ(readFile(file).size(), CompressedShadowContainer::extractArchive(archive, extracted));
+		ASSERT_EQ(readFile(file), readFile(extracted));
+	}
+
+	// Shared DAG
+	{
+		const DepthSource depths("read", [&img](uint, uint) { return img; }, false);
+		const ShadowBaker baker(32);
+
+		CompressedShadowContainer shadows(baker.getNumTiles());
+		baker.configure(shadows);
+		baker.bake(shadows, depths);
+		shadows.writeToFile(file);
+
+		const size_t archiveSize = shadows.writeArchive(archive);
+		ASSERT_LT(archiveSize, readFile(file).size());
+		CompressedShadowContainer::extractArchive(archive, extracted);
+		ASSERT_EQ(readFile(file), readFile(extracted));
+
+		CompressedShadowContainer loaded(std::make_unique<ContainerFile>(extracted));
+		ASSERT_EQ(1u, loaded.getLength());
+	}
+
+	ASSERT_THROW(CompressedShadowContainer::extractArchive("doesNotExist.cpva", extracted), FileNotFound);
+
+	// Cut off the end of the last DAG
+	auto bytes = readFile(archive);
+	{
+		std::ofstream os(archive, std::ios::binary | std::ios::trunc);
+		os.write(bytes.data(), bytes.size() - 1);
+	}
+	ASSERT_THROW(CompressedShadowContainer::extractArchive(archive, extracted), LoadFileException);
+	ASSERT_FALSE(std::ifstream(extracted).is_open());
+
+	// Data after the last DAG
+	{
+		std::ofstream os(archive, std::ios::binary | std::ios::trunc);
+		os.write(bytes.data(), bytes.size());
+		os.put(0);
+	}
+	ASSERT_THROW(CompressedShadowContainer::extractArchive(archive, extracted), LoadFileException);
+
+	std::remove(file.c_str());
+	std::remove(archive.c_str());
+	std::remove(extracted.c_str());
+}
@@ -0,0 +1,52 @@
+#include "DepthFile.h"
+#include "gtest/gtest.h"
+
+#include <cstdio>
+
+// contains depths32x32
+#include "TestImages.h"
+
+TEST(DepthFileTest, readTilesFromPFM) {
+	const string file = "depthFileTest.pfm";
+
+	ImageF img(32, 32, 1);
+	img.setAll(getDepths32x32());
+	DepthFile::writePFM(img, file);
+
+	{
+		DepthFile depthFile(file);
+		ASSERT_EQ(32, depthFile.getWidth());
+
+		auto whole = depthFile.createImageF(0, 0, 32);
+		for (uint y = 0; y < 32; ++y) {
+			for (uint x = 0; x < 32; ++x)
+				ASSERT_EQ(img.get(x, y, 0), whole.get(x, y, 0));
+		}
+
+		auto tile = depthFile.createImageF(1, 0, 16);
+		ASSERT_EQ(16, tile.getWidth());
+		ASSERT_EQ(img.get(16 + 7, 13, 0), tile.get(7, 13, 0));
+
+		tile = depthFile.createImageF(0, 1, 16);
+		ASSERT_EQ(img.get(8, 16 + 1, 0), tile.get(8, 1, 0));
+	}
+	std::remove(file.c_str());
+}
+
+TEST(DepthFileTest, fileNotFound) {
+	ASSERT_THROW(DepthFile("doesNotExist.pfm"), FileNotFound);
+}
+
+TEST(DepthFileTest, rejectNonSquareRaw) {
+	const string file = "depthFileTest.raw";
+
+	// 32 * 32 floats and one more, which would be ignored
+	vector<float> values(32 * 32 + 1, 0.5f);
+	FILE* f = std::fopen(file.c_str(), "wb");
+	ASSERT_NE(nullptr, f);
+	std::fwrite(values.data(), sizeof(float), values.size(), f);
+	std::fclose(f);
+
+	ASSERT_THROW(DepthFile{file}, LoadFileException);
+	std::remove(file.c_str());
+}
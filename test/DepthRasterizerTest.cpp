@@ -0,0 +1,111 @@
+#include "DepthRasterizer.h"
+#include "Scene.h"
+#include "gtest/gtest.h"
+
+// Minimum resolvable depth difference multiplied with the default polygon offset units
+static const float UNITS_OFFSET = 4.0f / (1 << 24);
+
+class DepthRasterizerTest : public ::testing::Test {
+protected:
+	/** Adds a triangle in normalized device coordinates, which is counter-clockwise if ccw is true */
+	void addTriangle(const vec3& v0, const vec3& v1, const vec3& v2, bool ccw = true) {
+		Mesh mesh;
+		mesh.vao = 0;
+		mesh.numFaces = 1;
+		mesh.positions = ccw ? vector<vec3>{ v0, v1, v2 } : vector<vec3>{ v0, v2, v1 };
+		mesh.indices = { 0, 1, 2 };
+		scene.meshes.push_back(mesh);
+	}
+
+	/** Adds a quad covering the whole image at the given depth in NDC */
+	void addFullscreenQuad(float z, bool ccw = true) {
+		addTriangle(vec3(-1, -1, z), vec3(1, -1, z), vec3(1, 1, z), ccw);
+		addTriangle(vec3(-1, -1, z), vec3(1, 1, z), vec3(-1, 1, z), ccw);
+	}
+
+	ImageF render(uint size) const {
+		return DepthRasterizer().render(&scene, mat4(1.0f), mat4(1.0f), size);
+	}
+
+protected:
+	Scene scene;
+};
+
+TEST_F(DepthRasterizerTest, testFullscreenQuad) {
+	addFullscreenQuad(0.0f);
+	const auto img = render(32);
+
+	for (uint y = 0; y < 32; ++y) {
+		for (uint x = 0; x < 32; ++x)
+			ASSERT_FLOAT_EQ(0.5f + UNITS_OFFSET, img.get(x, y, 0)) << x << ", " << y;
+	}
+}
+
+TEST_F(DepthRasterizerTest, testBackFacesAreCulled) {
+	addFullscreenQuad(0.0f, false);
+	const auto img = render(16);
+
+	for (uint y = 0; y < 16; ++y) {
+		for (uint x = 0; x < 16; ++x)
+			ASSERT_EQ(1.0f, img.get(x, y, 0));
+	}
+}
+
+TEST_F(DepthRasterizerTest, testSharedEdgeHasNoGaps) {
+	// Two triangles at different depths sharing the diagonal, whose pixel centers lie exactly on the edge
+	addTriangle(vec3(-1, -1, -0.5f), vec3(1, -1, -0.5f), vec3(1, 1, -0.5f));
+	addTriangle(vec3(-1, -1, 0.0f), vec3(1, 1, 0.0f), vec3(-1, 1, 0.0f));
+	const auto img = render(64);
+
+	for (uint y = 0; y < 64; ++y) {
+		for (uint x = 0; x < 64; ++x) {
+			const float expected = (x > y ? 0.25f : 0.5f) + UNITS_OFFSET;
+			const float depth = img.get(x, y, 0);
+
+			// The diagonal belongs to exactly one of the triangles
+			if (x == y)
+				ASSERT_TRUE(depth == 0.25f + UNITS_OFFSET || depth == 0.5f + UNITS_OFFSET) << x;
+			else
+				ASSERT_FLOAT_EQ(expected, depth) << x << ", " << y;
+		}
+	}
+}
+
+TEST_F(DepthRasterizerTest, testSlopedPlaneWithPolygonOffset) {
+	// Window depth goes from 0.25 to 0.75 from left to right
+	addFullscreenQuad(0.0f);
+	for (auto& mesh : scene.meshes) {
+		for (auto& pos : mesh.positions)
+			pos.z = pos.x * 0.5f;
+	}
+
+	const uint size = 64;
+	const auto img = render(size);
+	const float slope = 0.5f / size;
+
+	for (uint y = 0; y < size; ++y) {
+		for (uint x = 0; x < size; ++x) {
+			const float expected = 0.25f + (x + 0.5f) * slope + 1.1f * slope + UNITS_OFFSET;
+			ASSERT_NEAR(expected, img.get(x, y, 0), 1e-6f) << x << ", " << y;
+		}
+	}
+}
+
+TEST_F(DepthRasterizerTest, testNearestTriangleWins) {
+	addFullscreenQuad(0.5f);
+	addTriangle(vec3(-1, -1, -0.5f), vec3(0, -1, -0.5f), vec3(-1, 0, -0.5f));
+	addFullscreenQuad(0.8f);
+	const auto img = render(16);
+
+	ASSERT_FLOAT_EQ(0.25f + UNITS_OFFSET, img.get(0, 0, 0));
+	ASSERT_FLOAT_EQ(0.75f + UNITS_OFFSET, img.get(15, 15, 0));
+}
+
+TEST_F(DepthRasterizerTest, testRejectFreedMesh) {
+	// Uploaded meshes whose data hasn't been kept on the CPU can't be rasterized
+	addFullscreenQuad(0.0f);
+	scene.meshes[1].positions.clear();
+	scene.meshes[1].indices.clear();
+
+	ASSERT_THROW(render(16), std::invalid_argument);
+}
@@ -2,6 +2,7 @@
 #include "gtest/gtest.h"
 
 #include <iostream>
+#include <random>
 using namespace std;
 
 // contains depths32x32
@@ -88,3 +89,57 @@ TEST_F(MinMaxTest, test32x32) {
 	// test min values of level 2, i.e. size 8
 	ASSERT_TRUE(cmpFloats(0.63008, mm.getMin(2, 1, 1)));
 }
+
+TEST_F(MinMaxTest, compareBruteForce) {
+	// Larger than a block and than the parallel threshold, so all levels are computed by several passes
+	const size_t size = 512;
+	ImageF depths(size, size, 1);
+	std::mt19937 rng(3);
+	std::uniform_real_distribution<float> dist(0.0f, 1.0f);
+	for (size_t i = 0; i < size * size; ++i)
+		depths.data()[i] = dist(rng);
+
+	for (auto layout : {MinMaxHierarchy::ROW_MAJOR, MinMaxHierarchy::TILED}) {
+		MinMaxHierarchy mm(depths, layout);
+		ASSERT_EQ(10, mm.getNumLevels());
+
+		for (int level = 0; level < mm.getNumLevels(); ++level) {
+			const size_t levelSize = size >> level;
+			ASSERT_EQ(levelSize, mm.getSize(level));
+
+			// Check a few values of every level against the values of the root they cover
+			for (size_t i = 0; i < 16; ++i) {
+				const size_t x = rng() % levelSize, y = rng() % levelSize;
+
+				float min = 1.0f, max = 0.0f;
+				for (size_t v = y << level; v < (y + 1) << level; ++v) {
+					for (size_t u = x << level; u < (x + 1) << level; ++u) {
+						min = std::min(min, depths.get(u, v, 0));
+						max = std::max(max, depths.get(u, v, 0));
+					}
+				}
+				ASSERT_EQ(min, mm.getMin(level, x, y));
+				ASSERT_EQ(max, mm.getMax(level, x, y));
+			}
+		}
+	}
+}
+
+TEST_F(MinMaxTest, tiledLayout) {
+	MinMaxHierarchy rowMajor(img32);
+	MinMaxHierarchy tiled(img32, MinMaxHierarchy::TILED);
+	ASSERT_EQ(MinMaxHierarchy::TILED, tiled.getLayout());
+
+	// The 2x2 values of a node are adjacent
+	ASSERT_EQ(64u + 2 * 8 + 4, tiled.getIndex(0, 12, 2));
+	ASSERT_EQ(tiled.getIndex(0, 12, 2) + 9, tiled.getIndex(0, 13, 3));
+
+	for (int level = 0; level < tiled.getNumLevels(); ++level) {
+		for (size_t y = 0; y < tiled.getSize(level); ++y) {
+			for (size_t x = 0; x < tiled.getSize(level); ++x) {
+				ASSERT_EQ(rowMajor.getMin(level, x, y), tiled.getMin(level, x, y));
+				ASSERT_EQ(rowMajor.getMax(level, x, y), tiled.getMax(level, x, y));
+			}
+		}
+	}
+}
@@ -0,0 +1,118 @@
+#include "CompressedShadow.h"
+#include "MinMaxHierarchy.h"
+#include "NodeStore.h"
+#include "gtest/gtest.h"
+
+#include <thread>
+
+// contains test depths{8x8, 16x16, 32x32}
+#include "TestImages.h"
+
+class NodeStoreTest : public ::testing::Test {
+protected:
+	NodeStoreTest()
+		: img32(32, 32, 1)
+	{
+		img32.setAll(getDepths32x32());
+	}
+
+protected:
+	ImageF img32;
+};
+
+TEST_F(NodeStoreTest, testLayoutEqualsCreate) {
+	MinMaxHierarchy mm(img32);
+	auto store = CompressedShadow::createNodeStore(mm.getNumLevels());
+
+	const uint root = CompressedShadow::createInStore(mm, *store);
+	auto csPtr = CompressedShadow::create(mm);
+
+	ASSERT_EQ(csPtr->getDAG(), store->layout({ root }));
+}
+
+TEST_F(NodeStoreTest, testIdenticalShadowsAreShared) {
+	MinMaxHierarchy mm(img32);
+	auto store = CompressedShadow::createNodeStore(mm.getNumLevels());
+
+	// Insert the same shadow from several threads concurrently
+	vector<uint> roots(4);
+	vector<std::thread> threads;
+	for (uint i = 0; i < roots.size(); ++i) {
+		threads.emplace_back([&, i]() {
+			roots[i] = CompressedShadow::createInStore(mm, *store);
+		});
+	}
+	for (auto& thread : threads)
+		thread.join();
+
+	for (uint root : roots)
+		ASSERT_EQ(roots[0], root);
+
+	vector<uint> rootOffsets;
+	auto dag = store->layout(roots, &rootOffsets);
+
+	ASSERT_EQ(CompressedShadow::create(mm)->getDAG(), dag);
+	ASSERT_EQ(vector<uint>(roots.size(), 0), rootOffsets);
+}
+
+TEST_F(NodeStoreTest, testAppendDAG) {
+	MinMaxHierarchy mm(img32);
+	auto csPtr = CompressedShadow::create(mm);
+	const auto& orig = csPtr->getDAG();
+
+	vector<uint> dag;
+	csPtr->appendDAG(dag, 0);
+	ASSERT_EQ(orig, dag);
+
+	// The root is partially visible, so its first child pointer has to be relocated
+	const size_t base = dag.size();
+	csPtr->appendDAG(dag, base);
+	ASSERT_EQ(2 * orig.size(), dag.size());
+	ASSERT_EQ(orig[0], dag[base]);
+	ASSERT_EQ(orig[1] + base, dag[base + 1]);
+}
+
+TEST_F(NodeStoreTest, testAppendLayout) {
+	MinMaxHierarchy mm(img32);
+	auto store = CompressedShadow::createNodeStore(mm.getNumLevels());
+
+	vector<uint> roots = { CompressedShadow::createInStore(mm, *store, 0, 2) };
+	NodeStore::Placement placement;
+	vector<uint> dag = store->layout(roots, nullptr, &placement);
+	ASSERT_EQ(dag.size(), placement.size);
+
+	// The second z-slice is appended and may reference nodes of the first one
+	roots.push_back(CompressedShadow::createInStore(mm, *store, 1, 2));
+	vector<uint> rootOffsets;
+	const auto appended = store->layout({ roots[1] }, &rootOffsets, &placement);
+	ASSERT_EQ(dag.size(), rootOffsets[0]);
+	dag.insert(dag.end(), appended.begin(), appended.end());
+	ASSERT_EQ(dag.size(), placement.size);
+
+	// Nothing is appended for nodes which have been laid out before
+	ASSERT_TRUE(store->layout(roots, nullptr, &placement).empty());
+
+	// The roots are found at their offsets in the appended DAG
+	vector<uint> offsets;
+	store->layout(roots, &offsets, &placement);
+	for (uint z = 0; z < 2; ++z)
+		ASSERT_EQ(CompressedShadow::create(mm, z, 2)->getDAG()[0], dag[offsets[z]]);
+}
+
+TEST_F(NodeStoreTest, testCompact) {
+	MinMaxHierarchy mm(img32);
+	auto store = CompressedShadow::createNodeStore(mm.getNumLevels());
+
+	// The first root is replaced, so only the nodes of the second one are reachable
+	vector<uint> roots = { CompressedShadow::createInStore(mm, *store, 0, 2) };
+	roots[0] = CompressedShadow::createInStore(mm, *store, 1, 2);
+	const size_t reachableSize = store->getReachableSize(roots);
+	ASSERT_LT(reachableSize, store->getSize());
+
+	const auto expected = store->layout(roots);
+	ASSERT_EQ(expected.size(), store->getLayoutSize(roots));
+	auto compacted = store->compact(roots);
+
+	ASSERT_EQ(reachableSize, compacted->getSize());
+	ASSERT_EQ(expected, compacted->layout(roots));
+}
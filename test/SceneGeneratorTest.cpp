@@ -0,0 +1,91 @@
+#include "SceneGenerator.h"
+#include "MinMaxHierarchy.h"
+#include "CompressedShadow.h"
+#include "gtest/gtest.h"
+
+const SceneGenerator::Shape allShapes[] = {
+	SceneGenerator::TERRAIN, SceneGenerator::CITY, SceneGenerator::FOLIAGE, SceneGenerator::SPARSE
+};
+
+TEST(SceneGeneratorTest, testShapeNames) {
+	for (auto shape : allShapes)
+		ASSERT_EQ(shape, SceneGenerator::getShape(SceneGenerator::getShapeName(shape)));
+
+	ASSERT_THROW(SceneGenerator::getShape("mountains"), std::invalid_argument);
+}
+
+TEST(SceneGeneratorTest, testDeterministicDepths) {
+	for (auto shape : allShapes) {
+		const auto depths = SceneGenerator(shape, 3).createDepths(64);
+		ASSERT_EQ(64u, depths.getWidth());
+		ASSERT_EQ(64u, depths.getHeight());
+
+		// Same seed, same depths
+		const auto again = SceneGenerator(shape, 3).createDepths(64);
+		ASSERT_TRUE(std::equal(depths.data(), depths.data() + 64 * 64, again.data())) << SceneGenerator::getShapeName(shape);
+
+		// Another seed, other depths
+		const auto other = SceneGenerator(shape, 4).createDepths(64);
+		ASSERT_FALSE(std::equal(depths.data(), depths.data() + 64 * 64, other.data())) << SceneGenerator::getShapeName(shape);
+
+		for (size_t i = 0; i < 64 * 64; ++i) {
+			ASSERT_GE(depths.data()[i], 0.0f);
+			ASSERT_LE(depths.data()[i], 1.0f);
+		}
+	}
+}
+
+TEST(SceneGeneratorTest, testTilesFitTogether) {
+	const SceneGenerator generator(SceneGenerator::CITY, 1);
+	const auto whole = generator.createDepths(128);
+
+	for (uint y = 0; y < 4; ++y) {
+		for (uint x = 0; x < 4; ++x) {
+			const auto tile = generator.createTile(128, 32, x, y);
+			for (uint row = 0; row < 32; ++row) {
+				for (uint column = 0; column < 32; ++column)
+					ASSERT_EQ(whole.get(x * 32 + column, y * 32 + row, 0), tile.get(column, row, 0));
+			}
+		}
+	}
+}
+
+TEST(SceneGeneratorTest, testShadowOfGeneratedDepths) {
+	// The shapes differ in how well common subtrees are merged
+	size_t terrainSize = 0, sparseSize = 0;
+	for (auto shape : allShapes) {
+		MinMaxHierarchy mm(SceneGenerator(shape).createDepths(256));
+		const auto shadow = CompressedShadow::create(mm);
+		ASSERT_EQ(CompressedShadow::PARTIAL, shadow->getTotalVisibility());
+
+		if (shape == SceneGenerator::TERRAIN)
+			terrainSize = shadow->getDAG().size();
+		if (shape == SceneGenerator::SPARSE)
+			sparseSize = shadow->getDAG().size();
+	}
+	ASSERT_LT(sparseSize, terrainSize);
+}
+
+TEST(SceneGeneratorTest, testScene) {
+	const uint resolution = 16;
+	const auto scene = SceneGenerator(SceneGenerator::TERRAIN, 2).createScene(resolution);
+	ASSERT_EQ(1u, scene->meshes.size());
+
+	const Mesh& mesh = scene->meshes[0];
+	ASSERT_EQ((resolution + 1) * (resolution + 1), mesh.positions.size());
+	ASSERT_EQ(mesh.positions.size(), mesh.normals.size());
+	ASSERT_EQ(2 * resolution * resolution, mesh.numFaces);
+	ASSERT_EQ(mesh.numFaces * 3, mesh.indices.size());
+
+	for (const vec3& position : mesh.positions) {
+		ASSERT_TRUE(glm::all(glm::greaterThanEqual(position, scene->boundingBox.min)));
+		ASSERT_TRUE(glm::all(glm::lessThanEqual(position, scene->boundingBox.max)));
+	}
+
+	// The vertex at the position (u, v) of the heightfield has its height
+	const SceneGenerator generator(SceneGenerator::TERRAIN, 2);
+	const vec3 vertex = mesh.positions[3 * (resolution + 1) + 5];
+	ASSERT_FLOAT_EQ(generator.getHeight(vec2(5, 3) / static_cast<float>(resolution)), vertex.y);
+	ASSERT_FLOAT_EQ(5 * 2.0f / resolution - 1.0f, vertex.x);
+	ASSERT_FLOAT_EQ(1.0f - 3 * 2.0f / resolution, vertex.z);
+}
@@ -0,0 +1,19 @@
+#include "TestShadows.h"
+
+void setTestShadows(CompressedShadowContainer& shadows, const MinMaxHierarchy& mm, bool shared, int zTile) {
+	const uint length = shadows.getLength();
+	if (shared)
+		shadows.shareSubtrees(mm.getNumLevels());
+
+	for (uint z = 0; z < length; ++z) {
+		const uint tile = zTile >= 0 ? zTile : z;
+		for (uint y = 0; y < length; ++y) {
+			for (uint x = 0; x < length; ++x) {
+				if (shared)
+					shadows.setRoot(CompressedShadow::createInStore(mm, *shadows.getNodeStore(), tile, length), x, y, z);
+				else
+					shadows.set(CompressedShadow::create(mm, tile, length), x, y, z);
+			}
+		}
+	}
+}
@@ -0,0 +1,13 @@
+#ifndef TEST_SHADOWS_H
+#define TEST_SHADOWS_H
+#include "CompressedShadowContainer.h"
+#include "MinMaxHierarchy.h"
+
+/**
+ * Sets every cell of the container to the shadow of its z-tile of the hierarchy, or to the shadow of zTile for
+ * all cells if it isn't negative. If shared is true, the subtrees of all cells are shared in a node store.
+ */
+extern void setTestShadows(CompressedShadowContainer& shadows, const MinMaxHierarchy& mm, bool shared,
+		int zTile = -1);
+
+#endif
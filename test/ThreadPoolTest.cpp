@@ -0,0 +1,91 @@
+#include "ThreadPool.h"
+#include "TaskGraph.h"
+#include "gtest/gtest.h"
+
+#include <atomic>
+#include <stdexcept>
+
+TEST(ThreadPoolTest, testParallelForCoversRange) {
+	ThreadPool pool(3);
+
+	for (uint numChunks : { 0, 1, 4 }) {
+		for (size_t size : { 0, 1, 7, 1000 }) {
+			vector<std::atomic<uint>> visited(size);
+			for (auto& v : visited)
+				v = 0;
+
+			pool.parallelFor(size, numChunks, [&](uint, size_t begin, size_t end) {
+				for (size_t i = begin; i < end; ++i)
+					++visited[i];
+			});
+
+			for (size_t i = 0; i < size; ++i)
+				ASSERT_EQ(1u, visited[i]) << numChunks << " chunks, size " << size << ", index " << i;
+		}
+	}
+}
+
+TEST(ThreadPoolTest, testNestedParallelFor) {
+	// The inner loops wait for tasks, which must not deadlock with a single worker
+	ThreadPool pool(1);
+	std::atomic<size_t> sum(0);
+
+	pool.parallelFor(8, 8, [&](uint, size_t begin, size_t end) {
+		for (size_t i = begin; i < end; ++i) {
+			pool.parallelFor(100, 4, [&](uint, size_t innerBegin, size_t innerEnd) {
+				sum += innerEnd - innerBegin;
+			});
+		}
+	});
+
+	ASSERT_EQ(800u, sum);
+}
+
+TEST(ThreadPoolTest, testTaskGraphOrder) {
+	ThreadPool pool(2);
+	TaskGraph graph;
+
+	// A chain of main thread tasks, each with pool tasks depending on it
+	std::atomic<uint> counter(0);
+	vector<uint> renderOrder;
+	vector<std::atomic<uint>> buildAfter(4);
+
+	vector<TaskGraph::TaskId> renderTasks;
+	for (uint i = 0; i < 4; ++i) {
+		vector<TaskGraph::TaskId> dependencies;
+		if (i > 0)
+			dependencies.push_back(renderTasks.back());
+
+		renderTasks.push_back(graph.add("render", [&, i]() {
+			renderOrder.push_back(i);
+			++counter;
+		}, dependencies, true));
+
+		graph.add("build", [&, i]() { buildAfter[i] = counter.load(); }, { renderTasks.back() });
+	}
+
+	graph.run(pool);
+
+	ASSERT_EQ(vector<uint>({ 0, 1, 2, 3 }), renderOrder);
+	for (uint i = 0; i < 4; ++i)
+		ASSERT_GE(buildAfter[i], i + 1);
+
+	const auto stats = graph.getStageStats();
+	ASSERT_EQ(2u, stats.size());
+	ASSERT_EQ("render", stats[0].name);
+	ASSERT_EQ(4u, stats[0].numTasks);
+	ASSERT_EQ("build", stats[1].name);
+	ASSERT_EQ(4u, stats[1].numTasks);
+}
+
+TEST(ThreadPoolTest, testTaskGraphException) {
+	ThreadPool pool(2);
+	TaskGraph graph;
+
+	bool dependentRan = false;
+	const auto failing = graph.add("build", []() { throw std::runtime_error("failed"); });
+	graph.add("build", [&]() { dependentRan = true; }, { failing }, true);
+
+	ASSERT_THROW(graph.run(pool), std::runtime_error);
+	ASSERT_FALSE(dependentRan);
+}